@@ -0,0 +1,186 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "battery.h"
+#include "timer.h"
+#include "hw.h"
+#include "debug.h"
+
+/*
+ * Battery governor.
+ *
+ * Every minute or so we measure the supply, and smooth it (the radio
+ * pulls a coin cell down for a moment, which we don't want to react to).
+ * As the cell runs down we poll less often and listen for beacons a
+ * little less long: opening the door takes a bit longer, but the Ki
+ * lasts a good deal longer too.
+ *
+ * Until we have a measurement, nothing is scaled.
+ */
+
+/* A CR2032 is flat at 3V, and the nRF51 stops at 1.8V */
+static const battery_curve_point_t curve_default[] =
+{
+  { .mv = 2200, .sleep_scale = 640, .listen_scale = 192 },
+  { .mv = 2400, .sleep_scale = 448, .listen_scale = 224 },
+  { .mv = 2600, .sleep_scale = 320, .listen_scale = 240 },
+  { .mv = 2700, .sleep_scale = 256, .listen_scale = 256 },
+};
+
+static battery_curve_point_t curve[BATTERY_CURVE_MAX];
+static uint8_t curve_count;
+
+/* Smoothed supply voltage, mV << BATTERY_SMOOTHING_SHIFT. 0 if unknown */
+static uint32_t smoothed;
+
+static soft_timer_t sample_timer;
+
+static void battery_sample_due(void * ctx)
+{
+  battery_sample();
+  timer_start(&sample_timer, TIMER_MS_TO_TICKS(BATTERY_SAMPLE_INTERVAL),
+              battery_sample_due, NULL);
+}
+
+void battery_init(void)
+{
+  battery_set_curve(curve_default,
+                    sizeof(curve_default) / sizeof(curve_default[0]));
+  smoothed = 0;
+
+  battery_sample_due(NULL);
+}
+
+/* Measure the supply and fold it into the average */
+void battery_sample(void)
+{
+  uint32_t mv = hw_vdd_mv();
+
+  if (!smoothed)
+  {
+    smoothed = mv << BATTERY_SMOOTHING_SHIFT;
+  }
+  else
+  {
+    smoothed += mv - (smoothed >> BATTERY_SMOOTHING_SHIFT);
+  }
+
+  _debug_printf("Supply %d mV, average %d mV", (int) mv, (int) battery_mv());
+}
+
+/* Smoothed supply voltage, mV. 0 if we haven't measured it yet */
+uint16_t battery_mv(void)
+{
+  return (uint16_t)(smoothed >> BATTERY_SMOOTHING_SHIFT);
+}
+
+/*
+ * Use a different curve. Points go from the lowest voltage to the
+ * highest. Returns false (and keeps the old one) if it doesn't fit, isn't
+ * in order, or would stretch a sleep further than the poll intervals
+ * allow for (BATTERY_SLEEP_SCALE_MAX, see params_sane).
+ */
+bool battery_set_curve(const battery_curve_point_t * points, uint8_t count)
+{
+  if (!count || count > BATTERY_CURVE_MAX)
+  {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if ((i && points[i].mv <= points[i - 1].mv) ||
+        points[i].sleep_scale > BATTERY_SLEEP_SCALE_MAX)
+    {
+      return false;
+    }
+  }
+
+  memcpy(curve, points, count * sizeof(curve[0]));
+  curve_count = count;
+  return true;
+}
+
+static uint16_t battery_interpolate(uint16_t mv, uint16_t mv0, uint16_t mv1,
+                                    uint16_t a, uint16_t b)
+{
+  return (uint16_t)(a + ((int32_t) b - a) * (mv - mv0) / (mv1 - mv0));
+}
+
+/* Where the curve is at a given supply voltage */
+void battery_scale_at(uint16_t mv, uint16_t * sleep_scale,
+                      uint16_t * listen_scale)
+{
+  const battery_curve_point_t * lo;
+  const battery_curve_point_t * hi;
+  uint8_t i;
+
+  if (!mv || !curve_count)
+  {
+    *sleep_scale = BATTERY_SCALE_ONE;
+    *listen_scale = BATTERY_SCALE_ONE;
+    return;
+  }
+
+  if (mv <= curve[0].mv)
+  {
+    *sleep_scale = curve[0].sleep_scale;
+    *listen_scale = curve[0].listen_scale;
+    return;
+  }
+
+  i = 1;
+  while (i < curve_count && mv > curve[i].mv)
+  {
+    i++;
+  }
+
+  if (i == curve_count)
+  {
+    *sleep_scale = curve[i - 1].sleep_scale;
+    *listen_scale = curve[i - 1].listen_scale;
+    return;
+  }
+
+  lo = &curve[i - 1];
+  hi = &curve[i];
+  *sleep_scale = battery_interpolate(mv, lo->mv, hi->mv,
+                                     lo->sleep_scale, hi->sleep_scale);
+  *listen_scale = battery_interpolate(mv, lo->mv, hi->mv,
+                                      lo->listen_scale, hi->listen_scale);
+}
+
+/* A poll interval (mS), stretched for the battery we have */
+uint16_t battery_scale_sleep(uint16_t ms)
+{
+  uint16_t sleep_scale;
+  uint16_t listen_scale;
+  uint32_t scaled;
+
+  battery_scale_at(battery_mv(), &sleep_scale, &listen_scale);
+  scaled = ((uint32_t) ms * sleep_scale + BATTERY_SCALE_ONE / 2) /
+           BATTERY_SCALE_ONE;
+
+  return scaled > UINT16_MAX ? UINT16_MAX : (uint16_t) scaled;
+}
+
+/* A listen window (uS), trimmed for the battery we have */
+uint16_t battery_scale_listen(uint16_t us)
+{
+  uint16_t sleep_scale;
+  uint16_t listen_scale;
+  uint32_t scaled;
+
+  battery_scale_at(battery_mv(), &sleep_scale, &listen_scale);
+  scaled = ((uint32_t) us * listen_scale + BATTERY_SCALE_ONE / 2) /
+           BATTERY_SCALE_ONE;
+
+  return scaled > UINT16_MAX ? UINT16_MAX : (uint16_t) scaled;
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _battery_h
+#define _battery_h
+
+enum
+{
+  BATTERY_SAMPLE_INTERVAL = 60000,  /* mS between supply measurements */
+  BATTERY_SMOOTHING_SHIFT = 2,      /* Each sample counts 1/4 */
+  BATTERY_SCALE_ONE = 256,          /* Scale factors are in 1/256ths */
+  BATTERY_CURVE_MAX = 8,            /* Points a curve can have */
+  BATTERY_SLEEP_SCALE_MAX = 640,    /* Sleep at most 2.5 times as long */
+};
+
+/*
+ * One point on the governor curve: at this supply voltage, sleep this
+ * much longer and listen this much shorter. Between points we go in a
+ * straight line, and beyond the ends the end points hold.
+ */
+typedef struct
+{
+  uint16_t mv;                      /* Supply voltage */
+  uint16_t sleep_scale;             /* Poll interval factor, 1/256ths */
+  uint16_t listen_scale;            /* Beacon listen window factor, 1/256ths */
+} battery_curve_point_t;
+
+void battery_init(void);
+void battery_sample(void);
+uint16_t battery_mv(void);
+bool battery_set_curve(const battery_curve_point_t * points, uint8_t count);
+void battery_scale_at(uint16_t mv, uint16_t * sleep_scale,
+                      uint16_t * listen_scale);
+uint16_t battery_scale_sleep(uint16_t ms);
+uint16_t battery_scale_listen(uint16_t us);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include "clock.h"
+#include "timer.h"
+#include "hw.h"
+#include "sched.h"
+#include "debug.h"
+
+/*
+ * HF crystal pre-wake.
+ *
+ * Only the radio needs the crystal, everything else runs fine on the
+ * internal HF RC. Rather than wake up and then wait for the crystal, we
+ * have the RTC start it (through PPI) a little before the alarm, so it's
+ * ready by the time we want to listen.
+ *
+ * "A little" is calibrated: every cold start is timed, a pre-wake that
+ * didn't make it lengthens the lead, and a run of pre-wakes that did
+ * shortens it again (every tick the crystal runs early costs current).
+ */
+
+/*
+ * LFCLK RC calibration.
+ *
+ * The RTC runs off the 32kHz RC, which is only good to +-2% until it's
+ * calibrated against the crystal, and wanders off again as the
+ * temperature changes. The calibration timer (CTIV) has us check every
+ * few seconds: if it's been too long or the temperature has moved, a
+ * calibration is due. Calibrating needs the crystal, so rather than start
+ * it specially we wait until the radio has it running anyway.
+ */
+
+/* How many RTC ticks ahead we start the crystal */
+static uint8_t lead;
+
+/* Pre-wakes that made it in a row */
+static uint8_t hits;
+
+/* Calibration state */
+static struct
+{
+  bool calibrated;        /* Ever calibrated */
+  bool due;               /* Calibrate next time we have the crystal */
+  bool busy;              /* Calibrating right now */
+  bool stop_pending;      /* Stop the crystal once we're done */
+  int32_t temp;           /* Latest temperature (0.25C) */
+  int32_t cal_temp;       /* Temperature at the last calibration */
+  uint32_t cal_time;      /* When we last calibrated (timer_now) */
+} lfrc;
+
+static void clock_handle_event(sched_event_t event, void * ctx)
+{
+  int32_t delta;
+
+  switch (event)
+  {
+    case SCHED_EVT_CAL_TIMEOUT:
+      lfrc.temp = hw_temp_read();
+      delta = lfrc.temp - lfrc.cal_temp;
+
+      if (!lfrc.calibrated ||
+          delta >= LFRC_CAL_TEMP_DELTA || -delta >= LFRC_CAL_TEMP_DELTA ||
+          timer_elapsed(lfrc.cal_time) >= LFRC_CAL_INTERVAL)
+      {
+        lfrc.due = true;
+      }
+
+      hw_lfclk_cal_timer(LFRC_CAL_CTIV);
+      break;
+
+    case SCHED_EVT_CAL_DONE:
+      _debug_printf("LFCLK calibrated at %d", (int) lfrc.temp);
+      lfrc.busy = false;
+      lfrc.calibrated = true;
+      lfrc.cal_time = timer_now();
+
+      if (lfrc.stop_pending)
+      {
+        clock_hfxo_stop();
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+void clock_init(void)
+{
+  lead = HFCLK_LEAD_DEFAULT;
+  hits = 0;
+  hw_hfclk_prewake_cancel();
+
+  /* Calibrate as soon as we can, then keep an eye on it */
+  lfrc.calibrated = false;
+  lfrc.due = true;
+  lfrc.busy = false;
+  lfrc.stop_pending = false;
+  lfrc.temp = hw_temp_read();
+  lfrc.cal_temp = lfrc.temp;
+
+  sched_register(SCHED_EVT_CAL_TIMEOUT, clock_handle_event, NULL);
+  sched_register(SCHED_EVT_CAL_DONE, clock_handle_event, NULL);
+  hw_lfclk_cal_timer(LFRC_CAL_CTIV);
+}
+
+/* Start the crystal ahead of the alarm set for wake_tick (timer_now ticks) */
+void clock_prewake(uint32_t wake_tick)
+{
+  hw_hfclk_prewake((wake_tick - lead) & TIMER_COUNTER_MASK);
+}
+
+/*
+ * Make sure the crystal is running, for the radio. Returns straight away
+ * if the pre-wake did its job.
+ */
+void clock_hfxo_start(void)
+{
+  bool fired = hw_hfclk_prewake_fired();
+  bool running = hw_hfclk_running();
+  uint32_t started;
+
+  hw_hfclk_prewake_cancel();
+  lfrc.stop_pending = false;
+
+  if (running)
+  {
+    /* Made it. See if we can do with less every now and then */
+    if (fired && ++hits >= HFCLK_TRIM_HITS)
+    {
+      hits = 0;
+      if (lead > HFCLK_LEAD_MIN)
+      {
+        lead--;
+      }
+    }
+    return;
+  }
+
+  if (fired)
+  {
+    /* Pre-woken, but too late */
+    _debug_printf("Crystal pre-wake missed, lead %d", lead);
+    hits = 0;
+    if (lead < HFCLK_LEAD_MAX)
+    {
+      lead++;
+    }
+  }
+
+  /* Start it ourselves, and time how long it takes */
+  started = timer_now();
+  hw_switch_to_hfclock();
+  started = timer_elapsed(started) + 1;
+
+  if (started > lead)
+  {
+    lead = started < HFCLK_LEAD_MAX ? started : HFCLK_LEAD_MAX;
+  }
+}
+
+/*
+ * Done with the crystal, back to the internal RC. Unless a calibration
+ * needs it still, in which case it goes off when that's done.
+ */
+void clock_hfxo_stop(void)
+{
+  if (lfrc.busy)
+  {
+    lfrc.stop_pending = true;
+    return;
+  }
+
+  lfrc.stop_pending = false;
+  hw_switch_to_lfclock();
+}
+
+uint8_t clock_prewake_lead(void)
+{
+  return lead;
+}
+
+/* Carry on with a lead learnt before (across a System OFF) */
+void clock_set_prewake_lead(uint8_t ticks)
+{
+  if (ticks < HFCLK_LEAD_MIN)
+  {
+    ticks = HFCLK_LEAD_MIN;
+  }
+  else if (ticks > HFCLK_LEAD_MAX)
+  {
+    ticks = HFCLK_LEAD_MAX;
+  }
+  lead = ticks;
+}
+
+/* The crystal is running: a good time to calibrate, if it's due */
+void clock_lfrc_poll(void)
+{
+  if (!lfrc.due || lfrc.busy)
+  {
+    return;
+  }
+
+  lfrc.due = false;
+  lfrc.busy = true;
+  lfrc.cal_temp = lfrc.temp;
+  hw_lfclk_cal_start();
+}
+
+bool clock_lfrc_busy(void)
+{
+  return lfrc.busy;
+}
+
+bool clock_lfrc_calibrated(void)
+{
+  return lfrc.calibrated;
+}
+
+/*
+ * How far off the RTC could be right now, in parts per million. Anything
+ * that has to line up with someone else's clock can size its guard time
+ * from this, rather than assume the worst.
+ */
+uint16_t clock_lfrc_ppm(void)
+{
+  int32_t delta = lfrc.temp - lfrc.cal_temp;
+  uint32_t ppm;
+
+  if (!lfrc.calibrated)
+  {
+    return LFRC_PPM_UNCALIBRATED;
+  }
+
+  if (delta < 0)
+  {
+    delta = -delta;
+  }
+  ppm = LFRC_PPM_CALIBRATED + (uint32_t) delta * LFRC_PPM_PER_TEMP_STEP;
+
+  return ppm < LFRC_PPM_UNCALIBRATED ? ppm : LFRC_PPM_UNCALIBRATED;
+}
+
+/* How many ticks either way an interval of ticks could be out by */
+uint32_t clock_lfrc_guard(uint32_t ticks)
+{
+  return (uint32_t)(((uint64_t) ticks * clock_lfrc_ppm() + 999999) / 1000000);
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hw.h"
+
+#ifndef _clock_h
+#define _clock_h
+
+enum
+{
+  HFCLK_LEAD_DEFAULT = 48,  /* RTC ticks to start the crystal ahead of
+                               waking (~1.5mS) */
+  HFCLK_LEAD_MIN = 16,      /* Never trim the lead below this (~0.5mS) */
+  HFCLK_LEAD_MAX = 128,     /* Or grow it past this (~4mS) */
+  HFCLK_TRIM_HITS = 16,     /* Good pre-wakes in a row before we try shorter */
+};
+
+enum
+{
+  LFRC_CAL_CTIV = 16,             /* Check if we need calibrating every 4s
+                                     (CTIV counts 0.25s) */
+  LFRC_CAL_INTERVAL = 30 * RTC_FREQUENCY, /* Calibrate at least every 30s */
+  LFRC_CAL_TEMP_DELTA = 2,        /* Or on a 0.5C change (TEMP counts 0.25C) */
+  LFRC_PPM_UNCALIBRATED = 20000,  /* RC accuracy out of the box, +-2% */
+  LFRC_PPM_CALIBRATED = 250,      /* Just after calibration */
+  LFRC_PPM_PER_TEMP_STEP = 125,   /* Drift per 0.25C since calibration */
+};
+
+void clock_init(void);
+void clock_prewake(uint32_t wake_tick);
+void clock_hfxo_start(void);
+void clock_hfxo_stop(void);
+uint8_t clock_prewake_lead(void);
+void clock_set_prewake_lead(uint8_t ticks);
+void clock_lfrc_poll(void);
+bool clock_lfrc_busy(void);
+bool clock_lfrc_calibrated(void);
+uint16_t clock_lfrc_ppm(void);
+uint32_t clock_lfrc_guard(uint32_t ticks);
+
+#endif
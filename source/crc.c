@@ -0,0 +1,33 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include "crc.h"
+
+/*
+ * CRC-32 (IEEE 802.3, the one zlib uses), a bit at a time. Slow, but we
+ * only check a few hundred bytes now and then, and a table would cost a
+ * kilobyte of flash.
+ *
+ * Start with 0, and hand the result back in to carry on over more data.
+ */
+uint32_t crc32(uint32_t crc, const void * data, size_t length)
+{
+  const uint8_t * p = data;
+
+  crc = ~crc;
+  while (length--)
+  {
+    crc ^= *p++;
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
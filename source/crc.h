@@ -0,0 +1,18 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef _crc_h
+#define _crc_h
+
+uint32_t crc32(uint32_t crc, const void * data, size_t length);
+
+#endif
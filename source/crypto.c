@@ -95,16 +95,21 @@ void crypto_aes_encrypt(const uint8_t * key, const uint8_t * data,
   /* Clear the AES hardware status flag */
   NRF_ECB->EVENTS_ENDECB = 0;
 
+  /* Not enabled in the NVIC, the pending IRQ just ends our WFE (SEVONPEND) */
+  NRF_ECB->INTENSET = ECB_INTENSET_ENDECB_Msk;
+
   /* Turn on the hardware AES engine */
   NRF_ECB->TASKS_STARTECB = 1;
 
   /*
-   * Block until AES is done
+   * Sleep until AES is done (reboot on fail)
    */
-  wait_for_val_ne(&NRF_ECB->EVENTS_ENDECB);
+  hw_wait_event_or_reset(&NRF_ECB->EVENTS_ENDECB, CRYPTO_ECB_TIMEOUT_US);
 
   /* Clear result flag */
   NRF_ECB->EVENTS_ENDECB = 0;
+  NRF_ECB->INTENCLR = ECB_INTENCLR_ENDECB_Msk;
+  NVIC_ClearPendingIRQ(ECB_IRQn);
 
 #else
 #error "Asked to use hard AES acceleration, but no implementation available"
@@ -138,8 +143,8 @@ void crypto_gen_random_bytes(uint8_t * bytes, uint8_t count)
 
 #ifdef USE_HARDWARE_RANDOM
 #ifdef BOARD_KI_ALICE
-  /* Tell the RNG we want some random numbers. */
-  NRF_RNG->INTENSET = RNG_INTENSET_VALRDY_Set;
+  /* Wake us for each byte, the same way as for the ECB */
+  NRF_RNG->INTENSET = RNG_INTENSET_VALRDY_Msk;
 
   /* Start the RNG task */
   NRF_RNG->TASKS_START = 1U;
@@ -152,11 +157,12 @@ void crypto_gen_random_bytes(uint8_t * bytes, uint8_t count)
 
   while (count--)
   {
-    /* Clear the VALRDY event flag */
+    /* Clear the VALRDY event flag, and the wake up it left pending */
     NRF_RNG->EVENTS_VALRDY = 0;
+    NVIC_ClearPendingIRQ(RNG_IRQn);
 
-    /* Get a random byte (reboot on fail) */
-    wait_for_val_ne(&NRF_RNG->EVENTS_VALRDY);
+    /* Get a random byte, asleep (reboot on fail) */
+    hw_wait_event_or_reset(&NRF_RNG->EVENTS_VALRDY, CRYPTO_RNG_TIMEOUT_US);
 
     /* Read the random byte into our array */
     bytes[count] = (uint8_t) NRF_RNG->VALUE;
@@ -164,6 +170,9 @@ void crypto_gen_random_bytes(uint8_t * bytes, uint8_t count)
 
   /* Stop the RNG task */
   NRF_RNG->TASKS_STOP = 1U;
+  NRF_RNG->INTENCLR = RNG_INTENCLR_VALRDY_Msk;
+  NRF_RNG->EVENTS_VALRDY = 0;
+  NVIC_ClearPendingIRQ(RNG_IRQn);
 #else
 #error "Asked to use hard random generation, but no implementation available!"
 #endif
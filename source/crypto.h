@@ -23,6 +23,10 @@
 
 #define AES_BLOCK_SIZE 16
 
+/* Longest we wait on the hardware before giving up on it (uS) */
+#define CRYPTO_ECB_TIMEOUT_US 100
+#define CRYPTO_RNG_TIMEOUT_US 1000
+
 /* State struct for AES operations */
 typedef struct __attribute__((__packed__)) {
   uint8_t key[AES_BLOCK_SIZE];
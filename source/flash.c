@@ -0,0 +1,146 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stddef.h>
+#include "flash.h"
+#include "nrf_nvmc.h"
+
+/*
+ * Flash work that can wait.
+ *
+ * While the NVMC erases or writes, the CPU is stalled: a page erase takes
+ * over 20mS, far longer than a radio window. So anything that isn't
+ * urgent is queued here instead, and run in the slots the FSM has to
+ * spare, after the radio is done and before it goes to sleep. A slot
+ * comes with a time budget, and we only start what fits in it. Erases
+ * can't be split up; a long write carries on in the next slot.
+ *
+ * Jobs are run in the order they were queued, which is what makes a
+ * chain of them (erase, copy, commit) safe. Each one's callback runs as
+ * soon as it's done, and may queue more.
+ */
+
+static flash_job_t * jobs;
+
+void flash_init(void)
+{
+  jobs = NULL;
+}
+
+static void flash_submit(flash_job_t * job)
+{
+  flash_job_t ** link = &jobs;
+
+  while (*link)
+  {
+    link = &(*link)->next;
+  }
+
+  job->written = 0;
+  job->queued = true;
+  job->next = NULL;
+  *link = job;
+}
+
+/* Erase a page, when there's time */
+void flash_erase(flash_job_t * job, uint32_t address,
+                 flash_callback_t callback, void * ctx)
+{
+  job->type = FLASH_JOB_ERASE;
+  job->address = address;
+  job->data = NULL;
+  job->words = 0;
+  job->callback = callback;
+  job->ctx = ctx;
+  flash_submit(job);
+}
+
+/* Write some words, when there's time. data has to stay put till then */
+void flash_write(flash_job_t * job, uint32_t address, const uint32_t * data,
+                 uint16_t words, flash_callback_t callback, void * ctx)
+{
+  job->type = FLASH_JOB_WRITE;
+  job->address = address;
+  job->data = data;
+  job->words = words;
+  job->callback = callback;
+  job->ctx = ctx;
+  flash_submit(job);
+}
+
+/* Is there anything waiting? */
+bool flash_busy(void)
+{
+  return jobs != NULL;
+}
+
+/*
+ * Get on with whatever fits in budget_us. Returns how long we (worst
+ * case) took.
+ */
+uint32_t flash_run(uint32_t budget_us)
+{
+  uint32_t used = 0;
+
+  while (jobs)
+  {
+    flash_job_t * job = jobs;
+
+    if (job->type == FLASH_JOB_ERASE)
+    {
+      if (budget_us - used < FLASH_ERASE_US)
+      {
+        break;
+      }
+      nrf_nvmc_page_erase(job->address);
+      used += FLASH_ERASE_US;
+    }
+    else
+    {
+      uint32_t words = (budget_us - used) / FLASH_WRITE_US;
+
+      if (words > (uint32_t) (job->words - job->written))
+      {
+        words = job->words - job->written;
+      }
+      if (!words && job->written < job->words)
+      {
+        break;
+      }
+
+      nrf_nvmc_write_words(job->address + job->written * 4,
+                           job->data + job->written, words);
+      job->written += words;
+      used += words * FLASH_WRITE_US;
+
+      if (job->written < job->words)
+      {
+        break;
+      }
+    }
+
+    /* Done: off the queue before the callback, which may queue more */
+    jobs = job->next;
+    job->queued = false;
+    job->next = NULL;
+
+    if (job->callback)
+    {
+      job->callback(job, job->ctx);
+    }
+  }
+
+  return used;
+}
+
+/* Everything, now (before System OFF, which would lose the queue) */
+void flash_flush(void)
+{
+  flash_run(UINT32_MAX);
+}
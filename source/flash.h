@@ -0,0 +1,61 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _flash_h
+#define _flash_h
+
+enum
+{
+  /* How long the CPU stalls for each (nRF51 worst case, rounded up) */
+  FLASH_ERASE_US = 22000,       /* A page erase */
+  FLASH_WRITE_US = 47,          /* One word */
+
+  /* Left over at the end of a slot, for getting to sleep */
+  FLASH_SLOT_MARGIN_US = 1000,
+};
+
+typedef enum
+{
+  FLASH_JOB_ERASE,              /* Erase the page at address */
+  FLASH_JOB_WRITE,              /* Write words from data to address */
+} flash_job_type_t;
+
+struct flash_job;
+typedef void (*flash_callback_t)(struct flash_job * job, void * ctx);
+
+/*
+ * A piece of flash work. Jobs live wherever their owner wants them to (as
+ * does what they write), and are strung together in order while queued.
+ */
+typedef struct flash_job
+{
+  flash_job_type_t type;
+  uint32_t address;             /* Page, or first word */
+  const uint32_t * data;        /* What to write, left alone until done */
+  uint16_t words;               /* How much of it */
+  uint16_t written;             /* Words done so far */
+  flash_callback_t callback;    /* Called once done, may be NULL */
+  void * ctx;                   /* Handed to the callback */
+  bool queued;                  /* Waiting for a slot */
+  struct flash_job * next;      /* The job after this one */
+} flash_job_t;
+
+void flash_init(void);
+void flash_erase(flash_job_t * job, uint32_t address,
+                 flash_callback_t callback, void * ctx);
+void flash_write(flash_job_t * job, uint32_t address, const uint32_t * data,
+                 uint16_t words, flash_callback_t callback, void * ctx);
+bool flash_busy(void);
+uint32_t flash_run(uint32_t budget_us);
+void flash_flush(void);
+
+#endif
@@ -14,6 +14,9 @@
 #include "nrf_gpio.h"
 #include "nrf_gpiote.h"
 #include "nrf_delay.h"
+#include "nrf_temp.h"
+#include "nrf_nvmc.h"
+#include "sched.h"
 
 /* Some struct defines so that debuggers know how to read our memory */
 volatile NVIC_Type *Interrupts = NVIC;
@@ -40,17 +43,14 @@ void wait_for_val_ne(volatile uint32_t *value)
 
 void hw_init()
 {
-  /* Start the HF clock (XTAL) */
-  hw_switch_to_hfclock();
-
-  /* Start up the 32.768kHz LF clock (RC) for RTC functions */
-  hw_start_LF_clk();
+  /*
+   * Start the HF clock (XTAL), and the 32.768kHz LF clock (RC) for RTC
+   * functions. Both take a while, so set up the rest meanwhile.
+   */
+  hw_clocks_start();
 
-  /* Configure the RAM retention parameters */
-  NRF_POWER->RAMON = POWER_RAMON_ONRAM0_RAM0On   << POWER_RAMON_ONRAM0_Pos
-                   | POWER_RAMON_ONRAM1_RAM1Off  << POWER_RAMON_ONRAM1_Pos
-                   | POWER_RAMON_OFFRAM0_RAM0Off << POWER_RAMON_OFFRAM0_Pos
-                   | POWER_RAMON_OFFRAM1_RAM1Off << POWER_RAMON_OFFRAM1_Pos;
+  /* The temperature tells us when the RC needs calibrating */
+  nrf_temp_init();
 
   /* Enable Send-Event-on-Send feature (enables WFE's to wake up) */
   SCB->SCR |= SCB_SCR_SEVONPEND_Msk;
@@ -66,6 +66,12 @@ void hw_init()
   /* Enable sense interrupt */
   NVIC_EnableIRQ(GPIOTE_IRQn);
   NRF_GPIOTE->INTENSET  = GPIOTE_INTENCLR_PORT_Enabled << GPIOTE_INTENCLR_PORT_Pos;
+
+  /* Now we need the clocks */
+  hw_clocks_wait();
+
+  /* And keep time from the LF one */
+  hw_rtc_init();
 }
 
 void hw_enable_double_tap()
@@ -77,6 +83,24 @@ void hw_enable_double_tap()
    );
 }
 
+void hw_disable_double_tap()
+{
+   nrf_gpio_cfg_sense_input(
+     ACC_INT2,
+     NRF_GPIO_PIN_PULLDOWN,
+     NRF_GPIO_PIN_NOSENSE
+   );
+}
+
+/*
+ * The accelerometer's sleep-to-wake engine holds INT2 high while it thinks
+ * we're lying still. So does a double tap, until CLICK_SRC is read.
+ */
+uint8_t hw_acc_inactive()
+{
+  return nrf_gpio_pin_read(ACC_INT2);
+}
+
 void hw_enable_movement_detect()
 {
   nrf_gpio_cfg_sense_input(
@@ -115,6 +139,8 @@ void GPIOTE_IRQHandler(void)
   }
   NRF_GPIOTE->EVENTS_PORT = 0;
   NVIC_ClearPendingIRQ(GPIOTE_IRQn);
+
+  sched_post(SCHED_EVT_GPIOTE);
 }
 
 /*
@@ -132,6 +158,12 @@ void hw_switch_to_lfclock(void)
  */
 void hw_switch_to_hfclock(void)
 {
+  /* Nothing to do if the crystal is up already (pre-woken, say) */
+  if (hw_hfclk_running())
+  {
+    return;
+  }
+
   /* Mark the HF clock as not started */
   NRF_CLOCK->EVENTS_HFCLKSTARTED = 0;
 
@@ -142,6 +174,241 @@ void hw_switch_to_hfclock(void)
   wait_for_val_ne(&NRF_CLOCK->EVENTS_HFCLKSTARTED);
 }
 
+/*
+ * Is the HF crystal up and running? (Otherwise we're on the internal RC)
+ */
+uint8_t hw_hfclk_running(void)
+{
+  uint32_t stat = NRF_CLOCK->HFCLKSTAT;
+
+  return ((stat & CLOCK_HFCLKSTAT_STATE_Msk) >> CLOCK_HFCLKSTAT_STATE_Pos)
+           == CLOCK_HFCLKSTAT_STATE_Running &&
+         ((stat & CLOCK_HFCLKSTAT_SRC_Msk) >> CLOCK_HFCLKSTAT_SRC_Pos)
+           == CLOCK_HFCLKSTAT_SRC_Xtal;
+}
+
+/*
+ * Have the RTC start the HF crystal for us when COUNTER reaches tick,
+ * without waking the CPU (RTC1 COMPARE3 -> PPI -> HFCLKSTART).
+ */
+void hw_hfclk_prewake(uint32_t tick)
+{
+  NRF_RTC1->CC[RTC_CC_HFCLK_PREWAKE] = tick;
+  NRF_RTC1->EVENTS_COMPARE[RTC_CC_HFCLK_PREWAKE] = 0;
+  NRF_RTC1->EVTENSET = RTC_EVTEN_COMPARE3_Msk;
+
+  NRF_PPI->CH[PPI_CH_HFCLK_PREWAKE].EEP =
+    (uint32_t) &NRF_RTC1->EVENTS_COMPARE[RTC_CC_HFCLK_PREWAKE];
+  NRF_PPI->CH[PPI_CH_HFCLK_PREWAKE].TEP =
+    (uint32_t) &NRF_CLOCK->TASKS_HFCLKSTART;
+  NRF_PPI->CHENSET = 1UL << PPI_CH_HFCLK_PREWAKE;
+}
+
+void hw_hfclk_prewake_cancel(void)
+{
+  NRF_PPI->CHENCLR = 1UL << PPI_CH_HFCLK_PREWAKE;
+  NRF_RTC1->EVTENCLR = RTC_EVTENCLR_COMPARE3_Msk;
+  NRF_RTC1->EVENTS_COMPARE[RTC_CC_HFCLK_PREWAKE] = 0;
+}
+
+/* Did the pre-wake compare go off (and start the crystal)? */
+uint8_t hw_hfclk_prewake_fired(void)
+{
+  return NRF_RTC1->EVENTS_COMPARE[RTC_CC_HFCLK_PREWAKE] ? 1 : 0;
+}
+
+/* Set TIMER1 going for us uS, with a wake up (but no interrupt) at the end */
+static void hw_wait_timer_start(uint32_t us)
+{
+  NRF_TIMER1->TASKS_STOP = 1;
+  NRF_TIMER1->MODE = TIMER_MODE_MODE_Timer;
+  NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+  NRF_TIMER1->PRESCALER = 4;  /* 16MHz / 2^4 = 1MHz */
+  NRF_TIMER1->CC[0] = us;
+  NRF_TIMER1->SHORTS = TIMER_SHORTS_COMPARE0_STOP_Msk;
+  NRF_TIMER1->EVENTS_COMPARE[0] = 0;
+
+  /* Not enabled in the NVIC, the pending IRQ just ends our WFE (SEVONPEND) */
+  NRF_TIMER1->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+
+  NRF_TIMER1->TASKS_CLEAR = 1;
+  NRF_TIMER1->TASKS_START = 1;
+}
+
+/* Stop TIMER1 and tidy up. Returns how many uS it ran for */
+static uint32_t hw_wait_timer_stop(void)
+{
+  NRF_TIMER1->TASKS_CAPTURE[1] = 1;
+  NRF_TIMER1->TASKS_STOP = 1;
+  NRF_TIMER1->INTENCLR = TIMER_INTENCLR_COMPARE0_Msk;
+  NRF_TIMER1->EVENTS_COMPARE[0] = 0;
+  NVIC_ClearPendingIRQ(TIMER1_IRQn);
+
+  return NRF_TIMER1->CC[1];
+}
+
+/*
+ * Wait a while, asleep. Only very short waits spin.
+ */
+void hw_wait_us(uint32_t us)
+{
+  uint32_t chunk;
+
+  if (us < HW_WAIT_SPIN_US)
+  {
+    if (us)
+    {
+      nrf_delay_us(us);
+    }
+    return;
+  }
+
+  while (us)
+  {
+    chunk = us < HW_WAIT_MAX_US ? us : HW_WAIT_MAX_US;
+
+    hw_wait_timer_start(chunk);
+    while (!NRF_TIMER1->EVENTS_COMPARE[0])
+    {
+      WFE();
+    }
+    hw_wait_timer_stop();
+
+    us -= chunk;
+  }
+}
+
+/*
+ * Sleep until *event is set or us uS are up, whichever comes first. The
+ * event's interrupt has to be enabled (INTENSET) so that it wakes us.
+ *
+ * Returns the uS that were left when the event came (at least 1), or 0
+ * if it never did.
+ */
+uint32_t hw_wait_event_us(volatile uint32_t * event, uint32_t us)
+{
+  uint32_t elapsed;
+
+  if (us > HW_WAIT_MAX_US)
+  {
+    us = HW_WAIT_MAX_US;
+  }
+
+  hw_wait_timer_start(us);
+  while (!*event && !NRF_TIMER1->EVENTS_COMPARE[0])
+  {
+    WFE();
+  }
+  elapsed = hw_wait_timer_stop();
+
+  if (!*event)
+  {
+    return 0;
+  }
+  return elapsed < us ? us - elapsed : 1;
+}
+
+/*
+ * hw_wait_event_us, for an event that always comes. If it hasn't within
+ * us uS the peripheral is stuck, and like wait_for_val_ne we reboot.
+ */
+void hw_wait_event_or_reset(volatile uint32_t * event, uint32_t us)
+{
+  if (!hw_wait_event_us(event, us))
+  {
+    NVIC_SystemReset();
+  }
+}
+
+/*
+ * Start (or restart) the LFCLK calibration timer. It times out after
+ * quarter_seconds * 0.25s, which is our cue to see if the RC needs
+ * calibrating.
+ */
+void hw_lfclk_cal_timer(uint8_t quarter_seconds)
+{
+  NRF_CLOCK->CTIV = quarter_seconds;
+  NRF_CLOCK->EVENTS_CTTO = 0;
+  NRF_CLOCK->INTENSET = CLOCK_INTENSET_CTTO_Msk | CLOCK_INTENSET_DONE_Msk;
+  NVIC_EnableIRQ(POWER_CLOCK_IRQn);
+  NRF_CLOCK->TASKS_CTSTART = 1;
+}
+
+/*
+ * Calibrate the LFCLK RC against the HF crystal, which has to be running
+ * until EVENTS_DONE.
+ */
+void hw_lfclk_cal_start(void)
+{
+  NRF_CLOCK->EVENTS_DONE = 0;
+  NRF_CLOCK->TASKS_CAL = 1;
+}
+
+/* Die temperature, in 0.25 degrees C */
+int32_t hw_temp_read(void)
+{
+  int32_t temp;
+
+  NRF_TEMP->EVENTS_DATARDY = 0;
+  NRF_TEMP->INTENSET = TEMP_INTENSET_DATARDY_Msk;
+  NRF_TEMP->TASKS_START = 1;
+
+  /* Takes about 36uS, asleep */
+  hw_wait_event_or_reset(&NRF_TEMP->EVENTS_DATARDY, HW_TEMP_TIMEOUT_US);
+  NRF_TEMP->EVENTS_DATARDY = 0;
+  NRF_TEMP->INTENCLR = TEMP_INTENCLR_DATARDY_Msk;
+  NVIC_ClearPendingIRQ(TEMP_IRQn);
+
+  temp = nrf_temp_read();
+  NRF_TEMP->TASKS_STOP = 1;
+
+  return temp;
+}
+
+/* Supply voltage, in mV. VDD/3 against the 1.2V bandgap */
+uint16_t hw_vdd_mv(void)
+{
+  uint32_t result;
+
+  NRF_ADC->CONFIG =
+      (ADC_CONFIG_RES_10bit << ADC_CONFIG_RES_Pos)
+    | (ADC_CONFIG_INPSEL_SupplyOneThirdPrescaling << ADC_CONFIG_INPSEL_Pos)
+    | (ADC_CONFIG_REFSEL_VBG << ADC_CONFIG_REFSEL_Pos)
+    | (ADC_CONFIG_PSEL_Disabled << ADC_CONFIG_PSEL_Pos)
+    | (ADC_CONFIG_EXTREFSEL_None << ADC_CONFIG_EXTREFSEL_Pos);
+  NRF_ADC->ENABLE = ADC_ENABLE_ENABLE_Enabled;
+
+  NRF_ADC->EVENTS_END = 0;
+  NRF_ADC->INTENSET = ADC_INTENSET_END_Msk;
+  NRF_ADC->TASKS_START = 1;
+
+  /* Takes about 68uS at 10 bits, asleep */
+  hw_wait_event_or_reset(&NRF_ADC->EVENTS_END, HW_ADC_TIMEOUT_US);
+  NRF_ADC->EVENTS_END = 0;
+  NRF_ADC->INTENCLR = ADC_INTENCLR_END_Msk;
+  NVIC_ClearPendingIRQ(ADC_IRQn);
+
+  result = NRF_ADC->RESULT & ADC_RESULT_RESULT_Msk;
+  NRF_ADC->ENABLE = ADC_ENABLE_ENABLE_Disabled;
+
+  return (uint16_t)((result * 3 * HW_VBG_MV + 511) / 1023);
+}
+
+void POWER_CLOCK_IRQHandler(void)
+{
+  if (NRF_CLOCK->EVENTS_CTTO)
+  {
+    NRF_CLOCK->EVENTS_CTTO = 0;
+    sched_post(SCHED_EVT_CAL_TIMEOUT);
+  }
+
+  if (NRF_CLOCK->EVENTS_DONE)
+  {
+    NRF_CLOCK->EVENTS_DONE = 0;
+    sched_post(SCHED_EVT_CAL_DONE);
+  }
+}
+
 /*
  * Function for stopping the internal LFCLK RC oscillator.
  */
@@ -152,21 +419,35 @@ void hw_stop_LF_clk(void)
 }
 
 /*
- * Function for starting the internal LFCLK with RC oscillator as its source.
+ * Start the HF crystal and the LF RC without waiting for them, so that
+ * their start-up overlaps with whatever comes next. hw_clocks_wait
+ * catches up.
  */
-void hw_start_LF_clk(void)
+void hw_clocks_start(void)
 {
   /* Select the internal 32kHz RC */
   NRF_CLOCK->LFCLKSRC = (CLOCK_LFCLKSRC_SRC_RC << CLOCK_LFCLKSRC_SRC_Pos);
 
-  /* Mark the LF Clock as not started */
+  /* Mark the LF Clock as not started, and start it */
   NRF_CLOCK->EVENTS_LFCLKSTARTED = 0;
-
-  /* Try to start the LF clock */
   NRF_CLOCK->TASKS_LFCLKSTART = 1;
 
-  /* Start clock */
+  /* Same for the crystal, unless it's up already */
+  if (!hw_hfclk_running())
+  {
+    NRF_CLOCK->EVENTS_HFCLKSTARTED = 0;
+    NRF_CLOCK->TASKS_HFCLKSTART = 1;
+  }
+}
+
+void hw_clocks_wait(void)
+{
   wait_for_val_ne(&NRF_CLOCK->EVENTS_LFCLKSTARTED);
+
+  if (!hw_hfclk_running())
+  {
+    wait_for_val_ne(&NRF_CLOCK->EVENTS_HFCLKSTARTED);
+  }
 }
 
 void hw_read_reset_reason(uint32_t *resetreas)
@@ -225,73 +506,83 @@ uint32_t hw_ficr_deviceid(size_t index)
   return NRF_FICR->DEVICEID[index];
 }
 
+/* Keep the debugger out of flash from the next reset on */
+void hw_readback_protect(void)
+{
+  nrf_nvmc_write_word((uint32_t)&NRF_UICR->RBPCONF, 0);
+}
+
+void hw_reset(void)
+{
+  NVIC_SystemReset();
+}
+
 /*
- * Function for configuring the RTC to generate COMPARE0 event after t mS.
+ * Keep interrupts out while we touch something they share with us.
+ * Returns the previous mask, to hand back to hw_critical_exit (so these nest).
  */
-void hw_rtc_wakeup(uint32_t ms)
+uint32_t hw_critical_enter(void)
 {
-  /* Set prescaler to a TICK of RTC_FREQUENCY. */
-  NRF_RTC1->PRESCALER = COUNTER_PRESCALER;
+  uint32_t mask = __get_PRIMASK();
+  __disable_irq();
+  return mask;
+}
 
-  /* Compare0 after approximately COMPARE_COUNTERTIME mS */
-  NRF_RTC1->CC[0] = ms;// * RTC_FREQUENCY;
+void hw_critical_exit(uint32_t mask)
+{
+  __set_PRIMASK(mask);
+}
 
-  NRF_RTC1->EVTENSET = RTC_EVTEN_COMPARE0_Msk;
-  NRF_RTC1->INTENSET = RTC_INTENSET_COMPARE0_Msk;
+/*
+ * Start RTC1 free running. It is never stopped or cleared after this, the
+ * timer service (timer.c) keeps time from it.
+ */
+void hw_rtc_init(void)
+{
+  /* Set prescaler to a TICK of RTC_FREQUENCY. */
+  NRF_RTC1->PRESCALER = COUNTER_PRESCALER;
 
+  /* We want to know about the alarm and about the counter wrapping */
   NRF_RTC1->EVENTS_COMPARE[0] = 0;
-
-  /* Clear the counter */
-  NRF_RTC1->TASKS_CLEAR = 1;
+  NRF_RTC1->EVENTS_OVRFLW = 0;
+  NRF_RTC1->EVTENSET = RTC_EVTEN_OVRFLW_Msk;
+  NRF_RTC1->INTENSET = RTC_INTENSET_OVRFLW_Msk;
 
   /* Clear and then enable the RTC IRQ */
   NVIC_ClearPendingIRQ(RTC1_IRQn);
   NVIC_EnableIRQ(RTC1_IRQn);
-}
-
-uint32_t hw_rtc_value(void)
-{
-  /* Return the RTC1 value */
-  return NRF_RTC1->COUNTER;
-}
 
-void hw_rtc_start(void)
-{
   /* Start the RTC */
   NRF_RTC1->TASKS_START = 1;
 }
 
-void hw_rtc_clear(void)
+uint32_t hw_rtc_counter(void)
 {
-  /* Clear the RTC */
-  NRF_RTC1->TASKS_CLEAR = 1;
-  NVIC_ClearPendingIRQ(RTC1_IRQn);
+  /* Return the RTC1 value */
+  return NRF_RTC1->COUNTER;
 }
 
-void hw_rtc_stop(void)
+/*
+ * Set the alarm clock (COMPARE0) for when COUNTER reaches tick.
+ */
+void hw_rtc_set_alarm(uint32_t tick)
 {
-  /* Stop and clear the RTC timer */
-  NRF_RTC1->TASKS_STOP = 1;
-  NRF_RTC1->TASKS_CLEAR = 1;
-  NVIC_ClearPendingIRQ(RTC1_IRQn);
+  NRF_RTC1->CC[0] = tick;
+  NRF_RTC1->EVENTS_COMPARE[0] = 0;
+  NRF_RTC1->EVTENSET = RTC_EVTEN_COMPARE0_Msk;
+  NRF_RTC1->INTENSET = RTC_INTENSET_COMPARE0_Msk;
 }
 
-void hw_sleep_power_on(void)
+void hw_rtc_cancel_alarm(void)
 {
-  /* Set the power mode to power on sleeping, retain some RAM */
-  NRF_POWER->RAMON = POWER_RAMON_ONRAM0_Msk | POWER_RAMON_ONRAM1_Msk;
-
-  /* Signal an event and wait for it */
-  SEV(); WFE();
-
-  /* Go to sleep, baby */
-  WFE();
+  NRF_RTC1->INTENCLR = RTC_INTENCLR_COMPARE0_Msk;
+  NRF_RTC1->EVTENCLR = RTC_EVTEN_COMPARE0_Msk;
+  NRF_RTC1->EVENTS_COMPARE[0] = 0;
 }
 
 void hw_sleep_power_off(void)
 {
-  /* Set the power mode to power off sleeping, no RAM retention */
-  NRF_POWER->RAMON = POWER_RAMON_OFFRAM0_RAM0Off | POWER_RAMON_OFFRAM1_RAM1Off;
+  /* RAM retention was set up for this by power_set_mode */
 
   /* Clear the reset reason, so that it'll be valid when we wake up. */
   NRF_POWER->RESETREAS = 0;
@@ -301,12 +592,48 @@ void hw_sleep_power_off(void)
   while(1);
 }
 
+/*
+ * Set up the supply side of a power mode (see power.c). The RAM masks use
+ * bit 0 for RAM0 and bit 1 for RAM1. dcdc is only asked for with the
+ * supply well above 2.1V, power_apply sees to that.
+ */
+void hw_power_apply(bool dcdc, uint8_t ram_on, uint8_t ram_retain,
+                    bool radio_off)
+{
+  NRF_POWER->RAMON =
+      ((ram_on & 1) ? POWER_RAMON_ONRAM0_RAM0On : POWER_RAMON_ONRAM0_RAM0Off)
+        << POWER_RAMON_ONRAM0_Pos
+    | ((ram_on & 2) ? POWER_RAMON_ONRAM1_RAM1On : POWER_RAMON_ONRAM1_RAM1Off)
+        << POWER_RAMON_ONRAM1_Pos
+    | ((ram_retain & 1) ? POWER_RAMON_OFFRAM0_RAM0On : POWER_RAMON_OFFRAM0_RAM0Off)
+        << POWER_RAMON_OFFRAM0_Pos
+    | ((ram_retain & 2) ? POWER_RAMON_OFFRAM1_RAM1On : POWER_RAMON_OFFRAM1_RAM1Off)
+        << POWER_RAMON_OFFRAM1_Pos;
+
+  NRF_POWER->DCDCEN = (dcdc ? POWER_DCDCEN_DCDCEN_Enabled
+                            : POWER_DCDCEN_DCDCEN_Disabled)
+                      << POWER_DCDCEN_DCDCEN_Pos;
+
+  /* Powering the radio down also resets it. radio_init powers it back up */
+  if (radio_off)
+  {
+    NRF_RADIO->POWER = 0;
+  }
+}
+
 void RTC1_IRQHandler(void)
 {
   /* This handler will be run after wakeup from system ON (RTC wakeup) */
   if(NRF_RTC1->EVENTS_COMPARE[0])
   {
     NRF_RTC1->EVENTS_COMPARE[0] = 0;
-    NRF_RTC1->TASKS_CLEAR = 1;
+    sched_post(SCHED_EVT_RTC);
+  }
+
+  /* Let the timer service count the wrap */
+  if(NRF_RTC1->EVENTS_OVRFLW)
+  {
+    NRF_RTC1->EVENTS_OVRFLW = 0;
+    sched_post(SCHED_EVT_RTC);
   }
 }
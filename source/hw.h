@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #ifndef _hw_h
 #define _hw_h
@@ -27,7 +28,7 @@
 #define LFCLK_FREQUENCY       (32768UL)
 
 /* Required RTC working clock RTC_FREQUENCY Hertz. Changable. */
-#define RTC_FREQUENCY         (1000UL)  /* 1k gives approx resolution of 1mS */
+#define RTC_FREQUENCY         (32768UL) /* Full speed, a tick is ~30.5uS */
 
 /* f = LFCLK/(prescaler + 1) */
 #define COUNTER_PRESCALER     ((LFCLK_FREQUENCY/RTC_FREQUENCY) - 1)
@@ -36,6 +37,26 @@
 #define ACC_INT1 9  /* this is the motion detection input  */
 #define ACC_INT2 8  /* this is the double tap input */
 
+/* RTC1 compare channel and PPI channel that start the crystal ahead of us */
+#define RTC_CC_HFCLK_PREWAKE  3
+#define PPI_CH_HFCLK_PREWAKE  0
+
+/*
+ * Waits shorter than this (uS) just spin: going to sleep and waking up
+ * again costs about as much as they'd save.
+ */
+#define HW_WAIT_SPIN_US       10
+
+/* TIMER1 runs at 1MHz, and is 16 bits wide */
+#define HW_WAIT_MAX_US        0xFFFF
+
+/* ADC bandgap reference, mV */
+#define HW_VBG_MV             1200
+
+/* Longest a temperature or supply reading takes before we call it stuck */
+#define HW_TEMP_TIMEOUT_US    200
+#define HW_ADC_TIMEOUT_US     300
+
 #define PIN_DETECTED 1
 #define PIN_DEFAULT  0
 
@@ -47,19 +68,37 @@ void hw_init(void);
 void hw_enable_movement_detect(void);
 void hw_disable_movement_detect(void);
 void hw_enable_double_tap(void);
-void hw_rtc_wakeup(uint32_t ms);
-uint32_t hw_rtc_value(void);
-void hw_rtc_start(void);
-void hw_rtc_clear(void);
-void hw_rtc_stop(void);
+void hw_disable_double_tap(void);
+uint8_t hw_acc_inactive(void);
+void hw_rtc_init(void);
+uint32_t hw_rtc_counter(void);
+void hw_rtc_set_alarm(uint32_t tick);
+void hw_rtc_cancel_alarm(void);
 void hw_sleep_power_off(void);
-void hw_sleep_power_on(void);
+void hw_power_apply(bool dcdc, uint8_t ram_on, uint8_t ram_retain,
+                    bool radio_off);
 void hw_clear_port_event();
 void hw_switch_to_lfclock(void);
 void hw_switch_to_hfclock(void);
+uint8_t hw_hfclk_running(void);
+void hw_hfclk_prewake(uint32_t tick);
+void hw_hfclk_prewake_cancel(void);
+uint8_t hw_hfclk_prewake_fired(void);
+void hw_wait_us(uint32_t us);
+uint32_t hw_wait_event_us(volatile uint32_t * event, uint32_t us);
+void hw_wait_event_or_reset(volatile uint32_t * event, uint32_t us);
+void hw_lfclk_cal_timer(uint8_t quarter_seconds);
+void hw_lfclk_cal_start(void);
+int32_t hw_temp_read(void);
+uint16_t hw_vdd_mv(void);
 void hw_stop_LF_clk(void);
-void hw_start_LF_clk(void);
+void hw_clocks_start(void);
+void hw_clocks_wait(void);
 void hw_read_reset_reason(uint32_t *resetreas);
 uint32_t hw_ficr_deviceid(size_t index);
+void hw_readback_protect(void);
+void hw_reset(void);
+uint32_t hw_critical_enter(void);
+void hw_critical_exit(uint32_t mask);
 
 #endif
@@ -12,25 +12,20 @@
 #include "hw.h"
 #include "debug.h"
 #include "nrf_delay.h"
-#include "nrf_nvmc.h"
+#include "timer.h"
+#include "clock.h"
+#include "power.h"
+#include "retained.h"
+#include "battery.h"
+#include "phase.h"
+#include "kv.h"
+#include "flash.h"
 
 /*
- * This will allocate space in the binary
- * to hold the secrets. We will use this
- * during manufacturing
+ * This Ki's secrets, as the manufacturing machine gave them (kept in
+ * flash by kv.c). All 0xff until then.
  */
-static ki_secrets_t flash_secret_data
-__attribute__((section(".storage_section"))) =
-{
-  .key_id = { [0 ... SIZE_KI_ID - 1] = 0xff },
-  .private_key = { [0 ... AES_BLOCK_SIZE-1] = 0xff }
-};
-
-static uint8_t flash_is_installer_ki
-__attribute__((section(".storage_section"))) = 0xff;
-
-static uint8_t flash_is_tracked_ki
-__attribute__((section(".storage_section"))) = 0xff;
+static ki_secrets_t ki_secrets;
 
 /* We'll use this as a packet buffer */
 volatile radio_packet_t packet = {
@@ -68,32 +63,137 @@ bool has_been_manufactured(ki_state_t * state)
  */
 void kiwiki_setup_state(ki_state_t * state)
 {
+  ki_provision_t provision;
+  params_block_t params_block;
+
+  /* What we were given at manufacture */
+  kv_init();
+  if (!kv_read(KV_KEY_SECRETS, &provision, sizeof(provision)))
+  {
+    memset(&provision, 0xff, sizeof(provision));
+  }
+  ki_secrets = provision.secrets;
+
+  /* This site's timings, if it has its own */
+  if (!kv_read(KV_KEY_PARAMS, &params_block, sizeof(params_block)))
+  {
+    memset(&params_block, 0xff, sizeof(params_block));
+  }
+  params_load(&params_block);
+
   ki_state_t work_state =
   {
-    .ki = (ki_secrets_t *)&flash_secret_data,
+    .ki = &ki_secrets,
     .challenge = {{0},{0}},
     .sensor_id = {0},
     .ki_random = {0},
     .fsm_state = KI_STATE_SLEEP,
     .door_prox_state = MAYBE_IN_FRONT_OF_DOOR,
-    .is_installer_ki = (uint8_t)flash_is_installer_ki,
-    .is_tracked_ki = (uint8_t)flash_is_tracked_ki,
+    .is_installer_ki = provision.is_installer_ki,
+    .is_tracked_ki = provision.is_tracked_ki,
     .seen_stopwatch = 0,
     .packet_stat = 0,
-    .motionless_time = MOTIONLESS_TIME,
+    .motionless_until = timer_now64() +
+                        TIMER_MS_TO_TICKS(params_get()->motionless_time),
     .has_been_manufactured = false,
     .is_hw_good = true,
+    .acc_profile = LIS2DH_PROFILE_DOUBLE_TAP,
+    .is_sleeping = false,
+    .is_listening = false,
   };
 
+  session_set_holdoff(&work_state.sessions, HANDSHAKE_HOLDOFF);
+
   /* Check to see if we have been manufactured yet */
   work_state.has_been_manufactured = has_been_manufactured(&work_state);
 
   /* Check to see why we reset. */
   hw_read_reset_reason(&work_state.resetreas);
 
+  /* Pick up where we left off if we've only been in System OFF */
+  kiwiki_restore_warm(&work_state);
+
+  /*
+   * Picked up (the accelerometer woke us): someone's on the move, maybe
+   * to a door. Listen straight away rather than sleep first. The
+   * accelerometer kept its setup and was left waking on motion.
+   */
+  if (kiwiki_fast_boot(&work_state))
+  {
+    work_state.fsm_state = KI_STATE_LISTEN_BEACON;
+    work_state.acc_profile = LIS2DH_PROFILE_WAKE_ON_MOTION;
+  }
+
   memcpy(state, &work_state, sizeof(ki_state_t));
 }
 
+/*
+ * Did the accelerometer wake us from System OFF? (RESETREAS OFF is a
+ * GPIO DETECT wake, which is the only kind we set up.) If so, the
+ * accelerometer doesn't need setting up again.
+ */
+bool kiwiki_fast_boot(ki_state_t * state)
+{
+  return (state->resetreas & POWER_RESETREAS_OFF_Msk) != 0;
+}
+
+/*
+ * The warm state has to fit in retained RAM, or retained_save turns it
+ * down and every warm start quietly becomes a cold one. This won't build
+ * if it outgrows RETAINED_SIZE.
+ */
+typedef char kiwiki_warm_fits[sizeof(ki_warm_state_t) <= RETAINED_SIZE ? 1 : -1];
+
+/*
+ * Bring back what we knew before the last System OFF (see retained.c),
+ * so the first handshake after being picked up doesn't start from
+ * nothing. Anything but a wake from System OFF means it's stale (or
+ * garbage), and it is only good once.
+ *
+ * Returns true if there was something to bring back.
+ */
+bool kiwiki_restore_warm(ki_state_t * state)
+{
+  ki_warm_state_t warm;
+  bool restored = false;
+
+  if (kiwiki_fast_boot(state) && retained_load(&warm, sizeof(warm)))
+  {
+    memcpy(&state->challenge, &warm.challenge, sizeof(state->challenge));
+    memcpy(state->sensor_id, warm.sensor_id, sizeof(state->sensor_id));
+    memcpy(state->ki_random, warm.ki_random, sizeof(state->ki_random));
+    state->door_prox_state = warm.door_prox_state;
+    state->seen_stopwatch = warm.seen_stopwatch;
+    state->packet_stat = warm.packet_stat;
+    state->hfclk_lead = warm.hfclk_lead;
+    state->sessions.no_ack = warm.no_ack;
+    restored = true;
+
+    _debug_printf("Warm start%s", "");
+  }
+
+  retained_invalidate();
+  return restored;
+}
+
+/* Keep what's worth keeping, we're about to go to System OFF */
+void kiwiki_save_warm(ki_state_t * state)
+{
+  ki_warm_state_t warm;
+
+  memset(&warm, 0, sizeof(warm));
+  memcpy(&warm.challenge, &state->challenge, sizeof(warm.challenge));
+  memcpy(warm.sensor_id, state->sensor_id, sizeof(warm.sensor_id));
+  memcpy(warm.ki_random, state->ki_random, sizeof(warm.ki_random));
+  warm.door_prox_state = state->door_prox_state;
+  warm.seen_stopwatch = state->seen_stopwatch;
+  warm.packet_stat = state->packet_stat;
+  warm.hfclk_lead = clock_prewake_lead();
+  warm.no_ack = state->sessions.no_ack;
+
+  retained_save(&warm, sizeof(warm));
+}
+
 void kiwiki_set_state(ki_state_t * state, fsm_state_t newstate)
 {
   _debug_printf("State Change. Old: %d, New: %d", state->fsm_state, newstate);
@@ -105,7 +205,7 @@ void kiwiki_update_pckt_rate(ki_state_t * state)
 {
   if (packet.pipe != RADIO_PIPE_NONE)
   {
-    if(state->packet_stat < PACKET_STAT_MAX)
+    if(state->packet_stat < params_get()->packet_stat_max)
     {
       state->packet_stat++;
     }
@@ -119,389 +219,921 @@ void kiwiki_update_pckt_rate(ki_state_t * state)
   }
 }
 
+/* Is a timer_now64 deadline still to come? */
+static bool kiwiki_before(uint64_t deadline)
+{
+  return timer_now64() < deadline;
+}
+
 /*
- * Update the double-tap counter
+ * Update the double-tap timers
+ *
+ * Returns true if we were just double tapped, so that the caller can get
+ * going with the handshake burst straight away.
  */
-void kiwiki_update_doubletap_timer(ki_state_t * state, int16_t update_time)
+bool kiwiki_update_doubletap_timer(ki_state_t * state)
 {
-  if (double_tap_pin_status == PIN_DETECTED)
+  uint64_t now = timer_now64();
+
+  if (kiwiki_acc_double_tapped(state))
   {
     /* If double tap detected */
-    state->double_tap_time = DOUBLE_TAP_TIME;
+    state->double_tap_until = now + TIMER_MS_TO_TICKS(DOUBLE_TAP_TIME);
+    state->double_tap_burst_until = now + TIMER_MS_TO_TICKS(DOUBLE_TAP_BURST_TIME);
     state->double_tap_challenges = SEND_DOUBLE_TAP_CHALLENGES;
 
+    /* They want a door open, even one we've just challenged */
+    session_release(&state->sessions);
+
+    /* Somebody's holding us, whatever INT2 said before */
+    state->inactive_passes = 0;
+
+    state->tap_pending = false;
+    return true;
+  }
+  else if (now >= state->double_tap_until)
+  {
+    /* If the double tap timer ran out, stop sending double tap challenges
+     * over DHAL pipe */
+    state->double_tap_challenges = SEND_NORMAL_CHALLENGES;
+  }
+  return false;
+}
+
+/*
+ * Move the accelerometer to a new profile. Every change costs a handful of
+ * SPI transactions, so only do it when the profile actually changes.
+ */
+void kiwiki_set_acc_profile(ki_state_t * state, LIS2DH_Profile_t profile)
+{
+  if (state->acc_profile == profile)
+  {
+    return;
+  }
+
+  _debug_printf("Accelerometer profile. Old: %d, New: %d",
+    state->acc_profile, profile);
+
+  /* On failure keep the old profile, so that we try again next time */
+  if (LIS2DH_SetPowerProfile(profile) == MEMS_SUCCESS)
+  {
+    state->acc_profile = profile;
+  }
+}
+
+/*
+ * Is there a double tap in CLICK_SRC? Reading it clears it, so a tap we
+ * find is kept in tap_pending until the double tap timer takes it.
+ */
+static bool kiwiki_acc_read_tap(ki_state_t * state)
+{
+  u8_t tapped = 0;
+
+  /* If we can't tell, a tap is the safer guess */
+  if (LIS2DH_GetDoubleTap(&tapped) != MEMS_SUCCESS || tapped)
+  {
+    state->tap_pending = true;
+  }
+  return state->tap_pending;
+}
+
+/*
+ * Were we double tapped? INT2 going high says so, unless the sleep-to-wake
+ * engine is on: then it might just as well be the activity status, and
+ * CLICK_SRC says which.
+ */
+bool kiwiki_acc_double_tapped(ki_state_t * state)
+{
+  if (double_tap_pin_status == PIN_DETECTED)
+  {
     double_tap_pin_status = PIN_DEFAULT;
+#if ACC_INACTIVITY_SLEEP
+    kiwiki_acc_read_tap(state);
+#else
+    state->tap_pending = true;
+#endif
   }
-  else
+  return state->tap_pending;
+}
+
+/*
+ * Has the accelerometer's sleep-to-wake engine decided that we're lying
+ * still? It holds INT2 high for as long as we are. So does a double tap
+ * until we read CLICK_SRC, so we look there first, and we want to see INT2
+ * high on ACC_INACTIVE_PASSES sleep passes in a row before we believe it.
+ */
+bool kiwiki_acc_inactive(ki_state_t * state)
+{
+#if ACC_INACTIVITY_SLEEP
+  if (hw_acc_inactive() && !kiwiki_acc_read_tap(state))
   {
-    /* subtract awake time from double tap timer */
-    if (state->double_tap_time > 0)
-    {
-      state->double_tap_time = state->double_tap_time - update_time;
-    }
-    else
+    /*
+     * Stop sensing INT2 while it's held high, or the port's DETECT stays
+     * up and we'd never see movement on INT1
+     */
+    hw_disable_double_tap();
+    if (state->inactive_passes < ACC_INACTIVE_PASSES)
     {
-      /* If double tap timer negative, stop sending double tap challenges
-       * over DHAL pipe */
-      state->double_tap_challenges = SEND_NORMAL_CHALLENGES;
+      state->inactive_passes++;
     }
   }
+  else
+  {
+    hw_enable_double_tap();
+    state->inactive_passes = 0;
+  }
+
+  return state->inactive_passes >= ACC_INACTIVE_PASSES;
+#else
+  return false;
+#endif
 }
 
 /*
- * THIS IS OUR MAIN STATE MACHINE
+ * Time since we last looked, in mS, measured off the RTC. Rounded down,
+ * and we only move on by the ticks those whole mS take, so whatever is
+ * left over counts towards next time and we never get ahead of the RTC.
+ * Clamped, so that adding it to the stopwatch can't wrap it.
  */
-void kiwiki_step(ki_state_t * state)
+static int16_t kiwiki_take_time(ki_state_t * state)
+{
+  uint32_t ticks = timer_now() - state->accounted_at;
+  uint32_t elapsed = (uint64_t) ticks * 1000 / RTC_FREQUENCY;
+
+  if (elapsed > INT16_MAX)
+  {
+    elapsed = INT16_MAX;
+  }
+  state->accounted_at += (uint64_t) elapsed * RTC_FREQUENCY / 1000;
+
+  return (int16_t) elapsed;
+}
+
+/* The alarm clock went off */
+static void kiwiki_wake(void * ctx)
+{
+  ki_state_t * state = (ki_state_t *) ctx;
+
+  if (state->is_sleeping)
+  {
+    state->is_sleeping = false;
+    kiwiki_sleep_exit(state);
+    sched_post(SCHED_EVT_STEP);
+  }
+}
+
+/*
+ * Give the flash queue (flash.c) the time from now until the crystal has
+ * to start for the next listen. The CPU stalls while the flash works, but
+ * the RTC doesn't, so we'll still be up in time.
+ */
+static void kiwiki_flash_slot(ki_state_t * state)
 {
-  /* How long is left to listen */
-  uint16_t listen_time_left = 0;
+  uint32_t now = timer_now();
+  uint32_t start = state->wake_timer.deadline - clock_prewake_lead();
+  uint64_t slot_us;
+
+  if (!flash_busy() || (int32_t)(start - now) <= 0)
+  {
+    return;
+  }
+
+  slot_us = TIMER_TICKS_TO_US(start - now);
+  if (slot_us > FLASH_SLOT_MARGIN_US)
+  {
+    flash_run(slot_us - FLASH_SLOT_MARGIN_US);
+  }
+}
 
+/*
+ * Work out how long to sleep for, and set the alarm clock.
+ *
+ * Returns false if we shouldn't sleep after all (we've been double tapped
+ * and want to get going right away), in which case the state has moved on.
+ * Doesn't return at all if it's time for a deep sleep.
+ */
+bool kiwiki_sleep_enter(ki_state_t * state)
+{
   /* How long to sleep */
   uint16_t sleep_time;
 
   /* How long we were awake */
   int16_t awake_time;
 
-  switch (state->fsm_state)
+  /* Were we double tapped just now? */
+  bool double_tapped;
+
+  const params_t * params = params_get();
+
+  _debug_printf("Going to sleep%s", "");
+
+  /* Next time we wake, every door gets a turn again */
+  session_new_wake(&state->sessions);
+
+  /* Cut Radio Power */
+  radio_shutdown(1);
+
+  awake_time = kiwiki_take_time(state);
+
+  /* Add awake time to our door seen stop-watch */
+  if (state->seen_stopwatch < DOOR_SEEN_SW_MAX)
   {
-    case KI_STATE_LISTEN_BEACON:
-      /* Set expected packet size */
-      if(likely(state->has_been_manufactured))
+    state->seen_stopwatch += awake_time;
+  }
+
+  double_tapped = kiwiki_update_doubletap_timer(state);
+  if (state->double_tap_challenges == SEND_DOUBLE_TAP_CHALLENGES)
+  {
+    state->door_prox_state = NOT_IN_FRONT_OF_DOOR;
+  }
+
+  /* Wait an amount of time based on when we last saw a door */
+  switch (state->door_prox_state)
+  {
+    case MAYBE_IN_FRONT_OF_DOOR:
+      if (state->seen_stopwatch > params->maybe_ifod_threshold)
+      {
+        _debug_printf("Moved away from door...%s", "");
+        state->door_prox_state = NOT_IN_FRONT_OF_DOOR;
+        sleep_time = params->poll_interval_standard;
+      }
+      else if (state->packet_stat >= params->packet_stat_thresh)
       {
-        packet.payloadLength = sizeof(beacon_packet_t);
+        _debug_printf("Door found for sure...%s", "");
+        state->seen_stopwatch = 0;
+        state->door_prox_state = DEFINITELY_IN_FRONT_OF_DOOR;
+        sleep_time = params->poll_interval_short;
       }
       else
       {
-        packet.payloadLength = sizeof(manufacturing_secrets_packet_t);
+        _debug_printf("Maybe in front of door...%s", "");
+        sleep_time = params->poll_interval_shortest;
       }
+      break;
 
-      /* Turn on the XCVR for RX */
-      radio_start_listen(&packet, !state->has_been_manufactured);
-
-      if(likely(state->has_been_manufactured))
+    case NOT_IN_FRONT_OF_DOOR:
+      if (state->packet_stat > 0)
       {
-        /* Listen for a beacon.
-         * Keep listening while we have time and have not yet received a beacon,
-         * even if we get something else */
-        listen_time_left = LISTEN_TIME_BEACON;
-        while (listen_time_left && packet.pipe != RADIO_PIPE_KIWI)
-        {
-          listen_time_left = radio_middle_listen(&packet, listen_time_left);
-        }
+        _debug_printf("Maybe a door there...%s", "");
+        state->seen_stopwatch = 0;
+        state->door_prox_state = MAYBE_IN_FRONT_OF_DOOR;
+        sleep_time = params->poll_interval_shortest;
       }
       else
       {
-        /* Listen for a manufacturing machine beacon.
-         * Keep listening while we have time and have not yet received a beacon,
-         * even if we get something else */
-        listen_time_left = LISTEN_TIME_MANUFACTURING;
-        while (listen_time_left && (
-                (packet.pipe != RADIO_PIPE_MM_UUID_REQ) &&
-                (packet.pipe != RADIO_PIPE_MM_SECRETS)
-               ))
-        {
-          listen_time_left = radio_middle_listen(&packet, listen_time_left);
-        }
+        _debug_printf("Ki inactive...%s", "");
+        sleep_time = params->poll_interval_standard;
       }
+      break;
 
-      /* Turn off the XCVR */
-      radio_end_listen();
+    case DEFINITELY_IN_FRONT_OF_DOOR:
+      if (state->packet_stat < params->packet_stat_thresh)
+      {
+        _debug_printf("Possibly walked away from the door...%s", "");
+        state->seen_stopwatch = 0;
+        state->door_prox_state = MAYBE_IN_FRONT_OF_DOOR;
+        sleep_time = params->poll_interval_shortest;
+      }
+      else if (state->seen_stopwatch > params->longtime_ifod_threshold)
+      {
+        _debug_printf("Been in front of door for a while now...%s", "");
+        state->door_prox_state = IN_FRONT_OF_DOOR_LONG_TIME;
+        sleep_time = params->poll_interval_long;
+      }
+      else
+      {
+        _debug_printf("Definitely in front of door...%s", "");
+        sleep_time = params->poll_interval_short;
+      }
+      break;
 
-      /* Didn't get a packet during timeout, just go to sleep */
-      if (listen_time_left == 0)
+    case IN_FRONT_OF_DOOR_LONG_TIME:
+      if (state->packet_stat < params->packet_stat_thresh)
       {
-        kiwiki_set_state(state, KI_STATE_SLEEP);
-        break;
+        _debug_printf("Possibly walked away from the door...%s", "");
+        state->seen_stopwatch = 0;
+        state->door_prox_state = MAYBE_IN_FRONT_OF_DOOR;
+        sleep_time = params->poll_interval_shortest;
       }
+      else
+      {
+        _debug_printf("Ki sitting in front of door...%s", "");
+        sleep_time = params->poll_interval_long;
+      }
+      break;
+
+    /* Should never get here */
+    default:
+      state->door_prox_state = NOT_IN_FRONT_OF_DOOR;
+      sleep_time = params->poll_interval_standard;
+      break;
+  }
 
-      /* Update our "packet rate" counter */
-      kiwiki_update_pckt_rate(state);
+  /*
+   * A door we've been hearing but haven't got a challenge to (it was
+   * further away than another, or we lost the race for it): come back
+   * for it sooner than we otherwise would.
+   */
+  if (sleep_time > params->poll_interval_short &&
+      session_waiting(&state->sessions, timer_now()))
+  {
+    _debug_printf("A door is still waiting...%s", "");
+    sleep_time = params->poll_interval_short;
+  }
 
-      _debug_printf("Packet on pipe %d", packet.pipe);
+  /*
+   * Keep out of step with any other Kis at the same door. If we just
+   * talked over one, get out of its way for a random moment instead.
+   */
+  if (state->collided)
+  {
+    sleep_time = phase_backoff(&state->phase, params->poll_interval_shortest);
+    state->collided = false;
+  }
+  else
+  {
+    sleep_time = phase_jitter(&state->phase, sleep_time);
+  }
+
+  /* Poll less often as the battery runs down */
+  sleep_time = battery_scale_sleep(sleep_time);
+
+  /*
+   * Right after a double tap, poll fast for a little while. The user is
+   * waiting in front of a door for it to open.
+   */
+  if (kiwiki_before(state->double_tap_burst_until))
+  {
+    sleep_time = DOUBLE_TAP_BURST_INTERVAL;
+  }
+
+  /*
+   * Awake, double taps can come at any time, and any slower than the ODR
+   * the click timing is tuned for and they get missed. The low ODR is for
+   * System OFF.
+   */
+  kiwiki_set_acc_profile(state, LIS2DH_PROFILE_DOUBLE_TAP);
 
-      /* If we have been manufactured, listen only for beacons */
-      if (state->has_been_manufactured)
+  if (movement_pin_status == PIN_DETECTED)
+  {
+    /* If motion detected by accelerometer, start the motionless timer over */
+    state->motionless_until = timer_now64() +
+                              TIMER_MS_TO_TICKS(params->motionless_time);
+
+    /* Disable the movement sense momentarily so that we can distinguish
+     * a double tap sense if it occurs.
+     * This gets re-enabled when we wake from a light sleep next */
+    hw_disable_movement_detect();
+
+    /* Reset the pin state */
+    movement_pin_status = PIN_DEFAULT;
+    state->inactive_passes = 0;
+
+    /* Up and about: INT2 is for double taps again, if we'd stopped sensing it */
+    hw_enable_double_tap();
+  }
+  else
+  {
+    /*
+     * else no motion was detected
+     *  - ask the accelerometer whether we're lying still, and failing
+     *    that, see if the motionless timer has run out
+     * */
+    if (kiwiki_acc_inactive(state) ||
+        !kiwiki_before(state->motionless_until))
+    {
+      /*
+       * We have not detected motion for a while: go to deep sleep
+       * The next interrupt from the accelerometer will cause a CPU reset
+       */
+      kiwiki_set_acc_profile(state, LIS2DH_PROFILE_WAKE_ON_MOTION);
+      hw_clear_port_event();
+
+      /* INT2 stays high while we lie still, it mustn't wake us */
+      hw_disable_double_tap();
+      hw_enable_movement_detect();
+      kiwiki_save_warm(state);
+
+      /* Queued flash work wouldn't survive, get it done */
+      flash_flush();
+
+      power_set_mode(POWER_MODE_SYSTEM_OFF);
+      hw_sleep_power_off();
+      /*  * * * * * * * * * * * * * * *
+       * We are DEEPLY sleeping here  *
+       * Reset will occur on next int *
+       *       from accelerometer     *
+       *  * * * * * * * * * * * * * * */
+    }
+  }
+
+  /* A fresh double tap doesn't wait for the alarm clock */
+  if (double_tapped)
+  {
+    kiwiki_set_state(state, KI_STATE_LISTEN_BEACON);
+    return false;
+  }
+
+  /* Set the alarm clock */
+  timer_start(&state->wake_timer, TIMER_MS_TO_TICKS(sleep_time),
+              kiwiki_wake, state);
+
+  /* And have the crystal ready for the radio when it goes off */
+  clock_prewake(state->wake_timer.deadline);
+
+  /* Turn off HF clock */
+  clock_hfxo_stop();
+
+  /* The radio's quiet until then: a chance for any flash work */
+  kiwiki_flash_slot(state);
+
+  power_set_mode(POWER_MODE_LIGHT_SLEEP);
+
+  state->sleep_time = sleep_time;
+  return true;
+}
+
+/*
+ * We're back from a light sleep (the alarm clock went off, or a double tap
+ * cut it short). Account for the time slept and go listen for a beacon.
+ */
+void kiwiki_sleep_exit(ki_state_t * state)
+{
+  /* How long we really slept (a double tap cuts it short) */
+  int16_t slept_time = kiwiki_take_time(state);
+
+  /* If we woke early, the alarm clock is still set */
+  timer_stop(&state->wake_timer);
+  power_set_mode(POWER_MODE_CPU);
+
+  hw_enable_movement_detect();
+
+  /* Add sleep time to our door seen stop-watch */
+  if (state->seen_stopwatch < DOOR_SEEN_SW_MAX)
+  {
+    state->seen_stopwatch += slept_time;
+  }
+
+  /*
+   * A double tap wakes us up from the light sleep, and is picked up
+   * here, so the burst starts with the listen right after.
+   */
+  kiwiki_update_doubletap_timer(state);
+
+  kiwiki_set_state(state, KI_STATE_LISTEN_BEACON);
+}
+
+/* Is a packet from this pipe a beacon we answer? */
+static bool kiwiki_is_beacon(uint32_t pipe)
+{
+  return pipe == RADIO_PIPE_KIWI ||
+         (PROTOCOL_V2 && pipe == RADIO_PIPE_KIWI_V2);
+}
+
+/* Move the handshake with the current door along */
+static void kiwiki_session_state(ki_state_t * state, session_state_t session_state)
+{
+  session_t * session = session_find(&state->sessions, state->sensor_id);
+
+  if (session)
+  {
+    session->state = session_state;
+  }
+}
+
+/*
+ * A beacon came in: note the door, and say if it's the one to answer.
+ * Beacons from doors further away than one we've heard lately are let
+ * go (a few times), in the hope the closer door's beacon comes in too.
+ */
+static bool kiwiki_take_beacon(ki_state_t * state, volatile radio_packet_t * packet)
+{
+  session_t * session;
+  uint32_t now;
+
+  if (!kiwiki_is_beacon(packet->pipe))
+  {
+    return false;
+  }
+
+  now = timer_now();
+  session = session_seen(&state->sessions, (uint8_t *)packet->payload,
+                         (uint8_t)-packet->rssi, now);
+  if (session_should_answer(&state->sessions, session, now))
+  {
+    return true;
+  }
+
+  /*
+   * A door we've just challenged: nothing to say to it, but it's still
+   * there, which is all we wanted to know. Unless someone else is
+   * waiting, that's this listen done.
+   */
+  if (session_held_off(&state->sessions, session, now) &&
+      !session_pending(&state->sessions, now))
+  {
+    return true;
+  }
+
+  _debug_printf("Letting beacon go, RSSI -%d", session->rssi);
+  packet->pipe = RADIO_PIPE_NONE;
+  return false;
+}
+
+/* Is this beacon from a door we're holding off from? */
+static bool kiwiki_holding_off(ki_state_t * state, volatile radio_packet_t * packet)
+{
+  session_t * session = session_find(&state->sessions, (uint8_t *)packet->payload);
+
+  return session && session_held_off(&state->sessions, session, timer_now());
+}
+
+/*
+ * Done with the door we were talking to. If other doors are waiting for
+ * us this wake, listen for them straight away rather than sleep first.
+ *
+ * A door that should have acked our challenge and didn't most likely
+ * never got it, so it isn't counted as challenged: we try again next wake.
+ */
+static void kiwiki_handshake_done(ki_state_t * state, challenge_result_t result)
+{
+  session_t * session = session_find(&state->sessions, state->sensor_id);
+
+  if (session && result == CHALLENGE_UNACKED)
+  {
+    session_tried(session);
+  }
+  else if (session)
+  {
+    session_challenged(session, timer_now(), result == CHALLENGE_ACKED);
+  }
+
+  if (session_pending(&state->sessions, timer_now()))
+  {
+    kiwiki_set_state(state, KI_STATE_LISTEN_BEACON);
+  }
+  else
+  {
+    kiwiki_set_state(state, KI_STATE_SLEEP);
+  }
+}
+
+/*
+ * Did we hear what this listen is after? For a beacon (or the
+ * manufacturing machine) that's done by kiwiki_step's state, for a random
+ * it's the sensor we answered.
+ */
+static bool kiwiki_listen_wanted(ki_state_t * state, volatile radio_packet_t * packet)
+{
+  random_packet_t * sensor_rand_pckt = (random_packet_t *)packet->payload;
+
+  if (state->fsm_state == KI_STATE_LISTEN_RAND)
+  {
+    return packet->pipe == RADIO_PIPE_RAND &&
+           !memcmp(sensor_rand_pckt->sensor_id, state->sensor_id, SIZE_SENSOR_ID);
+  }
+
+  if (likely(state->has_been_manufactured))
+  {
+    return kiwiki_take_beacon(state, packet);
+  }
+
+  return packet->pipe == RADIO_PIPE_MM_UUID_REQ ||
+         packet->pipe == RADIO_PIPE_MM_SECRETS ||
+         packet->pipe == RADIO_PIPE_MM_PARAMS;
+}
+
+/* The listen for a beacon is over: heard is whether we got one */
+static void kiwiki_beacon_heard(ki_state_t * state, bool heard)
+{
+  /*
+   * Didn't get a packet during timeout, just go to sleep. Unless the
+   * manufacturing machine is running rounds: then stay on the air.
+   */
+  if (!heard)
+  {
+    kiwiki_set_state(state, provision_listening(&state->mm, timer_now()) ?
+                            KI_STATE_LISTEN_BEACON : KI_STATE_SLEEP);
+    return;
+  }
+
+  /* Update our "packet rate" counter */
+  kiwiki_update_pckt_rate(state);
+
+  _debug_printf("Packet on pipe %d", packet.pipe);
+
+  /* If we have been manufactured, listen only for beacons */
+  if (state->has_been_manufactured)
+  {
+    /* A door we've only just challenged? Leave it be */
+    if (kiwiki_is_beacon(packet.pipe) && kiwiki_holding_off(state, &packet))
+    {
+      _debug_printf("Holding off from this door%s", "");
+      state->held_off++;
+      kiwiki_set_state(state, KI_STATE_SLEEP);
+    }
+    /* Did we get a beacon? */
+    else if (packet.pipe == RADIO_PIPE_KIWI)
+    {
+      /* We received a beacon, process it */
+      kiwiki_receive_beacon(state, &packet);
+    }
+    else if (PROTOCOL_V2 && packet.pipe == RADIO_PIPE_KIWI_V2)
+    {
+      /* One with the sensor's random in: answer it in one go */
+      kiwiki_receive_beacon_v2(state, &packet);
+    }
+    /* Packet recieved on wrong pipe. Go back to sleep */
+    else
+    {
+      kiwiki_set_state(state, KI_STATE_SLEEP);
+    }
+  }
+  /* If we have not been manufactured, listen only for uuid requests (or secrets) */
+  else
+  {
+    /* Did we get a request from the manufacturing machine for our uuid? */
+    if (packet.pipe == RADIO_PIPE_MM_UUID_REQ)
+    {
+      if (state->is_hw_good &&
+          provision_round_valid((provision_round_packet_t *)packet.payload))
       {
-        /* Did we get a beacon? */
-        if (packet.pipe == RADIO_PIPE_KIWI)
-        {
-          /* We received a beacon, process it */
-          kiwiki_receive_beacon(state, &packet);
-        }
-        /* Packet recieved on wrong pipe. Go back to sleep */
-        else
-        {
-          kiwiki_set_state(state, KI_STATE_SLEEP);
-        }
+        kiwiki_process_mm_round(state, &packet);
       }
-      /* If we have not been manufactured, listen only for uuid requests (or secrets) */
-      else
+      else if (state->is_hw_good)
       {
-        /* Did we get a request from the manufacturing machine for our uuid? */
-        if (packet.pipe == RADIO_PIPE_MM_UUID_REQ)
-        {
-          if (state->is_hw_good)
-          {
-            kiwiki_process_mm_uuid_req(state, &packet);
-          }
-        }
-        /* Did we get secrets from a the manufacturing machine? */
-        else if (packet.pipe == RADIO_PIPE_MM_SECRETS)
-        {
-          kiwiki_process_mm_secrets(state, &packet);
-        }
-        /* Packet received on wrong pipe. Back to sleep */
-        else
-        {
-          kiwiki_set_state(state, KI_STATE_SLEEP);
-        }
+        kiwiki_process_mm_uuid_req(state, &packet);
       }
-    break;
+    }
+    /* Did we get secrets from a the manufacturing machine? */
+    else if (packet.pipe == RADIO_PIPE_MM_SECRETS)
+    {
+      kiwiki_process_mm_secrets(state, &packet);
+    }
+    /* Or this site's timings? */
+    else if (packet.pipe == RADIO_PIPE_MM_PARAMS)
+    {
+      kiwiki_process_mm_params(state, &packet);
+    }
+    /* Packet received on wrong pipe. Back to sleep */
+    else
+    {
+      kiwiki_set_state(state, KI_STATE_SLEEP);
+    }
+  }
+}
 
-    case KI_STATE_LISTEN_RAND:
+/* The listen for the sensor's random is over: heard is whether we got it */
+static void kiwiki_random_heard(ki_state_t * state, bool heard)
+{
+  if (heard)
+  {
+    /* yes, process it and send a bunch of challenges */
+    kiwiki_handshake_done(state, kiwiki_receive_random(state, &packet));
+  }
+  else
+  {
+    /*
+     * No random after sending ours? Most likely another Ki answered
+     * the same beacon. Pick a new phase and back off for a bit.
+     */
+    kiwiki_reseed_phase(state);
+    state->collided = true;
+    kiwiki_session_state(state, SESSION_DONE);
+    kiwiki_set_state(state, KI_STATE_SLEEP);
+  }
+}
 
-      /* Set expected packet size */
-      packet.payloadLength = sizeof(random_packet_t);
+/* A listen is over: see to what we heard, and on to the next step */
+static void kiwiki_listen_done(ki_state_t * state, bool heard)
+{
+  state->is_listening = false;
+  timer_stop(&state->listen_timer);
 
-      /* Turn on the XCVR for RX */
-      radio_start_listen(&packet, !state->has_been_manufactured);
+  /* Turn off the XCVR */
+  radio_end_listen();
 
-      /* Listen for a random for some amount of time */
-      listen_time_left = LISTEN_TIME_RANDOM;
+  if (state->fsm_state == KI_STATE_LISTEN_RAND)
+  {
+    kiwiki_random_heard(state, heard);
+  }
+  else
+  {
+    kiwiki_beacon_heard(state, heard);
+  }
+
+  sched_post(SCHED_EVT_STEP);
+}
+
+/* Out of time to listen */
+static void kiwiki_listen_timeout(void * ctx)
+{
+  ki_state_t * state = (ki_state_t *) ctx;
+
+  if (state->is_listening)
+  {
+    kiwiki_listen_done(state, false);
+  }
+}
+
+/*
+ * Listen for us uS. The radio is set going and we're straight back: each
+ * packet comes in as SCHED_EVT_RADIO, and listen_timer ends it.
+ */
+static void kiwiki_listen(ki_state_t * state, uint16_t us)
+{
+  /* Turn on the XCVR for RX */
+  radio_start_listen(&packet, !state->has_been_manufactured);
+  radio_listen_arm(&packet);
+
+  /* We're part way through a tick already, so one more */
+  timer_start(&state->listen_timer, TIMER_US_TO_TICKS(us) + 1,
+              kiwiki_listen_timeout, state);
+  state->is_listening = true;
+}
+
+/*
+ * THIS IS OUR MAIN STATE MACHINE
+ *
+ * A listening state only starts its listen here, kiwiki_listen_done
+ * finishes it.
+ */
+void kiwiki_step(ki_state_t * state)
+{
+  switch (state->fsm_state)
+  {
+    case KI_STATE_LISTEN_BEACON:
+      /* Andale, andale! (usually the crystal is up already) */
+      clock_hfxo_start();
 
-      random_packet_t * sensor_rand_pckt = (random_packet_t *)packet.payload;
+      /* Calibrate the RC while we have the crystal, if it's due */
+      clock_lfrc_poll();
 
       /*
-       * Keep listening while we have time and have not yet received a random,
-       * even if we get something else
-       *
-       * check also that the RAND is from the same sensor as the BEACON
+       * Set expected packet size. Like the manufacturing pipes, the beacon
+       * pipes share the longer length: the front of a v1 beacon is the
+       * same as a v2 one.
        */
-      while(listen_time_left)
+      if(likely(state->has_been_manufactured))
       {
-        listen_time_left = radio_middle_listen(&packet, listen_time_left);
-        if (packet.pipe == RADIO_PIPE_RAND &&
-          !memcmp(sensor_rand_pckt->sensor_id, state->sensor_id, SIZE_SENSOR_ID)
-           )
-        {
-          break;
-        }
-      }
+        packet.payloadLength = PROTOCOL_V2 ? sizeof(beacon_v2_packet_t) :
+                                             sizeof(beacon_packet_t);
 
-      /* Turn off the XCVR */
-      radio_end_listen();
-
-      /* Did we get a random? */
-      if (listen_time_left)
-      {
-        /* yes, process it and send a bunch of challenges */
-        kiwiki_receive_random(state, &packet);
-        kiwiki_set_state(state, KI_STATE_SLEEP);
+        /* Listen for a beacon */
+        kiwiki_listen(state, battery_scale_listen(params_get()->listen_time_beacon));
       }
       else
       {
-        /* No random after sending ours? Listen for another beacon. */
-        kiwiki_set_state(state, KI_STATE_LISTEN_BEACON);
+        packet.payloadLength = sizeof(manufacturing_secrets_packet_t);
+
+        /* Listen for a manufacturing machine beacon */
+        kiwiki_listen(state, LISTEN_TIME_MANUFACTURING);
       }
       break;
 
-    default:
-    case KI_STATE_SLEEP:
-      _debug_printf("Going to sleep%s", "");
+    case KI_STATE_LISTEN_RAND:
+      /* Set expected packet size */
+      packet.payloadLength = sizeof(random_packet_t);
 
-      /* Cut Radio Power */
-      radio_shutdown(1);
+      /* Listen for a random for some amount of time */
+      kiwiki_listen(state, params_get()->listen_time_random);
+      break;
 
-      awake_time = (int16_t) hw_rtc_value();
+    /* Sleeping is kiwiki_handle_event's */
+    default:
+    case KI_STATE_SLEEP:
+      break;
+  }
+}
 
-      /* Add awake time to our door seen stop-watch */
-      if (state->seen_stopwatch < DOOR_SEEN_SW_MAX)
-      {
-        state->seen_stopwatch += awake_time;
-      }
+/*
+ * Wait for the channel to go quiet before we send. If it stays busy we go
+ * anyway: the sensor won't wait for us long.
+ */
+static void kiwiki_wait_clear(ki_state_t * state)
+{
+#if RADIO_LBT
+  uint8_t attempt;
 
-      kiwiki_update_doubletap_timer(state, awake_time);
-      if (state->double_tap_challenges == SEND_DOUBLE_TAP_CHALLENGES)
-      {
-        state->door_prox_state = NOT_IN_FRONT_OF_DOOR;
-      }
+  for (attempt = 0; attempt < LBT_ATTEMPTS; attempt++)
+  {
+    if (radio_sample_rssi() >= LBT_RSSI_CLEAR)
+    {
+      break;
+    }
 
-      /* Wait an amount of time based on when we last saw a door */
-      switch (state->door_prox_state)
-      {
-        case MAYBE_IN_FRONT_OF_DOOR:
-          if (state->seen_stopwatch > MAYBE_IFOD_THRESHOLD)
-          {
-            _debug_printf("Moved away from door...%s", "");
-            state->door_prox_state = NOT_IN_FRONT_OF_DOOR;
-            sleep_time = POLL_INTERVAL_STANDARD;
-          }
-          else if (state->packet_stat >= PACKET_STAT_THRESH)
-          {
-            _debug_printf("Door found for sure...%s", "");
-            state->seen_stopwatch = 0;
-            state->door_prox_state = DEFINITELY_IN_FRONT_OF_DOOR;
-            sleep_time = POLL_INTERVAL_SHORT;
-          }
-          else
-          {
-            _debug_printf("Maybe in front of door...%s", "");
-            sleep_time = POLL_INTERVAL_SHORTEST;
-          }
-          break;
-
-        case NOT_IN_FRONT_OF_DOOR:
-          if (state->packet_stat > 0)
-          {
-            _debug_printf("Maybe a door there...%s", "");
-            state->seen_stopwatch = 0;
-            state->door_prox_state = MAYBE_IN_FRONT_OF_DOOR;
-            sleep_time = POLL_INTERVAL_SHORTEST;
-          }
-          else
-          {
-            /*
-             * Normal ~1.5 second poll time with some random jitter
-             * Here we subtract 16 and add a random of between 0 and 32
-             * which gives us a +- 16uS jitter.
-             */
-            _debug_printf("Ki inactive...%s", "");
-
-
-            /* Jitter index: this is just a barrel rolling index into the
-             * random number array used for pseudo random jitter */
-            static int8_t jindx;
-
-            /* Move the jitter index */
-            if(--jindx < 0)
-            {
-              jindx = SIZE_RANDOM - 1;
-            }
-            sleep_time = POLL_INTERVAL_STANDARD - 16 +
-                (state->ki_random[jindx] & 0x1F);
-          }
-          break;
-
-        case DEFINITELY_IN_FRONT_OF_DOOR:
-          if (state->packet_stat < PACKET_STAT_THRESH)
-          {
-            _debug_printf("Possibly walked away from the door...%s", "");
-            state->seen_stopwatch = 0;
-            state->door_prox_state = MAYBE_IN_FRONT_OF_DOOR;
-            sleep_time = POLL_INTERVAL_SHORTEST;
-          }
-          else if (state->seen_stopwatch > LONGTIME_IFOD_THRESHOLD)
-          {
-            _debug_printf("Been in front of door for a while now...%s", "");
-            state->door_prox_state = IN_FRONT_OF_DOOR_LONG_TIME;
-            sleep_time = POLL_INTERVAL_LONG;
-          }
-          else
-          {
-            _debug_printf("Definitely in front of door...%s", "");
-            sleep_time = POLL_INTERVAL_SHORT;
-          }
-          break;
-
-        case IN_FRONT_OF_DOOR_LONG_TIME:
-          if (state->packet_stat < PACKET_STAT_THRESH)
-          {
-            _debug_printf("Possibly walked away from the door...%s", "");
-            state->seen_stopwatch = 0;
-            state->door_prox_state = MAYBE_IN_FRONT_OF_DOOR;
-            sleep_time = POLL_INTERVAL_SHORTEST;
-          }
-          else
-          {
-            _debug_printf("Ki sitting in front of door...%s", "");
-            sleep_time = POLL_INTERVAL_LONG;
-          }
-          break;
-
-        /* Should never get here */
-        default:
-          state->door_prox_state = NOT_IN_FRONT_OF_DOOR;
-          sleep_time = POLL_INTERVAL_STANDARD;
-          break;
-      }
+    if (state->lbt_deferrals < UINT16_MAX)
+    {
+      state->lbt_deferrals++;
+    }
+    hw_wait_us(1 + phase_backoff(&state->phase, LBT_BACKOFF_MAX_US));
+  }
 
-      if (movement_pin_status == PIN_DETECTED)
-      {
-        /* If motion detected by accelerometer, reset counter */
-        state->motionless_time = MOTIONLESS_TIME;
+  if (attempt == LBT_ATTEMPTS && state->lbt_forced < UINT16_MAX)
+  {
+    _debug_printf("Channel busy, sending anyway%s", "");
+    state->lbt_forced++;
+  }
+#endif
+}
 
-        /* Disable the movement sense momentarily so that we can distinguish
-         * a double tap sense if it occurs.
-         * This gets re-enabled when we wake from a light sleep next */
-        hw_disable_movement_detect();
+/* Send to the sensor, but not over the top of someone else */
+static void kiwiki_send(ki_state_t * state, radio_packet_t * packet,
+                        char * address, uint8_t count, uint8_t us_wait_after)
+{
+  kiwiki_wait_clear(state);
+  radio_send_packet(packet, address, count, us_wait_after);
+}
 
-        /* Reset the pin state */
-        movement_pin_status = PIN_DEFAULT;
-      }
-      else
-      {
-        /*
-         * else no motion was detected
-         *  - subtract awake time from the motionless timer
-         * */
-        if ((state->motionless_time -= awake_time) < 0)
-        {
-          /*
-           * We have not detected motion for over 30 seconds: go to deep sleep
-           * The next interrupt from the accelerometer will cause a CPU reset
-           */
-          hw_clear_port_event();
-          hw_enable_movement_detect();
-          hw_sleep_power_off();
-          /*  * * * * * * * * * * * * * * *
-           * We are DEEPLY sleeping here  *
-           * Reset will occur on next int *
-           *       from accelerometer     *
-           *  * * * * * * * * * * * * * * */
-        }
-      }
+#if CHALLENGE_ACK
+/*
+ * Send the challenge, and listen for the sensor to ack it. The window
+ * opens at the end of our send, the radio turning straight round to
+ * listen, so the sensor has ACK_LISTEN_US to do the same and answer.
+ */
+static bool kiwiki_send_acked(ki_state_t * state, radio_packet_t * packet,
+                              char * address, const uint8_t * challenge)
+{
+  radio_packet_t ack;
+  ack_packet_t * payload = (ack_packet_t *)ack.payload;
+  uint16_t listen_time_left;
 
-      /*
-       * Set the alarm clock time.
-       * this also clears the rtc so that we will know how long we slept.
-       */
-      hw_rtc_wakeup(sleep_time);
+  kiwiki_wait_clear(state);
 
-      /* Turn on the alarm clock */
-      hw_rtc_start();
+  ack.payloadLength = sizeof(ack_packet_t);
+  listen_time_left = radio_send_then_listen(packet, address, SEND_COUNT_CHALLENGE,
+                                            SEND_SPACING_CHALLENGE, &ack, ACK_LISTEN_US);
 
-      /* Turn off HF clock */
-      hw_switch_to_lfclock();
+  while (listen_time_left)
+  {
+    listen_time_left = radio_middle_listen(&ack, listen_time_left);
+    if (ack.pipe == RADIO_PIPE_ACK &&
+        !memcmp(payload->sensor_id, state->sensor_id, SIZE_SENSOR_ID) &&
+        !memcmp(payload->challenge, challenge, SIZE_ACK_TAG))
+    {
+      break;
+    }
+  }
 
-      /* Go to sleep */
-      hw_sleep_power_on();
+  radio_end_listen();
 
-      /*  * * * * * * * * * * * * * * *
-       * We are LIGHTLY sleeping here *
-       *  * * * * * * * * * * * * * * */
+  return listen_time_left != 0;
+}
+#endif
 
-      /* Reset the rtc so that we will know the time spent awake */
-      hw_rtc_clear();
+/*
+ * Send a challenge. With CHALLENGE_ACK we wait for the sensor to ack it,
+ * and send it again (up to ACK_RETRIES times) if it doesn't, as ESB
+ * would. A door that hasn't acked any of its last ACK_GIVE_UP challenges
+ * doesn't know how: it's remembered (see session.c), and gets one plain
+ * send and no listen after.
+ */
+static challenge_result_t kiwiki_send_challenge(ki_state_t * state,
+                                                radio_packet_t * packet,
+                                                char * address,
+                                                const uint8_t * challenge)
+{
+#if CHALLENGE_ACK
+  session_t * session = session_find(&state->sessions, state->sensor_id);
 
-      /* Andale, andale! */
-      hw_switch_to_hfclock();
+  if (session_no_ack(&state->sessions, state->sensor_id))
+  {
+    kiwiki_send(state, packet, address, SEND_COUNT_CHALLENGE, SEND_SPACING_CHALLENGE);
+    return CHALLENGE_SENT;
+  }
 
-      /* subtract however long we were asleep for from our motionless timer */
-      state->motionless_time -=  sleep_time;
-      hw_enable_movement_detect();
+  for (uint8_t attempt = 0; attempt <= ACK_RETRIES; attempt++)
+  {
+    if (attempt && state->retransmits < UINT16_MAX)
+    {
+      state->retransmits++;
+    }
 
-      /* Add sleep time to our door seen stop-watch */
-      if (state->seen_stopwatch < DOOR_SEEN_SW_MAX)
+    if (kiwiki_send_acked(state, packet, address, challenge))
+    {
+      if (state->acks < UINT16_MAX)
       {
-        state->seen_stopwatch += sleep_time;
+        state->acks++;
       }
+      if (session)
+      {
+        session->ack_misses = 0;
+      }
+      return CHALLENGE_ACKED;
+    }
+  }
 
-      /* Add sleep time to our double tap timer */
-      kiwiki_update_doubletap_timer(state, (int16_t) sleep_time);
-
-      kiwiki_set_state(state, KI_STATE_LISTEN_BEACON);
-      break;
+  _debug_printf("Challenge not acked%s", "");
+  if (session && session->ack_misses < ACK_GIVE_UP &&
+      ++session->ack_misses == ACK_GIVE_UP)
+  {
+    session_set_no_ack(&state->sessions, state->sensor_id);
   }
+  return CHALLENGE_UNACKED;
+#else
+  kiwiki_send(state, packet, address, SEND_COUNT_CHALLENGE, SEND_SPACING_CHALLENGE);
+  return CHALLENGE_SENT;
+#endif
 }
 
 /*
@@ -536,11 +1168,12 @@ void kiwiki_receive_beacon(ki_state_t * state, volatile radio_packet_t * packet)
   ki_random_pckt.payloadLength = sizeof(random_packet_t);
 
   /* wait for the sensor to be listening */
-  nrf_delay_us(WAIT_BEFORE_RANDOM);
+  hw_wait_us(WAIT_BEFORE_RANDOM);
   /*
    * Send ki->sensor random packet
    */
-  radio_send_packet(&ki_random_pckt, "RAND", SEND_COUNT_RANDOM, SEND_SPACING_RANDOM);
+  kiwiki_send(state, &ki_random_pckt, "RAND", SEND_COUNT_RANDOM, SEND_SPACING_RANDOM);
+  kiwiki_session_state(state, SESSION_RAND_SENT);
 
    /*
    * Now listen for a response from the sensor
@@ -549,22 +1182,78 @@ void kiwiki_receive_beacon(ki_state_t * state, volatile radio_packet_t * packet)
 }
 
 /*
- * Transmit our HWID (UUID)
+ * We received a v2 beacon, which has the sensor's random in already
+ *
+ * Work out the challenge straight away, and send it along with our random
  */
-void kiwiki_process_mm_uuid_req(ki_state_t * state, volatile radio_packet_t * packet)
+void kiwiki_receive_beacon_v2(ki_state_t * state, volatile radio_packet_t * packet)
 {
-  beacon_packet_t * beacon = (beacon_packet_t *)packet->payload;
+  beacon_v2_packet_t * beacon = (beacon_v2_packet_t *)packet->payload;
+  challenge_result_t result;
 
-  /*
-   * Prepare a uuid packet for the manufacturing machine
-   */
-  manufacturing_uuid_packet_t uuid_pckt;
+  /* Something newer than we know: the v1 handshake still works */
+  if (beacon->version != PROTOCOL_VERSION_2)
+  {
+    kiwiki_receive_beacon(state, packet);
+    return;
+  }
+
+  kiwiki_set_state(state, KI_STATE_PROCESSING_RANDOM);
+
+  _debug_printf("Received v2 beacon for sensor id 0x%02x%02x%02x%02x",
+    beacon->sensor_id[0],
+    beacon->sensor_id[1],
+    beacon->sensor_id[2],
+    beacon->sensor_id[3]);
 
-  /*
-   * Copy the sensor's ID out of the beacon
-   */
   memcpy(state->sensor_id, beacon->sensor_id, SIZE_SENSOR_ID);
 
+  /* The beacon stands in for the sensor's random packet */
+  random_packet_t sensor_rand_pckt;
+  memcpy(sensor_rand_pckt.random, beacon->random, SIZE_RANDOM);
+  memcpy(sensor_rand_pckt.sensor_id, beacon->sensor_id, SIZE_SENSOR_ID);
+
+  /* Maybe calculate a new combikey */
+  kiwiki_calculate_combikey(state, &sensor_rand_pckt);
+
+  /* Generate a ki->sensor challenge */
+  challenge_packet_t challenge;
+  kiwiki_calculate_challenge(state, &sensor_rand_pckt, &challenge);
+
+  /* And put our random in front of it */
+  challenge_v2_packet_t reply;
+  memcpy(reply.random, state->ki_random, SIZE_RANDOM);
+  memcpy(reply.challenge, challenge.challenge, SIZE_CHALLENGE);
+  memcpy(reply.sensor_id, challenge.sensor_id, SIZE_SENSOR_ID);
+  reply.flags = 0;
+  if (state->is_tracked_ki)
+  {
+    reply.flags |= CHALLENGE_V2_TRACKED;
+  }
+  else if (state->double_tap_challenges == SEND_DOUBLE_TAP_CHALLENGES)
+  {
+    reply.flags |= CHALLENGE_V2_DOUBLE_TAP;
+  }
+
+  radio_packet_t reply_pckt;
+  memcpy(reply_pckt.payload, &reply, sizeof(reply));
+  reply_pckt.payloadLength = sizeof(reply);
+
+  /* wait for the sensor to be listening */
+  hw_wait_us(WAIT_BEFORE_RANDOM);
+  result = kiwiki_send_challenge(state, &reply_pckt, "VHAL", reply.challenge);
+
+  /* Done with this random */
+  crypto_gen_random_bytes(state->ki_random, SIZE_RANDOM);
+
+  kiwiki_handshake_done(state, result);
+}
+
+/* Our HWID (UUID) for the manufacturing machine */
+static void kiwiki_mm_uuid_packet(ki_state_t * state, radio_packet_t * packet)
+{
+  manufacturing_uuid_packet_t uuid_pckt;
+
   /* Copy UUID into packet */
   uuid_pckt.hw_id[0] = hw_ficr_deviceid(0);
   uuid_pckt.hw_id[1] = hw_ficr_deviceid(1);
@@ -577,10 +1266,27 @@ void kiwiki_process_mm_uuid_req(ki_state_t * state, volatile radio_packet_t * pa
   memcpy(uuid_pckt.sensor_id, state->sensor_id,
       sizeof(uuid_pckt.sensor_id));
 
+  memcpy(packet->payload, &uuid_pckt, sizeof(uuid_pckt));
+  packet->payloadLength = sizeof(uuid_pckt);
+}
+
+/*
+ * Transmit our HWID (UUID)
+ */
+void kiwiki_process_mm_uuid_req(ki_state_t * state, volatile radio_packet_t * packet)
+{
+  beacon_packet_t * beacon = (beacon_packet_t *)packet->payload;
   radio_packet_t ki_manufacture_pckt;
-  memcpy(ki_manufacture_pckt.payload, &uuid_pckt,
-      sizeof(uuid_pckt));
-  ki_manufacture_pckt.payloadLength = sizeof(uuid_pckt);
+
+  /*
+   * Copy the sensor's ID out of the beacon
+   */
+  memcpy(state->sensor_id, beacon->sensor_id, SIZE_SENSOR_ID);
+
+  /*
+   * Prepare a uuid packet for the manufacturing machine
+   */
+  kiwiki_mm_uuid_packet(state, &ki_manufacture_pckt);
 
   /*
    * Send UUID packet
@@ -590,7 +1296,49 @@ void kiwiki_process_mm_uuid_req(ki_state_t * state, volatile radio_packet_t * pa
 }
 
 /*
- * Write the received secrets into flash
+ * A round from the manufacturing machine (see provision.c). Answer it
+ * once, in our slot: with our UUID, or once we have our secrets, with a
+ * checksum of what we stored.
+ */
+void kiwiki_process_mm_round(ki_state_t * state, volatile radio_packet_t * packet)
+{
+  provision_round_packet_t round;
+  radio_packet_t reply;
+  uint32_t hw_id[2] = { hw_ficr_deviceid(0), hw_ficr_deviceid(1) };
+  uint32_t wait_us;
+
+  memcpy(&round, (void *)packet->payload, sizeof(round));
+  memcpy(state->sensor_id, round.sensor_id, SIZE_SENSOR_ID);
+
+  /* The machine checked what we stored: we're done here */
+  if (provision_confirmed(&state->mm, &round))
+  {
+    hw_reset();
+    return;
+  }
+
+  if (!provision_heard_round(&state->mm, &round, hw_id, timer_now(), &wait_us))
+  {
+    return;
+  }
+
+  if (state->mm.stored)
+  {
+    provision_confirm(&state->mm, hw_id,
+                      (provision_confirm_packet_t *)reply.payload);
+    reply.payloadLength = sizeof(provision_confirm_packet_t);
+  }
+  else
+  {
+    kiwiki_mm_uuid_packet(state, &reply);
+  }
+
+  hw_wait_us(wait_us);
+  radio_send_packet(&reply, state->mm.stored ? "FHAL" : "MHAL", 1, 0);
+}
+
+/*
+ * Write the received secrets into flash, check them, and say how it went
  */
 void kiwiki_process_mm_secrets(ki_state_t * state, volatile radio_packet_t * packet)
 {
@@ -611,64 +1359,111 @@ void kiwiki_process_mm_secrets(ki_state_t * state, volatile radio_packet_t * pac
 
   /*
    * Now we know we have received manufacturing secrets for this device,
-   * write them to flash and reboot.
+   * write them to flash, check them and reboot.
+   *
+   * The Ki ID is kept most significant byte first and the secret back to
+   * front, as they always have been.
    */
+  ki_provision_t provision;
+  ki_provision_t readback;
+  radio_packet_t ack;
+  uint32_t hw_id[2] = { hw_ficr_deviceid(0), hw_ficr_deviceid(1) };
+  uint8_t i;
+
+  for (i = 0; i < SIZE_KI_ID; i++)
+  {
+    provision.secrets.key_id[i] = secrets->ki_id >> (8 * (SIZE_KI_ID - 1 - i));
+  }
+  for (i = 0; i < AES_BLOCK_SIZE; i++)
+  {
+    provision.secrets.private_key[i] = secrets->secret[AES_BLOCK_SIZE - 1 - i];
+  }
+  provision.is_installer_ki = secrets->installer_ki;
+  provision.is_tracked_ki = secrets->tracked_ki;
+
+  /* One record, so we never end up with the secrets but not the flags */
+  kv_put(KV_KEY_SECRETS, &provision, sizeof(provision));
 
-  /* erase the flash page */
-  nrf_nvmc_page_erase((uint32_t)&flash_secret_data);
+  /* Read it back, the way we'll read it when we boot */
+  provision_stored(&state->mm, hw_id, provision.secrets.private_key,
+                   &provision,
+                   kv_read(KV_KEY_SECRETS, &readback, sizeof(readback)) ?
+                   &readback : NULL,
+                   sizeof(provision));
+
+  if (state->mm.status == PROVISION_STATUS_GOOD)
+  {
+    /* write read back protection bit */
+    hw_readback_protect();
+  }
+  else
+  {
+    /* Never boot with secrets we weren't sent: come back unprovisioned */
+    kv_delete(KV_KEY_SECRETS);
+  }
 
   /*
-   * Write Ki ID
+   * In rounds, we stay put till the machine has checked what we stored.
+   * How it went goes in our next answer, so it can.
    */
-  uint32_t word;
-  word = ((uint32_t)((secrets->ki_id&0x000000FF) >> 0) << 24) |
-         ((uint32_t)((secrets->ki_id&0x0000FF00) >> 8) <<16) |
-         ((uint32_t)((secrets->ki_id&0x00FF0000) >> 16)<<8)  |
-          (uint32_t)((secrets->ki_id&0xFF000000) >> 24);
-  nrf_nvmc_write_word((uint32_t)&flash_secret_data.key_id[0], word);
-
-
-  word = ((uint32_t)secrets->secret[0]<<24) |
-         ((uint32_t)secrets->secret[1]<<16) |
-         ((uint32_t)secrets->secret[2]<<8)  |
-          (uint32_t)secrets->secret[3];
-  nrf_nvmc_write_word((uint32_t)&flash_secret_data.private_key[12], word);
-
-  word = ((uint32_t)secrets->secret[4]<<24) |
-         ((uint32_t)secrets->secret[5]<<16) |
-         ((uint32_t)secrets->secret[6]<<8)  |
-          (uint32_t)secrets->secret[7];
-  nrf_nvmc_write_word((uint32_t)&flash_secret_data.private_key[8], word);
-
-  word = ((uint32_t)secrets->secret[8]<<24) |
-         ((uint32_t)secrets->secret[9]<<16) |
-         ((uint32_t)secrets->secret[10]<<8)  |
-          (uint32_t)secrets->secret[11];
-  nrf_nvmc_write_word((uint32_t)&flash_secret_data.private_key[4], word);
-
-  word = ((uint32_t)secrets->secret[12]<<24) |
-         ((uint32_t)secrets->secret[13]<<16) |
-         ((uint32_t)secrets->secret[14]<<8)  |
-          (uint32_t)secrets->secret[15];
-  nrf_nvmc_write_word((uint32_t)&flash_secret_data.private_key[0], word);
-
-  /* write installer ki and trackable ki switches */
-  word = ((uint32_t)secrets->installer_ki) |
-         ((uint32_t)secrets->tracked_ki<<8);
-  nrf_nvmc_write_word((uint32_t)&flash_secret_data.private_key[16], word);
-
-  /* write read back protection bit */
-  nrf_nvmc_write_word((uint32_t)&NRF_UICR->RBPCONF,0);
+  if (state->mm.joined)
+  {
+    return;
+  }
+
+  /* Otherwise tell it now, so it can get on with the next Ki */
+  provision_confirm(&state->mm, hw_id, (provision_confirm_packet_t *)ack.payload);
+  ack.payloadLength = sizeof(provision_confirm_packet_t);
+  radio_send_packet(&ack, "FHAL", SEND_COUNT_PROVISION_ACK,
+      SEND_SPACING_MANUFACTURING);
 
   /* Reboot */
-  NVIC_SystemReset();
+  hw_reset();
+}
+
+/*
+ * Write this site's timing and threshold knobs into flash, and start
+ * using them. They have to come before the secrets: once we have those
+ * we stop listening to the manufacturing machine.
+ *
+ * Returns false if they weren't for us, or aren't knobs we'd run with.
+ */
+bool kiwiki_process_mm_params(ki_state_t * state, volatile radio_packet_t * packet)
+{
+  manufacturing_params_packet_t mm_params;
+  params_block_t params_block;
+
+  memcpy(&mm_params, (void *)packet->payload, sizeof(mm_params));
+
+  if (mm_params.hw_id[0] != hw_ficr_deviceid(0) ||
+      mm_params.hw_id[1] != hw_ficr_deviceid(1) ||
+      mm_params.version != PARAMS_VERSION ||
+      !params_seal(&params_block, &mm_params.params))
+  {
+    return false;
+  }
+
+  /* The machine sends it over and over, kv_put only writes it the once */
+  if (!kv_put(KV_KEY_PARAMS, &params_block, sizeof(params_block)))
+  {
+    return false;
+  }
+
+  params_load(&params_block);
+  state->motionless_until = timer_now64() +
+                            TIMER_MS_TO_TICKS(params_get()->motionless_time);
+
+  return true;
 }
 
 /*
- * We received a random, generate a challenge, and send it.
+ * We received a random, generate a challenge, and send it. Returns how
+ * that went.
  */
-void kiwiki_receive_random(ki_state_t * state, volatile radio_packet_t * packet)
+challenge_result_t kiwiki_receive_random(ki_state_t * state, volatile radio_packet_t * packet)
 {
+  challenge_result_t result;
+
   /* Set the state to 'processing random' */
   kiwiki_set_state(state, KI_STATE_PROCESSING_RANDOM);
 
@@ -699,25 +1494,25 @@ void kiwiki_receive_random(ki_state_t * state, volatile radio_packet_t * packet)
   {
     if (state->double_tap_challenges == SEND_NORMAL_CHALLENGES)
     {
-      radio_send_packet(&challenge_packet, "CHAL", SEND_COUNT_CHALLENGE, SEND_SPACING_CHALLENGE);
+      result = kiwiki_send_challenge(state, &challenge_packet, "CHAL", challenge.challenge);
     }
     else /* Send double tap challenges */
     {
       state->double_tap_flipflop = !state->double_tap_flipflop;
       if (state->double_tap_flipflop)
       {
-        radio_send_packet(&challenge_packet, "DHAL", SEND_COUNT_CHALLENGE, SEND_SPACING_CHALLENGE);
+        result = kiwiki_send_challenge(state, &challenge_packet, "DHAL", challenge.challenge);
       }
       else
       {
-        radio_send_packet(&challenge_packet, "CHAL", SEND_COUNT_CHALLENGE, SEND_SPACING_CHALLENGE);
+        result = kiwiki_send_challenge(state, &challenge_packet, "CHAL", challenge.challenge);
       }
     }
   }
   else
   {
     /* Tracked Ki go to a different pipe altogether */
-    radio_send_packet(&challenge_packet, "KHAL", SEND_COUNT_CHALLENGE, SEND_SPACING_CHALLENGE);
+    result = kiwiki_send_challenge(state, &challenge_packet, "KHAL", challenge.challenge);
   }
 
   /*
@@ -725,6 +1520,8 @@ void kiwiki_receive_random(ki_state_t * state, volatile radio_packet_t * packet)
    * we're not in any timing-dependent part anymore.
    */
   crypto_gen_random_bytes(state->ki_random, SIZE_RANDOM);
+
+  return result;
 }
 
 void kiwiki_calculate_combikey(ki_state_t * state, random_packet_t * response)
@@ -744,6 +1541,15 @@ void kiwiki_calculate_combikey(ki_state_t * state, random_packet_t * response)
     return;
   }
 
+  /* Or for a door still in the table */
+  session_t * session = session_find(&state->sessions, response->sensor_id);
+  if (session && session->has_key)
+  {
+    memcpy(state->challenge.challenge_key, session->combikey, AES_BLOCK_SIZE);
+    memcpy(state->challenge.sensor_id, response->sensor_id, SIZE_SENSOR_ID);
+    return;
+  }
+
   _debug_printf("Calculating Combikey for sensor 0x%02x%02x%02x%02x",
       response->sensor_id[0],
       response->sensor_id[1],
@@ -789,6 +1595,13 @@ void kiwiki_calculate_combikey(ki_state_t * state, random_packet_t * response)
   /* Update the cached door ID */
   memcpy(state->challenge.sensor_id, response->sensor_id, SIZE_SENSOR_ID);
 
+  /* And keep it with the door, for when we come back to it */
+  if (session)
+  {
+    memcpy(session->combikey, combikey.out, AES_BLOCK_SIZE);
+    session->has_key = true;
+  }
+
 }
 
 void kiwiki_calculate_challenge(ki_state_t * state, random_packet_t * sensor_rand_pckt, challenge_packet_t * ki_challenge)
@@ -831,3 +1644,99 @@ void kiwiki_calculate_challenge(ki_state_t * state, random_packet_t * sensor_ran
   memcpy(ki_challenge->sensor_id, state->challenge.sensor_id, sizeof(ki_challenge->sensor_id));
 
 }
+
+/*
+ * The FSM, driven by the scheduler.
+ *
+ * Awake, each STEP event runs one kiwiki_step and queues the next. A light
+ * sleep is just the scheduler having nothing to do: we set the alarm clock
+ * and return, and the main loop waits for interrupts until the RTC (or a
+ * double tap) wakes us. A listen is the same, with the radio on: each
+ * packet is a RADIO event, and listen_timer ends it.
+ */
+void kiwiki_handle_event(sched_event_t event, void * ctx)
+{
+  ki_state_t * state = (ki_state_t *) ctx;
+
+  switch (event)
+  {
+    case SCHED_EVT_STEP:
+      if (state->fsm_state != KI_STATE_SLEEP)
+      {
+        kiwiki_step(state);
+
+        /* Listening: the radio or listen_timer has the next step */
+        if (state->is_listening)
+        {
+          return;
+        }
+      }
+      else if (kiwiki_sleep_enter(state))
+      {
+        /* Nothing more until we wake up */
+        state->is_sleeping = true;
+        return;
+      }
+      sched_post(SCHED_EVT_STEP);
+      break;
+
+    case SCHED_EVT_RADIO:
+      if (!state->is_listening || !radio_listen_take(&packet))
+      {
+        break;
+      }
+
+      /* Keep listening until we hear what we want, even if we get something else */
+      if (kiwiki_listen_wanted(state, &packet))
+      {
+        kiwiki_listen_done(state, true);
+      }
+      else
+      {
+        radio_listen_arm(&packet);
+      }
+      break;
+
+    case SCHED_EVT_GPIOTE:
+      /*
+       * Movement is picked up on the next pass anyway, only a double
+       * tap is worth cutting the sleep short for.
+       */
+      if (kiwiki_acc_double_tapped(state))
+      {
+        kiwiki_wake(state);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+/* Start (or restart) the wake phase generator, see phase.c */
+void kiwiki_reseed_phase(ki_state_t * state)
+{
+  uint8_t random[4];
+
+  crypto_gen_random_bytes(random, sizeof(random));
+  state->phase = phase_seed(hw_ficr_deviceid(0) ^ state->phase,
+                            hw_ficr_deviceid(1), random, sizeof(random));
+}
+
+/* Hook the FSM up to the scheduler and get it going */
+void kiwiki_start(ki_state_t * state)
+{
+  kiwiki_reseed_phase(state);
+
+  sched_register(SCHED_EVT_STEP, kiwiki_handle_event, state);
+  sched_register(SCHED_EVT_GPIOTE, kiwiki_handle_event, state);
+  sched_register(SCHED_EVT_RADIO, kiwiki_handle_event, state);
+
+  /* The clock has been set up by now, give it back what it had learnt */
+  if (state->hfclk_lead)
+  {
+    clock_set_prewake_lead(state->hfclk_lead);
+  }
+
+  sched_post(SCHED_EVT_STEP);
+}
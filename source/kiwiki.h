@@ -11,6 +11,12 @@
 #include <stdbool.h>
 #include "crypto.h"
 #include "radio.h"
+#include "lis2dh_driver.h"
+#include "sched.h"
+#include "timer.h"
+#include "session.h"
+#include "params.h"
+#include "provision.h"
 
 #ifndef KIWI_KI_H
 #define KIWI_KI_H
@@ -23,6 +29,51 @@
 #define SEND_DOUBLE_TAP_CHALLENGES 1
 #define SEND_NORMAL_CHALLENGES 0
 
+/*
+ * Let the accelerometer's sleep-to-wake engine decide when we're lying
+ * still and should go to System OFF. The software motionless timer stays
+ * around as a fallback.
+ */
+#ifndef ACC_INACTIVITY_SLEEP
+#define ACC_INACTIVITY_SLEEP 1
+#endif
+
+/*
+ * Listen before talk: check the channel is quiet before sending a random
+ * or a challenge, and back off a moment if another Ki is talking.
+ */
+#ifndef RADIO_LBT
+#define RADIO_LBT 1
+#endif
+
+/*
+ * Protocol v2: a v2 beacon carries the sensor's random, so we answer with
+ * our random and the challenge together, and never LISTEN_RAND. Sensors
+ * that only send v1 beacons get the v1 handshake as before.
+ */
+#ifndef PROTOCOL_V2
+#define PROTOCOL_V2 1
+#endif
+
+/*
+ * After a door acks a challenge (CHALLENGE_ACK), leave it be for this long
+ * (mS) unless we walk off or the user double taps. 0 answers every beacon.
+ */
+#ifndef HANDSHAKE_HOLDOFF
+#define HANDSHAKE_HOLDOFF 10000
+#endif
+
+/*
+ * Acknowledged challenges: after each challenge, listen a moment for the
+ * sensor to say it got it, and send it again if not. Sensors that never
+ * answer are noticed, and get plain challenges (remembered through a
+ * System OFF, see session.c). Off until the sensors send acks: until
+ * then it's only retries and listening for nothing.
+ */
+#ifndef CHALLENGE_ACK
+#define CHALLENGE_ACK 0
+#endif
+
 /* State machine states */
 typedef enum
 {
@@ -34,7 +85,11 @@ typedef enum
   KI_STATE_LISTEN_MANUFACTURE,
 } fsm_state_t;
 
-/* Listen times, in microseconds */
+/*
+ * Listen times, in microseconds. The beacon and random ones are only the
+ * defaults: the FSM goes by params_get() (see params.c), and so do the
+ * other knobs marked tunable below.
+ */
 enum
 {
   LISTEN_TIME_BEACON = 1500,
@@ -49,6 +104,7 @@ enum
   SIZE_KI_ID = 4,
   SIZE_RANDOM = 8,
   SIZE_CHALLENGE = 16,
+  SIZE_ACK_TAG = 4,
 };
 
 /* Packet malarky */
@@ -58,11 +114,18 @@ enum
   SEND_COUNT_RANDOM = 1,
   SEND_COUNT_CHALLENGE = 1,
   SEND_COUNT_MANUFACTURING = 50,
+  SEND_COUNT_PROVISION_ACK = 10, /* How storing the secrets went, before we reboot */
   SEND_SPACING_RANDOM = 1,
   SEND_SPACING_CHALLENGE = 50,
   SEND_SPACING_MANUFACTURING = 50,
-  PACKET_STAT_THRESH = 4,  /* Threshold for door proximity status transitioning */
-  PACKET_STAT_MAX = 5,     /* Packet stat window size */
+  PACKET_STAT_THRESH = 4,  /* Threshold for door proximity status transitioning (tunable) */
+  PACKET_STAT_MAX = 5,     /* Packet stat window size (tunable) */
+  LBT_RSSI_CLEAR = 85,     /* -dBm: a channel quieter than this is clear */
+  LBT_ATTEMPTS = 3,        /* Times we look before sending anyway */
+  LBT_BACKOFF_MAX_US = 300, /* Longest wait between looks */
+  ACK_LISTEN_US = 250,     /* How long after a challenge we wait for its ack */
+  ACK_RETRIES = 2,         /* Challenges sent again for want of an ack */
+  ACK_GIVE_UP = 3,         /* Unacked challenges before we stop asking */
 };
 
 /* Door proximity state machine states */
@@ -74,9 +137,18 @@ typedef enum
   IN_FRONT_OF_DOOR_LONG_TIME,
 } door_prox_state_t;
 
+/* How a challenge went */
+typedef enum
+{
+  CHALLENGE_SENT = 0,           /* Sent plain: no way of telling */
+  CHALLENGE_ACKED,              /* The sensor said it got it */
+  CHALLENGE_UNACKED,            /* We asked for an ack, and none came */
+} challenge_result_t;
+
 /*
  * Timing constants (mS)
  * IFOD == In Front Of Door
+ * The thresholds, poll intervals and motionless time are tunable.
  */
 enum
 {
@@ -89,13 +161,19 @@ enum
   POLL_INTERVAL_LONG = 1950,       /* Standing IFOD for a long time */
   MOTIONLESS_TIME = 5000,         /* Time before going to deep sleep */
   DOUBLE_TAP_TIME = 5000,          /* How long to send double tap challenges */
+  DOUBLE_TAP_BURST_TIME = 1000,    /* How long to poll fast after a double tap */
+  DOUBLE_TAP_BURST_INTERVAL = 50,  /* Poll interval during that burst */
 };
 
-/* Accelerometer constants */
+/*
+ * Accelerometer constants. The low power, movement and double tap
+ * thresholds are tunable. The sleep to wake duration follows the
+ * motionless time (params_acc_lowpwr_dur).
+ */
 enum
 {
   ACC_THRESHOLD_LOWPWR_G = 0x04,    /* Sleep to wake, return to Sleep activation threshold */
-  ACC_THRESHOLD_LOWPWR_DUR = 0x20,  /* Sleep to Wake, Return to Sleep duration */
+  ACC_INACTIVE_PASSES = 2,          /* Sleep passes INT2 must read inactive */
   ACC_THRESHOLD_MOVEMENT = 8,
   ACC_THRESHOLD_DURATION = 0,
   /* Double Tap Sensitivity Parameters */
@@ -104,6 +182,8 @@ enum
   ACC_DOUBLE_TAP_LIMIT = 0x20,      /* Value 0-127d */
   ACC_DOUBLE_TAP_LATENCY = 0x10,    /* Value 0-255d */
   ACC_DOUBLE_TAP_WINDOW = 0x30,     /* Value 0-255d */
+  /* ODR the sample counted values above are given at (Hz) */
+  ACC_TIMING_ODR_HZ = 100,
 };
 
 /* Ki secrets */
@@ -113,6 +193,14 @@ typedef struct __attribute__((__packed__))
   uint8_t private_key[AES_BLOCK_SIZE];
 } ki_secrets_t;
 
+/* What the manufacturing machine gives us, as kept in flash (kv.c) */
+typedef struct __attribute__((__packed__))
+{
+  ki_secrets_t secrets;
+  uint8_t is_installer_ki;
+  uint8_t is_tracked_ki;
+} ki_provision_t;
+
 /* Sensor info */
 typedef struct __attribute__((__packed__))
 {
@@ -126,6 +214,14 @@ typedef struct __attribute__((__packed__))
   uint8_t sensor_id[SIZE_SENSOR_ID];
 } beacon_packet_t;
 
+/* Contents of a v2 beacon */
+typedef struct __attribute__((__packed__))
+{
+  uint8_t sensor_id[SIZE_SENSOR_ID];
+  uint8_t version;                        /* PROTOCOL_VERSION_2 */
+  uint8_t random[SIZE_RANDOM];            /* The sensor's random */
+} beacon_v2_packet_t;
+
 /* Contents of a random packet */
 typedef struct __attribute__((__packed__))
 {
@@ -140,6 +236,29 @@ typedef struct __attribute__((__packed__))
   uint8_t sensor_id[SIZE_SENSOR_ID];
 } challenge_packet_t;
 
+/* Contents of a v2 challenge: our random and the challenge in one */
+typedef struct __attribute__((__packed__))
+{
+  uint8_t random[SIZE_RANDOM];
+  uint8_t challenge[SIZE_CHALLENGE];
+  uint8_t sensor_id[SIZE_SENSOR_ID];
+  uint8_t flags;                          /* CHALLENGE_V2_* */
+} challenge_v2_packet_t;
+
+enum
+{
+  PROTOCOL_VERSION_2 = 2,
+  CHALLENGE_V2_DOUBLE_TAP = 0x01,         /* What v1 sends to DHAL */
+  CHALLENGE_V2_TRACKED = 0x02,            /* What v1 sends to KHAL */
+};
+
+/* A sensor saying it got our challenge */
+typedef struct __attribute__((__packed__))
+{
+  uint8_t sensor_id[SIZE_SENSOR_ID];
+  uint8_t challenge[SIZE_ACK_TAG];        /* The front of the challenge */
+} ack_packet_t;
+
 /* Contents of a HWID packet for manufacturing */
 typedef struct __attribute__((__packed__))
 {
@@ -162,6 +281,18 @@ typedef struct __attribute__((__packed__))
   uint8_t sensor_id_half[2];
 } manufacturing_secrets_packet_t;
 
+/*
+ * Timing and threshold knobs from the manufacturing machine, sent before
+ * the secrets (the Ki stops listening for it once it has those). Heard in
+ * the same listen as the secrets, so it's the same length.
+ */
+typedef struct __attribute__((__packed__))
+{
+  uint32_t hw_id[2];
+  uint8_t version;                        /* PARAMS_VERSION */
+  params_t params;
+} manufacturing_params_packet_t;
+
 typedef struct
 {
   ki_secrets_t * ki;                      /* This Ki's secrets */
@@ -174,26 +305,75 @@ typedef struct
   uint8_t is_tracked_ki;                  /* Is this Ki a tracked Ki? */
   uint16_t seen_stopwatch;                /* Used for gauging timing for near-sensor */
   uint8_t packet_stat;                    /* Packet statistic */
-  int16_t motionless_time;                /* Time device has been in motion */
-  int16_t double_tap_time;                /* Time since device was double tapped */
+  uint64_t motionless_until;              /* Deep sleep if no motion by then */
+  uint64_t double_tap_until;              /* Double tap challenges until then */
+  uint64_t double_tap_burst_until;        /* Fast polling until then */
   bool double_tap_challenges;             /* Send double tap challenges switch */
   bool double_tap_flipflop;               /* Used for sending challenges on alternate pipes */
   bool has_been_manufactured;             /* Once secrets/KiID are assigned, this gets set */
   bool is_hw_good;                        /* Do all hardware tests pass? */
+  LIS2DH_Profile_t acc_profile;           /* Current accelerometer profile */
+  uint8_t inactive_passes;                /* Sleep passes seen inactive */
+  bool tap_pending;                       /* A double tap out of CLICK_SRC, not acted on yet */
+  uint16_t sleep_time;                    /* Length of the current light sleep */
+  bool is_sleeping;                       /* Waiting on the alarm clock */
+  soft_timer_t wake_timer;                /* The alarm clock */
+  bool is_listening;                      /* Waiting on the radio */
+  soft_timer_t listen_timer;              /* When to stop */
+  uint32_t accounted_at;                  /* When seen_stopwatch was last
+                                             brought up to date (timer_now) */
   uint32_t resetreas;                     /* The most recently read value from
                                              RESETREAS */
+  uint8_t hfclk_lead;                     /* Crystal lead brought back from
+                                             before a System OFF, 0 if none */
+  uint32_t phase;                         /* Wake phase generator (phase.c) */
+  bool collided;                          /* Our last random went unanswered */
+  uint16_t lbt_deferrals;                 /* Sends put off for a busy channel */
+  uint16_t lbt_forced;                    /* Sends that went out regardless */
+  session_table_t sessions;               /* The doors in range (session.c) */
+  uint16_t held_off;                      /* Beacons from doors we held off from */
+  uint16_t acks;                          /* Challenges the sensor acked */
+  uint16_t retransmits;                   /* Challenges sent again for want of one */
+  provision_state_t mm;                   /* Rounds from the manufacturing machine */
 } ki_state_t;
 
+/* What we keep in retained RAM through a System OFF */
+typedef struct
+{
+  sensor_data_t challenge;                /* The cached combikey */
+  uint8_t sensor_id[SIZE_SENSOR_ID];      /* The last sensor we heard */
+  uint8_t ki_random[SIZE_RANDOM];         /* Our next random number */
+  door_prox_state_t door_prox_state;
+  uint16_t seen_stopwatch;
+  uint8_t packet_stat;
+  uint8_t hfclk_lead;                     /* clock_prewake_lead */
+  session_no_ack_t no_ack;                /* Doors that don't ack */
+} ki_warm_state_t;
+
 /* Forward Declarations */
 void kiwiki_setup_state(ki_state_t *);
+bool kiwiki_fast_boot(ki_state_t * state);
+bool kiwiki_restore_warm(ki_state_t * state);
+void kiwiki_save_warm(ki_state_t * state);
 void kiwiki_receive_beacon(ki_state_t *, volatile radio_packet_t *);
-void kiwiki_receive_random(ki_state_t *, volatile radio_packet_t *);
+challenge_result_t kiwiki_receive_random(ki_state_t *, volatile radio_packet_t *);
+void kiwiki_receive_beacon_v2(ki_state_t *, volatile radio_packet_t *);
 void kiwiki_calculate_combikey(ki_state_t *, random_packet_t *);
 void kiwiki_calculate_challenge(ki_state_t *, random_packet_t *, challenge_packet_t *);
 void kiwiki_step(ki_state_t *);
 void kiwiki_process_mm_uuid_req(ki_state_t * state, volatile radio_packet_t * packet);
+void kiwiki_process_mm_round(ki_state_t * state, volatile radio_packet_t * packet);
 void kiwiki_process_mm_secrets(ki_state_t * state, volatile radio_packet_t * packet);
+bool kiwiki_process_mm_params(ki_state_t * state, volatile radio_packet_t * packet);
 bool has_been_manufactured(ki_state_t * state);
-void kiwiki_update_doubletap_timer(ki_state_t * state, int16_t update_time);
+bool kiwiki_update_doubletap_timer(ki_state_t * state);
+void kiwiki_set_acc_profile(ki_state_t * state, LIS2DH_Profile_t profile);
+bool kiwiki_acc_double_tapped(ki_state_t * state);
+bool kiwiki_acc_inactive(ki_state_t * state);
+bool kiwiki_sleep_enter(ki_state_t * state);
+void kiwiki_sleep_exit(ki_state_t * state);
+void kiwiki_handle_event(sched_event_t event, void * ctx);
+void kiwiki_reseed_phase(ki_state_t * state);
+void kiwiki_start(ki_state_t * state);
 
 #endif
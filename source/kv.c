@@ -0,0 +1,534 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "kv.h"
+#include "crc.h"
+#include "nrf_nvmc.h"
+#include "flash.h"
+
+/*
+ * What we keep in flash: secrets, flags, tuning and the like.
+ *
+ * The storage region is a few pages, one of them in use at a time. A page
+ * starts with a header (KV_MAGIC and a sequence number) and is then
+ * filled with records, one after the other, never rewritten in place:
+ *
+ *   word 0      key | length << 8 | the complement of those two << 16
+ *   words 1..n  the value, padded out with 0xFF
+ *   word n + 1  CRC of all the words before it
+ *
+ * Putting a key appends a record for it, and the last good record for a
+ * key is its value (a zero length one deletes it). Each record goes out in
+ * one nrf_nvmc_write_words. Losing power part way through leaves a record
+ * whose CRC is wrong, which is skipped: the old value stands.
+ *
+ * When a page is full its live records are copied to the next page, the
+ * header is written there last, and only then is the old page erased. If
+ * we lose power before the header, the old page is still the one in use;
+ * after it, both are good and the higher sequence number wins. Moving
+ * round the pages like this also spreads the erases.
+ *
+ * kv_init finds the page in use and indexes it in RAM (where each key's
+ * record is), so lookups don't search the flash.
+ *
+ * kv_put does it all there and then, stalling the CPU for as long as the
+ * flash takes. kv_put_later goes through the flash queue instead (see
+ * flash.c), a step at a time in the FSM's idle slots, for things that
+ * get saved while the Ki is in use (caches, counters). The steps are the
+ * same, in the same order, so a reboot part way through is no different
+ * from losing power part way through a kv_put. Until it's done, the old
+ * value is the one kv_get sees.
+ */
+
+uint32_t kv_flash[KV_PAGES][KV_PAGE_WORDS]
+__attribute__((section(".storage_section"), aligned(KV_PAGE_SIZE))) =
+{
+  [0 ... KV_PAGES - 1] = { [0 ... KV_PAGE_WORDS - 1] = 0xffffffff }
+};
+
+/* The page in use, and its sequence number */
+static uint8_t kv_page;
+static uint32_t kv_sequence;
+
+/* Where the next record goes (words into the page) */
+static uint16_t kv_next;
+
+/* Where each key's record is (words into the page), 0 for nowhere */
+static uint16_t kv_index[KV_KEY_MAX];
+
+/* Steps of a kv_put_later */
+typedef enum
+{
+  KV_LATER_IDLE = 0,
+  KV_LATER_ERASE,               /* Erasing the next page */
+  KV_LATER_COPY,                /* Copying a record over */
+  KV_LATER_COMMIT,              /* Writing its header */
+  KV_LATER_RELEASE,             /* Erasing the old page */
+  KV_LATER_RECORD,              /* Writing the new record */
+} kv_later_step_t;
+
+/* The kv_put_later in progress */
+static struct
+{
+  kv_later_step_t step;
+  kv_key_t key;                 /* What it's for */
+  uint8_t length;
+  uint32_t record[KV_RECORD_WORDS(KV_VALUE_MAX)];
+  uint16_t offset;              /* Where the next copy or the record goes */
+  uint8_t to;                   /* Page we're compacting to */
+  uint8_t copied;               /* Last key copied over */
+  uint16_t index[KV_KEY_MAX];   /* kv_index as it will be on that page */
+  uint32_t header[KV_HEADER_WORDS];
+  kv_callback_t callback;
+  void * ctx;
+  flash_job_t job;
+} kv_later;
+
+static uint32_t kv_record_header(uint8_t key, uint8_t length)
+{
+  uint32_t half = (uint32_t) key | (uint32_t) length << 8;
+  return half | (~half & 0xFFFF) << 16;
+}
+
+static uint8_t kv_record_length(uint32_t header)
+{
+  return (header >> 8) & 0xFF;
+}
+
+static uint32_t kv_record_crc(const uint32_t * record, uint8_t length)
+{
+  return crc32(0, record, (KV_RECORD_WORDS(length) - 1) * 4);
+}
+
+/*
+ * Is there a good record at this offset? Returns how many words it takes,
+ * or 0 if we can't tell where it ends (garbage, or the free space).
+ */
+static uint16_t kv_record_check(const uint32_t * page, uint16_t offset,
+                                bool * good)
+{
+  uint32_t header = page[offset];
+  uint8_t length = kv_record_length(header);
+  uint16_t words = KV_RECORD_WORDS(length);
+
+  *good = false;
+
+  if (header != kv_record_header(header & 0xFF, length) ||
+      (header & 0xFF) == KV_KEY_NONE || length > KV_VALUE_MAX ||
+      offset + words > KV_PAGE_WORDS)
+  {
+    return 0;
+  }
+
+  *good = page[offset + words - 1] == kv_record_crc(&page[offset], length) &&
+          (header & 0xFF) < KV_KEY_MAX;
+  return words;
+}
+
+/* Make up the record for a value, returning how many words it is */
+static uint16_t kv_record_build(uint32_t * record, kv_key_t key,
+                                const void * data, uint8_t length)
+{
+  uint16_t words = KV_RECORD_WORDS(length);
+
+  memset(record, 0xFF, words * 4);
+  record[0] = kv_record_header(key, length);
+  if (length)
+  {
+    memcpy(&record[1], data, length);
+  }
+  record[words - 1] = kv_record_crc(record, length);
+
+  return words;
+}
+
+/* Would putting this change anything? */
+static bool kv_unchanged(kv_key_t key, const void * data, uint8_t length)
+{
+  uint8_t stored;
+  const void * value = kv_get(key, &stored);
+
+  return value ? (stored == length && !memcmp(value, data, length)) : !length;
+}
+
+/* Is this page one we've finished setting up? Then it has a sequence */
+static bool kv_page_valid(uint8_t page)
+{
+  return kv_flash[page][0] == KV_MAGIC;
+}
+
+/* Has a been written since b? Works across the wrap */
+static bool kv_newer(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) > 0;
+}
+
+/* Finish setting up a page: the header goes last */
+static void kv_page_commit(uint8_t page, uint32_t sequence)
+{
+  uint32_t header[KV_HEADER_WORDS] = { KV_MAGIC, sequence };
+
+  nrf_nvmc_write_words((uint32_t) kv_flash[page], header, KV_HEADER_WORDS);
+}
+
+/* Index the page in use */
+static void kv_scan(void)
+{
+  const uint32_t * page = kv_flash[kv_page];
+  uint16_t offset = KV_HEADER_WORDS;
+
+  memset(kv_index, 0, sizeof(kv_index));
+
+  while (offset < KV_PAGE_WORDS && page[offset] != 0xffffffff)
+  {
+    bool good;
+    uint16_t words = kv_record_check(page, offset, &good);
+
+    if (!words)
+    {
+      /* Don't know where this ends: nothing more goes on this page */
+      offset = KV_PAGE_WORDS;
+      break;
+    }
+    if (good)
+    {
+      kv_index[page[offset] & 0xFF] =
+        kv_record_length(page[offset]) ? offset : 0;
+    }
+    offset += words;
+  }
+
+  kv_next = offset;
+}
+
+/* Find the page in use, or start afresh if there isn't one */
+void kv_init(void)
+{
+  bool found = false;
+
+  /* Anything that was on its way didn't make it */
+  kv_later.step = KV_LATER_IDLE;
+
+  for (uint8_t page = 0; page < KV_PAGES; page++)
+  {
+    if (kv_page_valid(page) &&
+        (!found || kv_newer(kv_flash[page][1], kv_sequence)))
+    {
+      kv_page = page;
+      kv_sequence = kv_flash[page][1];
+      found = true;
+    }
+  }
+
+  if (!found)
+  {
+    kv_page = 0;
+    kv_sequence = 0;
+    nrf_nvmc_page_erase((uint32_t) kv_flash[kv_page]);
+    kv_page_commit(kv_page, kv_sequence);
+  }
+
+  kv_scan();
+}
+
+/*
+ * Where a key's value is in flash, or NULL if we don't have one. Good
+ * until the next kv_put, which may move it.
+ */
+const void * kv_get(kv_key_t key, uint8_t * length)
+{
+  uint16_t offset;
+
+  if (key >= KV_KEY_MAX || !(offset = kv_index[key]))
+  {
+    return NULL;
+  }
+
+  if (length)
+  {
+    *length = kv_record_length(kv_flash[kv_page][offset]);
+  }
+  return &kv_flash[kv_page][offset + 1];
+}
+
+/* Copy a value out, if we have one of that length */
+bool kv_read(kv_key_t key, void * data, uint8_t length)
+{
+  uint8_t stored;
+  const void * value = kv_get(key, &stored);
+
+  if (!value || stored != length)
+  {
+    return false;
+  }
+
+  memcpy(data, value, length);
+  return true;
+}
+
+/*
+ * Move everything still current to the next page, and let go of this one.
+ * Any pointers from kv_get are no good afterwards.
+ */
+void kv_compact(void)
+{
+  uint8_t from;
+  uint8_t to;
+  uint16_t offset = KV_HEADER_WORDS;
+
+  /* Not from under a kv_put_later */
+  if (kv_pending())
+  {
+    flash_flush();
+  }
+
+  from = kv_page;
+  to = (kv_page + 1) % KV_PAGES;
+  nrf_nvmc_page_erase((uint32_t) kv_flash[to]);
+
+  for (uint8_t key = KV_KEY_NONE + 1; key < KV_KEY_MAX; key++)
+  {
+    uint16_t words;
+
+    if (!kv_index[key])
+    {
+      continue;
+    }
+
+    words = KV_RECORD_WORDS(kv_record_length(kv_flash[from][kv_index[key]]));
+    nrf_nvmc_write_words((uint32_t) &kv_flash[to][offset],
+                         &kv_flash[from][kv_index[key]], words);
+    kv_index[key] = offset;
+    offset += words;
+  }
+
+  kv_page_commit(to, kv_sequence + 1);
+  nrf_nvmc_page_erase((uint32_t) kv_flash[from]);
+
+  kv_page = to;
+  kv_sequence++;
+  kv_next = offset;
+}
+
+/*
+ * Keep a value for a key, in place of any it had. Putting what's there
+ * already doesn't touch the flash. Returns false if it didn't make it
+ * (too big, no room even after compacting, or it didn't read back).
+ */
+bool kv_put(kv_key_t key, const void * data, uint8_t length)
+{
+  uint32_t record[KV_RECORD_WORDS(KV_VALUE_MAX)];
+  uint16_t words = KV_RECORD_WORDS(length);
+  uint16_t offset;
+
+  if (key == KV_KEY_NONE || key >= KV_KEY_MAX || length > KV_VALUE_MAX)
+  {
+    return false;
+  }
+
+  /* Anything queued goes first, it may be moving the page */
+  if (kv_pending())
+  {
+    flash_flush();
+  }
+
+  if (kv_unchanged(key, data, length))
+  {
+    return true;
+  }
+
+  if (kv_next + words > KV_PAGE_WORDS)
+  {
+    kv_compact();
+  }
+  if (kv_next + words > KV_PAGE_WORDS)
+  {
+    return false;
+  }
+
+  kv_record_build(record, key, data, length);
+
+  offset = kv_next;
+  nrf_nvmc_write_words((uint32_t) &kv_flash[kv_page][offset], record, words);
+  kv_next += words;
+
+  if (memcmp(&kv_flash[kv_page][offset], record, words * 4))
+  {
+    return false;
+  }
+
+  kv_index[key] = length ? offset : 0;
+  return true;
+}
+
+bool kv_delete(kv_key_t key)
+{
+  return kv_put(key, NULL, 0);
+}
+
+/* Bytes left for records before the next compaction */
+uint16_t kv_free(void)
+{
+  return (KV_PAGE_WORDS - kv_next) * 4;
+}
+
+static void kv_later_step(flash_job_t * job, void * ctx);
+
+/* Is a kv_put_later still on its way? */
+bool kv_pending(void)
+{
+  return kv_later.step != KV_LATER_IDLE;
+}
+
+static void kv_later_done(bool ok)
+{
+  kv_later.step = KV_LATER_IDLE;
+  if (kv_later.callback)
+  {
+    kv_later.callback(kv_later.key, ok, kv_later.ctx);
+  }
+}
+
+/* Queue the new record on the page in use, if it fits */
+static void kv_later_record(void)
+{
+  uint16_t words = KV_RECORD_WORDS(kv_later.length);
+
+  if (kv_next + words > KV_PAGE_WORDS)
+  {
+    kv_later_done(false);
+    return;
+  }
+
+  kv_later.step = KV_LATER_RECORD;
+  kv_later.offset = kv_next;
+  kv_next += words;
+  flash_write(&kv_later.job, (uint32_t) &kv_flash[kv_page][kv_later.offset],
+              kv_later.record, words, kv_later_step, NULL);
+}
+
+/* Copy the next live record over, or commit the page if that was all */
+static void kv_later_copy(void)
+{
+  for (uint8_t key = kv_later.copied + 1; key < KV_KEY_MAX; key++)
+  {
+    const uint32_t * record = &kv_flash[kv_page][kv_index[key]];
+    uint16_t words;
+
+    if (!kv_index[key])
+    {
+      continue;
+    }
+
+    words = KV_RECORD_WORDS(kv_record_length(*record));
+    kv_later.step = KV_LATER_COPY;
+    kv_later.copied = key;
+    kv_later.index[key] = kv_later.offset;
+    flash_write(&kv_later.job,
+                (uint32_t) &kv_flash[kv_later.to][kv_later.offset],
+                record, words, kv_later_step, NULL);
+    kv_later.offset += words;
+    return;
+  }
+
+  kv_later.step = KV_LATER_COMMIT;
+  kv_later.header[0] = KV_MAGIC;
+  kv_later.header[1] = kv_sequence + 1;
+  flash_write(&kv_later.job, (uint32_t) kv_flash[kv_later.to],
+              kv_later.header, KV_HEADER_WORDS, kv_later_step, NULL);
+}
+
+/* A step is done, on to the next */
+static void kv_later_step(flash_job_t * job, void * ctx)
+{
+  uint8_t from = kv_page;
+
+  switch (kv_later.step)
+  {
+    case KV_LATER_ERASE:
+    case KV_LATER_COPY:
+      kv_later_copy();
+      break;
+
+    case KV_LATER_COMMIT:
+      /* The new page is the one in use from here on */
+      kv_page = kv_later.to;
+      kv_sequence++;
+      kv_next = kv_later.offset;
+      memcpy(kv_index, kv_later.index, sizeof(kv_index));
+
+      kv_later.step = KV_LATER_RELEASE;
+      flash_erase(&kv_later.job, (uint32_t) kv_flash[from], kv_later_step, NULL);
+      break;
+
+    case KV_LATER_RELEASE:
+      kv_later_record();
+      break;
+
+    case KV_LATER_RECORD:
+      if (memcmp(&kv_flash[kv_page][kv_later.offset], kv_later.record,
+                 KV_RECORD_WORDS(kv_later.length) * 4))
+      {
+        kv_later_done(false);
+        break;
+      }
+      kv_index[kv_later.key] = kv_later.length ? kv_later.offset : 0;
+      kv_later_done(true);
+      break;
+
+    default:
+      break;
+  }
+}
+
+/*
+ * Keep a value for a key, a step at a time in the FSM's idle slots. The
+ * value is copied, and the callback (may be NULL) says how it went. One
+ * at a time: returns false if there's one on its way already (or the
+ * key or length are no good).
+ */
+bool kv_put_later(kv_key_t key, const void * data, uint8_t length,
+                  kv_callback_t callback, void * ctx)
+{
+  if (key == KV_KEY_NONE || key >= KV_KEY_MAX || length > KV_VALUE_MAX ||
+      kv_pending())
+  {
+    return false;
+  }
+
+  kv_later.key = key;
+  kv_later.length = length;
+  kv_later.callback = callback;
+  kv_later.ctx = ctx;
+
+  if (kv_unchanged(key, data, length))
+  {
+    kv_later_done(true);
+    return true;
+  }
+
+  kv_record_build(kv_later.record, key, data, length);
+
+  if (kv_next + KV_RECORD_WORDS(length) <= KV_PAGE_WORDS)
+  {
+    kv_later_record();
+    return true;
+  }
+
+  /* No room: compact first, the same way kv_compact does */
+  kv_later.step = KV_LATER_ERASE;
+  kv_later.to = (kv_page + 1) % KV_PAGES;
+  kv_later.copied = KV_KEY_NONE;
+  kv_later.offset = KV_HEADER_WORDS;
+  memset(kv_later.index, 0, sizeof(kv_later.index));
+  flash_erase(&kv_later.job, (uint32_t) kv_flash[kv_later.to], kv_later_step, NULL);
+  return true;
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _kv_h
+#define _kv_h
+
+enum
+{
+  KV_PAGE_SIZE = 1024,          /* nRF51 flash page (FICR CODEPAGESIZE) */
+  KV_PAGE_WORDS = KV_PAGE_SIZE / 4,
+  KV_PAGES = 2,                 /* STORAGE_REGION, one active, one spare */
+  KV_VALUE_MAX = 64,            /* Largest value we keep, in bytes */
+  KV_MAGIC = 0x4B565354,        /* "KVST", a page in use */
+  KV_HEADER_WORDS = 2,          /* Magic and sequence number */
+};
+
+/* What we keep. Append only, never renumber */
+typedef enum
+{
+  KV_KEY_NONE = 0,
+  KV_KEY_SECRETS,               /* ki_provision_t, from manufacture */
+  KV_KEY_PARAMS,                /* params_block_t, this site's knobs */
+  KV_KEY_MAX,
+} kv_key_t;
+
+/* Words a record for a value this long takes: header, value, CRC */
+#define KV_RECORD_WORDS(length) (2 + ((length) + 3) / 4)
+
+/* How a kv_put_later went */
+typedef void (*kv_callback_t)(kv_key_t key, bool ok, void * ctx);
+
+void kv_init(void);
+const void * kv_get(kv_key_t key, uint8_t * length);
+bool kv_read(kv_key_t key, void * data, uint8_t length);
+bool kv_put(kv_key_t key, const void * data, uint8_t length);
+bool kv_delete(kv_key_t key);
+bool kv_put_later(kv_key_t key, const void * data, uint8_t length,
+                  kv_callback_t callback, void * ctx);
+bool kv_pending(void);
+void kv_compact(void);
+uint16_t kv_free(void);
+
+#endif
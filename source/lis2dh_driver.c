@@ -11,6 +11,29 @@
 #include "lis2dh_driver.h"
 #include "spi_master.h"
 #include "kiwiki.h"
+#include "params.h"
+
+/* Operating mode and output data rate for each LIS2DH_Profile_t */
+static const struct
+{
+  LIS3DH_Mode_t mode;
+  LIS3DH_ODR_t odr;
+  u8_t odr_hz;
+} lis2dh_profiles[] =
+{
+  [LIS2DH_PROFILE_WAKE_ON_MOTION] = { LIS3DH_LOW_POWER, LIS3DH_ODR_10Hz, 10 },
+  [LIS2DH_PROFILE_DOUBLE_TAP] =     { LIS3DH_LOW_POWER, LIS3DH_ODR_100Hz, 100 },
+};
+
+/*
+ * Rescale a register value given in samples at ACC_TIMING_ODR_HZ to the
+ * given output data rate, never letting it drop to zero.
+ */
+static u8_t LIS2DH_ScaleTiming(u8_t val, u8_t odr_hz)
+{
+  uint16_t scaled = ((uint16_t)val * odr_hz) / ACC_TIMING_ODR_HZ;
+  return scaled ? (u8_t)scaled : 1;
+}
 
 /*
  * Function to initialize the LIS2DH accelerometer
@@ -22,24 +45,12 @@ status_t LIS2DH_init(void)
   status_t ret = MEMS_SUCCESS;
 
   /* Set up low power function */
-  if ((ret = LIS3DH_SetMode(LIS3DH_LOW_POWER)) != MEMS_SUCCESS)
-  {
-    return MEMS_ERROR;
-  }
-  if ((ret = LIS2DH_SetAct_THS(ACC_THRESHOLD_LOWPWR_G)) != MEMS_SUCCESS)
-  {
-    return MEMS_ERROR;
-  }
-  if ((ret = LIS2DH_SetAct_DUR(ACC_THRESHOLD_LOWPWR_DUR)) != MEMS_SUCCESS)
+  if ((ret = LIS2DH_SetAct_THS(params_get()->acc_threshold_lowpwr_g)) != MEMS_SUCCESS)
   {
     return MEMS_ERROR;
   }
 
   /* Set up interrupt on INT1 pin on movement */
-  if ((ret = LIS3DH_SetODR(LIS3DH_ODR_100Hz)) != MEMS_SUCCESS)
-  {
-    return MEMS_ERROR;
-  }
   if ((ret = LIS3DH_HPFAOI1Enable(MEMS_ENABLE)) != MEMS_SUCCESS)
   {
     return MEMS_ERROR;
@@ -52,7 +63,7 @@ status_t LIS2DH_init(void)
   {
     return MEMS_ERROR;
   }
-  if ((ret = LIS3DH_SetInt1Threshold(ACC_THRESHOLD_MOVEMENT)) != MEMS_SUCCESS)
+  if ((ret = LIS3DH_SetInt1Threshold(params_get()->acc_threshold_movement)) != MEMS_SUCCESS)
   {
     return MEMS_ERROR;
   }
@@ -82,10 +93,25 @@ status_t LIS2DH_init(void)
   {
     return MEMS_ERROR;
   }
+
+  /*
+   * INT2 carries double taps, and (if enabled) the sleep-to-wake engine's
+   * activity status, which holds INT2 high for as long as we lie still.
+   * CLICK_SRC tells the two apart, see LIS2DH_GetDoubleTap.
+   */
+#if ACC_INACTIVITY_SLEEP
+  if ((ret = LIS3DH_SetInt2Pin(
+      LIS3DH_CLICK_ON_PIN_INT2_ENABLE |
+      LIS2DH_ACT_ON_PIN_INT2_ENABLE)) != MEMS_SUCCESS)
+  {
+    return MEMS_ERROR;
+  }
+#else
   if ((ret = LIS3DH_SetInt2Pin(LIS3DH_CLICK_ON_PIN_INT2_ENABLE)) != MEMS_SUCCESS)
   {
     return MEMS_ERROR;
   }
+#endif
   if ((ret = LIS3DH_SetClickCFG(
       LIS3DH_ZD_ENABLE |
       LIS3DH_YD_DISABLE |
@@ -93,19 +119,22 @@ status_t LIS2DH_init(void)
   {
     return MEMS_ERROR;
   }
-  if ((ret = LIS3DH_SetClickTHS(ACC_DOUBLE_TAP_THRESHOLD)) != MEMS_SUCCESS)
-  {
-    return MEMS_ERROR;
-  }
-  if ((ret = LIS3DH_SetClickLIMIT(ACC_DOUBLE_TAP_LIMIT)) != MEMS_SUCCESS)
+  if ((ret = LIS3DH_SetClickTHS(params_get()->acc_double_tap_threshold)) != MEMS_SUCCESS)
   {
     return MEMS_ERROR;
   }
-  if ((ret = LIS3DH_SetClickLATENCY(ACC_DOUBLE_TAP_LATENCY)) != MEMS_SUCCESS)
+  /* Keep a double tap in CLICK_SRC (and on INT2) until we've read it */
+  if ((ret = LIS2DH_ClickLatchEnable(MEMS_ENABLE)) != MEMS_SUCCESS)
   {
     return MEMS_ERROR;
   }
-  if ((ret = LIS3DH_SetClickWINDOW(ACC_DOUBLE_TAP_WINDOW)) != MEMS_SUCCESS)
+
+  /*
+   * Mode, ODR and everything timed in samples (double tap limit, latency and
+   * window, sleep to wake duration). We start out listening for double taps,
+   * the FSM moves us between profiles from here on.
+   */
+  if ((ret = LIS2DH_SetPowerProfile(LIS2DH_PROFILE_DOUBLE_TAP)) != MEMS_SUCCESS)
   {
     return MEMS_ERROR;
   }
@@ -119,8 +148,11 @@ status_t LIS2DH_init(void)
   {
     return MEMS_ERROR;
   }
-  /* Latch INT2 on double tap */
-  if ((ret = LIS2DH_Int2LatchEnable(MEMS_ENABLE)) != MEMS_SUCCESS)
+  /*
+   * Nothing reads INT2_SRC as we go, so a latch there would hold INT2
+   * high for good. The double tap latch is in CLICK_SRC instead.
+   */
+  if ((ret = LIS2DH_Int2LatchEnable(MEMS_DISABLE)) != MEMS_SUCCESS)
   {
     return MEMS_ERROR;
   }
@@ -168,6 +200,93 @@ status_t LIS2DH_SetAct_DUR(u8_t val)
   return MEMS_SUCCESS;
 }
 
+/*
+ * Latch double taps: CLICK_SRC (and the click interrupt) stay put until
+ * CLICK_SRC is read
+ */
+status_t LIS2DH_ClickLatchEnable(State_t latch)
+{
+  u8_t value;
+
+  if( !LIS3DH_ReadReg(LIS3DH_CLICK_THS, &value) )
+    return MEMS_ERROR;
+
+  value &= ~LIS2DH_LIR_CLICK;
+  if (latch == MEMS_ENABLE)
+    value |= LIS2DH_LIR_CLICK;
+
+  if( !LIS3DH_WriteReg(LIS3DH_CLICK_THS, value) )
+    return MEMS_ERROR;
+
+  return MEMS_SUCCESS;
+}
+
+/*
+ * Was there a double tap since we last asked? Reading CLICK_SRC clears it,
+ * and lets go of INT2 if the tap was what held it high.
+ */
+status_t LIS2DH_GetDoubleTap(u8_t * tapped)
+{
+  u8_t value;
+
+  if( !LIS3DH_ReadReg(LIS3DH_CLICK_SRC, &value) )
+    return MEMS_ERROR;
+
+  *tapped = (value & LIS3DH_IA) && (value & LIS3DH_DCLICK);
+
+  return MEMS_SUCCESS;
+}
+
+/*
+ * Let go of anything the accelerometer latched while we weren't looking
+ * (say, through System OFF), where LIS2DH_init would have.
+ */
+status_t LIS2DH_ResetLatches(void)
+{
+  u8_t tapped;
+
+  if (LIS2DH_ResetInt2Latch() != MEMS_SUCCESS)
+    return MEMS_ERROR;
+
+  return LIS2DH_GetDoubleTap(&tapped);
+}
+
+/*
+ * Switch the accelerometer to one of the power profiles.
+ *
+ * The double tap time parameters and the sleep to wake duration are counted
+ * in samples, so they are rescaled from ACC_TIMING_ODR_HZ to the new ODR.
+ */
+status_t LIS2DH_SetPowerProfile(LIS2DH_Profile_t profile)
+{
+  u8_t odr_hz;
+
+  if (profile > LIS2DH_PROFILE_DOUBLE_TAP)
+    return MEMS_ERROR;
+
+  odr_hz = lis2dh_profiles[profile].odr_hz;
+
+  if( LIS3DH_SetMode(lis2dh_profiles[profile].mode) != MEMS_SUCCESS )
+    return MEMS_ERROR;
+
+  if( LIS3DH_SetODR(lis2dh_profiles[profile].odr) != MEMS_SUCCESS )
+    return MEMS_ERROR;
+
+  if( LIS2DH_SetAct_DUR(LIS2DH_ScaleTiming(params_acc_lowpwr_dur(), odr_hz)) != MEMS_SUCCESS )
+    return MEMS_ERROR;
+
+  if( LIS3DH_SetClickLIMIT(LIS2DH_ScaleTiming(ACC_DOUBLE_TAP_LIMIT, odr_hz)) != MEMS_SUCCESS )
+    return MEMS_ERROR;
+
+  if( LIS3DH_SetClickLATENCY(LIS2DH_ScaleTiming(ACC_DOUBLE_TAP_LATENCY, odr_hz)) != MEMS_SUCCESS )
+    return MEMS_ERROR;
+
+  if( LIS3DH_SetClickWINDOW(LIS2DH_ScaleTiming(ACC_DOUBLE_TAP_WINDOW, odr_hz)) != MEMS_SUCCESS )
+    return MEMS_ERROR;
+
+  return MEMS_SUCCESS;
+}
+
 /*******************************************************************************
 * Function Name  : LIS2DH_Int1LatchEnable
 * Description    : Enable Interrupt 2 Latching function
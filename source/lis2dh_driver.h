@@ -16,6 +16,14 @@
 #define LIS2DH_LIR_INT2                                BIT(1)
 #define LIS2DH_D4D_INT2                                BIT(0)
 
+//CONTROL REGISTER 6
+#define LIS2DH_I2_ACT                                  BIT(3)
+#define LIS2DH_ACT_ON_PIN_INT2_ENABLE                  0x08
+#define LIS2DH_ACT_ON_PIN_INT2_DISABLE                 0x00
+
+//CLICK THRESHOLD REGISTER
+#define LIS2DH_LIR_CLICK                               0x80
+
 //INTERRUPT 2 SOURCE REGISTER
 #define LIS2DH_INT2_SRC       0x35
 
@@ -23,6 +31,17 @@
 #define LIS2DH_Act_THS             0x3E
 #define LIS2DH_Act_DUR             0x3F
 
+/*
+ * Accelerometer power profiles. Each one sets the operating mode and output
+ * data rate together, and rescales the ODR dependent timings (double tap,
+ * sleep to wake duration) so that they keep meaning the same in seconds.
+ */
+typedef enum
+{
+  LIS2DH_PROFILE_WAKE_ON_MOTION = 0,  /* System OFF, only movement matters */
+  LIS2DH_PROFILE_DOUBLE_TAP,          /* Awake: double taps, at the ODR they're tuned for */
+} LIS2DH_Profile_t;
+
 /*
  * LIS2DH functions
  */
@@ -31,5 +50,9 @@ status_t LIS2DH_SetAct_THS(u8_t val);
 status_t LIS2DH_SetAct_DUR(u8_t val);
 status_t LIS2DH_Int2LatchEnable(State_t latch);
 status_t LIS2DH_ResetInt2Latch(void);
+status_t LIS2DH_ClickLatchEnable(State_t latch);
+status_t LIS2DH_GetDoubleTap(u8_t * tapped);
+status_t LIS2DH_ResetLatches(void);
+status_t LIS2DH_SetPowerProfile(LIS2DH_Profile_t profile);
 
 #endif /* LIS2DH_DRIVER_H_ */
@@ -13,6 +13,12 @@
 #include "hw.h"
 #include "spi_master.h"
 #include "lis2dh_driver.h"
+#include "sched.h"
+#include "timer.h"
+#include "clock.h"
+#include "power.h"
+#include "battery.h"
+#include "flash.h"
 
 /*****************************************************************************/
 /** Main **/
@@ -28,15 +34,27 @@ int main(void)
   /* Set up the core */
   hw_init();
 
-  /* Set up the accelerometer */
-  if(!LIS2DH_init())
+  /*
+   * Set up the accelerometer, unless it has been set up all along. Then
+   * it only needs what it latched while we were off clearing.
+   */
+  if (kiwiki_fast_boot(&state) ? !LIS2DH_ResetLatches() : !LIS2DH_init())
   {
     state.is_hw_good = false;
   }
 
-  /* FSM */
+  /* Set up the event queue, and put the FSM on it */
+  sched_init();
+  timer_init();
+  clock_init();
+  power_init();
+  battery_init();
+  flash_init();
+  kiwiki_start(&state);
+
+  /* Handle events, sleep in between */
   for (;;)
   {
-    kiwiki_step(&state);
+    sched_run();
   }
 }
@@ -0,0 +1,149 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "params.h"
+#include "kiwiki.h"
+#include "crc.h"
+
+/*
+ * The timing and threshold knobs.
+ *
+ * Out of the box these are the compile time values in kiwiki.h. A site
+ * that wants to trade energy against latency differently can have its own
+ * set written to flash at manufacture (see kiwiki_process_mm_params), in
+ * a block with a magic, a version and a CRC. At boot a good block is
+ * copied here, and anything else (an erased page, a block from a firmware
+ * with a different layout, a torn write) leaves us on the defaults.
+ *
+ * Everything reads the knobs through params_get().
+ */
+
+static const params_t params_defaults =
+{
+  .listen_time_beacon = LISTEN_TIME_BEACON,
+  .listen_time_random = LISTEN_TIME_RANDOM,
+  .poll_interval_standard = POLL_INTERVAL_STANDARD,
+  .poll_interval_short = POLL_INTERVAL_SHORT,
+  .poll_interval_shortest = POLL_INTERVAL_SHORTEST,
+  .poll_interval_long = POLL_INTERVAL_LONG,
+  .maybe_ifod_threshold = MAYBE_IFOD_THRESHOLD,
+  .longtime_ifod_threshold = LONGTIME_IFOD_THRESHOLD,
+  .motionless_time = MOTIONLESS_TIME,
+  .packet_stat_thresh = PACKET_STAT_THRESH,
+  .packet_stat_max = PACKET_STAT_MAX,
+  .acc_threshold_lowpwr_g = ACC_THRESHOLD_LOWPWR_G,
+  .acc_threshold_movement = ACC_THRESHOLD_MOVEMENT,
+  .acc_double_tap_threshold = ACC_DOUBLE_TAP_THRESHOLD,
+};
+
+/* The RAM copy of a good block from flash */
+static params_t params;
+
+/* What we're running with, one or the other */
+static const params_t * current = &params_defaults;
+
+const params_t * params_get(void)
+{
+  return current;
+}
+
+static uint32_t params_crc(const params_block_t * block)
+{
+  return crc32(0, block, offsetof(params_block_t, crc));
+}
+
+/* A poll interval we can sleep for */
+static bool params_poll_sane(uint16_t interval)
+{
+  return interval && interval <= PARAMS_POLL_INTERVAL_MAX;
+}
+
+/*
+ * Would the FSM cope with these? A zero listen or poll would have us spin,
+ * too long a poll would wrap the sleep, the door seen stopwatch stops at
+ * DOOR_SEEN_SW_MAX so an IFOD threshold past it would never be crossed,
+ * and the accelerometer thresholds are 7 bit registers.
+ */
+static bool params_sane(const params_t * p)
+{
+  return p->listen_time_beacon && p->listen_time_random &&
+         params_poll_sane(p->poll_interval_standard) &&
+         params_poll_sane(p->poll_interval_short) &&
+         params_poll_sane(p->poll_interval_shortest) &&
+         params_poll_sane(p->poll_interval_long) &&
+         p->maybe_ifod_threshold <= DOOR_SEEN_SW_MAX &&
+         p->longtime_ifod_threshold <= DOOR_SEEN_SW_MAX &&
+         p->motionless_time && p->motionless_time <= INT16_MAX &&
+         p->packet_stat_thresh && p->packet_stat_thresh <= p->packet_stat_max &&
+         p->acc_threshold_lowpwr_g <= 0x7F &&
+         p->acc_threshold_movement <= 0x7F &&
+         p->acc_double_tap_threshold <= 0x7F;
+}
+
+/* Is this a block we wrote, for this layout, and intact? */
+bool params_valid(const params_block_t * block)
+{
+  return block->magic == PARAMS_MAGIC &&
+         block->version == PARAMS_VERSION &&
+         block->length == sizeof(params_t) &&
+         block->crc == params_crc(block) &&
+         params_sane(&block->params);
+}
+
+/*
+ * Take the knobs from a block in flash, or the defaults if it's no good.
+ * Returns true if the block was used.
+ */
+bool params_load(const params_block_t * block)
+{
+  if (!params_valid(block))
+  {
+    current = &params_defaults;
+    return false;
+  }
+
+  params = block->params;
+  current = &params;
+  return true;
+}
+
+/* Make up a block to write, if these are knobs we'd run with */
+bool params_seal(params_block_t * block, const params_t * p)
+{
+  if (!params_sane(p))
+  {
+    return false;
+  }
+
+  memset(block, 0xFF, sizeof(params_block_t));
+  block->magic = PARAMS_MAGIC;
+  block->version = PARAMS_VERSION;
+  block->length = sizeof(params_t);
+  block->params = *p;
+  block->crc = params_crc(block);
+  return true;
+}
+
+/*
+ * The sleep to wake duration, in samples at ACC_TIMING_ODR_HZ, that comes
+ * to about the motionless time: (8 * DUR + 1) / ODR.
+ */
+uint8_t params_acc_lowpwr_dur(void)
+{
+  uint32_t samples = (uint32_t) current->motionless_time * ACC_TIMING_ODR_HZ / 1000;
+  uint32_t dur = samples > 1 ? (samples - 1) / 8 : 0;
+
+  if (dur > UINT8_MAX)
+  {
+    return UINT8_MAX;
+  }
+  return dur ? dur : 1;
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "battery.h"
+
+#ifndef _params_h
+#define _params_h
+
+enum
+{
+  PARAMS_MAGIC = 0x5041,        /* "PA" */
+  PARAMS_VERSION = 1,           /* Bump whenever params_t changes */
+
+  /*
+   * Longest poll interval (mS): jittered by up to 1/8 (phase.c) and
+   * stretched for a flat battery, a sleep still has to fit an int16_t.
+   */
+  PARAMS_POLL_INTERVAL_MAX =
+    INT16_MAX * BATTERY_SCALE_ONE / BATTERY_SLEEP_SCALE_MAX * 8 / 9,
+};
+
+/*
+ * The timing and threshold knobs, tunable per site. This is also what the
+ * manufacturing machine sends, so it's packed.
+ */
+typedef struct __attribute__((__packed__))
+{
+  uint16_t listen_time_beacon;            /* uS, LISTEN_TIME_BEACON */
+  uint16_t listen_time_random;            /* uS, LISTEN_TIME_RANDOM */
+  uint16_t poll_interval_standard;        /* mS, POLL_INTERVAL_STANDARD */
+  uint16_t poll_interval_short;           /* mS, POLL_INTERVAL_SHORT */
+  uint16_t poll_interval_shortest;        /* mS, POLL_INTERVAL_SHORTEST */
+  uint16_t poll_interval_long;            /* mS, POLL_INTERVAL_LONG */
+  uint16_t maybe_ifod_threshold;          /* mS, MAYBE_IFOD_THRESHOLD */
+  uint16_t longtime_ifod_threshold;       /* mS, LONGTIME_IFOD_THRESHOLD */
+  uint16_t motionless_time;               /* mS, MOTIONLESS_TIME */
+  uint8_t packet_stat_thresh;             /* PACKET_STAT_THRESH */
+  uint8_t packet_stat_max;                /* PACKET_STAT_MAX */
+  uint8_t acc_threshold_lowpwr_g;         /* ACC_THRESHOLD_LOWPWR_G */
+  uint8_t acc_threshold_movement;         /* ACC_THRESHOLD_MOVEMENT */
+  uint8_t acc_double_tap_threshold;       /* ACC_DOUBLE_TAP_THRESHOLD */
+} params_t;
+
+/* How they're kept in flash (a whole number of words) */
+typedef struct
+{
+  uint16_t magic;               /* PARAMS_MAGIC if a block was written */
+  uint8_t version;              /* PARAMS_VERSION it was written by */
+  uint8_t length;               /* sizeof(params_t) */
+  params_t params;
+  uint8_t reserved;
+  uint32_t crc;                 /* Of everything above */
+} params_block_t;
+
+const params_t * params_get(void);
+bool params_valid(const params_block_t * block);
+bool params_load(const params_block_t * block);
+bool params_seal(params_block_t * block, const params_t * params);
+uint8_t params_acc_lowpwr_dur(void);
+
+#endif
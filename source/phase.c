@@ -0,0 +1,92 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include "phase.h"
+
+/*
+ * Wake phase decorrelation.
+ *
+ * Kis that walk up to a door together would otherwise poll in lock step,
+ * answer the same beacon, and talk over each other every time. So every
+ * poll interval is nudged by a random amount, from a generator seeded
+ * with what makes this Ki different from the others (its device ID) and
+ * some real randomness. Each Ki's phase then wanders off on its own.
+ *
+ * This is xorshift32: cheap, and good enough to pull schedules apart.
+ * Nothing here has to be secret.
+ */
+
+/* Stir a word in (the murmur3 finaliser) */
+static uint32_t phase_mix(uint32_t h, uint32_t k)
+{
+  h ^= k;
+  h ^= h >> 16;
+  h *= 0x85EBCA6B;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35;
+  h ^= h >> 16;
+  return h;
+}
+
+/* A starting state from the device ID and some random bytes */
+uint32_t phase_seed(uint32_t id0, uint32_t id1,
+                    const uint8_t * random, uint8_t count)
+{
+  uint32_t h = phase_mix(phase_mix(0, id0), id1);
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    h = phase_mix(h, random[i]);
+  }
+
+  /* xorshift gets stuck at zero */
+  return h ? h : 0x6B1D5A3F;
+}
+
+uint32_t phase_next(uint32_t * state)
+{
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+/* A poll interval (mS), nudged by up to 1/8 either way */
+uint16_t phase_jitter(uint32_t * state, uint16_t interval)
+{
+  uint16_t spread = interval >> PHASE_JITTER_SHIFT;
+
+  if (spread < PHASE_JITTER_MIN)
+  {
+    spread = PHASE_JITTER_MIN;
+  }
+  if (spread >= interval)
+  {
+    spread = interval - 1;
+  }
+  if (!spread)
+  {
+    return interval;
+  }
+
+  return interval - spread + phase_next(state) % (2 * spread + 1);
+}
+
+/* A random wait of less than max (in its units), to get out of someone's way */
+uint16_t phase_backoff(uint32_t * state, uint16_t max)
+{
+  if (!max)
+  {
+    return 0;
+  }
+  return phase_next(state) % max;
+}
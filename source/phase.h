@@ -0,0 +1,27 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+
+#ifndef _phase_h
+#define _phase_h
+
+enum
+{
+  PHASE_JITTER_SHIFT = 3,   /* Poll intervals vary by +-1/8 */
+  PHASE_JITTER_MIN = 16,    /* But at least this much either way (mS) */
+};
+
+uint32_t phase_seed(uint32_t id0, uint32_t id1,
+                    const uint8_t * random, uint8_t count);
+uint32_t phase_next(uint32_t * state);
+uint16_t phase_jitter(uint32_t * state, uint16_t interval);
+uint16_t phase_backoff(uint32_t * state, uint16_t max);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stddef.h>
+#include "power.h"
+#include "timer.h"
+#include "hw.h"
+#include "battery.h"
+
+/*
+ * Power modes.
+ *
+ * Everything that decides how much current we draw, set in one place per
+ * mode, so that no state forgets something. The DC/DC converter only pays
+ * for itself under the radio's load, below that its own quiescent current
+ * is more than it saves. Only RAM0 is linked, so RAM1 never needs power,
+ * and RAM0 is kept through System OFF for the retained section.
+ *
+ * Every change is logged with a timestamp and the time spent in each mode
+ * is added up, which the host energy model (and a debugger) can read back.
+ */
+static const power_config_t power_configs[POWER_MODE_COUNT] =
+{
+  [POWER_MODE_CPU] =
+    { .dcdc = false, .ram_on = POWER_RAM0, .ram_retain = 0,
+      .radio_off = false, .current_ua = 4400 },
+  [POWER_MODE_RADIO_RX] =
+    { .dcdc = true, .ram_on = POWER_RAM0, .ram_retain = 0,
+      .radio_off = false, .current_ua = 9500 },
+  [POWER_MODE_RADIO_TX] =
+    { .dcdc = true, .ram_on = POWER_RAM0, .ram_retain = 0,
+      .radio_off = false, .current_ua = 8000 },
+  [POWER_MODE_LIGHT_SLEEP] =
+    { .dcdc = false, .ram_on = POWER_RAM0, .ram_retain = 0,
+      .radio_off = true, .current_ua = 3 },
+  [POWER_MODE_SYSTEM_OFF] =
+    { .dcdc = false, .ram_on = POWER_RAM0, .ram_retain = POWER_RAM0,
+      .radio_off = true, .current_ua = 1 },
+};
+
+static power_mode_t mode;
+static uint32_t mode_since;
+static uint32_t time_in_mode[POWER_MODE_COUNT];
+
+static power_log_entry_t power_log[POWER_LOG_SIZE];
+static uint8_t log_next;
+static uint8_t log_count;
+
+static void power_apply(power_mode_t new_mode)
+{
+  const power_config_t * config = &power_configs[new_mode];
+
+  /*
+   * The DC/DC converter can't run a supply below 2.1V. Leave it off
+   * unless the cell is well clear of that (and until we've measured it,
+   * battery_mv is 0).
+   */
+  bool dcdc = config->dcdc && battery_mv() >= POWER_DCDC_MIN_MV;
+
+  hw_power_apply(dcdc, config->ram_on, config->ram_retain,
+                 config->radio_off);
+}
+
+void power_init(void)
+{
+  mode = POWER_MODE_CPU;
+  mode_since = timer_now();
+  log_next = 0;
+  log_count = 0;
+
+  for (uint8_t i = 0; i < POWER_MODE_COUNT; i++)
+  {
+    time_in_mode[i] = 0;
+  }
+
+  power_apply(mode);
+}
+
+/*
+ * Set the chip up for a new mode. Call on entering each state.
+ */
+void power_set_mode(power_mode_t new_mode)
+{
+  uint32_t now;
+
+  if (new_mode >= POWER_MODE_COUNT || new_mode == mode)
+  {
+    return;
+  }
+
+  now = timer_now();
+  time_in_mode[mode] += now - mode_since;
+  mode_since = now;
+  mode = new_mode;
+
+  power_log[log_next].at = now;
+  power_log[log_next].mode = new_mode;
+  log_next = (log_next + 1) % POWER_LOG_SIZE;
+  if (log_count < POWER_LOG_SIZE)
+  {
+    log_count++;
+  }
+
+  power_apply(new_mode);
+}
+
+power_mode_t power_mode(void)
+{
+  return mode;
+}
+
+const power_config_t * power_config(power_mode_t which)
+{
+  if (which >= POWER_MODE_COUNT)
+  {
+    return NULL;
+  }
+  return &power_configs[which];
+}
+
+uint8_t power_log_count(void)
+{
+  return log_count;
+}
+
+/* Logged transitions, 0 being the oldest we still have */
+const power_log_entry_t * power_log_entry(uint8_t index)
+{
+  if (index >= log_count)
+  {
+    return NULL;
+  }
+  return &power_log[(log_next + POWER_LOG_SIZE - log_count + index) % POWER_LOG_SIZE];
+}
+
+/* RTC ticks spent in a mode, up to now */
+uint32_t power_time_in_mode(power_mode_t which)
+{
+  uint32_t ticks;
+
+  if (which >= POWER_MODE_COUNT)
+  {
+    return 0;
+  }
+
+  ticks = time_in_mode[which];
+  if (which == mode)
+  {
+    ticks += timer_now() - mode_since;
+  }
+  return ticks;
+}
+
+/* Charge drawn so far according to the typical currents, in nC */
+uint64_t power_charge_nc(void)
+{
+  uint64_t charge = 0;
+
+  for (uint8_t i = 0; i < POWER_MODE_COUNT; i++)
+  {
+    charge += (uint64_t) power_time_in_mode((power_mode_t) i) *
+              power_configs[i].current_ua * 1000 / RTC_FREQUENCY;
+  }
+  return charge;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _power_h
+#define _power_h
+
+typedef enum
+{
+  POWER_MODE_CPU = 0,       /* Awake, radio idle */
+  POWER_MODE_RADIO_RX,      /* Listening */
+  POWER_MODE_RADIO_TX,      /* Sending */
+  POWER_MODE_LIGHT_SLEEP,   /* System ON, waiting on the RTC */
+  POWER_MODE_SYSTEM_OFF,    /* Waiting on the accelerometer to reset us */
+  POWER_MODE_COUNT
+} power_mode_t;
+
+/* RAM blocks, for power_config_t ram_on/ram_retain */
+#define POWER_RAM0 (1 << 0)
+#define POWER_RAM1 (1 << 1)
+
+/* How the chip is set up in each mode */
+typedef struct
+{
+  bool dcdc;                /* DC/DC converter on */
+  uint8_t ram_on;           /* RAM blocks powered while System ON */
+  uint8_t ram_retain;       /* RAM blocks kept through System OFF */
+  bool radio_off;           /* Power the radio down */
+  uint16_t current_ua;      /* Typical supply current, for the energy model */
+} power_config_t;
+
+/* One entry of the transition log */
+typedef struct
+{
+  uint32_t at;              /* When (timer_now ticks) */
+  power_mode_t mode;        /* Mode we went into */
+} power_log_entry_t;
+
+enum
+{
+  POWER_LOG_SIZE = 16,      /* Transitions we remember */
+  POWER_DCDC_MIN_MV = 2300, /* DC/DC needs 2.1V, keep clear of it */
+};
+
+void power_init(void);
+void power_set_mode(power_mode_t mode);
+power_mode_t power_mode(void);
+const power_config_t * power_config(power_mode_t mode);
+uint8_t power_log_count(void);
+const power_log_entry_t * power_log_entry(uint8_t index);
+uint32_t power_time_in_mode(power_mode_t mode);
+uint64_t power_charge_nc(void);
+
+#endif
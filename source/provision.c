@@ -0,0 +1,163 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "provision.h"
+#include "crc.h"
+#include "crypto.h"
+#include "timer.h"
+
+/*
+ * Provisioning a tray of Kis at once.
+ *
+ * The legacy way is one Ki at a time: a Ki that hears a uuid request
+ * sends its uuid back 50 times, and takes the first secrets for it that
+ * come along. With a tray full of Kis, the ones that hear the same
+ * request all answer at the same moment, and nobody is heard.
+ *
+ * Instead the machine runs rounds. A round request says how many slots
+ * follow and how long each one is. A Ki answers once, in the slot its
+ * hw id hashes to with the round's seed. The machine can work the same
+ * hash out from a uuid it already has. It picks a seed that puts the Kis
+ * it knows in slots of their own, so only new Kis can collide. A Ki that
+ * collides lands somewhere else in the next round.
+ *
+ * A Ki answers with its uuid until it has secrets. Then it answers with
+ * a confirm: a checksum of what it read back out of flash, whether that
+ * was what it was sent, and a tag signing both with the secret it was
+ * sent. The next round request has a done bit for every slot whose
+ * confirm matched what the machine sent. A Ki that sees its own bit
+ * reboots, provisioned. If the checksum doesn't match, the machine sends
+ * the secrets again.
+ *
+ * Two Kis can answer in the same slot and the machine still make one of
+ * them out. So it leaves the done bit off if another Ki that might have
+ * its secrets wrong hashes to that slot too, and sets it in a later round.
+ *
+ * Outside rounds, a Ki sends the same confirm a few times just before it
+ * reboots, so the machine needn't wait to find out.
+ *
+ * Once it has heard a round, a Ki stays on the air until PROVISION_STAY_MS
+ * goes by without one. Before the first round, the machine sends a train
+ * of rounds with no slots, one poll interval long, to wake the whole tray.
+ *
+ * Times are timer_now ticks, and all of this is plain logic so it runs
+ * on the host (see the station in test_provision.c).
+ */
+
+void provision_init(provision_state_t * state)
+{
+  memset(state, 0, sizeof(provision_state_t));
+}
+
+/* Is this a round, rather than a legacy uuid request? */
+bool provision_round_valid(const provision_round_packet_t * round)
+{
+  return round->version == PROVISION_VERSION &&
+         round->slots <= PROVISION_SLOTS_MAX &&
+         (!round->slots || round->slot_us >= PROVISION_SLOT_US_MIN);
+}
+
+/* The slot a Ki answers a round in, which the machine can work out too */
+uint8_t provision_slot(const uint32_t * hw_id, uint8_t seed, uint8_t slots)
+{
+  uint32_t words[3] = { hw_id[0], hw_id[1], seed };
+
+  return slots ? crc32(0, words, sizeof(words)) % slots : 0;
+}
+
+/* Did the machine get our confirm in the round before this one? */
+bool provision_confirmed(const provision_state_t * state,
+                         const provision_round_packet_t * round)
+{
+  return state->answered && state->confirming &&
+         state->status == PROVISION_STATUS_GOOD &&
+         (uint8_t) (state->round + 1) == round->round &&
+         (round->done[state->slot / 8] & (1 << (state->slot % 8)));
+}
+
+/*
+ * A round came in. Returns true if we're to answer it, wait_us after
+ * the request.
+ */
+bool provision_heard_round(provision_state_t * state,
+                           const provision_round_packet_t * round,
+                           const uint32_t * hw_id, uint32_t now,
+                           uint32_t * wait_us)
+{
+  state->joined = true;
+  state->heard_at = now;
+  state->answered = round->slots != 0;
+  if (!state->answered)
+  {
+    return false;
+  }
+
+  state->confirming = state->stored;
+  state->round = round->round;
+  state->slot = provision_slot(hw_id, round->seed, round->slots);
+  *wait_us = (uint32_t) state->slot * round->slot_us;
+  return true;
+}
+
+/* Should we keep listening, rather than go to sleep? */
+bool provision_listening(const provision_state_t * state, uint32_t now)
+{
+  return state->joined &&
+         now - state->heard_at < TIMER_MS_TO_TICKS(PROVISION_STAY_MS);
+}
+
+/*
+ * We stored what we were sent, and this is what we read back (NULL if
+ * nothing). The key is the secret we were sent, which the machine knows
+ * whatever ended up in flash.
+ */
+void provision_stored(provision_state_t * state, const uint32_t * hw_id,
+                      const uint8_t * key, const void * sent,
+                      const void * readback, size_t length)
+{
+  state->stored = true;
+  state->status = readback && !memcmp(readback, sent, length) ?
+                  PROVISION_STATUS_GOOD : PROVISION_STATUS_BAD;
+  state->checksum = readback ? crc32(0, readback, length) : 0;
+  provision_tag(hw_id, state->checksum, state->status, key, state->tag);
+}
+
+/* Sign a confirm, for the machine to check we're who we say we are */
+void provision_tag(const uint32_t * hw_id, uint32_t checksum, uint8_t status,
+                   const uint8_t * key, uint8_t * tag)
+{
+  uint8_t block[AES_BLOCK_SIZE] = { 0 };
+  aes_state_t aes;
+
+  memcpy(&block[0], hw_id, 2 * sizeof(uint32_t));
+  memcpy(&block[8], &checksum, sizeof(checksum));
+  block[12] = status;
+
+  crypto_aes_encrypt(key, block, &aes);
+  memcpy(tag, aes.out, PROVISION_TAG_SIZE);
+}
+
+void provision_confirm(const provision_state_t * state, const uint32_t * hw_id,
+                       provision_confirm_packet_t * confirm)
+{
+  memset(confirm, 0, sizeof(provision_confirm_packet_t));
+  confirm->hw_id[0] = hw_id[0];
+  confirm->hw_id[1] = hw_id[1];
+  confirm->round = state->round;
+  confirm->checksum = state->checksum;
+  confirm->status = state->status;
+  memcpy(confirm->tag, state->tag, PROVISION_TAG_SIZE);
+}
+
+/* For the machine: this slot's confirm was good */
+void provision_set_done(provision_round_packet_t * round, uint8_t slot)
+{
+  round->done[slot / 8] |= 1 << (slot % 8);
+}
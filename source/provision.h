@@ -0,0 +1,98 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _provision_h
+#define _provision_h
+
+enum
+{
+  PROVISION_VERSION = 2,        /* In a round request (a legacy uuid request has 0) */
+  PROVISION_SLOTS_MAX = 128,    /* Slots a round can have, one done bit each */
+  PROVISION_SLOT_US_MIN = 400,  /* A reply on air, and the turnaround either side */
+  PROVISION_STAY_MS = 2000,     /* How long we stay on the air after a round */
+  PROVISION_TAG_SIZE = 4,       /* The front of the AES block that signs a confirm */
+};
+
+/* How storing the secrets went */
+typedef enum
+{
+  PROVISION_STATUS_NONE = 0,    /* Nothing stored yet */
+  PROVISION_STATUS_GOOD,        /* Read back just what we were sent */
+  PROVISION_STATUS_BAD,         /* Read back something else, or nothing */
+} provision_status_t;
+
+/*
+ * A round from the manufacturing machine, on the uuid request pipe. It
+ * starts the way a uuid request does.
+ */
+typedef struct __attribute__((__packed__))
+{
+  uint8_t sensor_id[4];                   /* As in a uuid request */
+  uint8_t version;                        /* PROVISION_VERSION */
+  uint8_t round;                          /* Counts up one a round */
+  uint8_t seed;                           /* Shuffles the slots */
+  uint8_t slots;                          /* Slots to answer in, 0 for just stay awake */
+  uint16_t slot_us;                       /* How long each one is */
+  uint8_t done[PROVISION_SLOTS_MAX / 8];  /* Slots of the round before with a good confirm */
+} provision_round_packet_t;
+
+/*
+ * A Ki saying what it read back out of flash after it stored its
+ * secrets, signed with the secret it was sent. The same length as a uuid
+ * packet: the machine listens for both at once.
+ */
+typedef struct __attribute__((__packed__))
+{
+  uint32_t hw_id[2];
+  uint8_t round;                          /* The round it's answering, 0 outside rounds */
+  uint32_t checksum;                      /* crc32 of the stored record */
+  uint8_t status;                         /* provision_status_t */
+  uint8_t tag[PROVISION_TAG_SIZE];        /* provision_tag() */
+  uint8_t reserved[1];
+} provision_confirm_packet_t;
+
+/* Where a Ki is in the rounds */
+typedef struct
+{
+  bool joined;                            /* Heard a round: stay on the air */
+  uint32_t heard_at;                      /* The last one (timer_now) */
+  bool answered;                          /* Did we answer it? */
+  bool confirming;                        /* With a confirm? */
+  uint8_t round;                          /* Which round that was */
+  uint8_t slot;                           /* And in which slot */
+  bool stored;                            /* We've had our secrets */
+  uint8_t status;                         /* provision_status_t: how storing them went */
+  uint32_t checksum;                      /* What we read back */
+  uint8_t tag[PROVISION_TAG_SIZE];        /* Signing the two */
+} provision_state_t;
+
+void provision_init(provision_state_t * state);
+bool provision_round_valid(const provision_round_packet_t * round);
+uint8_t provision_slot(const uint32_t * hw_id, uint8_t seed, uint8_t slots);
+bool provision_confirmed(const provision_state_t * state,
+                         const provision_round_packet_t * round);
+bool provision_heard_round(provision_state_t * state,
+                           const provision_round_packet_t * round,
+                           const uint32_t * hw_id, uint32_t now,
+                           uint32_t * wait_us);
+bool provision_listening(const provision_state_t * state, uint32_t now);
+void provision_stored(provision_state_t * state, const uint32_t * hw_id,
+                      const uint8_t * key, const void * sent,
+                      const void * readback, size_t length);
+void provision_tag(const uint32_t * hw_id, uint32_t checksum, uint8_t status,
+                   const uint8_t * key, uint8_t * tag);
+void provision_confirm(const provision_state_t * state, const uint32_t * hw_id,
+                       provision_confirm_packet_t * confirm);
+void provision_set_done(provision_round_packet_t * round, uint8_t slot);
+
+#endif
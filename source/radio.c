@@ -16,6 +16,8 @@
 #include "string.h"
 #include "nrf_nvmc.h"
 #include "hw.h"
+#include "sched.h"
+#include "power.h"
 
 /* Mock struct so that we can see it when debugging */
 NRF_RADIO_Type *RadioPtr = NRF_RADIO;
@@ -83,6 +85,19 @@ uint32_t radio_convert_bytes(const char * bytes)
   return ret;
 }
 
+/*
+ * Sleep until the radio gets round to an event (a ramp up or down, an
+ * RSSI sample). Its interrupt is only enabled to end the WFE. These
+ * always come, so if one doesn't the radio is stuck and we reboot.
+ */
+static void radio_wait_for(volatile uint32_t * event, uint32_t intmask)
+{
+  RadioPtr->INTENSET = intmask;
+  hw_wait_event_or_reset(event, RADIO_RAMP_TIMEOUT_US);
+  RadioPtr->INTENCLR = intmask;
+  NVIC_ClearPendingIRQ(RADIO_IRQn);
+}
+
 void radio_start_listen(volatile radio_packet_t * data, uint8_t is_manufacturing_mode)
 {
 
@@ -93,6 +108,7 @@ void radio_start_listen(volatile radio_packet_t * data, uint8_t is_manufacturing
   }
 
   /* Set up the radio */
+  power_set_mode(POWER_MODE_RADIO_RX);
   radio_init();
 
   /* Set the pipe to some value that could never happen */
@@ -123,20 +139,27 @@ void radio_start_listen(volatile radio_packet_t * data, uint8_t is_manufacturing
   if (is_manufacturing_mode)
   {
     RadioPtr->PREFIX0 = radio_convert_byte('S') << 24 |  /* 4. Manufacture secrets */
-                        radio_convert_byte('M') << 16;   /* 3. Manufacture uuid? */
-    RadioPtr->RXADDRESSES = 0x0C;
+                        radio_convert_byte('M') << 16 |  /* 3. Manufacture uuid? */
+                        radio_convert_byte('P') << 8;    /* 2. Manufacture params */
+    RadioPtr->RXADDRESSES = 0x0E;
   }
   else
   {
-    RadioPtr->PREFIX0 = radio_convert_byte('R') << 8 |
+    RadioPtr->PREFIX0 = radio_convert_byte('A') << 24 |  /* 3. Challenge ack */
+                        radio_convert_byte('V') << 16 |  /* 2. v2 beacon */
+                        radio_convert_byte('R') << 8 |
                         radio_convert_byte('K');
-    RadioPtr->RXADDRESSES = 0x03;
+    RadioPtr->RXADDRESSES = 0x0F;
   }
 
   /* Set address bases */
   RadioPtr->BASE0 = radio_convert_bytes("KIWI");  /* Beacon pipe */
   RadioPtr->BASE1 = radio_convert_bytes("RNKI");  /* Random pipe */
 
+  /* Measure the signal of every packet, so we can tell near doors from far */
+  RadioPtr->SHORTS = RADIO_SHORTS_ADDRESS_RSSISTART_Msk |
+                     RADIO_SHORTS_DISABLED_RSSISTOP_Msk;
+
   /* Clear the event ready task flag */
   RadioPtr->EVENTS_READY = 0U;
 
@@ -144,7 +167,7 @@ void radio_start_listen(volatile radio_packet_t * data, uint8_t is_manufacturing
   RadioPtr->TASKS_RXEN = 1U;
 
   /* Wait for radio to ramp up */
-  wait_for_val_ne(&RadioPtr->EVENTS_READY);
+  radio_wait_for(&RadioPtr->EVENTS_READY, RADIO_INTENSET_READY_Msk);
 
   _debug_printf("XCVR Turned on in RX mode%s", "");
 }
@@ -159,15 +182,12 @@ uint16_t radio_middle_listen(volatile radio_packet_t * data, uint16_t us_listen_
   /* Clear packet RX'd */
   RadioPtr->EVENTS_END = 0U;   /* clr END (packet received) flag */
 
-  /* Break listen time into LISTEN_QUANTA quanta */
-  uint32_t wait_time = us_listen_duration / LISTEN_QUANTA;
-
-  /* Start Listening */
+  /* Start Listening, asleep until a packet comes in or time is up */
+  RadioPtr->INTENSET = RADIO_INTENSET_END_Msk;
   RadioPtr->TASKS_START = 1U;
-  while (wait_time-- && (RadioPtr->EVENTS_END == 0U))
-  {
-    nrf_delay_us(LISTEN_QUANTA);
-  }
+  uint32_t wait_time = hw_wait_event_us(&RadioPtr->EVENTS_END, us_listen_duration);
+  RadioPtr->INTENCLR = RADIO_INTENCLR_END_Msk;
+  NVIC_ClearPendingIRQ(RADIO_IRQn);
 
   /* If no packet was received the whole duration */
   if (RadioPtr->EVENTS_END == 0U)
@@ -180,16 +200,51 @@ uint16_t radio_middle_listen(volatile radio_packet_t * data, uint16_t us_listen_
    * By here, we know we got a packet
    */
   data->pipe = RadioPtr->RXMATCH;
-  data->rssi = RadioPtr->RSSISAMPLE * -1;
+  data->rssi = (RadioPtr->RSSISAMPLE & RADIO_RSSISAMPLE_RSSISAMPLE_Msk) * -1;
 
   /* Return the amount of time left to listen */
-  return wait_time * LISTEN_QUANTA;
+  return wait_time;
+}
+
+/*
+ * Listen for a packet, but don't wait for it: the radio interrupt posts
+ * SCHED_EVT_RADIO when one comes in (see radio_listen_take). After
+ * radio_start_listen, and again for each packet until radio_end_listen.
+ */
+void radio_listen_arm(volatile radio_packet_t * data)
+{
+  data->pipe = RADIO_PIPE_NONE;
+
+  RadioPtr->EVENTS_END = 0U;
+  RadioPtr->INTENSET = RADIO_INTENSET_END_Msk;
+  NVIC_ClearPendingIRQ(RADIO_IRQn);
+  NVIC_EnableIRQ(RADIO_IRQn);
+  RadioPtr->TASKS_START = 1U;
+}
+
+/* Did radio_listen_arm get a packet? If it did, which pipe and how loud */
+bool radio_listen_take(volatile radio_packet_t * data)
+{
+  if (RadioPtr->EVENTS_END == 0U)
+  {
+    return false;
+  }
+
+  data->pipe = RadioPtr->RXMATCH;
+  data->rssi = (RadioPtr->RSSISAMPLE & RADIO_RSSISAMPLE_RSSISAMPLE_Msk) * -1;
+  return true;
 }
 
 void radio_end_listen(void)
 {
+  /* Back to sleeping on our own events, see radio_wait_for */
+  RadioPtr->INTENCLR = RADIO_INTENCLR_END_Msk;
+  NVIC_DisableIRQ(RADIO_IRQn);
+  NVIC_ClearPendingIRQ(RADIO_IRQn);
+
   /* Stop the radio task */
   radio_shutdown(0);
+  power_set_mode(POWER_MODE_CPU);
 
   _debug_printf("XCVR should shutdown%s", "");
 }
@@ -209,25 +264,16 @@ uint16_t radio_listen(volatile radio_packet_t * data, uint16_t us_listen_duratio
   return result;
 }
 
-/*
- * Transmit a packet
- * * to the specified address
- * * the specified number of times
- * * and wait a certain amount of microseconds between each packet.
- */
-void radio_send_packet(volatile radio_packet_t * data, char * address, uint8_t count, uint8_t us_wait_after)
+/* Set the radio up to send data to address, and ramp it up */
+static void radio_tx_start(volatile radio_packet_t * data, char * address)
 {
-
-  if (!count || !data || !address)
-  {
-    return;
-  }
+  power_set_mode(POWER_MODE_RADIO_TX);
 
   /* Turn off the RADIO Task */
   RadioPtr->TASKS_DISABLE = 1U;
 
   /* Block until the radio is off */
-  wait_for_val_ne(&RadioPtr->EVENTS_DISABLED);
+  radio_wait_for(&RadioPtr->EVENTS_DISABLED, RADIO_INTENSET_DISABLED_Msk);
 
   /* Set the packet source pointer */
   RadioPtr->PACKETPTR = (uint32_t)data->payload;
@@ -266,28 +312,141 @@ void radio_send_packet(volatile radio_packet_t * data, char * address, uint8_t c
   RadioPtr->TASKS_TXEN = 1U;
 
   /* Block until Radio is powered up */
-  wait_for_val_ne(&RadioPtr->EVENTS_READY);
+  radio_wait_for(&RadioPtr->EVENTS_READY, RADIO_INTENSET_READY_Msk);
+}
 
-  while (count--)
-  {
-    /* Clear event flag */
-    RadioPtr->EVENTS_END = 0U;
+/* Send one packet, asleep until it's gone */
+static void radio_tx_one(void)
+{
+  /* Clear event flag */
+  RadioPtr->EVENTS_END = 0U;
+
+  /* Start the task */
+  RadioPtr->TASKS_START = 1U;
+
+  /* Sleep until sent */
+  RadioPtr->INTENSET = RADIO_INTENSET_END_Msk;
+  hw_wait_event_us(&RadioPtr->EVENTS_END, RADIO_TX_TIMEOUT_US);
+  RadioPtr->INTENCLR = RADIO_INTENCLR_END_Msk;
+  NVIC_ClearPendingIRQ(RADIO_IRQn);
+}
+
+/*
+ * Transmit a packet
+ * * to the specified address
+ * * the specified number of times
+ * * and wait a certain amount of microseconds between each packet.
+ */
+void radio_send_packet(volatile radio_packet_t * data, char * address, uint8_t count, uint8_t us_wait_after)
+{
 
-    /* Start the task */
-    RadioPtr->TASKS_START = 1U;
+  if (!count || !data || !address)
+  {
+    return;
+  }
 
-    /* Reset the hold-down timer */
-    uint8_t hold_down_timer = 255;
+  radio_tx_start(data, address);
 
-    /* Block until sent */
-    while (!RadioPtr->EVENTS_END && hold_down_timer--);
+  while (count--)
+  {
+    radio_tx_one();
 
     /* Wait the packet spacing */
-    nrf_delay_us(us_wait_after);
+    hw_wait_us(us_wait_after);
   }
 
   /* Stop Radio Task */
   radio_shutdown(0);
+  power_set_mode(POWER_MODE_CPU);
+}
+
+/*
+ * radio_send_packet, then listen for the ack straight after: the radio
+ * turns itself round from the end of the last packet (END -> DISABLE ->
+ * RXEN), still powered and without radio_init, and we point it at reply
+ * and the ack pipe while it ramps up.
+ *
+ * Returns the uS left of us_listen_duration, counted from the end of the
+ * send, once the radio is listening (0 if the ramp took it all). Carry on
+ * with radio_middle_listen and radio_end_listen.
+ */
+uint16_t radio_send_then_listen(volatile radio_packet_t * data, char * address, uint8_t count, uint8_t us_wait_after,
+                                volatile radio_packet_t * reply, uint16_t us_listen_duration)
+{
+  uint16_t us_left;
+
+  if (!count || !data || !address || !reply)
+  {
+    return 0;
+  }
+
+  radio_tx_start(data, address);
+
+  while (--count)
+  {
+    radio_tx_one();
+    hw_wait_us(us_wait_after);
+  }
+
+  /* The last one: the radio turns round by itself at its END */
+  RadioPtr->SHORTS = RADIO_SHORTS_END_DISABLE_Msk | RADIO_SHORTS_DISABLED_RXEN_Msk;
+  RadioPtr->EVENTS_READY = 0U;
+  radio_tx_one();
+  power_set_mode(POWER_MODE_RADIO_RX);
+
+  /* Set up for the ack while it ramps up */
+  reply->pipe = RADIO_PIPE_NONE;
+  RadioPtr->PACKETPTR = (uint32_t)reply->payload;
+  RadioPtr->PCNF1 =
+            (RADIO_PCNF1_WHITEEN_Disabled << RADIO_PCNF1_WHITEEN_Pos) |
+            (RADIO_PCNF1_ENDIAN_Big << RADIO_PCNF1_ENDIAN_Pos) |
+            ((ADDRESS_LENGTH - 1) << RADIO_PCNF1_BALEN_Pos) |
+            (reply->payloadLength << RADIO_PCNF1_STATLEN_Pos) |
+            (MAX_PACKET_SIZE << RADIO_PCNF1_MAXLEN_Pos);
+  RadioPtr->PREFIX0 = radio_convert_byte('A') << 24;   /* 3. Challenge ack */
+  RadioPtr->BASE1 = radio_convert_bytes("RNKI");
+  RadioPtr->RXADDRESSES = 1 << RADIO_PIPE_ACK;
+  RadioPtr->SHORTS = RADIO_SHORTS_ADDRESS_RSSISTART_Msk |
+                     RADIO_SHORTS_DISABLED_RSSISTOP_Msk;
+
+  /* The ramp comes out of the window */
+  RadioPtr->INTENSET = RADIO_INTENSET_READY_Msk;
+  us_left = hw_wait_event_us(&RadioPtr->EVENTS_READY, us_listen_duration);
+  RadioPtr->INTENCLR = RADIO_INTENCLR_READY_Msk;
+  NVIC_ClearPendingIRQ(RADIO_IRQn);
+
+  _debug_printf("XCVR turned round to RX%s", "");
+
+  return us_left;
+}
+
+/*
+ * How loud our channel is right now, in -dBm (so bigger is quieter).
+ * Leaves the radio disabled, ready to send.
+ */
+uint8_t radio_sample_rssi(void)
+{
+  uint8_t rssi;
+
+  power_set_mode(POWER_MODE_RADIO_RX);
+
+  /* Receive, without looking for any packet */
+  radio_shutdown(0);
+  RadioPtr->EVENTS_READY = 0U;
+  RadioPtr->TASKS_RXEN = 1U;
+  radio_wait_for(&RadioPtr->EVENTS_READY, RADIO_INTENSET_READY_Msk);
+
+  /* One sample takes a few uS */
+  RadioPtr->EVENTS_RSSIEND = 0U;
+  RadioPtr->TASKS_RSSISTART = 1U;
+  radio_wait_for(&RadioPtr->EVENTS_RSSIEND, RADIO_INTENSET_RSSIEND_Msk);
+  rssi = RadioPtr->RSSISAMPLE & RADIO_RSSISAMPLE_RSSISAMPLE_Msk;
+  RadioPtr->TASKS_RSSISTOP = 1U;
+
+  radio_shutdown(0);
+  power_set_mode(POWER_MODE_CPU);
+
+  return rssi;
 }
 
 void radio_shutdown(uint8_t power_off)
@@ -299,7 +458,7 @@ void radio_shutdown(uint8_t power_off)
   RadioPtr->TASKS_DISABLE = 1U;
 
   /* Block until the radio is off */
-  wait_for_val_ne(&RadioPtr->EVENTS_DISABLED);
+  radio_wait_for(&RadioPtr->EVENTS_DISABLED, RADIO_INTENSET_DISABLED_Msk);
 
   if (power_off)
   {
@@ -308,7 +467,11 @@ void radio_shutdown(uint8_t power_off)
   }
 }
 
+/* Only radio_listen_arm enables this: a packet came in */
 void RADIO_IRQHandler(void)
 {
+  RadioPtr->INTENCLR = RADIO_INTENCLR_END_Msk;
   NVIC_ClearPendingIRQ(RADIO_IRQn);
+
+  sched_post(SCHED_EVT_RADIO);
 }
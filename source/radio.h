@@ -8,6 +8,7 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #ifndef _radio_h
 #define _radio_h
@@ -55,20 +56,29 @@ typedef struct
 enum {
   RADIO_PIPE_KIWI = 0,
   RADIO_PIPE_RAND = 1,
+  RADIO_PIPE_MM_PARAMS = 1, /* Manufacturing mode only */
+  RADIO_PIPE_KIWI_V2 = 2,   /* Not in manufacturing mode */
   RADIO_PIPE_MM_UUID_REQ = 2,
   RADIO_PIPE_MM_SECRETS = 3,
+  RADIO_PIPE_ACK = 3,       /* Not in manufacturing mode */
   RADIO_PIPE_NONE = 127,
 };
 
-#define LISTEN_QUANTA 100
+#define RADIO_TX_TIMEOUT_US 500 /* Longest we wait for a packet to go out */
+#define RADIO_RAMP_TIMEOUT_US 300 /* Longest ramp up or down before we give up */
 
 void radio_init(void);
 void radio_send_packet(volatile radio_packet_t * data, char * address, uint8_t count, uint8_t us_wait_after);
+uint16_t radio_send_then_listen(volatile radio_packet_t * data, char * address, uint8_t count, uint8_t us_wait_after,
+                                volatile radio_packet_t * reply, uint16_t us_listen_duration);
 void radio_end_listen(void);
 void radio_start_listen(volatile radio_packet_t * data, uint8_t is_manufacturing_mode);
 uint16_t radio_middle_listen(volatile radio_packet_t * data, uint16_t us_listen_duration);
+void radio_listen_arm(volatile radio_packet_t * data);
+bool radio_listen_take(volatile radio_packet_t * data);
 uint16_t radio_listen(volatile radio_packet_t * data, uint16_t us_listen_duration, uint8_t is_manufacturing);
 void radio_shutdown(uint8_t power_off);
+uint8_t radio_sample_rssi(void);
 
 /* These are exposed for testing only. Don't use them */
 uint8_t radio_convert_byte(const char byte);
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "retained.h"
+#include "crc.h"
+
+/*
+ * A little RAM that lives through System OFF.
+ *
+ * The linker puts .retained in RAM0 outside .data and .bss, so the startup
+ * code leaves it alone, and the System OFF power mode keeps RAM0 powered.
+ * After a power-on reset it holds garbage, which the magic and the CRC
+ * catch.
+ */
+retained_block_t retained_block __attribute__((section(".retained")));
+
+static uint32_t retained_crc(void)
+{
+  uint32_t crc = crc32(0, &retained_block.length,
+                       sizeof(retained_block.length));
+  return crc32(crc, retained_block.data, retained_block.length);
+}
+
+/* Keep some data for after the next System OFF */
+bool retained_save(const void * data, uint16_t length)
+{
+  if (length > RETAINED_SIZE)
+  {
+    return false;
+  }
+
+  memcpy(retained_block.data, data, length);
+  retained_block.length = length;
+  retained_block.reserved = 0;
+  retained_block.crc = retained_crc();
+  retained_block.magic = RETAINED_MAGIC;
+  return true;
+}
+
+/*
+ * Get back what was saved. Fails if nothing was, or it's not intact, or
+ * it was saved as something of a different size (an older firmware).
+ */
+bool retained_load(void * data, uint16_t length)
+{
+  if (length > RETAINED_SIZE ||
+      retained_block.magic != RETAINED_MAGIC ||
+      retained_block.length != length ||
+      retained_block.crc != retained_crc())
+  {
+    return false;
+  }
+
+  memcpy(data, retained_block.data, length);
+  return true;
+}
+
+/* Forget it, so that it's only ever used once */
+void retained_invalidate(void)
+{
+  retained_block.magic = 0;
+}
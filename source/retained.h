@@ -0,0 +1,36 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _retained_h
+#define _retained_h
+
+enum
+{
+  RETAINED_MAGIC = 0x4B495749,  /* "KIWI" */
+  RETAINED_SIZE = 64,           /* Bytes of payload we can keep */
+};
+
+/* What sits in the retained section */
+typedef struct
+{
+  uint32_t magic;               /* RETAINED_MAGIC if anything was saved */
+  uint16_t length;              /* Bytes of data saved */
+  uint16_t reserved;
+  uint32_t crc;                 /* Of length and data */
+  uint8_t data[RETAINED_SIZE];
+} retained_block_t;
+
+bool retained_save(const void * data, uint16_t length);
+bool retained_load(void * data, uint16_t length);
+void retained_invalidate(void);
+
+#endif
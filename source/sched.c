@@ -0,0 +1,133 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include "sched.h"
+#include "hw.h"
+
+/* Who to call for each event */
+static struct
+{
+  sched_handler_t handler;
+  void * ctx;
+} handlers[SCHED_EVT_COUNT];
+
+/* Events waiting to be handled, oldest first */
+static volatile uint8_t queue[SCHED_QUEUE_SIZE];
+static volatile uint8_t queue_head;
+static volatile uint8_t queue_tail;
+
+/* One bit per event that's in the queue, so we never queue one twice */
+static volatile uint32_t queue_pending;
+
+void sched_init(void)
+{
+  uint32_t mask = hw_critical_enter();
+
+  queue_head = 0;
+  queue_tail = 0;
+  queue_pending = 0;
+
+  hw_critical_exit(mask);
+
+  for (uint8_t i = 0; i < SCHED_EVT_COUNT; i++)
+  {
+    handlers[i].handler = NULL;
+    handlers[i].ctx = NULL;
+  }
+}
+
+void sched_register(sched_event_t event, sched_handler_t handler, void * ctx)
+{
+  if (event >= SCHED_EVT_COUNT)
+  {
+    return;
+  }
+
+  handlers[event].handler = handler;
+  handlers[event].ctx = ctx;
+}
+
+/*
+ * Queue an event. Safe to call from interrupt handlers.
+ *
+ * Returns false if the event was already waiting (the two are merged).
+ */
+bool sched_post(sched_event_t event)
+{
+  bool queued = false;
+  uint32_t mask;
+
+  if (event >= SCHED_EVT_COUNT)
+  {
+    return false;
+  }
+
+  mask = hw_critical_enter();
+
+  if (!(queue_pending & (1UL << event)))
+  {
+    queue_pending |= (1UL << event);
+    queue[queue_tail] = (uint8_t) event;
+    queue_tail = (queue_tail + 1) % SCHED_QUEUE_SIZE;
+    queued = true;
+  }
+
+  hw_critical_exit(mask);
+
+  /* Make sure a WFE in the main loop doesn't miss us */
+  SEV();
+
+  return queued;
+}
+
+/*
+ * Run the handler for the oldest waiting event.
+ *
+ * Returns false if there was nothing to do.
+ */
+bool sched_dispatch(void)
+{
+  sched_event_t event;
+  uint32_t mask;
+
+  mask = hw_critical_enter();
+
+  if (queue_head == queue_tail)
+  {
+    hw_critical_exit(mask);
+    return false;
+  }
+
+  event = (sched_event_t) queue[queue_head];
+  queue_head = (queue_head + 1) % SCHED_QUEUE_SIZE;
+
+  /* Clear before running it, so the handler can post itself again */
+  queue_pending &= ~(1UL << event);
+
+  hw_critical_exit(mask);
+
+  if (handlers[event].handler)
+  {
+    handlers[event].handler(event, handlers[event].ctx);
+  }
+
+  return true;
+}
+
+/*
+ * One pass of the main loop: handle an event, or sleep until there is one.
+ */
+void sched_run(void)
+{
+  if (!sched_dispatch())
+  {
+    /* Nothing to do. Interrupts will post something and wake us up */
+    WFE();
+  }
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _sched_h
+#define _sched_h
+
+/*
+ * Things that can happen. Interrupt handlers post these, and the handler
+ * registered for each one runs later from the main loop, to completion.
+ */
+typedef enum
+{
+  SCHED_EVT_STEP = 0,     /* Run the next step of the FSM */
+  SCHED_EVT_RTC,          /* RTC1 compare (alarm clock) */
+  SCHED_EVT_GPIOTE,       /* Accelerometer pin sense */
+  SCHED_EVT_RADIO,        /* Radio interrupt */
+  SCHED_EVT_CAL_TIMEOUT,  /* LFCLK calibration timer */
+  SCHED_EVT_CAL_DONE,     /* LFCLK calibration finished */
+  SCHED_EVT_COUNT
+} sched_event_t;
+
+enum
+{
+  /*
+   * Each event is queued at most once, so this only needs to hold them all
+   * (plus the slot the ring always leaves empty)
+   */
+  SCHED_QUEUE_SIZE = SCHED_EVT_COUNT + 1,
+};
+
+typedef void (*sched_handler_t)(sched_event_t event, void * ctx);
+
+void sched_init(void);
+void sched_register(sched_event_t event, sched_handler_t handler, void * ctx);
+bool sched_post(sched_event_t event);
+bool sched_dispatch(void);
+void sched_run(void);
+
+#endif
@@ -0,0 +1,408 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "session.h"
+#include "timer.h"
+
+/*
+ * The doors in range.
+ *
+ * In a corridor we can hear several sensors, and the first beacon in a
+ * listen isn't necessarily from the door we're standing at. Each beacon
+ * updates its door's entry here, and the FSM asks which one to answer:
+ * the strongest door we've heard lately, unless it's been let down a few
+ * times already. Once a door has been challenged it is left alone until
+ * the next wake, so the others get their turn in the meantime.
+ *
+ * It doubles as our memory of the neighbourhood: how often and how
+ * strongly we've heard each door, and when we last got a challenge to
+ * it, which the FSM polls by.
+ *
+ * Having got a challenge to a door, and an ack back for it, we hold off
+ * from it for a while: standing in front of a door we've opened, another
+ * handshake every poll is all cost and no use. Without an ack we can't
+ * tell the door opened, so a lost challenge mustn't lock the user out:
+ * the door is only left be for the rest of that wake, never past the
+ * next poll. The hold-off ends early if the door's signal drops well
+ * below where it was (we walked off, and may be back), if it goes out of
+ * range, or if the user double taps.
+ *
+ * Doors that never ack their challenges (older sensors) are remembered
+ * in a short list of their own, so a door being pushed out of the table
+ * or a System OFF doesn't cost us finding out all over again.
+ *
+ * The table is open addressed with linear probing on the sensor id, so
+ * the beacon path finds its door in a probe or two. When it's full the
+ * door heard longest ago makes room.
+ *
+ * Times are timer_now ticks. The hold-off is turned into ticks once, by
+ * session_set_holdoff, so the beacon path never converts.
+ */
+
+void session_init(session_table_t * table)
+{
+  memset(table, 0, sizeof(session_table_t));
+}
+
+void session_set_holdoff(session_table_t * table, uint32_t ms)
+{
+  table->holdoff = TIMER_MS_TO_TICKS(ms);
+}
+
+/* Is this door still worth considering? */
+static bool session_fresh(session_t * session, uint32_t now)
+{
+  return session->state != SESSION_FREE &&
+         now - session->seen_at <= TIMER_MS_TO_TICKS(SESSION_FRESH_TIME);
+}
+
+/* Has this door only just acked a challenge? Then leave it be */
+bool session_held_off(session_table_t * table, session_t * session,
+                      uint32_t now)
+{
+  return table->holdoff && session->challenged && session->acked &&
+         !session->left && now - session->challenged_at < table->holdoff;
+}
+
+/* Is this door one to talk to? */
+static bool session_open(session_table_t * table, session_t * session,
+                         uint32_t now)
+{
+  return session_fresh(session, now) && session->state != SESSION_DONE &&
+         !session_held_off(table, session, now);
+}
+
+/* Where a door's probe sequence starts */
+static uint8_t session_slot(const uint8_t * sensor_id)
+{
+  uint32_t h = (uint32_t) sensor_id[0] | (uint32_t) sensor_id[1] << 8 |
+               (uint32_t) sensor_id[2] << 16 | (uint32_t) sensor_id[3] << 24;
+
+  /* Sensor ids are handed out in runs, so mix the bits about first */
+  h ^= h >> 16;
+  h *= 0x45D9F3B;
+  h ^= h >> 16;
+
+  return h & (SESSION_MAX - 1);
+}
+
+static uint8_t session_probe(uint8_t slot)
+{
+  return (slot + 1) & (SESSION_MAX - 1);
+}
+
+session_t * session_find(session_table_t * table, const uint8_t * sensor_id)
+{
+  uint8_t slot = session_slot(sensor_id);
+
+  for (uint8_t i = 0; i < SESSION_MAX; i++, slot = session_probe(slot))
+  {
+    session_t * session = &table->sessions[slot];
+
+    if (session->state == SESSION_FREE)
+    {
+      return NULL;
+    }
+    if (!memcmp(session->sensor_id, sensor_id, SESSION_ID_SIZE))
+    {
+      return session;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Take a door out, moving any door after it in the same run back into
+ * the gap, so nothing gets cut off from its home slot.
+ */
+static void session_remove(session_table_t * table, session_t * session)
+{
+  uint8_t gap = session - table->sessions;
+  uint8_t slot = gap;
+
+  memset(session, 0, sizeof(session_t));
+  table->count--;
+
+  for (;;)
+  {
+    slot = session_probe(slot);
+    session_t * next = &table->sessions[slot];
+
+    if (next->state == SESSION_FREE)
+    {
+      break;
+    }
+
+    /* Can it live in the gap? Only if its home isn't between the two */
+    uint8_t home = session_slot(next->sensor_id);
+    if (((slot - home) & (SESSION_MAX - 1)) >= ((slot - gap) & (SESSION_MAX - 1)))
+    {
+      table->sessions[gap] = *next;
+      memset(next, 0, sizeof(session_t));
+      gap = slot;
+    }
+  }
+}
+
+/* The door we heard from longest ago (its combikey is the cheapest to lose) */
+static session_t * session_oldest(session_table_t * table, uint32_t now)
+{
+  session_t * oldest = &table->sessions[0];
+
+  for (uint8_t i = 1; i < SESSION_MAX; i++)
+  {
+    session_t * session = &table->sessions[i];
+
+    if (now - session->seen_at > now - oldest->seen_at)
+    {
+      oldest = session;
+    }
+  }
+
+  return oldest;
+}
+
+/* Make room for a door we haven't seen */
+static session_t * session_insert(session_table_t * table,
+                                  const uint8_t * sensor_id, uint32_t now)
+{
+  uint8_t slot = session_slot(sensor_id);
+
+  if (table->count >= SESSION_MAX)
+  {
+    session_remove(table, session_oldest(table, now));
+  }
+
+  while (table->sessions[slot].state != SESSION_FREE)
+  {
+    slot = session_probe(slot);
+  }
+
+  session_t * session = &table->sessions[slot];
+  memset(session, 0, sizeof(session_t));
+  memcpy(session->sensor_id, sensor_id, SESSION_ID_SIZE);
+  session->state = SESSION_SEEN;
+  table->count++;
+
+  return session;
+}
+
+/* We heard a beacon from this door */
+session_t * session_seen(session_table_t * table, const uint8_t * sensor_id,
+                         uint8_t rssi, uint32_t now)
+{
+  session_t * session = session_find(table, sensor_id);
+
+  if (!session)
+  {
+    session = session_insert(table, sensor_id, now);
+    session->rssi = rssi;
+  }
+  else if (!session_fresh(session, now))
+  {
+    /* Been a while, what we knew about the signal is no good */
+    session->rssi = rssi;
+    session->beacons = 0;
+    session->left = true;
+  }
+  else
+  {
+    session->rssi = session->rssi -
+      (((int16_t) session->rssi - rssi) >> SESSION_RSSI_SHIFT);
+  }
+
+  /* Walked off since we challenged it? Whenever we're back, it's fair game */
+  if (session->challenged &&
+      session->rssi >= (uint16_t) session->challenged_rssi + SESSION_LEFT_RSSI)
+  {
+    session->left = true;
+  }
+
+  if (session->beacons < UINT16_MAX)
+  {
+    session->beacons++;
+  }
+  session->seen_at = now;
+
+  return session;
+}
+
+/* We got a challenge out to this door (and it said so, if acked) */
+void session_challenged(session_t * session, uint32_t now, bool acked)
+{
+  session->state = SESSION_DONE;
+  session->challenged = true;
+  session->acked = acked;
+  session->challenged_at = now;
+  session->challenged_rssi = session->rssi;
+  session->left = false;
+}
+
+/*
+ * We got nowhere with this door (it never acked): leave it for the rest of
+ * this wake, but don't hold off from it after
+ */
+void session_tried(session_t * session)
+{
+  session->state = SESSION_DONE;
+}
+
+/* Do we know this door doesn't ack? */
+bool session_no_ack(session_table_t * table, const uint8_t * sensor_id)
+{
+  for (uint8_t i = 0; i < table->no_ack.count; i++)
+  {
+    if (!memcmp(table->no_ack.sensor_ids[i], sensor_id, SESSION_ID_SIZE))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Note that a door doesn't ack */
+void session_set_no_ack(session_table_t * table, const uint8_t * sensor_id)
+{
+  session_no_ack_t * list = &table->no_ack;
+  uint8_t i;
+
+  if (session_no_ack(table, sensor_id))
+  {
+    return;
+  }
+
+  /* Full: the one that's been there longest makes room */
+  if (list->count < SESSION_NO_ACK_MAX)
+  {
+    i = list->count++;
+  }
+  else
+  {
+    i = list->next;
+    list->next = (list->next + 1) % SESSION_NO_ACK_MAX;
+  }
+  memcpy(list->sensor_ids[i], sensor_id, SESSION_ID_SIZE);
+}
+
+/* The user wants something (a double tap): no more holding off */
+void session_release(session_table_t * table)
+{
+  for (uint8_t i = 0; i < SESSION_MAX; i++)
+  {
+    table->sessions[i].left = true;
+  }
+}
+
+/*
+ * Is there a door about that we haven't got a challenge to lately? Then
+ * it's worth coming back soon rather than on the usual poll.
+ */
+bool session_waiting(session_table_t * table, uint32_t now)
+{
+  for (uint8_t i = 0; i < SESSION_MAX; i++)
+  {
+    session_t * session = &table->sessions[i];
+
+    if (session_fresh(session, now) &&
+        !session_held_off(table, session, now) &&
+        (!session->challenged ||
+         now - session->challenged_at > TIMER_MS_TO_TICKS(SESSION_FRESH_TIME)))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* The closest door we haven't challenged yet this wake */
+session_t * session_best(session_table_t * table, uint32_t now)
+{
+  session_t * best = NULL;
+
+  for (uint8_t i = 0; i < SESSION_MAX; i++)
+  {
+    session_t * session = &table->sessions[i];
+
+    if (!session_open(table, session, now))
+    {
+      continue;
+    }
+    if (!best || session->rssi < best->rssi)
+    {
+      best = session;
+    }
+  }
+
+  return best;
+}
+
+/*
+ * We've just heard this door's beacon: do we answer it, or let it go by
+ * and keep listening for a door that's clearly closer?
+ *
+ * A door isn't let go more than SESSION_MAX_DEFERRALS times in a wake, in
+ * case the closer one isn't interested in us.
+ */
+bool session_should_answer(session_table_t * table, session_t * session,
+                           uint32_t now)
+{
+  session_t * best;
+
+  if (!session_open(table, session, now))
+  {
+    return false;
+  }
+
+  best = session_best(table, now);
+  if (best == session ||
+      (uint16_t) best->rssi + SESSION_RSSI_MARGIN > session->rssi ||
+      session->deferrals >= SESSION_MAX_DEFERRALS)
+  {
+    session->deferrals = 0;
+    return true;
+  }
+
+  session->deferrals++;
+  return false;
+}
+
+/* How many doors are still waiting for us this wake */
+uint8_t session_pending(session_table_t * table, uint32_t now)
+{
+  uint8_t count = 0;
+
+  for (uint8_t i = 0; i < SESSION_MAX; i++)
+  {
+    session_t * session = &table->sessions[i];
+
+    if (session_open(table, session, now))
+    {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/* Asleep and awake again: every door is fair game */
+void session_new_wake(session_table_t * table)
+{
+  for (uint8_t i = 0; i < SESSION_MAX; i++)
+  {
+    if (table->sessions[i].state != SESSION_FREE)
+    {
+      table->sessions[i].state = SESSION_SEEN;
+      table->sessions[i].deferrals = 0;
+    }
+  }
+}
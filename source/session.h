@@ -0,0 +1,95 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _session_h
+#define _session_h
+
+enum
+{
+  SESSION_MAX = 8,              /* Doors we keep track of at once (a power of 2) */
+  SESSION_ID_SIZE = 4,          /* SIZE_SENSOR_ID */
+  SESSION_KEY_SIZE = 16,        /* AES_BLOCK_SIZE */
+  SESSION_FRESH_TIME = 2000,    /* mS a door stays a candidate after its beacon */
+  SESSION_RSSI_SHIFT = 1,       /* Smoothing: each beacon moves RSSI halfway */
+  SESSION_RSSI_MARGIN = 4,      /* dB a door must be stronger by to wait for it */
+  SESSION_MAX_DEFERRALS = 2,    /* Beacons we let go by waiting for a stronger door */
+  SESSION_LEFT_RSSI = 10,       /* dB weaker than at the challenge: we walked off */
+  SESSION_NO_ACK_MAX = 4,       /* Doors we remember don't ack */
+};
+
+typedef enum
+{
+  SESSION_FREE = 0,             /* Unused slot */
+  SESSION_SEEN,                 /* Heard a beacon, nothing sent yet */
+  SESSION_RAND_SENT,            /* Sent our random, waiting for theirs */
+  SESSION_DONE,                 /* Challenged this wake, leave it be */
+} session_state_t;
+
+/* One door in range */
+typedef struct
+{
+  uint8_t sensor_id[SESSION_ID_SIZE];
+  uint8_t state;                          /* session_state_t */
+  uint8_t rssi;                           /* Smoothed, in -dBm (smaller is closer) */
+  uint8_t deferrals;                      /* Beacons let go for a stronger door */
+  bool has_key;                           /* Is combikey worked out? */
+  bool challenged;                        /* Have we ever got a challenge out? */
+  bool acked;                             /* And did the door say it got it? */
+  bool left;                              /* Gone away since, the hold-off is off */
+  uint8_t challenged_rssi;                /* rssi when we did */
+  uint8_t ack_misses;                     /* Challenges in a row it didn't ack */
+  uint16_t beacons;                       /* Beacons heard since it came in range */
+  uint8_t combikey[SESSION_KEY_SIZE];     /* Challenge key for this door */
+  uint32_t seen_at;                       /* Last beacon (timer_now) */
+  uint32_t challenged_at;                 /* Last challenge sent (timer_now) */
+} session_t;
+
+/*
+ * Doors that don't ack their challenges. Kept apart from the sessions, and
+ * small, so it survives evictions and goes through a System OFF warm.
+ */
+typedef struct
+{
+  uint8_t sensor_ids[SESSION_NO_ACK_MAX][SESSION_ID_SIZE];
+  uint8_t count;                          /* Entries in use */
+  uint8_t next;                           /* Which one goes when it's full */
+} session_no_ack_t;
+
+/* Open addressed on the sensor id, so a beacon finds its door straight off */
+typedef struct
+{
+  session_t sessions[SESSION_MAX];
+  uint8_t count;                          /* Slots in use */
+  uint32_t holdoff;                       /* Ticks a challenged door is left be, 0 for never */
+  session_no_ack_t no_ack;                /* Doors that don't ack */
+} session_table_t;
+
+void session_init(session_table_t * table);
+session_t * session_find(session_table_t * table, const uint8_t * sensor_id);
+session_t * session_seen(session_table_t * table, const uint8_t * sensor_id,
+                         uint8_t rssi, uint32_t now);
+session_t * session_best(session_table_t * table, uint32_t now);
+void session_set_holdoff(session_table_t * table, uint32_t ms);
+void session_challenged(session_t * session, uint32_t now, bool acked);
+void session_tried(session_t * session);
+bool session_no_ack(session_table_t * table, const uint8_t * sensor_id);
+void session_set_no_ack(session_table_t * table, const uint8_t * sensor_id);
+bool session_held_off(session_table_t * table, session_t * session,
+                      uint32_t now);
+void session_release(session_table_t * table);
+bool session_waiting(session_table_t * table, uint32_t now);
+bool session_should_answer(session_table_t * table, session_t * session,
+                           uint32_t now);
+uint8_t session_pending(session_table_t * table, uint32_t now);
+void session_new_wake(session_table_t * table);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stddef.h>
+#include "timer.h"
+#include "sched.h"
+#include "hw.h"
+
+/*
+ * Software timers on top of the free running RTC1.
+ *
+ * The counter is never cleared: time is always "now minus then", so it
+ * can't be lost between one deadline and the next. Running timers are
+ * kept in deadline order, and only the first one is given to the RTC as
+ * a compare. The RTC interrupt (compare or overflow) posts an event, and
+ * timer_process runs whatever is due from the main loop.
+ */
+
+/* Running timers, soonest first */
+static soft_timer_t * timers;
+
+/* The last time we looked, with the overflows we've counted on top */
+static uint64_t last_now;
+
+/* Has a before b? Works across the wrap */
+static bool timer_due(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) <= 0;
+}
+
+static void timer_handle_event(sched_event_t event, void * ctx)
+{
+  timer_process();
+}
+
+/* Give the RTC the next deadline (or nothing) */
+static void timer_program(uint32_t now)
+{
+  uint32_t ticks;
+
+  if (!timers)
+  {
+    hw_rtc_cancel_alarm();
+    return;
+  }
+
+  ticks = timers->deadline - now;
+  if (timer_due(timers->deadline, now + TIMER_MIN_TICKS))
+  {
+    /* The RTC might miss it, don't wait for it */
+    hw_rtc_cancel_alarm();
+    sched_post(SCHED_EVT_RTC);
+    return;
+  }
+  else if (ticks > TIMER_MAX_TICKS)
+  {
+    /* Too far to set in one go, we'll come back halfway */
+    ticks = TIMER_MAX_TICKS;
+  }
+
+  hw_rtc_set_alarm((now + ticks) & TIMER_COUNTER_MASK);
+}
+
+void timer_init(void)
+{
+  timers = NULL;
+  last_now = hw_rtc_counter() & TIMER_COUNTER_MASK;
+
+  sched_register(SCHED_EVT_RTC, timer_handle_event, NULL);
+}
+
+/*
+ * Monotonic time since boot, in RTC ticks: the RTC counter stretched to
+ * 64 bits, so it never wraps.
+ *
+ * We notice the 24 bit counter wrapping by it going backwards, so this
+ * has to be called at least once per wrap (512 seconds). The overflow
+ * interrupt makes sure of that.
+ */
+uint64_t timer_now64(void)
+{
+  uint32_t mask = hw_critical_enter();
+  uint32_t counter = hw_rtc_counter() & TIMER_COUNTER_MASK;
+  uint64_t now = (last_now & ~(uint64_t) TIMER_COUNTER_MASK) | counter;
+
+  if (counter < (last_now & TIMER_COUNTER_MASK))
+  {
+    now += (uint64_t) TIMER_COUNTER_MASK + 1;
+  }
+  last_now = now;
+
+  hw_critical_exit(mask);
+  return now;
+}
+
+/*
+ * The same, cut down to 32 bits. Wraps after a day and a half, so only
+ * good for differences (which is all the timers need).
+ */
+uint32_t timer_now(void)
+{
+  return (uint32_t) timer_now64();
+}
+
+/* Ticks since a timer_now timestamp */
+uint32_t timer_elapsed(uint32_t since)
+{
+  return timer_now() - since;
+}
+
+/* Microseconds since a timer_now64 timestamp */
+uint64_t timer_elapsed_us(uint64_t since)
+{
+  return TIMER_TICKS_TO_US(timer_now64() - since);
+}
+
+void timer_start(soft_timer_t * timer, uint32_t ticks,
+                 timer_callback_t callback, void * ctx)
+{
+  soft_timer_t ** link;
+  uint32_t now;
+
+  /* Restarting a timer moves it */
+  timer_stop(timer);
+
+  now = timer_now();
+  timer->deadline = now + ticks;
+  timer->callback = callback;
+  timer->ctx = ctx;
+  timer->running = true;
+
+  /* Keep the list in deadline order (after any others due at the same time) */
+  link = &timers;
+  while (*link && timer_due((*link)->deadline, timer->deadline))
+  {
+    link = &(*link)->next;
+  }
+  timer->next = *link;
+  *link = timer;
+
+  if (timers == timer)
+  {
+    timer_program(now);
+  }
+}
+
+void timer_stop(soft_timer_t * timer)
+{
+  soft_timer_t ** link;
+
+  if (!timer->running)
+  {
+    return;
+  }
+
+  for (link = &timers; *link; link = &(*link)->next)
+  {
+    if (*link == timer)
+    {
+      *link = timer->next;
+      break;
+    }
+  }
+
+  timer->running = false;
+  timer->next = NULL;
+
+  timer_program(timer_now());
+}
+
+bool timer_running(soft_timer_t * timer)
+{
+  return timer->running;
+}
+
+/* Fire everything that's due, and set the alarm for what's left */
+void timer_process(void)
+{
+  soft_timer_t * timer;
+  uint32_t now = timer_now();
+
+  while (timers && timer_due(timers->deadline, now + TIMER_MIN_TICKS))
+  {
+    timer = timers;
+    timers = timer->next;
+    timer->running = false;
+    timer->next = NULL;
+
+    /* This may start timers again, so check the time afresh */
+    timer->callback(timer->ctx);
+    now = timer_now();
+  }
+
+  timer_program(now);
+}
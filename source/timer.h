@@ -0,0 +1,70 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hw.h"
+
+#ifndef _timer_h
+#define _timer_h
+
+enum
+{
+  /* RTC1 COUNTER is 24 bits wide */
+  TIMER_COUNTER_MASK = 0x00FFFFFF,
+
+  /*
+   * A compare this close to COUNTER might not fire (nRF51 RTC needs N+2),
+   * so we treat it as already expired.
+   */
+  TIMER_MIN_TICKS = 2,
+
+  /* Never program a compare further out than this, so it can't look expired */
+  TIMER_MAX_TICKS = TIMER_COUNTER_MASK / 2,
+};
+
+/* Converting between ticks and the units the rest of us think in (rounded) */
+#define TIMER_MS_TO_TICKS(ms) \
+  ((uint32_t)(((uint64_t)(ms) * RTC_FREQUENCY + 500) / 1000))
+#define TIMER_TICKS_TO_MS(ticks) \
+  ((uint32_t)(((uint64_t)(ticks) * 1000 + RTC_FREQUENCY / 2) / RTC_FREQUENCY))
+#define TIMER_TICKS_TO_US(ticks) \
+  ((uint64_t)(ticks) * 1000000 / RTC_FREQUENCY)
+
+/* Rounded up, so that a wait of so many uS is never cut short */
+#define TIMER_US_TO_TICKS(us) \
+  ((uint32_t)(((uint64_t)(us) * RTC_FREQUENCY + 999999) / 1000000))
+
+typedef void (*timer_callback_t)(void * ctx);
+
+/*
+ * A software timer. Timers live wherever their owner wants them to, and
+ * are strung together in deadline order while they are running.
+ */
+typedef struct soft_timer
+{
+  uint32_t deadline;          /* When to fire, in timer_now ticks */
+  timer_callback_t callback;  /* What to call */
+  void * ctx;                 /* Handed to the callback */
+  bool running;               /* Waiting to fire */
+  struct soft_timer * next;   /* The next timer to fire after this one */
+} soft_timer_t;
+
+void timer_init(void);
+uint64_t timer_now64(void);
+uint32_t timer_now(void);
+uint32_t timer_elapsed(uint32_t since);
+uint64_t timer_elapsed_us(uint64_t since);
+void timer_start(soft_timer_t * timer, uint32_t ticks,
+                 timer_callback_t callback, void * ctx);
+void timer_stop(soft_timer_t * timer);
+bool timer_running(soft_timer_t * timer);
+void timer_process(void);
+
+#endif
@@ -2,20 +2,61 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/time.h>
+#include <string.h>
 #include "debug.h"
+#include "sched.h"
+#include "nrf51.h"
+#include "nrf51_bitfields.h"
+#include "radio.h"
+#include "power.h"
 
 bool using_lfclock = false;
 bool using_hfclock = false;
-uint32_t ms_to_sleep = 0;
-bool event = false;
+uint32_t rtc_counter = 0;     /* Fake RTC1 COUNTER, tests move it along */
+uint32_t rtc_alarm = 0;       /* Fake RTC1 CC[0] */
+bool rtc_alarm_set = false;
+uint32_t hfclk_startup_ticks = 1; /* How long the fake crystal takes */
+uint32_t hfclk_prewake_tick = 0;  /* Fake RTC1 CC[3] */
+bool hfclk_prewake_set = false;
+int32_t mock_temperature = 100;   /* Fake die temperature (0.25C), 25C */
+int32_t rc_uncal_error_ppm = 15000; /* How far off the RC runs uncalibrated */
+int32_t rc_tempco_ppm = 100;      /* And how it drifts per 0.25C once it is */
+int32_t rc_cal_residual_ppm = 50; /* What calibrating leaves */
+int rc_calibrations = 0;
+uint64_t wait_spin_us = 0;        /* Time we'd have spent spinning */
+uint64_t wait_sleep_us = 0;       /* And asleep in WFE */
+bool rc_calibrated = false;
+int32_t rc_cal_temperature = 0;
+uint8_t acc_inactive_level = 0;
+bool mock_double_tap_sense = true;   /* Sensing INT2 */
+bool power_dcdc = false;          /* Fake POWER DCDCEN */
+uint8_t power_ram_on = 0;         /* Fake POWER RAMON, as power.c gives it */
+uint8_t power_ram_retain = 0;
+bool radio_powered = true;        /* Fake RADIO POWER */
+int power_applied = 0;            /* How often hw_power_apply was called */
+uint32_t mock_resetreas = 0;      /* What hw_read_reset_reason reads */
+uint16_t mock_vdd_mv = 3000;      /* Fake supply voltage */
+int vdd_samples = 0;              /* How often it was measured */
+int mock_resets = 0;              /* Times we'd have rebooted */
+bool mock_readback_protected = false; /* Fake UICR RBPCONF written */
+uint32_t mock_tx_prefix0 = 0;     /* Where the last packet went out to */
+uint8_t mock_tx_payload[MAX_PACKET_SIZE]; /* And what was in it */
+int mock_tx_count = 0;            /* Packets sent */
+int mock_rx_count = 0;            /* Listens started on */
+void (*mock_rx_hook)(void) = NULL; /* Plays the other end when we listen */
+uint32_t mock_radio_ramp_us = 130; /* TX or RX ramp up, as the chip's */
 pthread_t rtc_thread;
+pthread_mutex_t critical_lock = PTHREAD_MUTEX_INITIALIZER;
 extern bool steady_state_test; /* test_main.c */
+extern NRF_RADIO_Type *RadioPtr; /* radio.c */
 
 void wait_for_val_ne(volatile uint32_t *value)
 {
   uint8_t hold_down = 0xFF;
   while(*value == 0 && hold_down--)
   {
+    wait_spin_us++;
     if (steady_state_test)
     {
       usleep(1000);
@@ -23,16 +64,62 @@ void wait_for_val_ne(volatile uint32_t *value)
   }
 }
 
+/* The alarm goes off: what the RTC1 interrupt would do */
+static void rtc_fire(void)
+{
+  if (rtc_alarm_set)
+  {
+    rtc_alarm_set = false;
+    sched_post(SCHED_EVT_RTC);
+  }
+}
+
+/* Move the fake counter on, setting off the alarm if we pass it */
+void hw_rtc_advance(uint32_t ticks)
+{
+  uint32_t to_alarm = (rtc_alarm - rtc_counter) & 0x00FFFFFF;
+
+  rtc_counter = (rtc_counter + ticks) & 0x00FFFFFF;
+  if (rtc_alarm_set && to_alarm <= ticks)
+  {
+    rtc_fire();
+  }
+}
+
+/* In the steady state test, the RTC runs in real time */
+static uint32_t rtc_real_counter(void)
+{
+  static struct timeval start;
+  struct timeval now;
+
+  if (!start.tv_sec)
+  {
+    gettimeofday(&start, NULL);
+  }
+  gettimeofday(&now, NULL);
+  return ((uint64_t)((now.tv_sec - start.tv_sec) * 1000000 +
+          (now.tv_usec - start.tv_usec)) * RTC_FREQUENCY / 1000000) & 0x00FFFFFF;
+}
+
 void *timerthread(void * arg)
 {
-  if (steady_state_test)
+  uint32_t alarm = rtc_alarm;
+  uint32_t ticks = (alarm - rtc_real_counter()) & 0x00FFFFFF;
+
+  /*
+   * Sleep until the alarm is due. We can start a little late, after a
+   * short alarm: then it's due now, not after the counter wraps.
+   */
+  if (ticks < 0x00800000)
   {
-    /* Sleep for the amount of time set */
-    usleep(ms_to_sleep * 1000);
+    usleep(ticks * 1000000ULL / RTC_FREQUENCY);
   }
 
-  /* Set the event flag */
-  event = true;
+  /* Unless it was moved meanwhile */
+  if (alarm == rtc_alarm)
+  {
+    rtc_fire();
+  }
 
   pthread_exit(NULL);
 }
@@ -50,10 +137,181 @@ void hw_switch_to_lfclock(void)
 
 void hw_switch_to_hfclock(void)
 {
+  if (hw_hfclk_running())
+  {
+    return;
+  }
+
+  /* Waiting for the crystal takes time */
+  if (!steady_state_test)
+  {
+    hw_rtc_advance(hfclk_startup_ticks);
+  }
+
   using_lfclock = false;
   using_hfclock = true;
 }
 
+uint8_t hw_hfclk_prewake_fired(void)
+{
+  return hfclk_prewake_set &&
+    ((hw_rtc_counter() - hfclk_prewake_tick) & 0x00FFFFFF) < 0x00800000;
+}
+
+/* Running if we started it, or the pre-wake started it long enough ago */
+uint8_t hw_hfclk_running(void)
+{
+  return using_hfclock || (hw_hfclk_prewake_fired() &&
+    ((hw_rtc_counter() - hfclk_prewake_tick) & 0x00FFFFFF) >=
+      hfclk_startup_ticks);
+}
+
+/* How far off the fake RC (and so the RTC) is running right now */
+int32_t hw_mock_rc_error_ppm(void)
+{
+  int32_t delta = mock_temperature - rc_cal_temperature;
+
+  if (!rc_calibrated)
+  {
+    return rc_uncal_error_ppm;
+  }
+  return rc_cal_residual_ppm + rc_tempco_ppm * (delta < 0 ? -delta : delta);
+}
+
+void hw_wait_us(uint32_t us)
+{
+  if (us < HW_WAIT_SPIN_US)
+  {
+    wait_spin_us += us;
+  }
+  else
+  {
+    wait_sleep_us += us;
+  }
+
+  if (steady_state_test && us)
+  {
+    usleep(us);
+  }
+}
+
+uint32_t hw_wait_event_us(volatile uint32_t * event, uint32_t us)
+{
+  struct timeval start, now;
+  uint32_t elapsed = 0;
+
+  if (us > HW_WAIT_MAX_US)
+  {
+    us = HW_WAIT_MAX_US;
+  }
+
+  /* Keep what we send, the registers are gone by the time tests look */
+  if (!steady_state_test && event == &RadioPtr->EVENTS_END &&
+      power_mode() == POWER_MODE_RADIO_TX)
+  {
+    mock_tx_prefix0 = RadioPtr->PREFIX0;
+    memcpy(mock_tx_payload, (void *)RadioPtr->PACKETPTR,
+           (RadioPtr->PCNF1 & RADIO_PCNF1_STATLEN_Msk) >> RADIO_PCNF1_STATLEN_Pos);
+    mock_tx_count++;
+  }
+  else if (!steady_state_test && event == &RadioPtr->EVENTS_END &&
+           power_mode() == POWER_MODE_RADIO_RX)
+  {
+    mock_rx_count++;
+    if (mock_rx_hook)
+    {
+      mock_rx_hook();
+    }
+  }
+
+  /* Other threads play the radio here, so really wait for them */
+  if (steady_state_test)
+  {
+    gettimeofday(&start, NULL);
+    while (!*event && elapsed < us)
+    {
+      usleep(1);
+      gettimeofday(&now, NULL);
+      elapsed = (now.tv_sec - start.tv_sec) * 1000000 +
+                (now.tv_usec - start.tv_usec);
+    }
+  }
+  else if (event == &RadioPtr->EVENTS_READY && !*event &&
+           mock_radio_ramp_us < us)
+  {
+    /* Nobody else plays the radio, but it always ramps up */
+    *event = 1;
+    elapsed = mock_radio_ramp_us;
+  }
+  else if (!*event)
+  {
+    elapsed = us;
+  }
+
+  wait_sleep_us += elapsed < us ? elapsed : us;
+
+  if (!*event)
+  {
+    return 0;
+  }
+  return elapsed < us ? us - elapsed : 1;
+}
+
+/* Nothing's stuck here, we don't reboot */
+void hw_wait_event_or_reset(volatile uint32_t * event, uint32_t us)
+{
+  hw_wait_event_us(event, us);
+}
+
+/* How long we've waited, and how much of that was spent spinning */
+void hw_mock_wait_stats(uint64_t * spin_us, uint64_t * sleep_us)
+{
+  *spin_us = wait_spin_us;
+  *sleep_us = wait_sleep_us;
+}
+
+void hw_lfclk_cal_timer(uint8_t quarter_seconds)
+{
+  /* Tests post SCHED_EVT_CAL_TIMEOUT themselves */
+}
+
+/* Calibration is instant here, DONE is posted straight away */
+void hw_lfclk_cal_start(void)
+{
+  rc_calibrations++;
+  rc_calibrated = true;
+  rc_cal_temperature = mock_temperature;
+  sched_post(SCHED_EVT_CAL_DONE);
+}
+
+uint16_t hw_vdd_mv(void)
+{
+  vdd_samples++;
+  return mock_vdd_mv;
+}
+
+int32_t hw_temp_read(void)
+{
+  return mock_temperature;
+}
+
+void hw_hfclk_prewake(uint32_t tick)
+{
+  hfclk_prewake_tick = tick;
+  hfclk_prewake_set = true;
+}
+
+void hw_hfclk_prewake_cancel(void)
+{
+  /* A crystal the pre-wake got going stays running */
+  if (hw_hfclk_running())
+  {
+    using_lfclock = false;
+    using_hfclock = true;
+  }
+  hfclk_prewake_set = false;
+}
+
 void hw_enable_movement_detect(void)
 {
   ;
@@ -64,34 +322,63 @@ void hw_disable_movement_detect(void)
   ;
 }
 
-/*
- * Function for configuring the RTC to generate COMPARE0 event after t mS.
- */
-void hw_rtc_wakeup(uint32_t ms)
+void hw_enable_double_tap(void)
 {
-  _debug_printf("Setting wakeup to %dms", ms);
-  ms_to_sleep = ms;
+  mock_double_tap_sense = true;
 }
 
-void hw_rtc_start(void)
+void hw_disable_double_tap(void)
 {
-  /* Start the RTC */
-  pthread_create(&rtc_thread, NULL, timerthread, NULL);
+  mock_double_tap_sense = false;
 }
 
-void hw_rtc_stop(void)
+/* INT2: the activity status, or a double tap nobody has read yet */
+uint8_t hw_acc_inactive(void)
 {
-  ms_to_sleep = 0;
-  event = false;
+  extern uint8_t mock_acc_tapped; /* lis2dh_driver_mock.c */
+
+  return acc_inactive_level || mock_acc_tapped;
 }
 
-void hw_sleep_power_on(void)
+void hw_rtc_init(void)
 {
-  while(!event)
+  rtc_counter = 0;
+  rtc_alarm_set = false;
+}
+
+uint32_t hw_rtc_counter(void)
+{
+  if (steady_state_test)
   {
-    if (steady_state_test) {
-      usleep(1000);
-    }
+    return rtc_real_counter();
+  }
+  return rtc_counter;
+}
+
+void hw_rtc_set_alarm(uint32_t tick)
+{
+  _debug_printf("Setting alarm for %d", tick);
+  rtc_alarm = tick;
+  rtc_alarm_set = true;
+
+  if (steady_state_test)
+  {
+    pthread_create(&rtc_thread, NULL, timerthread, NULL);
+    pthread_detach(rtc_thread);
+  }
+}
+
+void hw_rtc_cancel_alarm(void)
+{
+  rtc_alarm_set = false;
+}
+
+/* Nothing to do till the alarm: skip straight to it, as sched_run would sleep */
+void hw_rtc_advance_to_alarm(void)
+{
+  if (rtc_alarm_set)
+  {
+    hw_rtc_advance((rtc_alarm - rtc_counter) & 0x00FFFFFF);
   }
 }
 
@@ -104,18 +391,21 @@ uint8_t hw_acc_read_dt_int(void)
 {
   return 0;
 }
-uint32_t hw_rtc_value(void)
-{
-  /* Return the RTC1 value */
-  return 0;
-}
 void hw_sleep_power_off(void)
 {
   /* Set the power mode to power off sleeping, no RAM retention */
 }
-void hw_rtc_clear(void)
+void hw_power_apply(bool dcdc, uint8_t ram_on, uint8_t ram_retain,
+                    bool radio_off)
 {
-  /* Clear the RTC */
+  power_dcdc = dcdc;
+  power_ram_on = ram_on;
+  power_ram_retain = ram_retain;
+  if (radio_off)
+  {
+    radio_powered = false;
+  }
+  power_applied++;
 }
 void hw_clear_port_event(void)
 {
@@ -124,8 +414,21 @@ void hw_clear_port_event(void)
 
 void hw_read_reset_reason(uint32_t *resetreas)
 {
-  /* We don't know what reset reason we should pretend to read, so we don't
-   * do anything. */
+  /* Tests say what reset reason we should pretend to read */
+  *resetreas = mock_resetreas;
+  mock_resetreas = 0;
+}
+
+/* The timer thread plays the part of our interrupts */
+uint32_t hw_critical_enter(void)
+{
+  pthread_mutex_lock(&critical_lock);
+  return 0;
+}
+
+void hw_critical_exit(uint32_t mask)
+{
+  pthread_mutex_unlock(&critical_lock);
 }
 
 uint32_t hw_ficr_deviceid(size_t index)
@@ -147,3 +450,14 @@ uint32_t hw_ficr_deviceid(size_t index)
     }
   }
 }
+
+void hw_readback_protect(void)
+{
+  mock_readback_protected = true;
+}
+
+void hw_reset(void)
+{
+  /* The caller carries on, which is as far as the tests go */
+  mock_resets++;
+}
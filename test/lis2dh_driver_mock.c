@@ -5,6 +5,8 @@
 #include "spi_master.h"
 #include "kiwiki.h"
 
+uint8_t mock_acc_tapped = 0;        /* A double tap latched in CLICK_SRC */
+
 status_t LIS2DH_init(void)
 {
   return MEMS_SUCCESS;
@@ -28,3 +30,25 @@ status_t LIS2DH_ResetInt2Latch(void) {
   return MEMS_SUCCESS;
 }
 
+status_t LIS2DH_ClickLatchEnable(State_t latch)
+{
+  return MEMS_SUCCESS;
+}
+
+status_t LIS2DH_GetDoubleTap(u8_t * tapped)
+{
+  *tapped = mock_acc_tapped;
+  mock_acc_tapped = 0;
+  return MEMS_SUCCESS;
+}
+
+status_t LIS2DH_ResetLatches(void)
+{
+  mock_acc_tapped = 0;
+  return MEMS_SUCCESS;
+}
+
+status_t LIS2DH_SetPowerProfile(LIS2DH_Profile_t profile)
+{
+  return MEMS_SUCCESS;
+}
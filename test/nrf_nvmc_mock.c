@@ -0,0 +1,89 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "nrf_nvmc.h"
+#include "kv.h"
+#include "flash.h"
+#include "hw.h"
+
+extern void hw_rtc_advance(uint32_t ticks); /* hw_mock.c */
+
+/*
+ * Flash on the host is whatever RAM the caller points us at. Like the
+ * real thing, an erase sets a page to 0xFF and a write can only clear
+ * bits, and the CPU is stalled meanwhile: the fake RTC moves on by as
+ * long as it would take. Tests can pull the plug after so many
+ * operations.
+ */
+
+int mock_nvmc_erases = 0;         /* Pages erased */
+int mock_nvmc_words = 0;          /* Words written */
+int mock_nvmc_power_left = -1;    /* Operations before we lose power, -1 for never */
+uint64_t mock_nvmc_busy_us = 0;   /* Time the CPU spent stalled */
+
+/* Stall for this long */
+static void mock_nvmc_busy(uint32_t us)
+{
+  static uint64_t carry;
+
+  mock_nvmc_busy_us += us;
+  carry += (uint64_t) us * RTC_FREQUENCY;
+  hw_rtc_advance(carry / 1000000);
+  carry %= 1000000;
+}
+
+/* Does this operation still happen? */
+static bool mock_nvmc_powered(void)
+{
+  if (mock_nvmc_power_left == 0)
+  {
+    return false;
+  }
+  if (mock_nvmc_power_left > 0)
+  {
+    mock_nvmc_power_left--;
+  }
+  return true;
+}
+
+void nrf_nvmc_wait_for_ready(void)
+{
+}
+
+void nrf_nvmc_page_erase(uint32_t address)
+{
+  if (!mock_nvmc_powered())
+  {
+    return;
+  }
+  memset((void *) (uintptr_t) address, 0xFF, KV_PAGE_SIZE);
+  mock_nvmc_erases++;
+  mock_nvmc_busy(FLASH_ERASE_US);
+}
+
+void nrf_nvmc_write_word(uint32_t address, uint32_t value)
+{
+  if (!mock_nvmc_powered())
+  {
+    return;
+  }
+  *(uint32_t *) (uintptr_t) address &= value;
+  mock_nvmc_words++;
+  mock_nvmc_busy(FLASH_WRITE_US);
+}
+
+void nrf_nvmc_write_words(uint32_t address, const uint32_t * src, uint32_t num_words)
+{
+  for (uint32_t i = 0; i < num_words; i++)
+  {
+    nrf_nvmc_write_word(address + i * 4, src[i]);
+  }
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include "test.h"
+#include "battery.h"
+#include "timer.h"
+#include "sched.h"
+#include "hw.h"
+
+extern uint16_t mock_vdd_mv;                /* hw_mock.c */
+extern int vdd_samples;                     /* hw_mock.c */
+extern void hw_rtc_advance(uint32_t ticks); /* hw_mock.c */
+
+static const battery_curve_point_t curve_test[] =
+{
+  { .mv = 2000, .sleep_scale = 512, .listen_scale = 128 },
+  { .mv = 2400, .sleep_scale = 256, .listen_scale = 256 },
+};
+
+static void setup(uint16_t mv)
+{
+  sched_init();
+  hw_rtc_init();
+  timer_init();
+  mock_vdd_mv = mv;
+  vdd_samples = 0;
+  battery_init();
+}
+
+TEST(battery_test_curve, 0, 0)
+{
+  uint16_t sleep_scale;
+  uint16_t listen_scale;
+
+  setup(3000);
+  TEST_EQ(battery_set_curve(curve_test, 2), true);
+
+  /* The ends hold */
+  battery_scale_at(1800, &sleep_scale, &listen_scale);
+  TEST_EQ(sleep_scale, 512);
+  TEST_EQ(listen_scale, 128);
+  battery_scale_at(3000, &sleep_scale, &listen_scale);
+  TEST_EQ(sleep_scale, BATTERY_SCALE_ONE);
+  TEST_EQ(listen_scale, BATTERY_SCALE_ONE);
+
+  /* Straight line in between */
+  battery_scale_at(2200, &sleep_scale, &listen_scale);
+  TEST_EQ(sleep_scale, 384);
+  TEST_EQ(listen_scale, 192);
+  battery_scale_at(2300, &sleep_scale, &listen_scale);
+  TEST_EQ(sleep_scale, 320);
+  TEST_EQ(listen_scale, 224);
+
+  /* Not knowing is the same as a full battery */
+  battery_scale_at(0, &sleep_scale, &listen_scale);
+  TEST_EQ(sleep_scale, BATTERY_SCALE_ONE);
+
+  /* Curves have to go up */
+  TEST_EQ(battery_set_curve(curve_test, 0), false);
+  TEST_EQ(battery_set_curve(&curve_test[1], 1), true);
+  battery_scale_at(1800, &sleep_scale, &listen_scale);
+  TEST_EQ(sleep_scale, BATTERY_SCALE_ONE);
+
+  const battery_curve_point_t backwards[] = { curve_test[1], curve_test[0] };
+  TEST_EQ(battery_set_curve(backwards, 2), false);
+
+  /* Nor one that sleeps longer than the poll intervals allow for */
+  const battery_curve_point_t sleepy = { .mv = 2000, .sleep_scale = BATTERY_SLEEP_SCALE_MAX + 1,
+                                   .listen_scale = 128 };
+  TEST_EQ(battery_set_curve(&sleepy, 1), false);
+  battery_scale_at(1800, &sleep_scale, &listen_scale);
+  TEST_EQ(sleep_scale, BATTERY_SCALE_ONE);
+}
+
+TEST(battery_test_smoothing, 0, 0)
+{
+  /* The first sample is taken as it is */
+  setup(3000);
+  TEST_EQ(vdd_samples, 1);
+  TEST_EQ(battery_mv(), 3000);
+
+  /* A dip only moves it a quarter of the way */
+  mock_vdd_mv = 2600;
+  battery_sample();
+  TEST_EQ(battery_mv(), 2900);
+
+  /* But it gets there */
+  for (int i = 0; i < 40; i++)
+  {
+    battery_sample();
+  }
+  TEST_EQ(battery_mv(), 2600);
+
+  /* Measured again once a sample interval */
+  vdd_samples = 0;
+  hw_rtc_advance(TIMER_MS_TO_TICKS(BATTERY_SAMPLE_INTERVAL) - 10);
+  TEST_EQ(vdd_samples, 0);
+  hw_rtc_advance(20);
+  sched_dispatch();
+  TEST_EQ(vdd_samples, 1);
+}
+
+TEST(battery_test_governor, 0, 0)
+{
+  /* A fresh cell changes nothing */
+  setup(3000);
+  TEST_EQ(battery_scale_sleep(950), 950);
+  TEST_EQ(battery_scale_listen(1500), 1500);
+
+  /* A tired one polls less and listens a bit less */
+  setup(2400);
+  TEST_EQ(battery_scale_sleep(950) > 950, true);
+  TEST_EQ(battery_scale_listen(1500) < 1500, true);
+
+  /* And a flat one the least */
+  uint16_t tired = battery_scale_sleep(950);
+  setup(2000);
+  TEST_EQ(battery_scale_sleep(950) > tired, true);
+
+  /* Long intervals don't wrap */
+  TEST_EQ(battery_scale_sleep(UINT16_MAX), UINT16_MAX);
+}
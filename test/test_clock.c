@@ -0,0 +1,235 @@
+#include "test.h"
+#include "clock.h"
+#include "timer.h"
+#include "sched.h"
+#include "hw.h"
+#include "debug.h"
+
+extern bool using_hfclock;                  /* hw_mock.c */
+extern uint32_t rtc_counter;                /* hw_mock.c */
+extern uint32_t hfclk_startup_ticks;        /* hw_mock.c */
+extern uint32_t hfclk_prewake_tick;         /* hw_mock.c */
+extern void hw_rtc_advance(uint32_t ticks); /* hw_mock.c */
+
+static void setup(uint32_t startup)
+{
+  sched_init();
+  hw_rtc_init();
+  timer_init();
+  clock_init();
+  hfclk_startup_ticks = startup;
+  using_hfclock = false;
+}
+
+/* Sleep until tick with the crystal off, like the FSM does */
+static void sleep_until(uint32_t tick)
+{
+  using_hfclock = false;
+  hw_rtc_advance((tick - rtc_counter) & TIMER_COUNTER_MASK);
+}
+
+TEST(clock_test_cold_start, 0, 0)
+{
+  setup(HFCLK_LEAD_DEFAULT + 2);
+
+  /* No pre-wake: we wait, and learn how long it takes */
+  clock_hfxo_start();
+  TEST_EQ(hw_hfclk_running(), true);
+  TEST_EQ(rtc_counter, HFCLK_LEAD_DEFAULT + 2);
+  TEST_EQ(clock_prewake_lead(), HFCLK_LEAD_DEFAULT + 3);
+
+  /* Which is enough next time round */
+  clock_prewake(100);
+  TEST_EQ(hfclk_prewake_tick, 100 - (HFCLK_LEAD_DEFAULT + 3));
+  sleep_until(100);
+  clock_hfxo_start();
+  TEST_EQ(rtc_counter, 100);
+}
+
+TEST(clock_test_prewake_hit, 0, 0)
+{
+  setup(1);
+
+  /* The crystal is running when we wake, nothing to wait for */
+  for (int i = 1; i <= HFCLK_TRIM_HITS; i++)
+  {
+    clock_prewake(i * 100);
+    sleep_until(i * 100);
+    TEST_EQ(hw_hfclk_running(), true);
+    clock_hfxo_start();
+    TEST_EQ(rtc_counter, i * 100);
+  }
+
+  /* After a good run, we try a shorter lead */
+  TEST_EQ(clock_prewake_lead(), HFCLK_LEAD_DEFAULT - 1);
+}
+
+TEST(clock_test_prewake_miss, 0, 0)
+{
+  setup(HFCLK_LEAD_DEFAULT + 1);
+
+  /* Too short a lead: we wait for the rest, and lengthen it */
+  clock_prewake(100);
+  sleep_until(100);
+  TEST_EQ(hw_hfclk_running(), false);
+  clock_hfxo_start();
+  TEST_EQ(hw_hfclk_running(), true);
+  TEST_EQ(clock_prewake_lead() > HFCLK_LEAD_DEFAULT, true);
+  TEST_EQ(clock_prewake_lead() <= HFCLK_LEAD_MAX, true);
+
+  /* Then it makes it */
+  clock_prewake(200);
+  sleep_until(200);
+  TEST_EQ(hw_hfclk_running(), true);
+
+  /* However slow the crystal, the lead stays bounded */
+  setup(HFCLK_LEAD_MAX * 2);
+  clock_hfxo_start();
+  TEST_EQ(clock_prewake_lead(), HFCLK_LEAD_MAX);
+}
+
+TEST(clock_test_early_wake, 0, 0)
+{
+  setup(1);
+
+  /* Woken before the pre-wake (double tap): a plain cold start */
+  clock_prewake(1000);
+  sleep_until(500);
+  clock_hfxo_start();
+  TEST_EQ(hw_hfclk_running(), true);
+  TEST_EQ(clock_prewake_lead(), HFCLK_LEAD_DEFAULT);
+
+  /* And the pre-wake is off */
+  sleep_until(1000);
+  TEST_EQ(hw_hfclk_prewake_fired(), false);
+}
+
+extern int32_t mock_temperature;             /* hw_mock.c */
+extern int rc_calibrations;                  /* hw_mock.c */
+extern bool rc_calibrated;                   /* hw_mock.c */
+extern int32_t hw_mock_rc_error_ppm(void);   /* hw_mock.c */
+
+/* The calibration timer went off */
+static void cal_timeout(void)
+{
+  sched_post(SCHED_EVT_CAL_TIMEOUT);
+  while (sched_dispatch());
+}
+
+/* The radio has the crystal running */
+static void cal_poll(void)
+{
+  clock_lfrc_poll();
+  while (sched_dispatch());
+}
+
+TEST(clock_test_lfrc_due, 0, 0)
+{
+  mock_temperature = 100;
+  rc_calibrated = false;
+  setup(1);
+  rc_calibrations = 0;
+
+  /* Nothing known yet, so the worst case */
+  TEST_EQ(clock_lfrc_calibrated(), false);
+  TEST_EQ(clock_lfrc_ppm(), LFRC_PPM_UNCALIBRATED);
+
+  /* First chance we get, we calibrate */
+  cal_poll();
+  TEST_EQ(rc_calibrations, 1);
+  TEST_EQ(clock_lfrc_calibrated(), true);
+  TEST_EQ(clock_lfrc_ppm(), LFRC_PPM_CALIBRATED);
+
+  /* Same temperature, not long ago: nothing to do */
+  hw_rtc_advance(TIMER_MS_TO_TICKS(4000));
+  cal_timeout();
+  cal_poll();
+  TEST_EQ(rc_calibrations, 1);
+
+  /* The temperature moves: the estimate gets worse, and we calibrate */
+  mock_temperature += LFRC_CAL_TEMP_DELTA;
+  cal_timeout();
+  TEST_EQ(clock_lfrc_ppm(),
+    LFRC_PPM_CALIBRATED + LFRC_CAL_TEMP_DELTA * LFRC_PPM_PER_TEMP_STEP);
+  cal_poll();
+  TEST_EQ(rc_calibrations, 2);
+  TEST_EQ(clock_lfrc_ppm(), LFRC_PPM_CALIBRATED);
+
+  /* And again once it's been long enough, whatever the temperature */
+  hw_rtc_advance(LFRC_CAL_INTERVAL);
+  cal_timeout();
+  cal_poll();
+  TEST_EQ(rc_calibrations, 3);
+
+  /* Guard times follow the estimate */
+  TEST_EQ(clock_lfrc_guard(0), 0);
+  TEST_EQ(clock_lfrc_guard(4000), 1);
+  TEST_EQ(clock_lfrc_guard(1000000), LFRC_PPM_CALIBRATED);
+}
+
+TEST(clock_test_lfrc_stop_deferred, 0, 0)
+{
+  setup(1);
+
+  /* Calibrating needs the crystal, so stopping it waits */
+  clock_hfxo_start();
+  clock_lfrc_poll();
+  TEST_EQ(clock_lfrc_busy(), true);
+  clock_hfxo_stop();
+  TEST_EQ(using_hfclock, true);
+
+  /* Until it's done */
+  while (sched_dispatch());
+  TEST_EQ(clock_lfrc_busy(), false);
+  TEST_EQ(using_hfclock, false);
+}
+
+/*
+ * An hour of polling with the temperature creeping up. Add up how far
+ * the RTC is out over each 4s stretch, with and without calibrating.
+ */
+static uint64_t drift_us(bool calibrate)
+{
+  uint64_t error_us = 0;
+
+  mock_temperature = 80;
+  rc_calibrated = false;
+  setup(1);
+
+  for (int i = 0; i < 900; i++)
+  {
+    /* 0.25C every 32s */
+    if (i % 8 == 0)
+    {
+      mock_temperature++;
+    }
+
+    hw_rtc_advance(TIMER_MS_TO_TICKS(4000));
+    cal_timeout();
+    if (calibrate)
+    {
+      cal_poll();
+    }
+
+    /* What we think it could be is never less than what it is */
+    if (clock_lfrc_ppm() < hw_mock_rc_error_ppm())
+    {
+      return UINT64_MAX;
+    }
+
+    error_us += 4 * (uint64_t) hw_mock_rc_error_ppm();
+  }
+  return error_us;
+}
+
+TEST(clock_test_lfrc_drift, 0, 0)
+{
+  uint64_t uncalibrated = drift_us(false);
+  uint64_t calibrated = drift_us(true);
+
+  TEST_NE(calibrated, UINT64_MAX);
+  TEST_NE(uncalibrated, UINT64_MAX);
+  TEST_EQ(calibrated * 20 < uncalibrated, true);
+  _debug_printf("RC error over an hour: %llu us calibrated, %llu us not",
+    (unsigned long long) calibrated, (unsigned long long) uncalibrated);
+}
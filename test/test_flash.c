@@ -0,0 +1,123 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "test.h"
+#include "flash.h"
+#include "kv.h"
+
+extern int mock_nvmc_erases;                        /* nrf_nvmc_mock.c */
+extern int mock_nvmc_words;                         /* nrf_nvmc_mock.c */
+extern uint64_t mock_nvmc_busy_us;                  /* nrf_nvmc_mock.c */
+
+/* Somewhere to scribble on */
+static uint32_t scratch[KV_PAGE_WORDS] __attribute__((aligned(KV_PAGE_SIZE)));
+
+/* The order jobs finished in */
+static int finished[8];
+static int finished_count;
+
+static void flash_test_done(flash_job_t * job, void * ctx)
+{
+  finished[finished_count++] = (int) (intptr_t) ctx;
+}
+
+TEST(flash_test_order, 0, 0)
+{
+  flash_job_t erase;
+  flash_job_t write;
+  uint32_t data[4] = { 0x11111111, 0x22222222, 0x33333333, 0x44444444 };
+
+  flash_init();
+  finished_count = 0;
+  memset(scratch, 0, sizeof(scratch));
+
+  /* Nothing happens until there's a slot */
+  flash_erase(&erase, (uint32_t) scratch, flash_test_done, (void *) 1);
+  flash_write(&write, (uint32_t) scratch, data, 4, flash_test_done, (void *) 2);
+  TEST_EQ(flash_busy(), true);
+  TEST_EQ(scratch[0], 0);
+
+  /* Then in the order they were queued */
+  flash_flush();
+  TEST_EQ(flash_busy(), false);
+  TEST_EQ(finished_count, 2);
+  TEST_EQ(finished[0], 1);
+  TEST_EQ(finished[1], 2);
+  TEST_MEM_EQ(scratch, data, sizeof(data));
+  TEST_EQ(scratch[4], 0xffffffff);
+  TEST_EQ(erase.queued, false);
+}
+
+TEST(flash_test_budget, 0, 0)
+{
+  flash_job_t erase;
+  flash_job_t write;
+  uint32_t data[20];
+  uint64_t busy;
+  int erases;
+
+  flash_init();
+  finished_count = 0;
+  memset(data, 0x5A, sizeof(data));
+
+  flash_erase(&erase, (uint32_t) scratch, flash_test_done, (void *) 1);
+  flash_write(&write, (uint32_t) scratch, data, 20, flash_test_done, (void *) 2);
+
+  /* An erase doesn't get started in a slot too short for it */
+  erases = mock_nvmc_erases;
+  TEST_EQ(flash_run(FLASH_ERASE_US - 1), 0);
+  TEST_EQ(mock_nvmc_erases, erases);
+
+  /* A write goes as far as it can, and carries on next time */
+  busy = mock_nvmc_busy_us;
+  TEST_EQ(flash_run(FLASH_ERASE_US + 5 * FLASH_WRITE_US),
+          FLASH_ERASE_US + 5 * FLASH_WRITE_US);
+  TEST_EQ(mock_nvmc_busy_us - busy, FLASH_ERASE_US + 5 * FLASH_WRITE_US);
+  TEST_EQ(finished_count, 1);
+  TEST_EQ(write.written, 5);
+  TEST_EQ(scratch[5], 0xffffffff);
+
+  TEST_EQ(flash_run(100 * FLASH_WRITE_US), 15 * FLASH_WRITE_US);
+  TEST_EQ(finished_count, 2);
+  TEST_MEM_EQ(scratch, data, sizeof(data));
+
+  /* Never more than the slot */
+  TEST_EQ(mock_nvmc_busy_us - busy, FLASH_ERASE_US + 20 * FLASH_WRITE_US);
+}
+
+/* Queue another job from the callback, like a chain of steps does */
+static flash_job_t chained;
+
+static void flash_test_chain_next(flash_job_t * job, void * ctx)
+{
+  static const uint32_t word = 0x12345678;
+
+  finished[finished_count++] = 1;
+  flash_write(&chained, (uint32_t) &scratch[1], &word, 1, flash_test_done,
+              (void *) 2);
+}
+
+TEST(flash_test_chain, 0, 0)
+{
+  flash_job_t first;
+  static const uint32_t word = 0x87654321;
+
+  flash_init();
+  finished_count = 0;
+  memset(scratch, 0xFF, sizeof(scratch));
+
+  flash_write(&first, (uint32_t) scratch, &word, 1, flash_test_chain_next, NULL);
+  flash_run(10 * FLASH_WRITE_US);
+
+  TEST_EQ(finished_count, 2);
+  TEST_EQ(scratch[0], 0x87654321);
+  TEST_EQ(scratch[1], 0x12345678);
+  TEST_EQ(flash_busy(), false);
+}
@@ -3,6 +3,16 @@
 #include "hw.h"
 #include "radio.h"
 #include "nrf51.h"
+#include "nrf51_bitfields.h"
+#include "sched.h"
+#include "timer.h"
+#include "clock.h"
+#include "power.h"
+#include "phase.h"
+#include "debug.h"
+#include "kv.h"
+#include "flash.h"
+#include "crc.h"
 
 ki_secrets_t secrets_default =
 {
@@ -22,13 +32,21 @@ ki_state_t state_default =
   .is_tracked_ki = 0xff,
   .seen_stopwatch = 0,
   .packet_stat = 0,
-  .motionless_time = MOTIONLESS_TIME,
   .has_been_manufactured = false,
   .is_hw_good = true,
 };
 
 uint8_t fake_radio_memory[sizeof(NRF_RADIO_Type)];
 extern NRF_RADIO_Type *RadioPtr;
+extern uint32_t mock_tx_prefix0;        /* hw_mock.c */
+extern uint8_t mock_tx_payload[];       /* hw_mock.c */
+extern int mock_tx_count;               /* hw_mock.c */
+extern int mock_rx_count;               /* hw_mock.c */
+extern void (*mock_rx_hook)(void);      /* hw_mock.c */
+extern void hw_rtc_advance(uint32_t ticks); /* hw_mock.c */
+extern void hw_rtc_advance_to_alarm(void); /* hw_mock.c */
+extern void RADIO_IRQHandler(void);     /* radio.c */
+extern uint8_t mock_acc_tapped;         /* lis2dh_driver_mock.c */
 
 /* RTC, RADIO, and Clock switching need to be mocked */
 
@@ -62,7 +80,7 @@ TEST(kiwiki_test_setup_state, 0, 0)
   TEST_EQ(state.is_tracked_ki, state_default.is_tracked_ki);
   TEST_EQ(state.seen_stopwatch, state_default.seen_stopwatch);
   TEST_EQ(state.packet_stat, state_default.packet_stat);
-  TEST_EQ(state.motionless_time, state_default.motionless_time);
+  TEST_EQ(state.motionless_until - timer_now64(), TIMER_MS_TO_TICKS(MOTIONLESS_TIME));
   TEST_EQ(state.has_been_manufactured, state_default.has_been_manufactured);
   TEST_EQ(state.is_hw_good, state_default.is_hw_good);
 }
@@ -98,6 +116,114 @@ TEST(kiwiki_test_receive_beacon, 0, 0)
 
 }
 
+TEST(kiwiki_test_receive_beacon_v2, 0, 0)
+{
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+
+  /* A v2 beacon, with the sensor's random in */
+  ki_state_t state;
+  kiwiki_setup_state(&state);
+  state.is_tracked_ki = 0;
+  beacon_v2_packet_t beacon = {
+    .sensor_id = { 0x12, 0x34, 0x56, 0x78 },
+    .version = PROTOCOL_VERSION_2,
+    .random = { 0x21, 0x43, 0x65, 0x87, 0x21, 0x43, 0x65, 0x87 },
+  };
+  radio_packet_t packet;
+  memcpy(packet.payload, &beacon, sizeof(beacon));
+
+  /* What the v1 handshake would have worked out from the same randoms */
+  ki_state_t expect = state;
+  random_packet_t sensor_rand;
+  challenge_packet_t challenge;
+  memcpy(sensor_rand.random, beacon.random, SIZE_RANDOM);
+  memcpy(sensor_rand.sensor_id, beacon.sensor_id, SIZE_SENSOR_ID);
+  kiwiki_calculate_combikey(&expect, &sensor_rand);
+  kiwiki_calculate_challenge(&expect, &sensor_rand, &challenge);
+
+  kiwiki_receive_beacon_v2(&state, &packet);
+
+  /* One packet back, with both our random and the challenge, and we're done */
+  challenge_v2_packet_t * reply = (challenge_v2_packet_t *)mock_tx_payload;
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('V'));
+  TEST_MEM_EQ(reply->random, expect.ki_random, SIZE_RANDOM);
+  TEST_MEM_EQ(reply->challenge, challenge.challenge, SIZE_CHALLENGE);
+  TEST_MEM_EQ(reply->sensor_id, beacon.sensor_id, SIZE_SENSOR_ID);
+  TEST_EQ(reply->flags, 0);
+  TEST_MEM_EQ(state.sensor_id, beacon.sensor_id, SIZE_SENSOR_ID);
+  TEST_EQ(state.fsm_state, KI_STATE_SLEEP);
+
+  /* That random has been used, so we have a new one */
+  TEST_NE(memcmp(state.ki_random, expect.ki_random, SIZE_RANDOM), 0);
+
+  /* Tracked and double tap Kis say so in the flags */
+  state.is_tracked_ki = 1;
+  kiwiki_receive_beacon_v2(&state, &packet);
+  TEST_EQ(reply->flags, CHALLENGE_V2_TRACKED);
+
+  state.is_tracked_ki = 0;
+  state.double_tap_challenges = SEND_DOUBLE_TAP_CHALLENGES;
+  kiwiki_receive_beacon_v2(&state, &packet);
+  TEST_EQ(reply->flags, CHALLENGE_V2_DOUBLE_TAP);
+
+  /* A version we don't know gets the v1 handshake */
+  ((beacon_v2_packet_t *)packet.payload)->version = PROTOCOL_VERSION_2 + 1;
+  kiwiki_receive_beacon_v2(&state, &packet);
+  TEST_EQ(RadioPtr->PREFIX0, radio_convert_byte('R'));
+  TEST_EQ(state.fsm_state, KI_STATE_LISTEN_RAND);
+}
+
+TEST(kiwiki_test_sessions, 0, 0)
+{
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+
+  ki_state_t state;
+  kiwiki_setup_state(&state);
+  state.is_installer_ki = 0;
+  beacon_v2_packet_t near = {
+    .sensor_id = { 0x01, 0x02, 0x03, 0x04 },
+    .version = PROTOCOL_VERSION_2,
+  };
+  beacon_v2_packet_t far = {
+    .sensor_id = { 0x0A, 0x0B, 0x0C, 0x0D },
+    .version = PROTOCOL_VERSION_2,
+  };
+  radio_packet_t packet;
+
+  /* Two doors in range, and we've heard both */
+  session_seen(&state.sessions, near.sensor_id, 60, timer_now());
+  session_seen(&state.sessions, far.sensor_id, 85, timer_now());
+
+  /* The near one first: the far one is still waiting, so we go listen for it */
+  memcpy(packet.payload, &near, sizeof(near));
+  kiwiki_receive_beacon_v2(&state, &packet);
+  TEST_EQ(state.fsm_state, KI_STATE_LISTEN_BEACON);
+  TEST_EQ(session_find(&state.sessions, near.sensor_id)->state, SESSION_DONE);
+  TEST_EQ(session_find(&state.sessions, near.sensor_id)->has_key, true);
+
+  /* Then the far one, and that's everybody */
+  memcpy(packet.payload, &far, sizeof(far));
+  kiwiki_receive_beacon_v2(&state, &packet);
+  TEST_EQ(state.fsm_state, KI_STATE_SLEEP);
+  TEST_EQ(session_pending(&state.sessions, timer_now()), 0);
+
+  /* Back at the near door, its combikey comes from the table */
+  sensor_data_t far_key = state.challenge;
+  memcpy(packet.payload, &near, sizeof(near));
+  session_new_wake(&state.sessions);
+  kiwiki_receive_beacon_v2(&state, &packet);
+  TEST_MEM_EQ(state.challenge.challenge_key,
+              session_find(&state.sessions, near.sensor_id)->combikey,
+              AES_BLOCK_SIZE);
+  TEST_NE(memcmp(state.challenge.challenge_key, far_key.challenge_key,
+                 AES_BLOCK_SIZE), 0);
+
+  sched_init();
+}
+
 TEST(kiwiki_test_receive_random, 0, 0)
 {
   /* Make the Radio memory use fake memory instead */
@@ -129,22 +255,207 @@ TEST(kiwiki_test_receive_random, 0, 0)
   TEST_MEM_EQ(RadioPtr->PACKETPTR + SIZE_CHALLENGE, &packet.payload + SIZE_RANDOM, SIZE_SENSOR_ID);
 
   /* Make sure that the challenge packet is sent to the correct pipe */
-  TEST_EQ(RadioPtr->PREFIX0, radio_convert_byte('C'));
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('C'));
 
   /* Test Tracked ki */
   state.is_tracked_ki = 1;
   kiwiki_receive_random(&state, &packet);
 
   /* Make sure that the challenge packet is sent to the correct pipe */
-  TEST_EQ(RadioPtr->PREFIX0, radio_convert_byte('K'));
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('K'));
   state.is_tracked_ki = 0;
 
   /* Test Double-tap */
   state.double_tap_challenges = SEND_DOUBLE_TAP_CHALLENGES;
 
   kiwiki_receive_random(&state, &packet);
-  TEST_EQ(RadioPtr->PREFIX0, radio_convert_byte('D'));
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('D'));
+
+}
+
+#if CHALLENGE_ACK
+/* The sensor's end of an acked challenge: ack_ignore listens go unanswered */
+static int ack_ignore;
+static int ack_listens;
 
+static void kiwiki_test_ack_hook(void)
+{
+  ack_packet_t * ack = (ack_packet_t *)RadioPtr->PACKETPTR;
+
+  /* Turned round from the send, listening for nothing but the ack */
+  if (RadioPtr->RXADDRESSES == 1 << RADIO_PIPE_ACK)
+  {
+    ack_listens++;
+  }
+
+  if (ack_ignore)
+  {
+    ack_ignore--;
+    return;
+  }
+
+  memcpy(ack->sensor_id, mock_tx_payload + SIZE_CHALLENGE, SIZE_SENSOR_ID);
+  memcpy(ack->challenge, mock_tx_payload, SIZE_ACK_TAG);
+  *(uint32_t *)&RadioPtr->RXMATCH = RADIO_PIPE_ACK;    /* Read only on the chip */
+  RadioPtr->EVENTS_END = 1;
+}
+#endif
+
+TEST(kiwiki_test_challenge_ack, 0, 0)
+{
+  random_packet_t rand = {
+    .random = { 0x12, 0x34, 0x56, 0x78, 0x12, 0x34, 0x56, 0x78 },
+    .sensor_id = { 0x12, 0x34, 0x56, 0x78 },
+  };
+  radio_packet_t packet;
+  ki_state_t state;
+  int tx;
+  int rx;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  RadioPtr->RSSISAMPLE = LBT_RSSI_CLEAR + 10;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  state.is_tracked_ki = 0;
+  memcpy(packet.payload, &rand, sizeof(rand));
+  memcpy(state.sensor_id, rand.sensor_id, SIZE_SENSOR_ID);
+  session_t * session = session_seen(&state.sessions, rand.sensor_id, 60, timer_now());
+
+#if CHALLENGE_ACK
+  extern uint32_t mock_radio_ramp_us;  /* hw_mock.c */
+
+  mock_rx_hook = kiwiki_test_ack_hook;
+
+  /* Acked first time: one send, and the radio turned straight round */
+  ack_ignore = 0;
+  ack_listens = 0;
+  tx = mock_tx_count;
+  TEST_EQ(kiwiki_receive_random(&state, &packet), CHALLENGE_ACKED);
+  TEST_EQ(mock_tx_count - tx, 1);
+  TEST_EQ(ack_listens, 1);
+  TEST_EQ(state.acks, 1);
+  TEST_EQ(state.retransmits, 0);
+
+  /* The window counts from the end of the send: a ramp that eats it is a miss */
+  mock_radio_ramp_us = ACK_LISTEN_US + 1;
+  rx = mock_rx_count;
+  TEST_EQ(kiwiki_receive_random(&state, &packet), CHALLENGE_UNACKED);
+  TEST_EQ(mock_rx_count - rx, 0);
+  mock_radio_ramp_us = 130;
+  session->ack_misses = 0;
+  state.retransmits = 0;
+
+  /* The first ack went missing: sent again */
+  ack_ignore = 1;
+  tx = mock_tx_count;
+  kiwiki_receive_random(&state, &packet);
+  TEST_EQ(mock_tx_count - tx, 2);
+  TEST_EQ(state.acks, 2);
+  TEST_EQ(state.retransmits, 1);
+  TEST_EQ(session->ack_misses, 0);
+
+  /* A sensor that doesn't ack: the full retries, a few times... */
+  ack_ignore = INT32_MAX;
+  for (int i = 0; i < ACK_GIVE_UP; i++)
+  {
+    tx = mock_tx_count;
+    TEST_EQ(kiwiki_receive_random(&state, &packet), CHALLENGE_UNACKED);
+    TEST_EQ(mock_tx_count - tx, 1 + ACK_RETRIES);
+  }
+  TEST_EQ(session->ack_misses, ACK_GIVE_UP);
+  TEST_EQ(session_no_ack(&state.sessions, rand.sensor_id), true);
+  TEST_EQ(state.acks, 2);
+
+  /* ...then it gets plain challenges, and we don't wait about */
+  tx = mock_tx_count;
+  rx = mock_rx_count;
+  TEST_EQ(kiwiki_receive_random(&state, &packet), CHALLENGE_SENT);
+  TEST_EQ(mock_tx_count - tx, 1);
+  TEST_EQ(mock_rx_count - rx, 0);
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('C'));
+
+  /* Through a System OFF too, with the sessions gone */
+  {
+    extern uint32_t mock_resetreas;  /* hw_mock.c */
+    ki_state_t woken;
+
+    kiwiki_save_warm(&state);
+    mock_resetreas = POWER_RESETREAS_OFF_Msk;
+    kiwiki_setup_state(&woken);
+    mock_resetreas = 0;
+    TEST_EQ(woken.sessions.count, 0);
+    TEST_EQ(session_no_ack(&woken.sessions, rand.sensor_id), true);
+  }
+
+  /* A door we've no record of still gets its retries */
+  ack_ignore = 1;
+  session_init(&state.sessions);
+  tx = mock_tx_count;
+  kiwiki_receive_random(&state, &packet);
+  TEST_EQ(mock_tx_count - tx, 2);
+
+  mock_rx_hook = NULL;
+#else
+  /* Sensors don't ack yet: send once, and don't listen for one */
+  tx = mock_tx_count;
+  rx = mock_rx_count;
+  TEST_EQ(kiwiki_receive_random(&state, &packet), CHALLENGE_SENT);
+  TEST_EQ(mock_tx_count - tx, 1);
+  TEST_EQ(mock_rx_count - rx, 0);
+  TEST_EQ(state.acks, 0);
+  (void)session;
+#endif
+  RadioPtr->RSSISAMPLE = 0;
+  sched_init();
+}
+
+/*
+ * A challenge that might not have got there doesn't hold the door off:
+ * the next wake tries again
+ */
+TEST(kiwiki_test_holdoff_needs_ack, 0, 0)
+{
+  beacon_v2_packet_t beacon = {
+    .sensor_id = { 0x12, 0x34, 0x56, 0x78 },
+    .version = PROTOCOL_VERSION_2,
+  };
+  radio_packet_t packet;
+  ki_state_t state;
+  session_t * session;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  RadioPtr->RSSISAMPLE = LBT_RSSI_CLEAR + 10;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  state.is_tracked_ki = 0;
+  memcpy(packet.payload, &beacon, sizeof(beacon));
+  session = session_seen(&state.sessions, beacon.sensor_id, 60, timer_now());
+
+#if CHALLENGE_ACK
+  /* Never acked: done for this wake, but not held off */
+  kiwiki_receive_beacon_v2(&state, &packet);
+  TEST_EQ(session->challenged, false);
+  TEST_EQ(session_should_answer(&state.sessions, session, timer_now()), false);
+  session_new_wake(&state.sessions);
+  TEST_EQ(session_should_answer(&state.sessions, session, timer_now()), true);
+
+  /* A door that can't ack: challenged, but no telling it opened either */
+  session_set_no_ack(&state.sessions, beacon.sensor_id);
+#else
+  /* Nobody acks: challenged, but no telling the door opened either */
+#endif
+  kiwiki_receive_beacon_v2(&state, &packet);
+  TEST_EQ(session->challenged, true);
+  session_new_wake(&state.sessions);
+  TEST_EQ(session_held_off(&state.sessions, session, timer_now()), false);
+  TEST_EQ(session_should_answer(&state.sessions, session, timer_now()), true);
+
+  RadioPtr->RSSISAMPLE = 0;
+  sched_init();
 }
 
 TEST(kiwiki_test_calculate_combikey, 0, 0)
@@ -184,23 +495,1005 @@ TEST(kiwiki_test_has_been_manufactured, 0, 0)
 TEST(kiwiki_test_update_doubletap_timer, 0, 0)
 {
   ki_state_t state;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
   kiwiki_setup_state(&state);
 
   /* Test that with no double tap, nothing happens */
   double_tap_pin_status = PIN_DEFAULT;
-  kiwiki_update_doubletap_timer(&state, 0);
+  kiwiki_update_doubletap_timer(&state);
   TEST_EQ(state.double_tap_challenges, SEND_NORMAL_CHALLENGES);
 
   /* Test what with a double tap, it changes the challenges */
   double_tap_pin_status = PIN_DETECTED;
-  kiwiki_update_doubletap_timer(&state, 0);
+  mock_acc_tapped = 1;
+  TEST_EQ(kiwiki_update_doubletap_timer(&state), true);
   TEST_EQ(state.double_tap_challenges, SEND_DOUBLE_TAP_CHALLENGES);
+  TEST_EQ(state.double_tap_burst_until - timer_now64(),
+          TIMER_MS_TO_TICKS(DOUBLE_TAP_BURST_TIME));
+
+  /* The fast polling burst runs out before the double tap challenges do */
+  hw_rtc_advance(TIMER_MS_TO_TICKS(DOUBLE_TAP_BURST_TIME));
+  TEST_EQ(kiwiki_update_doubletap_timer(&state), false);
+  TEST_EQ(timer_now64() >= state.double_tap_burst_until, true);
+  TEST_EQ(state.double_tap_challenges, SEND_DOUBLE_TAP_CHALLENGES);
+
+  /* Start over */
+  double_tap_pin_status = PIN_DETECTED;
+  mock_acc_tapped = 1;
+  kiwiki_update_doubletap_timer(&state);
 
-  /* Make sure it goes back to normal */
+  /* Make sure it goes back to normal, and not a tick early */
   double_tap_pin_status = PIN_DEFAULT;
-  kiwiki_update_doubletap_timer(&state, DOUBLE_TAP_TIME);
+  hw_rtc_advance(TIMER_MS_TO_TICKS(DOUBLE_TAP_TIME) - 1);
+  kiwiki_update_doubletap_timer(&state);
   TEST_EQ(state.double_tap_challenges, SEND_DOUBLE_TAP_CHALLENGES);
-  kiwiki_update_doubletap_timer(&state, 0);
+  hw_rtc_advance(1);
+  kiwiki_update_doubletap_timer(&state);
   TEST_EQ(state.double_tap_challenges, SEND_NORMAL_CHALLENGES);
 
+  sched_init();
+}
+
+extern uint8_t acc_inactive_level; /* hw_mock.c */
+
+TEST(kiwiki_test_acc_profile, 0, 0)
+{
+  ki_state_t state;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_reseed_phase(&state);
+
+  /* We start out matching what LIS2DH_init sets up */
+  TEST_EQ(state.acc_profile, LIS2DH_PROFILE_DOUBLE_TAP);
+
+  /* Switching profiles is remembered */
+  kiwiki_set_acc_profile(&state, LIS2DH_PROFILE_WAKE_ON_MOTION);
+  TEST_EQ(state.acc_profile, LIS2DH_PROFILE_WAKE_ON_MOTION);
+
+  /* Awake, even nowhere near a door, double taps get the full ODR */
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+  state.double_tap_challenges = SEND_NORMAL_CHALLENGES;
+  state.door_prox_state = NOT_IN_FRONT_OF_DOOR;
+  TEST_EQ(kiwiki_sleep_enter(&state), true);
+  TEST_EQ(state.acc_profile, LIS2DH_PROFILE_DOUBLE_TAP);
+  kiwiki_sleep_exit(&state);
+
+  sched_init();
+}
+
+TEST(kiwiki_test_acc_inactive, 0, 0)
+{
+  ki_state_t state;
+  kiwiki_setup_state(&state);
+
+  /* Moving about, nothing happens */
+  acc_inactive_level = 0;
+  TEST_EQ(kiwiki_acc_inactive(&state), false);
+
+  /* A single high read could be a double tap */
+  acc_inactive_level = 1;
+  TEST_EQ(kiwiki_acc_inactive(&state), ACC_INACTIVE_PASSES <= 1);
+
+  /* Seeing it for long enough means we're lying still */
+  TEST_EQ(kiwiki_acc_inactive(&state), true);
+
+  /* And any activity starts the count again */
+  acc_inactive_level = 0;
+  TEST_EQ(kiwiki_acc_inactive(&state), false);
+  TEST_EQ(state.inactive_passes, 0);
+}
+
+extern bool mock_double_tap_sense;      /* hw_mock.c */
+
+/*
+ * INT2 carries both double taps and the activity status. A tap holds it
+ * high too, till CLICK_SRC is read, and mustn't send us to System OFF.
+ */
+TEST(kiwiki_test_acc_tap_not_inactive, 0, 0)
+{
+  ki_state_t state;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_reseed_phase(&state);
+  movement_pin_status = PIN_DEFAULT;
+  acc_inactive_level = 0;
+
+  /* The activity status going high isn't a tap */
+  acc_inactive_level = 1;
+  double_tap_pin_status = PIN_DETECTED;
+  TEST_EQ(kiwiki_acc_double_tapped(&state), false);
+
+  /* A tap is, and then two sleep passes */
+  acc_inactive_level = 0;
+  double_tap_pin_status = PIN_DETECTED;
+  mock_acc_tapped = 1;
+  TEST_EQ(kiwiki_sleep_enter(&state), false);
+  TEST_EQ(power_mode() == POWER_MODE_SYSTEM_OFF, false);
+  TEST_EQ(state.double_tap_challenges, SEND_DOUBLE_TAP_CHALLENGES);
+  TEST_EQ(kiwiki_sleep_enter(&state), true);
+  TEST_EQ(power_mode() == POWER_MODE_SYSTEM_OFF, false);
+  TEST_EQ(mock_double_tap_sense, true);
+  kiwiki_sleep_exit(&state);
+
+  /* Lying still: we stop sensing INT2, so movement on INT1 gets through */
+  acc_inactive_level = 1;
+  kiwiki_sleep_enter(&state);
+  TEST_EQ(state.inactive_passes, 1);
+  TEST_EQ(mock_double_tap_sense, false);
+  kiwiki_sleep_exit(&state);
+
+  /* A tap we weren't sensing for still isn't lying still */
+  acc_inactive_level = 0;
+  mock_acc_tapped = 1;
+  kiwiki_sleep_enter(&state);
+  TEST_EQ(power_mode() == POWER_MODE_SYSTEM_OFF, false);
+  TEST_EQ(state.inactive_passes, 0);
+  TEST_EQ(state.tap_pending, true);
+  TEST_EQ(mock_double_tap_sense, true);
+  kiwiki_sleep_exit(&state);
+
+  double_tap_pin_status = PIN_DEFAULT;
+  state.tap_pending = false;
+  sched_init();
+}
+
+TEST(kiwiki_test_handle_event, 0, 0)
+{
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+
+  ki_state_t state;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_start(&state);
+  TEST_EQ(sched_dispatch(), true);
+  uint64_t motionless_until = state.motionless_until;
+
+  /* Keep clear of the deep sleep and the double tap shortcut */
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+
+  /* The step in SLEEP set the alarm clock and left us asleep */
+  TEST_EQ(state.is_sleeping, true);
+  TEST_EQ(state.fsm_state, KI_STATE_SLEEP);
+  TEST_EQ(timer_running(&state.wake_timer), true);
+  TEST_EQ(sched_dispatch(), false);
+
+  /* For a little more or less than the poll interval, but not much */
+  TEST_EQ(state.sleep_time >= POLL_INTERVAL_SHORTEST -
+          (POLL_INTERVAL_SHORTEST >> PHASE_JITTER_SHIFT), true);
+  TEST_EQ(state.sleep_time <= POLL_INTERVAL_SHORTEST +
+          (POLL_INTERVAL_SHORTEST >> PHASE_JITTER_SHIFT), true);
+
+  /* Movement alone doesn't wake us */
+  sched_post(SCHED_EVT_GPIOTE);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_sleeping, true);
+
+  /* Nor does the clock before it's time */
+  hw_rtc_advance(TIMER_MS_TO_TICKS(state.sleep_time - 10));
+  TEST_EQ(sched_dispatch(), false);
+  TEST_EQ(state.is_sleeping, true);
+
+  /* The alarm clock does, and the next step is queued */
+  hw_rtc_advance(TIMER_MS_TO_TICKS(10));
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_sleeping, false);
+  TEST_EQ(state.fsm_state, KI_STATE_LISTEN_BEACON);
+  TEST_EQ(timer_running(&state.wake_timer), false);
+
+  /* The whole sleep counts towards the motionless timeout */
+  TEST_EQ(state.motionless_until, motionless_until);
+  TEST_EQ(state.motionless_until - timer_now64() <=
+          TIMER_MS_TO_TICKS(MOTIONLESS_TIME - state.sleep_time) + 1, true);
+
+  sched_init();
+}
+
+/* The sensor's end of a listen: a packet comes in on pipe */
+static void kiwiki_test_rx(uint8_t pipe, const void * payload, size_t len)
+{
+  memcpy((void *)RadioPtr->PACKETPTR, payload, len);
+  *(uint32_t *)&RadioPtr->RXMATCH = pipe;    /* Read only on the chip */
+  RadioPtr->EVENTS_END = 1;
+  RADIO_IRQHandler();
+}
+
+/*
+ * A listen doesn't wait about: the radio is set going, and its packets
+ * and the listen timer carry the FSM on through the scheduler.
+ */
+TEST(kiwiki_test_listen_events, 0, 0)
+{
+  uint8_t door[SIZE_SENSOR_ID] = { 0x12, 0x34, 0x56, 0x78 };
+  random_packet_t other = {
+    .sensor_id = { 0x87, 0x65, 0x43, 0x21 },
+  };
+  ki_state_t state;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  RadioPtr->RSSISAMPLE = LBT_RSSI_CLEAR + 10;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_start(&state);
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+  state.has_been_manufactured = true;
+  state.is_tracked_ki = 0;
+  state.fsm_state = KI_STATE_LISTEN_BEACON;
+
+  /* The step starts the listen, and leaves nothing to do */
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_listening, true);
+  TEST_EQ(power_mode(), POWER_MODE_RADIO_RX);
+  TEST_EQ(sched_dispatch(), false);
+
+  /* Something that isn't a beacon: still listening */
+  kiwiki_test_rx(RADIO_PIPE_RAND, &other, sizeof(other));
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_listening, true);
+  TEST_EQ(RadioPtr->EVENTS_END, 0);
+  TEST_EQ(sched_dispatch(), false);
+
+  /* A beacon: our random goes out, and the next step listens for theirs */
+  kiwiki_test_rx(RADIO_PIPE_KIWI, door, sizeof(door));
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_listening, false);
+  TEST_EQ(state.fsm_state, KI_STATE_LISTEN_RAND);
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('R'));
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_listening, true);
+
+  /* A random from somebody else's door doesn't end it */
+  kiwiki_test_rx(RADIO_PIPE_RAND, &other, sizeof(other));
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_listening, true);
+
+  /* Nor does the clock, until the whole listen is up */
+  hw_rtc_advance(TIMER_US_TO_TICKS(params_get()->listen_time_random));
+  TEST_EQ(sched_dispatch(), false);
+  TEST_EQ(state.is_listening, true);
+  hw_rtc_advance(1);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_listening, false);
+  TEST_EQ(state.collided, true);
+  TEST_EQ(state.fsm_state, KI_STATE_SLEEP);
+  TEST_EQ(power_mode(), POWER_MODE_CPU);
+
+  /* A packet too late for it is let be, and off to sleep we go */
+  kiwiki_test_rx(RADIO_PIPE_RAND, &other, sizeof(other));
+  while (sched_dispatch());
+  TEST_EQ(state.fsm_state, KI_STATE_SLEEP);
+  TEST_EQ(state.is_sleeping, true);
+  TEST_EQ(state.is_listening, false);
+
+  RadioPtr->RSSISAMPLE = 0;
+  sched_init();
+}
+
+TEST(kiwiki_test_sleep_accounting, 0, 0)
+{
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+
+  ki_state_t state;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_start(&state);
+
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+
+  /* Awake for a while (in odd ticks), then off to sleep */
+  hw_rtc_advance(TIMER_MS_TO_TICKS(37) + 3);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_sleeping, true);
+  TEST_EQ(state.seen_stopwatch, 37);
+
+  /* Movement during the sleep is counted, but doesn't end it */
+  movement_pin_status = PIN_DETECTED;
+  hw_rtc_advance(TIMER_MS_TO_TICKS(20));
+  sched_post(SCHED_EVT_GPIOTE);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_sleeping, true);
+
+  /* A double tap part way through: we count what we really slept */
+  hw_rtc_advance(TIMER_MS_TO_TICKS(30));
+  double_tap_pin_status = PIN_DETECTED;
+  mock_acc_tapped = 1;
+  sched_post(SCHED_EVT_GPIOTE);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(state.is_sleeping, false);
+  TEST_EQ(state.motionless_until - timer_now64(), TIMER_MS_TO_TICKS(MOTIONLESS_TIME) -
+          TIMER_MS_TO_TICKS(20) - TIMER_MS_TO_TICKS(30));
+  TEST_EQ(state.seen_stopwatch, 37 + 50);
+  TEST_EQ(timer_running(&state.wake_timer), false);
+
+  double_tap_pin_status = PIN_DEFAULT;
+  sched_init();
+}
+
+/*
+ * Time is taken off the timers in whole mS, and a pass or two a few ticks
+ * apart mustn't get ahead of the RTC and come back as a huge time.
+ */
+TEST(kiwiki_test_take_time_ticks, 0, 0)
+{
+  ki_state_t state;
+  uint32_t start;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_reseed_phase(&state);
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+  state.seen_stopwatch = 0;
+  start = state.accounted_at = timer_now();
+
+  /* 17 ticks is half a mS: nothing yet, and we stay behind the RTC */
+  hw_rtc_advance(17);
+  kiwiki_sleep_enter(&state);
+  TEST_EQ(state.seen_stopwatch, 0);
+  TEST_EQ((int32_t) (timer_now() - state.accounted_at) >= 0, true);
+
+  /* A few ticks later: now a whole mS, and still not ahead */
+  hw_rtc_advance(5);
+  kiwiki_sleep_exit(&state);
+  TEST_EQ(state.seen_stopwatch, 0);
+  hw_rtc_advance(12);
+  kiwiki_sleep_enter(&state);
+  TEST_EQ(state.seen_stopwatch, 1);
+  TEST_EQ((int32_t) (timer_now() - state.accounted_at) >= 0, true);
+  kiwiki_sleep_exit(&state);
+
+  /* And nothing is lost along the way */
+  hw_rtc_advance(TIMER_MS_TO_TICKS(100) - 34);
+  kiwiki_sleep_enter(&state);
+  TEST_EQ(state.seen_stopwatch, TIMER_TICKS_TO_MS(timer_now() - start));
+  kiwiki_sleep_exit(&state);
+
+  sched_init();
+}
+
+TEST(kiwiki_test_warm_start, 0, 0)
+{
+  extern uint32_t mock_resetreas;  /* hw_mock.c */
+  ki_state_t state;
+  ki_state_t woken;
+
+  kiwiki_setup_state(&state);
+  state.sensor_id[0] = 0x12;
+  state.challenge.sensor_id[0] = 0x12;
+  state.challenge.challenge_key[0] = 0x34;
+  state.ki_random[0] = 0x56;
+  state.door_prox_state = DEFINITELY_IN_FRONT_OF_DOOR;
+  state.seen_stopwatch = 1234;
+  state.packet_stat = PACKET_STAT_MAX;
+  clock_set_prewake_lead(HFCLK_LEAD_MIN + 1);
+
+  /* Back from System OFF: it's all still there */
+  kiwiki_save_warm(&state);
+  mock_resetreas = POWER_RESETREAS_OFF_Msk;
+  kiwiki_setup_state(&woken);
+  TEST_MEM_EQ(&woken.challenge, &state.challenge, sizeof(state.challenge));
+  TEST_MEM_EQ(&woken.sensor_id, &state.sensor_id, sizeof(state.sensor_id));
+  TEST_MEM_EQ(&woken.ki_random, &state.ki_random, sizeof(state.ki_random));
+  TEST_EQ(woken.door_prox_state, DEFINITELY_IN_FRONT_OF_DOOR);
+  TEST_EQ(woken.seen_stopwatch, 1234);
+  TEST_EQ(woken.packet_stat, PACKET_STAT_MAX);
+  TEST_EQ(woken.hfclk_lead, HFCLK_LEAD_MIN + 1);
+
+  /* But only once */
+  mock_resetreas = POWER_RESETREAS_OFF_Msk;
+  kiwiki_setup_state(&woken);
+  TEST_EQ(woken.door_prox_state, state_default.door_prox_state);
+
+  /* And not after any other kind of reset */
+  kiwiki_save_warm(&state);
+  mock_resetreas = POWER_RESETREAS_RESETPIN_Msk;
+  kiwiki_setup_state(&woken);
+  TEST_EQ(woken.seen_stopwatch, state_default.seen_stopwatch);
+  TEST_EQ(woken.hfclk_lead, 0);
+}
+
+/* Ticks from reset until the radio first listens, booting as main does */
+static uint32_t kiwiki_ticks_to_first_listen(ki_state_t * state,
+                                             uint32_t resetreas)
+{
+  extern uint32_t mock_resetreas;  /* hw_mock.c */
+  uint32_t start;
+
+  hw_rtc_init();
+  start = hw_rtc_counter();
+  mock_resetreas = resetreas;
+  kiwiki_setup_state(state);
+  if (kiwiki_fast_boot(state))
+  {
+    LIS2DH_ResetLatches();
+  }
+  else
+  {
+    LIS2DH_init();
+  }
+  sched_init();
+  timer_init();
+  power_init();
+  kiwiki_start(state);
+
+  for (int i = 0; i < 10; i++)
+  {
+    for (uint8_t j = 0; j < power_log_count(); j++)
+    {
+      if (power_log_entry(j)->mode == POWER_MODE_RADIO_RX)
+      {
+        return power_log_entry(j)->at - start;
+      }
+    }
+
+    /* Nothing to do, sleep until there is */
+    if (!sched_dispatch())
+    {
+      hw_rtc_advance_to_alarm();
+    }
+  }
+
+  return UINT32_MAX;
+}
+
+TEST(kiwiki_test_fast_boot, 0, 0)
+{
+  extern uint32_t mock_resetreas;       /* hw_mock.c */
+  extern uint32_t hfclk_startup_ticks;  /* hw_mock.c */
+  extern bool using_hfclock;            /* hw_mock.c */
+  ki_state_t state;
+  uint32_t cold;
+  uint32_t fast;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+  hfclk_startup_ticks = 20;
+
+  /* Any old reset: sleep first, then listen */
+  mock_resetreas = POWER_RESETREAS_RESETPIN_Msk;
+  kiwiki_setup_state(&state);
+  TEST_EQ(kiwiki_fast_boot(&state), false);
+  TEST_EQ(state.fsm_state, KI_STATE_SLEEP);
+  using_hfclock = false;
+  cold = kiwiki_ticks_to_first_listen(&state, POWER_RESETREAS_RESETPIN_Msk);
+  /* The first sleep can be jittered short, but no shorter than this */
+  TEST_EQ(cold >= TIMER_MS_TO_TICKS(POLL_INTERVAL_SHORTEST -
+                                    (POLL_INTERVAL_SHORTEST >> PHASE_JITTER_SHIFT)), true);
+
+  /* Picked up: straight to a listen, the accelerometer is as we left it */
+  mock_resetreas = POWER_RESETREAS_OFF_Msk;
+  kiwiki_setup_state(&state);
+  TEST_EQ(kiwiki_fast_boot(&state), true);
+  TEST_EQ(state.fsm_state, KI_STATE_LISTEN_BEACON);
+  TEST_EQ(state.acc_profile, LIS2DH_PROFILE_WAKE_ON_MOTION);
+  using_hfclock = false;
+  mock_acc_tapped = 1;
+  fast = kiwiki_ticks_to_first_listen(&state, POWER_RESETREAS_OFF_Msk);
+  TEST_EQ(fast <= hfclk_startup_ticks, true);
+
+  /* Whatever latched while we were off is let go of */
+  TEST_EQ(mock_acc_tapped, 0);
+
+  _debug_printf("First listen after %d ticks cold, %d ticks from a wake",
+                (int) cold, (int) fast);
+
+  hfclk_startup_ticks = 1;
+  sched_init();
+}
+
+TEST(kiwiki_test_collision_backoff, 0, 0)
+{
+  ki_state_t state;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_reseed_phase(&state);
+
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+
+  /* Our random went unanswered: a short random sleep, just the once */
+  for (int i = 0; i < 20; i++)
+  {
+    state.collided = true;
+    TEST_EQ(kiwiki_sleep_enter(&state), true);
+    TEST_EQ(state.sleep_time < POLL_INTERVAL_SHORTEST, true);
+    TEST_EQ(state.collided, false);
+    kiwiki_sleep_exit(&state);
+    movement_pin_status = PIN_DETECTED;
+  }
+
+  sched_init();
+}
+
+TEST(kiwiki_test_waiting_door, 0, 0)
+{
+  ki_state_t state;
+  uint8_t door[SIZE_SENSOR_ID] = { 0x12, 0x34, 0x56, 0x78 };
+  uint16_t spread = POLL_INTERVAL_STANDARD >> PHASE_JITTER_SHIFT;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_reseed_phase(&state);
+
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+  state.door_prox_state = NOT_IN_FRONT_OF_DOOR;
+  state.packet_stat = 0;
+
+  /* Nobody about: the usual poll */
+  TEST_EQ(kiwiki_sleep_enter(&state), true);
+  TEST_EQ(state.sleep_time >= POLL_INTERVAL_STANDARD - spread, true);
+  kiwiki_sleep_exit(&state);
+  movement_pin_status = PIN_DETECTED;
+
+  /* A door we heard but didn't get to: come back sooner */
+  session_t * session = session_seen(&state.sessions, door, 80, timer_now());
+  TEST_EQ(kiwiki_sleep_enter(&state), true);
+  TEST_EQ(state.sleep_time <= POLL_INTERVAL_SHORT + PHASE_JITTER_MIN +
+                              (POLL_INTERVAL_SHORT >> PHASE_JITTER_SHIFT), true);
+  kiwiki_sleep_exit(&state);
+  movement_pin_status = PIN_DETECTED;
+
+  /* Once it's had its challenge, back to normal */
+  session_challenged(session, timer_now(), false);
+  TEST_EQ(kiwiki_sleep_enter(&state), true);
+  TEST_EQ(state.sleep_time >= POLL_INTERVAL_STANDARD - spread, true);
+  kiwiki_sleep_exit(&state);
+
+  sched_init();
+}
+
+/*
+ * Charge (nC) for so long in a power mode: a back of the envelope model
+ * of a poll, using the same currents as power.c
+ */
+static uint64_t kiwiki_sim_charge(power_mode_t mode, uint32_t us)
+{
+  return (uint64_t) power_config(mode)->current_ua * us / 1000;
+}
+
+/*
+ * A minute in front of a door we've opened, fidgeting (so no System OFF),
+ * polling every POLL_INTERVAL_LONG. Every poll hears the beacon; without
+ * the hold-off, each one goes on to a full v1 handshake as well.
+ */
+static uint64_t kiwiki_sim_door_minute(uint32_t holdoff_ms, uint16_t * handshakes)
+{
+  enum
+  {
+    SIM_RAMP_US = 140,            /* Radio ramp up, either way */
+    SIM_BYTE_US = 4,              /* On air at 2Mbit */
+    SIM_OVERHEAD_BYTES = 7,       /* Preamble, address, CRC */
+    SIM_SENSOR_REPLY_US = 2000,   /* Sensor turnaround for its random */
+    SIM_AES_US = 50,              /* One ECB block, with setup */
+    SIM_LBT_US = SIM_RAMP_US + 10,
+  };
+  uint8_t door[SIZE_SENSOR_ID] = { 0x12, 0x34, 0x56, 0x78 };
+  session_table_t table;
+  uint64_t nc = 0;
+  uint32_t now = 0;
+  uint32_t poll = TIMER_MS_TO_TICKS(POLL_INTERVAL_LONG);
+
+  session_init(&table);
+  session_set_holdoff(&table, holdoff_ms);
+  *handshakes = 0;
+
+  for (uint32_t t = 0; t < TIMER_MS_TO_TICKS(60000); t += poll, now += poll)
+  {
+    session_t * session = session_seen(&table, door, 60, now);
+
+    /* The beacon comes halfway through the listen, on average */
+    nc += kiwiki_sim_charge(POWER_MODE_RADIO_RX,
+                            SIM_RAMP_US + LISTEN_TIME_BEACON / 2);
+
+    if (session_should_answer(&table, session, now))
+    {
+      /* RAND out, their random back, combikey cached, challenge out */
+      nc += kiwiki_sim_charge(POWER_MODE_RADIO_RX, 2 * SIM_LBT_US);
+      nc += kiwiki_sim_charge(POWER_MODE_RADIO_TX, SIM_RAMP_US +
+              (SIM_OVERHEAD_BYTES + sizeof(random_packet_t)) * SIM_BYTE_US);
+      nc += kiwiki_sim_charge(POWER_MODE_RADIO_RX,
+                              SIM_RAMP_US + SIM_SENSOR_REPLY_US);
+      nc += kiwiki_sim_charge(POWER_MODE_CPU, SIM_AES_US);
+      nc += kiwiki_sim_charge(POWER_MODE_RADIO_TX, SIM_RAMP_US +
+              (SIM_OVERHEAD_BYTES + sizeof(challenge_packet_t)) * SIM_BYTE_US);
+      session_challenged(session, now, true);
+      (*handshakes)++;
+    }
+    session_new_wake(&table);
+
+    nc += kiwiki_sim_charge(POWER_MODE_LIGHT_SLEEP, POLL_INTERVAL_LONG * 1000);
+  }
+
+  return nc;
+}
+
+TEST(kiwiki_test_holdoff_energy, 0, 0)
+{
+  uint16_t without_count;
+  uint16_t with_count;
+  uint64_t without = kiwiki_sim_door_minute(0, &without_count);
+  uint64_t with = kiwiki_sim_door_minute(HANDSHAKE_HOLDOFF, &with_count);
+
+  if (test_verbose)
+  {
+    printf("A minute at an open door: %d handshakes %d uC without hold-off, "
+           "%d handshakes %d uC with (%d%% less)\n",
+           without_count, (int)(without / 1000), with_count, (int)(with / 1000),
+           (int)(100 - with * 100 / without));
+  }
+
+  /* One handshake per hold-off window, rather than one per poll */
+  TEST_EQ(with_count, (60000 + HANDSHAKE_HOLDOFF - 1) / HANDSHAKE_HOLDOFF);
+  TEST_EQ(without_count > 4 * with_count, true);
+  TEST_EQ(with * 100 / without < 70, true);
+}
+
+TEST(kiwiki_test_params, 0, 0)
+{
+  ki_state_t state;
+  params_block_t block;
+  params_t slow = *params_get();
+  volatile radio_packet_t mm_packet;
+  manufacturing_params_packet_t * mm_params =
+    (manufacturing_params_packet_t *) mm_packet.payload;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_reseed_phase(&state);
+
+  /* A site that polls less often when nobody is about */
+  slow.poll_interval_standard = 2950;
+  slow.motionless_time = 10000;
+  TEST_EQ(params_seal(&block, &slow), true);
+  TEST_EQ(params_load(&block), true);
+
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+  state.door_prox_state = NOT_IN_FRONT_OF_DOOR;
+  state.packet_stat = 0;
+
+  TEST_EQ(kiwiki_sleep_enter(&state), true);
+  TEST_EQ(state.sleep_time >= 2950 - (2950 >> PHASE_JITTER_SHIFT), true);
+  TEST_EQ(state.motionless_until - timer_now64(), TIMER_MS_TO_TICKS(10000));
+  kiwiki_sleep_exit(&state);
+
+  /* Knobs from the manufacturing machine for another Ki are ignored */
+  memset((void *)&mm_packet, 0, sizeof(mm_packet));
+  mm_params->hw_id[0] = hw_ficr_deviceid(0) + 1;
+  mm_params->hw_id[1] = hw_ficr_deviceid(1);
+  mm_params->version = PARAMS_VERSION;
+  mm_params->params = slow;
+  TEST_EQ(kiwiki_process_mm_params(&state, &mm_packet), false);
+
+  /* So are ones for us from another firmware, or ones we can't run with */
+  mm_params->hw_id[0] = hw_ficr_deviceid(0);
+  mm_params->version = PARAMS_VERSION + 1;
+  TEST_EQ(kiwiki_process_mm_params(&state, &mm_packet), false);
+  mm_params->version = PARAMS_VERSION;
+  mm_params->params.poll_interval_standard = 0;
+  TEST_EQ(kiwiki_process_mm_params(&state, &mm_packet), false);
+
+  /* A fresh boot with nothing in flash is back on the defaults */
+  kiwiki_setup_state(&state);
+  TEST_EQ(params_get()->poll_interval_standard, POLL_INTERVAL_STANDARD);
+  TEST_EQ(state.motionless_until - timer_now64(), TIMER_MS_TO_TICKS(MOTIONLESS_TIME));
+
+  /* Ours are kept, and still there after a reboot */
+  mm_params->params = slow;
+  TEST_EQ(kiwiki_process_mm_params(&state, &mm_packet), true);
+  TEST_EQ(params_get()->poll_interval_standard, 2950);
+  kiwiki_setup_state(&state);
+  TEST_EQ(params_get()->poll_interval_standard, 2950);
+  TEST_EQ(state.motionless_until - timer_now64(), TIMER_MS_TO_TICKS(10000));
+
+  kv_delete(KV_KEY_PARAMS);
+  kiwiki_setup_state(&state);
+  TEST_EQ(params_get()->poll_interval_standard, POLL_INTERVAL_STANDARD);
+
+  sched_init();
+}
+
+TEST(kiwiki_test_listen_before_talk, 0, 0)
+{
+  ki_state_t state;
+  radio_packet_t packet = { .payload = { 0x12, 0x34, 0x56, 0x78 } };
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kiwiki_reseed_phase(&state);
+
+  /* A quiet channel: straight out */
+  RadioPtr->RSSISAMPLE = LBT_RSSI_CLEAR + 10;
+  kiwiki_receive_beacon(&state, &packet);
+  TEST_EQ(state.lbt_deferrals, 0);
+  TEST_EQ(state.lbt_forced, 0);
+  TEST_MEM_EQ(RadioPtr->PACKETPTR, &state.ki_random, SIZE_RANDOM);
+
+  /* A busy one: we wait, but it still goes in the end */
+  RadioPtr->PACKETPTR = 0;
+  RadioPtr->RSSISAMPLE = LBT_RSSI_CLEAR - 30;
+  kiwiki_receive_beacon(&state, &packet);
+  TEST_EQ(state.lbt_deferrals, LBT_ATTEMPTS);
+  TEST_EQ(state.lbt_forced, 1);
+  TEST_MEM_EQ(RadioPtr->PACKETPTR, &state.ki_random, SIZE_RANDOM);
+
+  RadioPtr->RSSISAMPLE = 0;
+  sched_init();
+}
+
+extern int mock_nvmc_erases;            /* nrf_nvmc_mock.c */
+
+/*
+ * Flash work queued up while we're awake is done on the way to sleep, as
+ * much as fits before the crystal has to be back up, and never so much
+ * that we miss the alarm clock.
+ */
+TEST(kiwiki_test_flash_slot, 0, 0)
+{
+  static uint32_t scratch[KV_PAGE_WORDS] __attribute__((aligned(KV_PAGE_SIZE)));
+  flash_job_t erases[5];
+  ki_state_t state;
+  int erased = mock_nvmc_erases;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  flash_init();
+  kiwiki_setup_state(&state);
+  kiwiki_reseed_phase(&state);
+
+  acc_inactive_level = 0;
+  movement_pin_status = PIN_DETECTED;
+  double_tap_pin_status = PIN_DEFAULT;
+
+  for (int i = 0; i < 5; i++)
+  {
+    flash_erase(&erases[i], (uint32_t) scratch, NULL, NULL);
+  }
+
+  /* Polling fast after a double tap: room for two erases a sleep */
+  for (int sleep = 0; sleep < 3; sleep++)
+  {
+    state.double_tap_challenges = SEND_DOUBLE_TAP_CHALLENGES;
+    state.double_tap_burst_until = timer_now64() +
+                                   TIMER_MS_TO_TICKS(DOUBLE_TAP_BURST_TIME);
+
+    TEST_EQ(kiwiki_sleep_enter(&state), true);
+    TEST_EQ(state.sleep_time, DOUBLE_TAP_BURST_INTERVAL);
+    TEST_EQ(mock_nvmc_erases - erased, sleep < 2 ? 2 * (sleep + 1) : 5);
+    TEST_EQ((int32_t) (state.wake_timer.deadline - clock_prewake_lead() -
+                       timer_now()) > 0, true);
+
+    hw_rtc_advance(state.wake_timer.deadline - timer_now());
+    kiwiki_sleep_exit(&state);
+  }
+  TEST_EQ(flash_busy(), false);
+
+  /* Nothing queued: no time taken */
+  state.double_tap_challenges = SEND_DOUBLE_TAP_CHALLENGES;
+  state.double_tap_burst_until = timer_now64() +
+                                 TIMER_MS_TO_TICKS(DOUBLE_TAP_BURST_TIME);
+  uint32_t before = timer_now();
+  kiwiki_sleep_enter(&state);
+  TEST_EQ(timer_now(), before);
+  kiwiki_sleep_exit(&state);
+
+  sched_init();
+}
+
+extern int mock_resets;                 /* hw_mock.c */
+extern bool mock_readback_protected;    /* hw_mock.c */
+
+/*
+ * In rounds, a Ki answers once in its slot, stays put after it has its
+ * secrets, and only reboots once the machine says its confirm was good.
+ */
+TEST(kiwiki_test_mm_rounds, 0, 0)
+{
+  ki_state_t state;
+  volatile radio_packet_t mm_packet;
+  provision_round_packet_t * round =
+    (provision_round_packet_t *) mm_packet.payload;
+  manufacturing_secrets_packet_t * secrets =
+    (manufacturing_secrets_packet_t *) mm_packet.payload;
+  provision_confirm_packet_t * confirm =
+    (provision_confirm_packet_t *) mock_tx_payload;
+  uint32_t hw_id[2] = { hw_ficr_deviceid(0), hw_ficr_deviceid(1) };
+  ki_provision_t stored;
+  int resets = mock_resets;
+  int sent;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kv_delete(KV_KEY_SECRETS);
+
+  /* A legacy uuid request still gets the 50 repeats */
+  memset((void *)&mm_packet, 0, sizeof(mm_packet));
+  memcpy(round->sensor_id, "\x12\x34\x56\x78", SIZE_SENSOR_ID);
+  TEST_EQ(provision_round_valid(round), false);
+  sent = mock_tx_count;
+  kiwiki_process_mm_uuid_req(&state, &mm_packet);
+  TEST_EQ(mock_tx_count - sent, SEND_COUNT_MANUFACTURING);
+  TEST_EQ(state.mm.joined, false);
+
+  /* A wake call: no answer, but we stay on the air */
+  round->version = PROVISION_VERSION;
+  TEST_EQ(provision_round_valid(round), true);
+  sent = mock_tx_count;
+  kiwiki_process_mm_round(&state, &mm_packet);
+  TEST_EQ(mock_tx_count, sent);
+  TEST_EQ(provision_listening(&state.mm, timer_now()), true);
+
+  /* A round: our uuid, once */
+  round->round = 1;
+  round->slots = 16;
+  round->slot_us = PROVISION_SLOT_US_MIN;
+  kiwiki_process_mm_round(&state, &mm_packet);
+  TEST_EQ(mock_tx_count - sent, 1);
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('M'));
+  TEST_MEM_EQ(mock_tx_payload, hw_id, sizeof(hw_id));
+  TEST_EQ(state.mm.slot, provision_slot(hw_id, 0, 16));
+
+  /* Our secrets: stored and protected, but no reboot yet */
+  memset((void *)&mm_packet, 0, sizeof(mm_packet));
+  secrets->ki_id = 0x01020304;
+  memset(secrets->secret, 0xA5, AES_BLOCK_SIZE);
+  secrets->hw_id[0] = hw_id[0];
+  secrets->hw_id[1] = hw_id[1];
+  memcpy(secrets->sensor_id_half, "\x12\x34", 2);
+  mock_readback_protected = false;
+  kiwiki_process_mm_secrets(&state, &mm_packet);
+  TEST_EQ(mock_readback_protected, true);
+  TEST_EQ(mock_resets, resets);
+  TEST_EQ(state.mm.stored, true);
+  TEST_EQ(kv_read(KV_KEY_SECRETS, &stored, sizeof(stored)), true);
+
+  /* The next round: what we read back, on the confirm pipe */
+  memset((void *)&mm_packet, 0, sizeof(mm_packet));
+  memcpy(round->sensor_id, "\x12\x34\x56\x78", SIZE_SENSOR_ID);
+  round->version = PROVISION_VERSION;
+  round->round = 2;
+  round->seed = 7;
+  round->slots = 16;
+  round->slot_us = PROVISION_SLOT_US_MIN;
+  sent = mock_tx_count;
+  kiwiki_process_mm_round(&state, &mm_packet);
+  TEST_EQ(mock_tx_count - sent, 1);
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('F'));
+  TEST_EQ(confirm->round, 2);
+  TEST_EQ(confirm->checksum, crc32(0, &stored, sizeof(stored)));
+  TEST_EQ(confirm->status, PROVISION_STATUS_GOOD);
+
+  /* Somebody else's done bit is no use to us */
+  round->round = 3;
+  provision_set_done(round, (state.mm.slot + 1) % 16);
+  kiwiki_process_mm_round(&state, &mm_packet);
+  TEST_EQ(mock_resets, resets);
+
+  /* Ours is, and off we go */
+  round->round = 4;
+  provision_set_done(round, state.mm.slot);
+  kiwiki_process_mm_round(&state, &mm_packet);
+  TEST_EQ(mock_resets, resets + 1);
+
+  kv_delete(KV_KEY_SECRETS);
+  sched_init();
+}
+
+/*
+ * Outside rounds, a Ki checks what it stored and says so, signed, before
+ * it reboots.
+ */
+TEST(kiwiki_test_mm_secrets_ack, 0, 0)
+{
+  ki_state_t state;
+  volatile radio_packet_t mm_packet;
+  manufacturing_secrets_packet_t * secrets =
+    (manufacturing_secrets_packet_t *) mm_packet.payload;
+  provision_confirm_packet_t * ack =
+    (provision_confirm_packet_t *) mock_tx_payload;
+  uint32_t hw_id[2] = { hw_ficr_deviceid(0), hw_ficr_deviceid(1) };
+  ki_provision_t stored;
+  uint8_t key[AES_BLOCK_SIZE];
+  uint8_t tag[PROVISION_TAG_SIZE];
+  int resets = mock_resets;
+  int sent;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  hw_rtc_init();
+  sched_init();
+  timer_init();
+  kiwiki_setup_state(&state);
+  kv_delete(KV_KEY_SECRETS);
+  memcpy(state.sensor_id, "\x12\x34\x56\x78", SIZE_SENSOR_ID);
+
+  /* Somebody else's secrets: nothing stored, nothing said */
+  memset((void *)&mm_packet, 0, sizeof(mm_packet));
+  secrets->ki_id = 0x01020304;
+  for (int i = 0; i < AES_BLOCK_SIZE; i++)
+  {
+    secrets->secret[i] = i;
+    key[AES_BLOCK_SIZE - 1 - i] = i;
+  }
+  secrets->hw_id[0] = hw_id[0] + 1;
+  secrets->hw_id[1] = hw_id[1];
+  secrets->tracked_ki = 1;
+  memcpy(secrets->sensor_id_half, "\x12\x34", 2);
+  sent = mock_tx_count;
+  kiwiki_process_mm_secrets(&state, &mm_packet);
+  TEST_EQ(mock_tx_count, sent);
+  TEST_EQ(kv_read(KV_KEY_SECRETS, &stored, sizeof(stored)), false);
+
+  /* Ours: stored, protected, acked, then off we go */
+  secrets->hw_id[0] = hw_id[0];
+  mock_readback_protected = false;
+  kiwiki_process_mm_secrets(&state, &mm_packet);
+  TEST_EQ(kv_read(KV_KEY_SECRETS, &stored, sizeof(stored)), true);
+  TEST_MEM_EQ(stored.secrets.private_key, key, AES_BLOCK_SIZE);
+  TEST_EQ(stored.is_tracked_ki, 1);
+  TEST_EQ(mock_readback_protected, true);
+  TEST_EQ(mock_tx_count - sent, SEND_COUNT_PROVISION_ACK);
+  TEST_EQ(mock_tx_prefix0, radio_convert_byte('F'));
+  TEST_EQ(mock_resets, resets + 1);
+
+  /* What we stored, and the machine can tell it was us that said so */
+  TEST_MEM_EQ(ack->hw_id, hw_id, sizeof(hw_id));
+  TEST_EQ(ack->round, 0);
+  TEST_EQ(ack->status, PROVISION_STATUS_GOOD);
+  TEST_EQ(ack->checksum, crc32(0, &stored, sizeof(stored)));
+  provision_tag(hw_id, ack->checksum, ack->status, key, tag);
+  TEST_MEM_EQ(ack->tag, tag, PROVISION_TAG_SIZE);
+
+  kv_delete(KV_KEY_SECRETS);
+  sched_init();
 }
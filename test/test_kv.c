@@ -0,0 +1,338 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "kv.h"
+#include "flash.h"
+
+extern uint32_t kv_flash[KV_PAGES][KV_PAGE_WORDS]; /* kv.c */
+extern int mock_nvmc_erases;                        /* nrf_nvmc_mock.c */
+extern int mock_nvmc_words;                         /* nrf_nvmc_mock.c */
+extern int mock_nvmc_power_left;                    /* nrf_nvmc_mock.c */
+
+/* Straight out of the factory */
+static void kv_test_blank(void)
+{
+  memset(kv_flash, 0xFF, sizeof(kv_flash));
+  mock_nvmc_power_left = -1;
+  kv_init();
+}
+
+TEST(kv_test_put_get, 0, 0)
+{
+  uint8_t secret[20] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+  uint8_t read[KV_VALUE_MAX + 1];
+  uint8_t length;
+  int words;
+
+  kv_test_blank();
+  TEST_EQ(kv_get(KV_KEY_SECRETS, &length) == NULL, true);
+  TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), false);
+
+  TEST_EQ(kv_put(KV_KEY_SECRETS, secret, sizeof(secret)), true);
+  TEST_MEM_EQ(kv_get(KV_KEY_SECRETS, &length), secret, sizeof(secret));
+  TEST_EQ(length, sizeof(secret));
+  TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), true);
+  TEST_MEM_EQ(read, secret, sizeof(secret));
+
+  /* Only the length it was put with */
+  TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret) - 1), false);
+
+  /* A new value replaces the old one */
+  secret[0] = 0x55;
+  TEST_EQ(kv_put(KV_KEY_SECRETS, secret, sizeof(secret)), true);
+  TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), true);
+  TEST_EQ(read[0], 0x55);
+
+  /* Putting the same again costs nothing */
+  words = mock_nvmc_words;
+  TEST_EQ(kv_put(KV_KEY_SECRETS, secret, sizeof(secret)), true);
+  TEST_EQ(mock_nvmc_words, words);
+
+  /* Other keys don't get in the way */
+  TEST_EQ(kv_put(KV_KEY_PARAMS, "knobs", 5), true);
+  TEST_MEM_EQ(kv_get(KV_KEY_PARAMS, NULL), "knobs", 5);
+  TEST_MEM_EQ(kv_get(KV_KEY_SECRETS, NULL), secret, sizeof(secret));
+
+  /* Gone once deleted */
+  TEST_EQ(kv_delete(KV_KEY_PARAMS), true);
+  TEST_EQ(kv_get(KV_KEY_PARAMS, NULL) == NULL, true);
+
+  /* Things we don't keep */
+  TEST_EQ(kv_put(KV_KEY_NONE, secret, 1), false);
+  TEST_EQ(kv_put(KV_KEY_MAX, secret, 1), false);
+  TEST_EQ(kv_put(KV_KEY_PARAMS, read, KV_VALUE_MAX + 1), false);
+}
+
+TEST(kv_test_reboot, 0, 0)
+{
+  uint8_t secret[22] = { 0xAA, 0xBB };
+  uint8_t read[sizeof(secret)];
+  uint16_t free;
+
+  kv_test_blank();
+  kv_put(KV_KEY_SECRETS, secret, sizeof(secret));
+  secret[1] = 0xCC;
+  kv_put(KV_KEY_SECRETS, secret, sizeof(secret));
+  kv_put(KV_KEY_PARAMS, "knobs", 5);
+  kv_delete(KV_KEY_PARAMS);
+  free = kv_free();
+
+  /* Everything is where we left it, and new records go after it */
+  kv_init();
+  TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), true);
+  TEST_MEM_EQ(read, secret, sizeof(secret));
+  TEST_EQ(kv_get(KV_KEY_PARAMS, NULL) == NULL, true);
+  TEST_EQ(kv_free(), free);
+}
+
+TEST(kv_test_compact, 0, 0)
+{
+  uint8_t value[KV_VALUE_MAX];
+  uint8_t read[KV_VALUE_MAX];
+  uint8_t secret[22] = { 0x12, 0x34 };
+  int puts;
+
+  kv_test_blank();
+  mock_nvmc_erases = 0;
+  kv_put(KV_KEY_SECRETS, secret, sizeof(secret));
+
+  /*
+   * A value that keeps changing (a cache, say), enough to go round the
+   * pages a few times
+   */
+  puts = 4 * KV_PAGES * KV_PAGE_WORDS / KV_RECORD_WORDS(KV_VALUE_MAX);
+  for (int i = 0; i < puts; i++)
+  {
+    memset(value, i, sizeof(value));
+    TEST_EQ(kv_put(KV_KEY_PARAMS, value, sizeof(value)), true);
+  }
+
+  TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+  TEST_MEM_EQ(read, value, sizeof(value));
+  TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), true);
+  TEST_MEM_EQ(read, secret, sizeof(secret));
+
+  /* Each compaction erases two pages, and they take turns */
+  TEST_EQ(mock_nvmc_erases >= 2 * (puts / (KV_PAGE_WORDS / KV_RECORD_WORDS(KV_VALUE_MAX))) - 2, true);
+  TEST_EQ(kv_flash[0][0] == KV_MAGIC || kv_flash[1][0] == KV_MAGIC, true);
+
+  if (test_verbose)
+  {
+    printf("%d puts of %d bytes: %d page erases\n", puts, KV_VALUE_MAX,
+           mock_nvmc_erases);
+  }
+
+  /* And after a reboot */
+  kv_init();
+  TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+  TEST_MEM_EQ(read, value, sizeof(value));
+  TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), true);
+  TEST_MEM_EQ(read, secret, sizeof(secret));
+}
+
+/*
+ * Pull the plug at every point of a put that has to compact first: after
+ * a reboot we have either the old value or the new one, never neither,
+ * and the other key is untouched.
+ */
+TEST(kv_test_power_fail, 0, 0)
+{
+  static uint32_t full[KV_PAGES][KV_PAGE_WORDS];
+  uint8_t old_value[KV_VALUE_MAX];
+  uint8_t new_value[KV_VALUE_MAX];
+  uint8_t read[KV_VALUE_MAX];
+  uint8_t secret[22] = { 0x56, 0x78 };
+  int cut;
+  bool done = false;
+
+  memset(old_value, 0x11, sizeof(old_value));
+  memset(new_value, 0x22, sizeof(new_value));
+
+  /* A page with no room for another value */
+  kv_test_blank();
+  kv_put(KV_KEY_SECRETS, secret, sizeof(secret));
+  while (kv_free() >= KV_RECORD_WORDS(KV_VALUE_MAX) * 4)
+  {
+    old_value[0]++;
+    kv_put(KV_KEY_PARAMS, old_value, sizeof(old_value));
+  }
+  memcpy(full, kv_flash, sizeof(full));
+
+  for (cut = 0; !done; cut++)
+  {
+    memcpy(kv_flash, full, sizeof(full));
+    kv_init();
+
+    mock_nvmc_power_left = cut;
+    kv_put(KV_KEY_PARAMS, new_value, sizeof(new_value));
+    done = mock_nvmc_power_left != 0;
+    mock_nvmc_power_left = -1;
+
+    kv_init();
+    TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+    TEST_EQ(!memcmp(read, old_value, sizeof(read)) ||
+            !memcmp(read, new_value, sizeof(read)), true);
+    TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), true);
+    TEST_MEM_EQ(read, secret, sizeof(secret));
+
+    /* And it carries on working */
+    TEST_EQ(kv_put(KV_KEY_PARAMS, new_value, sizeof(new_value)), true);
+    TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+    TEST_MEM_EQ(read, new_value, sizeof(new_value));
+  }
+
+  /* Erase, copy, header, erase, and the record itself */
+  TEST_EQ(cut > 2 + KV_HEADER_WORDS + KV_RECORD_WORDS(KV_VALUE_MAX), true);
+}
+
+TEST(kv_test_corrupt, 0, 0)
+{
+  uint8_t value[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  uint8_t read[8];
+  const uint32_t * latest;
+
+  kv_test_blank();
+  kv_put(KV_KEY_PARAMS, value, sizeof(value));
+  value[0] = 9;
+  kv_put(KV_KEY_PARAMS, value, sizeof(value));
+
+  /* A bit gone in the newer record: the older one stands */
+  latest = kv_get(KV_KEY_PARAMS, NULL);
+  *(uint32_t *) latest &= ~1;
+  kv_init();
+  TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+  TEST_EQ(read[0], 1);
+
+  /* Nonsense where a record should start: no more goes on that page */
+  kv_test_blank();
+  kv_put(KV_KEY_PARAMS, value, sizeof(value));
+  kv_flash[0][KV_HEADER_WORDS + KV_RECORD_WORDS(sizeof(value))] = 0x12345678;
+  kv_init();
+  TEST_EQ(kv_free(), 0);
+  TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+
+  /* So the next put moves on */
+  value[0] = 10;
+  TEST_EQ(kv_put(KV_KEY_PARAMS, value, sizeof(value)), true);
+  TEST_EQ(kv_flash[1][0], KV_MAGIC);
+  kv_init();
+  TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+  TEST_EQ(read[0], 10);
+}
+
+static int later_calls;
+static bool later_ok;
+
+static void kv_test_later_done(kv_key_t key, bool ok, void * ctx)
+{
+  later_calls++;
+  later_ok = ok;
+}
+
+/*
+ * A put a slot at a time, the way the FSM does it between listens: the
+ * old value stands till the new one is down, and a reboot after any slot
+ * finds one or the other.
+ */
+TEST(kv_test_put_later, 0, 0)
+{
+  static uint32_t full[KV_PAGES][KV_PAGE_WORDS];
+  uint8_t old_value[KV_VALUE_MAX];
+  uint8_t new_value[KV_VALUE_MAX];
+  uint8_t read[KV_VALUE_MAX];
+  uint8_t secret[22] = { 0x9A, 0xBC };
+  int slots;
+  bool done = false;
+
+  memset(old_value, 0x33, sizeof(old_value));
+  memset(new_value, 0x44, sizeof(new_value));
+
+  /* Room to spare: just the record */
+  kv_test_blank();
+  flash_init();
+  kv_put(KV_KEY_PARAMS, old_value, sizeof(old_value));
+  later_calls = 0;
+  TEST_EQ(kv_put_later(KV_KEY_PARAMS, new_value, sizeof(new_value),
+                       kv_test_later_done, NULL), true);
+  TEST_EQ(kv_pending(), true);
+  TEST_EQ(kv_put_later(KV_KEY_SECRETS, secret, sizeof(secret), NULL, NULL),
+          false);
+  TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+  TEST_MEM_EQ(read, old_value, sizeof(read));
+
+  flash_run(4 * FLASH_WRITE_US);
+  TEST_EQ(later_calls, 0);
+  flash_flush();
+  TEST_EQ(later_calls, 1);
+  TEST_EQ(later_ok, true);
+  TEST_EQ(kv_pending(), false);
+  TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+  TEST_MEM_EQ(read, new_value, sizeof(read));
+
+  /* Nothing new, nothing written */
+  TEST_EQ(kv_put_later(KV_KEY_PARAMS, new_value, sizeof(new_value),
+                       kv_test_later_done, NULL), true);
+  TEST_EQ(later_calls, 2);
+  TEST_EQ(flash_busy(), false);
+
+  /* A page with no room for another value, so it compacts first */
+  kv_test_blank();
+  kv_put(KV_KEY_SECRETS, secret, sizeof(secret));
+  while (kv_free() >= KV_RECORD_WORDS(KV_VALUE_MAX) * 4)
+  {
+    old_value[0]++;
+    kv_put(KV_KEY_PARAMS, old_value, sizeof(old_value));
+  }
+  memcpy(full, kv_flash, sizeof(full));
+
+  /* Slots about as long as an erase, cut short after each one */
+  for (slots = 0; !done; slots++)
+  {
+    memcpy(kv_flash, full, sizeof(full));
+    flash_init();
+    kv_init();
+    later_calls = 0;
+
+    kv_put_later(KV_KEY_PARAMS, new_value, sizeof(new_value),
+                 kv_test_later_done, NULL);
+    for (int slot = 0; slot < slots && kv_pending(); slot++)
+    {
+      flash_run(FLASH_ERASE_US + 3000);
+
+      /* Whatever's in flash, the value is there to be read */
+      TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), true);
+      TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+    }
+    done = !kv_pending();
+
+    flash_init();
+    kv_init();
+    TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+    TEST_EQ(!memcmp(read, old_value, sizeof(read)) ||
+            !memcmp(read, new_value, sizeof(read)), true);
+    TEST_EQ(kv_read(KV_KEY_SECRETS, read, sizeof(secret)), true);
+    TEST_MEM_EQ(read, secret, sizeof(secret));
+  }
+
+  /* It got there in the end, a few slots on */
+  TEST_EQ(later_calls, 1);
+  TEST_EQ(later_ok, true);
+  TEST_EQ(kv_read(KV_KEY_PARAMS, read, sizeof(read)), true);
+  TEST_MEM_EQ(read, new_value, sizeof(read));
+  TEST_EQ(slots > 2, true);
+
+  if (test_verbose)
+  {
+    printf("Compacting put took %d slots of %dmS\n", slots - 1,
+           (FLASH_ERASE_US + 3000) / 1000);
+  }
+}
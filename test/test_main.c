@@ -4,7 +4,13 @@
 #include "hw.h"
 #include "spi_master.h"
 #include "lis2dh_driver.h"
+#include "sched.h"
+#include "timer.h"
+#include "clock.h"
+#include "power.h"
+#include "battery.h"
 #include "nrf51.h"
+#include "nrf51_bitfields.h"
 #include "debug.h"
 #include <unistd.h>
 #include <sys/mman.h>
@@ -21,6 +27,7 @@ struct kiwi_test_shm {
   bool should_quit;
   bool accl_double_tap_int;
   bool accl_movement_int;
+  bool beacon_v2;             /* Be a v2 sensor: the random rides in the beacon */
 };
 
 struct kiwi_test_shm *sptr;
@@ -39,7 +46,11 @@ volatile bool has_packet;
 radio_packet_t packet;
 ki_state_t * mState;
 bool steady_state_test = false;
+bool steady_beacon_v2 = false;
+void hw_mock_wait_stats(uint64_t * spin_us, uint64_t * sleep_us); /* hw_mock.c */
+extern uint32_t mock_resetreas; /* hw_mock.c */
 extern NRF_RADIO_Type *RadioPtr;
+extern void RADIO_IRQHandler(void); /* radio.c */
 
 
 #define MOVEMENT_INTERVAL 45
@@ -103,12 +114,27 @@ void *beacon(void * a)
     {
       has_packet = true;
       /* copy something into packet */
-      packet.pipe = 0;
       packet.rssi = 0;
-      packet.payloadLength = 4;
 
       uint8_t door_id[4] = { 0x01, 0x02, 0x03, 0x04 };
-      memcpy(packet.payload, door_id, 4);
+      if (sptr->beacon_v2)
+      {
+        beacon_v2_packet_t beacon = {
+          .version = PROTOCOL_VERSION_2,
+          .random = { 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17 },
+        };
+        memcpy(beacon.sensor_id, door_id, 4);
+
+        packet.pipe = RADIO_PIPE_KIWI_V2;
+        packet.payloadLength = sizeof(beacon_v2_packet_t);
+        memcpy(packet.payload, &beacon, sizeof(beacon_v2_packet_t));
+      }
+      else
+      {
+        packet.pipe = 0;
+        packet.payloadLength = 4;
+        memcpy(packet.payload, door_id, 4);
+      }
 
     }
     usleep(10);
@@ -185,8 +211,9 @@ void *listen(void * a)
           memcpy((void *)rptr->PACKETPTR, &packet, sizeof(radio_packet_t));
           has_packet = false;
 
-          /* Mark the packet as recieved */
+          /* Mark the packet as recieved, and interrupt */
           rptr->EVENTS_END = 1;
+          RADIO_IRQHandler();
          }
     }
     usleep(1);
@@ -242,6 +269,16 @@ void *send(void * a)
         }
         _debug_printf("TX: SENDING CHAL FROM KI%s", "");
       }
+      else if(rptr->PREFIX0 == (uint32_t)radio_convert_byte('V'))
+      {
+        /* Random and challenge in one: straight back to beaconing */
+        if(sptr->autosend)
+        {
+          sptr->send_beacon = true;
+          sptr->send_rand = false;
+        }
+        _debug_printf("TX: SENDING V2 CHAL FROM KI%s", "");
+      }
       else
       {
         _debug_printf("TX: Sending to odd/unknown address?%s", "");
@@ -286,6 +323,16 @@ static void handle_command_line(
         case 's':
           steady_state_test = true;
           break;
+        case 'w':
+          /* Steady state, booting as if the accelerometer woke us */
+          steady_state_test = true;
+          mock_resetreas = POWER_RESETREAS_OFF_Msk;
+          break;
+        case '2':
+          /* Steady state, against a v2 sensor */
+          steady_state_test = true;
+          steady_beacon_v2 = true;
+          break;
       }
     }
   }
@@ -293,7 +340,9 @@ static void handle_command_line(
 
 /* If you provide "-v" on the command line, the test output will be more
  * verbose. If you provide a "-f" followed by a file name on the command line,
- * the test runner will output JUint-style XML to that file. */
+ * the test runner will output JUint-style XML to that file. "-s" runs the
+ * firmware in steady state, and "-w" does the same after a motion wake from
+ * System OFF. "-2" runs it against a sensor sending v2 beacons. */
 int main(int argc, char *argv[])
 {
   char *junit_xml_output_filepath = NULL;
@@ -311,6 +360,7 @@ int main(int argc, char *argv[])
     sptr = mmap(NULL, sizeof(struct kiwi_test_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (sptr == MAP_FAILED) return -1;
     sptr->should_quit = false;
+    sptr->beacon_v2 = steady_beacon_v2;
 
     /* Spin up the autosender */
     if(sptr->autosend)
@@ -322,6 +372,9 @@ int main(int argc, char *argv[])
     /* Redirect the radio to the mmap'd struct */
     RadioPtr = &(sptr->fake_radio_memory);
 
+    /* Nobody else about, unless someone says so */
+    RadioPtr->RSSISAMPLE = LBT_RSSI_CLEAR + 10;
+
     pthread_create(&listen_thread, NULL, listen, NULL);
 
     pthread_create(&send_thread, NULL, send, NULL);
@@ -339,6 +392,10 @@ int main(int argc, char *argv[])
 
     /* ------ main starts here ------- */
 
+    /* For timing how long it takes us to first listen: from reset */
+    uint32_t boot_tick = hw_rtc_counter();
+    bool first_listen_reported = false;
+
     /* KI state stored here */
     ki_state_t state;
     mState = &state;
@@ -352,18 +409,59 @@ int main(int argc, char *argv[])
     /* Set up the radio */
     radio_init();
 
-    /* Set up the accelerometer */
-    LIS2DH_init();
+    /* Set up the accelerometer, unless it has been set up all along */
+    if (kiwiki_fast_boot(&state))
+    {
+      LIS2DH_ResetLatches();
+    }
+    else
+    {
+      LIS2DH_init();
+    }
+
+    /* Set up the event queue, and put the FSM on it */
+    sched_init();
+    timer_init();
+    clock_init();
+    power_init();
+    battery_init();
+    kiwiki_start(&state);
 
     /* FSM */
     while (!sptr->should_quit)
     {
-      kiwiki_step(&state);
+      fsm_state_t last_state = state.fsm_state;
+
+      sched_run();
 
       /* Print the current timestamp and the state
        * We can use this to reconstruct power measurements
        * and behavior */
-      _debug_printf("State after step: %d", state.fsm_state);
+      if (state.fsm_state != last_state)
+      {
+        _debug_printf("State after step: %d", state.fsm_state);
+      }
+
+      /* And how our waiting is split between spinning and sleeping */
+      if (state.fsm_state == KI_STATE_SLEEP && last_state != KI_STATE_SLEEP)
+      {
+        uint64_t spin_us, sleep_us;
+        hw_mock_wait_stats(&spin_us, &sleep_us);
+        _debug_printf("Waited: %llu uS spinning, %llu uS asleep",
+          (unsigned long long) spin_us, (unsigned long long) sleep_us);
+      }
+
+      /* How long from boot until the radio first listened */
+      for (uint8_t i = 0; !first_listen_reported && i < power_log_count(); i++)
+      {
+        const power_log_entry_t * entry = power_log_entry(i);
+        if (entry->mode == POWER_MODE_RADIO_RX)
+        {
+          _debug_printf("First listen %llu uS after boot",
+            (unsigned long long) TIMER_TICKS_TO_US(entry->at - boot_tick));
+          first_listen_reported = true;
+        }
+      }
     }
   }
 
@@ -380,7 +478,9 @@ int main(int argc, char *argv[])
     radio,
     radio_test_convert_byte,
     radio_test_convert_bytes,
-    radio_test_init
+    radio_test_init,
+    radio_test_middle_listen,
+    radio_test_sample_rssi
   );
 
   RUN_TESTS(
@@ -388,11 +488,134 @@ int main(int argc, char *argv[])
     kiwiki_test_step,
     kiwiki_test_setup_state,
     kiwiki_test_receive_beacon,
+    kiwiki_test_receive_beacon_v2,
+    kiwiki_test_sessions,
     kiwiki_test_receive_random,
+    kiwiki_test_challenge_ack,
+    kiwiki_test_holdoff_needs_ack,
     kiwiki_test_calculate_combikey,
     kiwiki_test_calculate_challenge,
     kiwiki_test_has_been_manufactured,
-    kiwiki_test_update_doubletap_timer
+    kiwiki_test_update_doubletap_timer,
+    kiwiki_test_acc_profile,
+    kiwiki_test_acc_inactive,
+    kiwiki_test_acc_tap_not_inactive,
+    kiwiki_test_handle_event,
+    kiwiki_test_listen_events,
+    kiwiki_test_sleep_accounting,
+    kiwiki_test_take_time_ticks,
+    kiwiki_test_warm_start,
+    kiwiki_test_fast_boot,
+    kiwiki_test_collision_backoff,
+    kiwiki_test_waiting_door,
+    kiwiki_test_holdoff_energy,
+    kiwiki_test_params,
+    kiwiki_test_listen_before_talk,
+    kiwiki_test_flash_slot,
+    kiwiki_test_mm_rounds,
+    kiwiki_test_mm_secrets_ack
+  );
+
+  RUN_TESTS(
+    sched,
+    sched_test_dispatch_order,
+    sched_test_coalesce,
+    sched_test_repost,
+    sched_test_unregistered
+  );
+
+  RUN_TESTS(
+    timer,
+    timer_test_now_wraps,
+    timer_test_order,
+    timer_test_stop,
+    timer_test_restart_from_callback,
+    timer_test_far_deadline,
+    timer_test_now64
+  );
+
+  RUN_TESTS(
+    clock,
+    clock_test_cold_start,
+    clock_test_prewake_hit,
+    clock_test_prewake_miss,
+    clock_test_early_wake,
+    clock_test_lfrc_due,
+    clock_test_lfrc_stop_deferred,
+    clock_test_lfrc_drift
+  );
+
+  RUN_TESTS(
+    power,
+    power_test_modes,
+    power_test_dcdc_low_battery,
+    power_test_log,
+    power_test_energy
+  );
+
+  RUN_TESTS(
+    retained,
+    retained_test_crc32,
+    retained_test_save_load,
+    retained_test_corrupt
+  );
+
+  RUN_TESTS(
+    battery,
+    battery_test_curve,
+    battery_test_smoothing,
+    battery_test_governor
+  );
+
+  RUN_TESTS(
+    phase,
+    phase_test_jitter,
+    phase_test_seed,
+    phase_test_population
+  );
+
+  RUN_TESTS(
+    session,
+    session_test_table,
+    session_test_hash,
+    session_test_neighbours,
+    session_test_holdoff,
+    session_test_no_ack,
+    session_test_rssi,
+    session_test_pick,
+    session_test_starvation,
+    session_test_corridor
+  );
+
+  RUN_TESTS(
+    params,
+    params_test_defaults,
+    params_test_round_trip,
+    params_test_corrupt
+  );
+
+  RUN_TESTS(
+    kv,
+    kv_test_put_get,
+    kv_test_reboot,
+    kv_test_compact,
+    kv_test_power_fail,
+    kv_test_corrupt,
+    kv_test_put_later
+  );
+
+  RUN_TESTS(
+    flash,
+    flash_test_order,
+    flash_test_budget,
+    flash_test_chain
+  );
+
+  RUN_TESTS(
+    provision,
+    provision_test_slots,
+    provision_test_round,
+    provision_test_station
   );
 
   TEST_FINALIZE();
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "test.h"
+#include "params.h"
+#include "kiwiki.h"
+
+/* A site that would rather save battery than open quickly */
+static const params_t params_slow =
+{
+  .listen_time_beacon = 1200,
+  .listen_time_random = 8000,
+  .poll_interval_standard = 2950,
+  .poll_interval_short = 950,
+  .poll_interval_shortest = 250,
+  .poll_interval_long = 3950,
+  .maybe_ifod_threshold = 2500,
+  .longtime_ifod_threshold = 8000,
+  .motionless_time = 10000,
+  .packet_stat_thresh = 3,
+  .packet_stat_max = 6,
+  .acc_threshold_lowpwr_g = 0x06,
+  .acc_threshold_movement = 12,
+  .acc_double_tap_threshold = 0x60,
+};
+
+TEST(params_test_defaults, 0, 0)
+{
+  params_block_t erased;
+
+  /* Nothing written: today's values */
+  memset(&erased, 0xFF, sizeof(erased));
+  TEST_EQ(params_load(&erased), false);
+  TEST_EQ(params_get()->listen_time_beacon, LISTEN_TIME_BEACON);
+  TEST_EQ(params_get()->listen_time_random, LISTEN_TIME_RANDOM);
+  TEST_EQ(params_get()->poll_interval_standard, POLL_INTERVAL_STANDARD);
+  TEST_EQ(params_get()->poll_interval_short, POLL_INTERVAL_SHORT);
+  TEST_EQ(params_get()->poll_interval_shortest, POLL_INTERVAL_SHORTEST);
+  TEST_EQ(params_get()->poll_interval_long, POLL_INTERVAL_LONG);
+  TEST_EQ(params_get()->maybe_ifod_threshold, MAYBE_IFOD_THRESHOLD);
+  TEST_EQ(params_get()->longtime_ifod_threshold, LONGTIME_IFOD_THRESHOLD);
+  TEST_EQ(params_get()->motionless_time, MOTIONLESS_TIME);
+  TEST_EQ(params_get()->packet_stat_thresh, PACKET_STAT_THRESH);
+  TEST_EQ(params_get()->packet_stat_max, PACKET_STAT_MAX);
+  TEST_EQ(params_get()->acc_threshold_lowpwr_g, ACC_THRESHOLD_LOWPWR_G);
+  TEST_EQ(params_get()->acc_threshold_movement, ACC_THRESHOLD_MOVEMENT);
+  TEST_EQ(params_get()->acc_double_tap_threshold, ACC_DOUBLE_TAP_THRESHOLD);
+
+  /* The sleep to wake duration we always had */
+  TEST_EQ(params_acc_lowpwr_dur(), 0x3E);
+
+  /* Fits in the words the flash has for it, and over the air */
+  TEST_EQ(sizeof(params_block_t) % 4, 0);
+  TEST_EQ(sizeof(manufacturing_params_packet_t),
+          sizeof(manufacturing_secrets_packet_t));
+}
+
+TEST(params_test_round_trip, 0, 0)
+{
+  params_block_t block;
+  params_block_t erased;
+
+  TEST_EQ(params_seal(&block, &params_slow), true);
+  TEST_EQ(params_valid(&block), true);
+  TEST_EQ(params_load(&block), true);
+  TEST_MEM_EQ(params_get(), &params_slow, sizeof(params_t));
+
+  /* Lying still for longer before System OFF, so does the accelerometer */
+  TEST_EQ(params_acc_lowpwr_dur(), (10000 * ACC_TIMING_ODR_HZ / 1000 - 1) / 8);
+
+  /* Back to the defaults */
+  memset(&erased, 0xFF, sizeof(erased));
+  params_load(&erased);
+  TEST_EQ(params_get()->poll_interval_standard, POLL_INTERVAL_STANDARD);
+}
+
+TEST(params_test_corrupt, 0, 0)
+{
+  params_block_t block;
+  params_t insane = params_slow;
+
+  /* A flipped bit is caught */
+  params_seal(&block, &params_slow);
+  block.params.poll_interval_long ^= 0x10;
+  TEST_EQ(params_load(&block), false);
+  TEST_EQ(params_get()->poll_interval_long, POLL_INTERVAL_LONG);
+
+  /* A block from a firmware with another layout is left alone */
+  params_seal(&block, &params_slow);
+  block.version++;
+  TEST_EQ(params_valid(&block), false);
+  params_seal(&block, &params_slow);
+  block.length--;
+  TEST_EQ(params_valid(&block), false);
+  params_seal(&block, &params_slow);
+  block.magic = 0;
+  TEST_EQ(params_valid(&block), false);
+
+  /* Knobs we couldn't run with are never written */
+  insane.poll_interval_shortest = 0;
+  TEST_EQ(params_seal(&block, &insane), false);
+  insane = params_slow;
+  insane.packet_stat_thresh = insane.packet_stat_max + 1;
+  TEST_EQ(params_seal(&block, &insane), false);
+  insane = params_slow;
+  insane.poll_interval_long = PARAMS_POLL_INTERVAL_MAX + 1;
+  TEST_EQ(params_seal(&block, &insane), false);
+  insane.poll_interval_long = PARAMS_POLL_INTERVAL_MAX;
+  TEST_EQ(params_seal(&block, &insane), true);
+  insane = params_slow;
+  insane.longtime_ifod_threshold = DOOR_SEEN_SW_MAX + 1;
+  TEST_EQ(params_seal(&block, &insane), false);
+  insane = params_slow;
+  insane.motionless_time = 0x8000;
+  TEST_EQ(params_seal(&block, &insane), false);
+  insane = params_slow;
+  insane.acc_double_tap_threshold = 0x80;
+  TEST_EQ(params_seal(&block, &insane), false);
+
+  TEST_EQ(params_get()->acc_double_tap_threshold, ACC_DOUBLE_TAP_THRESHOLD);
+}
@@ -0,0 +1,155 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdio.h>
+#include "test.h"
+#include "phase.h"
+#include "kiwiki.h"
+
+TEST(phase_test_jitter, 0, 0)
+{
+  uint32_t state = phase_seed(1, 2, NULL, 0);
+  uint16_t lowest = UINT16_MAX;
+  uint16_t highest = 0;
+
+  for (int i = 0; i < 1000; i++)
+  {
+    uint16_t t = phase_jitter(&state, 800);
+    lowest = t < lowest ? t : lowest;
+    highest = t > highest ? t : highest;
+  }
+
+  /* +-1/8, and it gets to both ends */
+  TEST_EQ(lowest, 700);
+  TEST_EQ(highest, 900);
+
+  /* Short intervals still get some, but never go to zero */
+  for (int i = 0; i < 100; i++)
+  {
+    uint16_t t = phase_jitter(&state, 50);
+    TEST_EQ(t >= 50 - PHASE_JITTER_MIN && t <= 50 + PHASE_JITTER_MIN, true);
+    TEST_NE(phase_jitter(&state, 2), 0);
+  }
+  TEST_EQ(phase_jitter(&state, 1), 1);
+
+  for (int i = 0; i < 100; i++)
+  {
+    TEST_EQ(phase_backoff(&state, 150) < 150, true);
+  }
+  TEST_EQ(phase_backoff(&state, 0), 0);
+}
+
+TEST(phase_test_seed, 0, 0)
+{
+  uint8_t random[4] = { 1, 2, 3, 4 };
+
+  /* Different Kis, or different luck, start differently */
+  TEST_NE(phase_seed(0xBEEFC007, 0, random, 4),
+          phase_seed(0xBEEFC008, 0, random, 4));
+  TEST_NE(phase_seed(0xBEEFC007, 0, random, 4),
+          phase_seed(0xBEEFC007, 0, random, 3));
+
+  /* And never where xorshift gets stuck */
+  uint32_t state = phase_seed(0, 0, NULL, 0);
+  TEST_NE(state, 0);
+  TEST_NE(phase_next(&state), 0);
+}
+
+/*
+ * Population simulator: a few Kis walk up to a door at the same moment
+ * and poll it for a minute. Each wakes, listens, and answers the next
+ * beacon. Two answering the same beacon is a collision, and neither gets
+ * a random back.
+ */
+enum
+{
+  SIM_KIS = 6,
+  SIM_BEACON_US = 1000,               /* Sensor beacon period */
+  SIM_DURATION_US = 60000000,
+};
+
+/* Collisions per hundred answers */
+static uint32_t phase_simulate(bool decorrelate)
+{
+  uint64_t wake[SIM_KIS];
+  uint32_t phase[SIM_KIS];
+  uint64_t slot[SIM_KIS];
+  uint32_t answers = 0;
+  uint32_t collisions = 0;
+
+  for (int k = 0; k < SIM_KIS; k++)
+  {
+    uint8_t random[4] = { k * 37, k * 11, k, 0x5A };
+    wake[k] = 0;
+    phase[k] = phase_seed(0xBEEF0000 + k, 0x1234, random, sizeof(random));
+  }
+
+  for (;;)
+  {
+    /* Whoever wakes first, and everyone else who'll hear the same beacon */
+    uint64_t first = UINT64_MAX;
+    for (int k = 0; k < SIM_KIS; k++)
+    {
+      slot[k] = (wake[k] / SIM_BEACON_US + 1) * SIM_BEACON_US;
+      first = slot[k] < first ? slot[k] : first;
+    }
+    if (first > SIM_DURATION_US)
+    {
+      break;
+    }
+
+    uint8_t heard = 0;
+    for (int k = 0; k < SIM_KIS; k++)
+    {
+      heard += slot[k] == first;
+    }
+
+    for (int k = 0; k < SIM_KIS; k++)
+    {
+      if (slot[k] != first)
+      {
+        continue;
+      }
+
+      answers++;
+      if (heard > 1)
+      {
+        collisions++;
+
+        /* The old way listened again straight away, now we back off */
+        wake[k] = first + LISTEN_TIME_RANDOM + (decorrelate ?
+          phase_backoff(&phase[k], POLL_INTERVAL_SHORTEST) * 1000ULL : 0);
+      }
+      else
+      {
+        wake[k] = first + LISTEN_TIME_RANDOM + (decorrelate ?
+          phase_jitter(&phase[k], POLL_INTERVAL_SHORTEST) :
+          POLL_INTERVAL_SHORTEST) * 1000ULL;
+      }
+    }
+  }
+
+  return collisions * 100 / answers;
+}
+
+TEST(phase_test_population, 0, 0)
+{
+  uint32_t lockstep = phase_simulate(false);
+  uint32_t decorrelated = phase_simulate(true);
+
+  if (test_verbose)
+  {
+    printf("Collision rate %u%% in lock step, %u%% decorrelated\n",
+           (unsigned) lockstep, (unsigned) decorrelated);
+  }
+
+  /* Kis in lock step never get through, apart they mostly do */
+  TEST_EQ(lockstep, 100);
+  TEST_EQ(decorrelated < 20, true);
+}
@@ -0,0 +1,132 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include "test.h"
+#include "power.h"
+#include "timer.h"
+#include "sched.h"
+#include "hw.h"
+#include "battery.h"
+
+extern bool power_dcdc;                     /* hw_mock.c */
+extern uint8_t power_ram_on;                /* hw_mock.c */
+extern uint8_t power_ram_retain;            /* hw_mock.c */
+extern bool radio_powered;                  /* hw_mock.c */
+extern int power_applied;                   /* hw_mock.c */
+extern uint16_t mock_vdd_mv;                /* hw_mock.c */
+extern void hw_rtc_advance(uint32_t ticks); /* hw_mock.c */
+
+static void setup(void)
+{
+  sched_init();
+  hw_rtc_init();
+  timer_init();
+  battery_init();
+  radio_powered = true;
+  power_applied = 0;
+  power_init();
+}
+
+TEST(power_test_modes, 0, 0)
+{
+  setup();
+  TEST_EQ(power_mode(), POWER_MODE_CPU);
+  TEST_EQ(power_applied, 1);
+  TEST_EQ(power_dcdc, false);
+  TEST_EQ(power_ram_on, POWER_RAM0);
+
+  /* The DC/DC converter only runs under the radio */
+  power_set_mode(POWER_MODE_RADIO_RX);
+  TEST_EQ(power_dcdc, true);
+  power_set_mode(POWER_MODE_RADIO_TX);
+  TEST_EQ(power_dcdc, true);
+  TEST_EQ(radio_powered, true);
+
+  power_set_mode(POWER_MODE_LIGHT_SLEEP);
+  TEST_EQ(power_dcdc, false);
+  TEST_EQ(power_ram_on, POWER_RAM0);
+  TEST_EQ(radio_powered, false);
+
+  power_set_mode(POWER_MODE_SYSTEM_OFF);
+  TEST_EQ(power_ram_retain, power_config(POWER_MODE_SYSTEM_OFF)->ram_retain);
+
+  /* Nothing to do for the mode we're in, or one that doesn't exist */
+  power_applied = 0;
+  power_set_mode(POWER_MODE_SYSTEM_OFF);
+  power_set_mode(POWER_MODE_COUNT);
+  TEST_EQ(power_applied, 0);
+  TEST_EQ(power_mode(), POWER_MODE_SYSTEM_OFF);
+}
+
+TEST(power_test_dcdc_low_battery, 0, 0)
+{
+  /* Too close to 2.1V: the radio goes without the DC/DC converter */
+  mock_vdd_mv = POWER_DCDC_MIN_MV - 1;
+  setup();
+  power_set_mode(POWER_MODE_RADIO_RX);
+  TEST_EQ(power_dcdc, false);
+
+  /* And gets it back once the cell is well clear */
+  mock_vdd_mv = POWER_DCDC_MIN_MV;
+  battery_init();
+  power_set_mode(POWER_MODE_RADIO_TX);
+  TEST_EQ(power_dcdc, true);
+
+  mock_vdd_mv = 3000;
+  sched_init();
+}
+
+TEST(power_test_log, 0, 0)
+{
+  setup();
+  TEST_EQ(power_log_count(), 0);
+  TEST_EQ(power_log_entry(0) == NULL, true);
+
+  hw_rtc_advance(10);
+  power_set_mode(POWER_MODE_RADIO_RX);
+  hw_rtc_advance(20);
+  power_set_mode(POWER_MODE_CPU);
+
+  TEST_EQ(power_log_count(), 2);
+  TEST_EQ(power_log_entry(0)->mode, POWER_MODE_RADIO_RX);
+  TEST_EQ(power_log_entry(1)->mode, POWER_MODE_CPU);
+  TEST_EQ(power_log_entry(1)->at - power_log_entry(0)->at, 20);
+
+  /* When it fills up we keep the newest */
+  for (int i = 0; i < POWER_LOG_SIZE; i++)
+  {
+    power_set_mode(i % 2 ? POWER_MODE_CPU : POWER_MODE_LIGHT_SLEEP);
+  }
+  TEST_EQ(power_log_count(), POWER_LOG_SIZE);
+  TEST_EQ(power_log_entry(0)->mode, POWER_MODE_LIGHT_SLEEP);
+  TEST_EQ(power_log_entry(POWER_LOG_SIZE - 1)->mode, POWER_MODE_CPU);
+  TEST_EQ(power_log_entry(POWER_LOG_SIZE) == NULL, true);
+}
+
+TEST(power_test_energy, 0, 0)
+{
+  setup();
+
+  hw_rtc_advance(RTC_FREQUENCY);
+  power_set_mode(POWER_MODE_RADIO_RX);
+  hw_rtc_advance(RTC_FREQUENCY / 2);
+  power_set_mode(POWER_MODE_LIGHT_SLEEP);
+  hw_rtc_advance(RTC_FREQUENCY * 4);
+
+  TEST_EQ(power_time_in_mode(POWER_MODE_CPU), RTC_FREQUENCY);
+  TEST_EQ(power_time_in_mode(POWER_MODE_RADIO_RX), RTC_FREQUENCY / 2);
+
+  /* The mode we're in counts up to now */
+  TEST_EQ(power_time_in_mode(POWER_MODE_LIGHT_SLEEP), RTC_FREQUENCY * 4);
+
+  TEST_EQ(power_charge_nc(),
+          power_config(POWER_MODE_CPU)->current_ua * 1000ULL +
+          power_config(POWER_MODE_RADIO_RX)->current_ua * 500ULL +
+          power_config(POWER_MODE_LIGHT_SLEEP)->current_ua * 4000ULL);
+}
@@ -0,0 +1,545 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "provision.h"
+#include "kiwiki.h"
+#include "crc.h"
+#include "flash.h"
+
+TEST(provision_test_slots, 0, 0)
+{
+  uint32_t hw_id[2] = { 0xBEEFC007, 0xC0DEBABE };
+  uint8_t used[64];
+  uint8_t seed;
+  bool clash = true;
+
+  /* Always the same slot for the same seed, and in range */
+  TEST_EQ(provision_slot(hw_id, 7, 64), provision_slot(hw_id, 7, 64));
+  TEST_EQ(provision_slot(hw_id, 7, 64) < 64, true);
+  TEST_EQ(provision_slot(hw_id, 7, 0), 0);
+
+  /* Twenty Kis we know of: some seed gives each a slot of its own */
+  for (seed = 0; clash && seed < 255; seed++)
+  {
+    memset(used, 0, sizeof(used));
+    clash = false;
+    for (uint32_t ki = 0; ki < 20; ki++)
+    {
+      hw_id[0] = 0x1000 + ki;
+      clash |= used[provision_slot(hw_id, seed, 64)]++ != 0;
+    }
+  }
+  TEST_EQ(clash, false);
+}
+
+TEST(provision_test_round, 0, 0)
+{
+  provision_state_t mm;
+  provision_round_packet_t round;
+  provision_confirm_packet_t confirm;
+  uint32_t hw_id[2] = { 0xBEEFC007, 0xC0DEBABE };
+  uint8_t record[22] = { 1, 2, 3 };
+  uint8_t wrong[22] = { 1, 2, 4 };
+  uint8_t key[AES_BLOCK_SIZE] = { 0x2B, 0x7E, 0x15, 0x16 };
+  uint8_t tag[PROVISION_TAG_SIZE];
+  uint32_t wait_us = 0;
+
+  provision_init(&mm);
+  memset(&round, 0, sizeof(round));
+
+  /* A legacy uuid request isn't a round */
+  TEST_EQ(provision_round_valid(&round), false);
+  round.version = PROVISION_VERSION;
+  TEST_EQ(provision_round_valid(&round), true);
+  round.slots = 16;
+  round.slot_us = PROVISION_SLOT_US_MIN - 1;
+  TEST_EQ(provision_round_valid(&round), false);
+  round.slot_us = 500;
+  round.slots = PROVISION_SLOTS_MAX + 1;
+  TEST_EQ(provision_round_valid(&round), false);
+
+  /* A wake up call: stay on the air, nothing to say */
+  round.slots = 0;
+  TEST_EQ(provision_heard_round(&mm, &round, hw_id, 1000, &wait_us), false);
+  TEST_EQ(provision_listening(&mm, 1000), true);
+  TEST_EQ(provision_listening(&mm, 1000 + TIMER_MS_TO_TICKS(PROVISION_STAY_MS)),
+          false);
+
+  /* Our slot, after the ones before it */
+  round.round = 1;
+  round.seed = 9;
+  round.slots = 16;
+  TEST_EQ(provision_heard_round(&mm, &round, hw_id, 2000, &wait_us), true);
+  TEST_EQ(wait_us, provision_slot(hw_id, 9, 16) * 500);
+
+  /* Only a confirm gets confirmed... */
+  provision_stored(&mm, hw_id, key, record, record, sizeof(record));
+  TEST_EQ(mm.status, PROVISION_STATUS_GOOD);
+  round.round = 2;
+  provision_set_done(&round, mm.slot);
+  TEST_EQ(provision_confirmed(&mm, &round), false);
+
+  /* ...and says what we read back */
+  provision_heard_round(&mm, &round, hw_id, 3000, &wait_us);
+  provision_confirm(&mm, hw_id, &confirm);
+  TEST_EQ(sizeof(confirm), sizeof(manufacturing_uuid_packet_t));
+  TEST_EQ(confirm.hw_id[1], hw_id[1]);
+  TEST_EQ(confirm.round, 2);
+  TEST_EQ(confirm.checksum, crc32(0, record, sizeof(record)));
+  TEST_EQ(confirm.status, PROVISION_STATUS_GOOD);
+
+  /* ...signed with the key we were sent */
+  provision_tag(hw_id, confirm.checksum, PROVISION_STATUS_GOOD, key, tag);
+  TEST_MEM_EQ(confirm.tag, tag, PROVISION_TAG_SIZE);
+  key[0]++;
+  provision_tag(hw_id, confirm.checksum, PROVISION_STATUS_GOOD, key, tag);
+  TEST_EQ(memcmp(confirm.tag, tag, PROVISION_TAG_SIZE) != 0, true);
+  key[0]--;
+  provision_tag(hw_id, confirm.checksum, PROVISION_STATUS_BAD, key, tag);
+  TEST_EQ(memcmp(confirm.tag, tag, PROVISION_TAG_SIZE) != 0, true);
+
+  /* Done, in the round after, in our slot */
+  memset(round.done, 0, sizeof(round.done));
+  round.round = 3;
+  TEST_EQ(provision_confirmed(&mm, &round), false);
+  provision_set_done(&round, mm.slot + 1);
+  TEST_EQ(provision_confirmed(&mm, &round), false);
+  provision_set_done(&round, mm.slot);
+  TEST_EQ(provision_confirmed(&mm, &round), true);
+  round.round = 4;
+  TEST_EQ(provision_confirmed(&mm, &round), false);
+
+  /* Flash that doesn't read back what we wrote, or at all: say so */
+  provision_stored(&mm, hw_id, key, record, wrong, sizeof(record));
+  TEST_EQ(mm.status, PROVISION_STATUS_BAD);
+  TEST_EQ(mm.checksum, crc32(0, wrong, sizeof(wrong)));
+  provision_stored(&mm, hw_id, key, record, NULL, sizeof(record));
+  TEST_EQ(mm.status, PROVISION_STATUS_BAD);
+  provision_tag(hw_id, 0, PROVISION_STATUS_BAD, key, tag);
+  TEST_MEM_EQ(mm.tag, tag, PROVISION_TAG_SIZE);
+
+  /* And never take a done bit for it */
+  round.round = 5;
+  provision_heard_round(&mm, &round, hw_id, 4000, &wait_us);
+  round.round = 6;
+  provision_set_done(&round, mm.slot);
+  TEST_EQ(provision_confirmed(&mm, &round), false);
+}
+
+/*
+ * A stand-in for the manufacturing machine, and a tray of Kis for it.
+ *
+ * Time goes in uS of air time. The Kis run provision.c as the firmware
+ * does; kiwiki.c only adds the radio to it. Each packet is lost now and
+ * then, and when Kis answer over the top of each other the machine
+ * sometimes still makes one of them out. A few Kis get their secrets
+ * wrong in flash the first time round.
+ */
+enum
+{
+  STATION_KIS = 300,            /* A tray */
+  STATION_AIR_US = 300,         /* A 32 byte packet at 2Mbps, with the ramp up */
+  STATION_REPLY_US = 240,       /* A uuid or confirm */
+  STATION_GAP_US = 50,          /* Between packets */
+  STATION_SLOT_US = 500,
+  STATION_STORE_US = FLASH_ERASE_US + 20 * FLASH_WRITE_US, /* A Ki deaf in kv_put */
+  STATION_LOSS = 50,            /* 1 in this many packets go missing */
+  STATION_BAD_WRITE = 40,       /* 1 in this many Kis store it wrong the first time */
+  STATION_TIME_US = 60000000,   /* How long we run the legacy machine for */
+};
+
+typedef enum
+{
+  STATION_UNKNOWN = 0,          /* Not heard from yet */
+  STATION_NEW,                  /* Have its uuid, secrets to send */
+  STATION_SENT,                 /* Sent, waiting on its confirm */
+  STATION_GOOD,                 /* Its confirm was good: tell it so when we can */
+  STATION_DONE,                 /* Told it so */
+} station_ki_state_t;
+
+typedef struct
+{
+  uint32_t hw_id[2];
+  uint32_t wake_us;             /* When in the poll interval it listens */
+  provision_state_t mm;
+  uint64_t deaf_until;          /* Busy storing */
+  bool bad_write;               /* Stores it wrong, the next time */
+  bool legacy_awake;            /* Legacy: still listening after answering */
+  bool rebooted;                /* Gone off provisioned */
+  bool good;                    /* With the right secrets */
+  uint8_t station_state;        /* station_ki_state_t: what the machine knows */
+} station_ki_t;
+
+static station_ki_t kis[STATION_KIS];
+static uint32_t station_seed;
+
+static uint32_t station_random(void)
+{
+  station_seed = station_seed * 1103515245 + 12345;
+  return station_seed >> 8;
+}
+
+/* A Ki's secrets record, as it should be (or not) */
+static void station_record(const station_ki_t * ki, bool wrong,
+                           ki_provision_t * record)
+{
+  memset(record, 0, sizeof(ki_provision_t));
+  memcpy(record->secrets.key_id, &ki->hw_id[0], SIZE_KI_ID);
+  memcpy(record->secrets.private_key, ki->hw_id, sizeof(ki->hw_id));
+  record->secrets.private_key[AES_BLOCK_SIZE - 1] ^= wrong;
+}
+
+static void station_tray(void)
+{
+  memset(kis, 0, sizeof(kis));
+  station_seed = 4242;
+  for (int i = 0; i < STATION_KIS; i++)
+  {
+    kis[i].hw_id[0] = 0xA0000000 + station_random();
+    kis[i].hw_id[1] = station_random();
+    kis[i].wake_us = station_random() % (POLL_INTERVAL_STANDARD * 1000);
+    kis[i].bad_write = station_random() % STATION_BAD_WRITE == 0;
+  }
+}
+
+/* Does a Ki hear a packet that goes out at now? */
+static bool station_heard(station_ki_t * ki, uint64_t now, bool awake)
+{
+  uint64_t into = (now + POLL_INTERVAL_STANDARD * 1000 - ki->wake_us) %
+                  (POLL_INTERVAL_STANDARD * 1000);
+
+  if (ki->rebooted || now < ki->deaf_until ||
+      station_random() % STATION_LOSS == 0)
+  {
+    return false;
+  }
+  return awake || into + STATION_AIR_US <= LISTEN_TIME_MANUFACTURING;
+}
+
+/* Of the Kis that answered at once, which one (if any) did we hear? */
+static station_ki_t * station_receive(station_ki_t ** answers, int count)
+{
+  if (count == 0 || station_random() % STATION_LOSS == 0)
+  {
+    return NULL;
+  }
+  if (count == 1)
+  {
+    return answers[0];
+  }
+
+  /* Over the top of each other: now and then the closest one gets through */
+  return station_random() % (2 * count) == 0 ?
+         answers[station_random() % count] : NULL;
+}
+
+/* A Ki takes its secrets, and reads back what it stored */
+static void station_store(station_ki_t * ki, uint64_t now)
+{
+  ki_provision_t sent;
+  ki_provision_t readback;
+
+  ki->deaf_until = now + STATION_STORE_US;
+  ki->good = !ki->bad_write;
+  ki->bad_write = false;
+
+  station_record(ki, false, &sent);
+  station_record(ki, !ki->good, &readback);
+  provision_stored(&ki->mm, ki->hw_id, sent.secrets.private_key, &sent,
+                   &readback, sizeof(sent));
+}
+
+/* Is what the Ki read back what we sent it, and is it the Ki saying so? */
+static bool station_confirm_good(station_ki_t * ki)
+{
+  provision_confirm_packet_t confirm;
+  ki_provision_t record;
+  uint8_t tag[PROVISION_TAG_SIZE];
+
+  provision_confirm(&ki->mm, ki->hw_id, &confirm);
+  station_record(ki, false, &record);
+  provision_tag(ki->hw_id, confirm.checksum, confirm.status,
+                record.secrets.private_key, tag);
+  return confirm.status == PROVISION_STATUS_GOOD &&
+         confirm.checksum == crc32(0, &record, sizeof(record)) &&
+         !memcmp(confirm.tag, tag, PROVISION_TAG_SIZE);
+}
+
+/* Might this Ki have its secrets wrong? */
+static bool station_doubtful(const station_ki_t * ki)
+{
+  return ki->station_state == STATION_NEW || ki->station_state == STATION_SENT;
+}
+
+/*
+ * Work out a seed that gives each Ki we know of a slot of its own, or as
+ * near as we can get. doubtful says how many that might have their
+ * secrets wrong ended up in each slot.
+ */
+static uint8_t station_pick_seed(uint8_t slots, uint8_t * doubtful)
+{
+  static uint8_t used[PROVISION_SLOTS_MAX];
+  uint8_t seed = station_random();
+  uint8_t best = seed;
+  int fewest = STATION_KIS + 1;
+
+  for (int tries = 0; tries < 32 && fewest; tries++, seed++)
+  {
+    int clashes = 0;
+
+    memset(used, 0, sizeof(used));
+    for (int i = 0; i < STATION_KIS; i++)
+    {
+      if (kis[i].station_state != STATION_UNKNOWN &&
+          kis[i].station_state < STATION_GOOD)
+      {
+        clashes += used[provision_slot(kis[i].hw_id, seed, slots)]++ != 0;
+      }
+    }
+    if (clashes < fewest)
+    {
+      fewest = clashes;
+      best = seed;
+    }
+  }
+
+  memset(doubtful, 0, PROVISION_SLOTS_MAX);
+  for (int i = 0; i < STATION_KIS; i++)
+  {
+    if (station_doubtful(&kis[i]))
+    {
+      doubtful[provision_slot(kis[i].hw_id, best, slots)]++;
+    }
+  }
+  return best;
+}
+
+/* Rounds, as provision.c describes. Returns the uS it took, 0 if never */
+static uint64_t station_rounds(int * good)
+{
+  static station_ki_t * answers[PROVISION_SLOTS_MAX][STATION_KIS];
+  static uint16_t count[PROVISION_SLOTS_MAX];
+  static uint8_t doubtful[PROVISION_SLOTS_MAX];
+  provision_round_packet_t round;
+  provision_round_packet_t last;
+  uint64_t now = 0;
+  uint8_t number = 0;
+  int left = STATION_KIS;
+
+  memset(&last, 0, sizeof(last));
+
+  while (left && now < STATION_TIME_US)
+  {
+    uint8_t slots = 0;
+    int expected = 0;
+
+    /* The first poll interval just wakes the tray */
+    if (now > (POLL_INTERVAL_STANDARD + 10) * 1000)
+    {
+      for (int i = 0; i < STATION_KIS; i++)
+      {
+        expected += kis[i].station_state < STATION_GOOD;
+      }
+      expected += expected / 2;
+      slots = expected < 8 ? 8 : expected > PROVISION_SLOTS_MAX ?
+              PROVISION_SLOTS_MAX : expected;
+    }
+
+    memset(&round, 0, sizeof(round));
+    round.version = PROVISION_VERSION;
+    round.round = ++number;
+    round.seed = station_pick_seed(slots ? slots : 1, doubtful);
+    round.slots = slots;
+    round.slot_us = STATION_SLOT_US;
+    memcpy(round.done, last.done, sizeof(round.done));
+    memset(last.done, 0, sizeof(last.done));
+    memset(count, 0, sizeof(count));
+
+    for (int i = 0; i < STATION_KIS; i++)
+    {
+      station_ki_t * ki = &kis[i];
+      uint32_t wait_us;
+
+      if (!station_heard(ki, now, provision_listening(&ki->mm,
+                                  TIMER_MS_TO_TICKS(now / 1000))))
+      {
+        continue;
+      }
+      if (provision_confirmed(&ki->mm, &round))
+      {
+        ki->rebooted = true;
+        left--;
+        *good += ki->good;
+        continue;
+      }
+      if (provision_heard_round(&ki->mm, &round, ki->hw_id,
+                                TIMER_MS_TO_TICKS(now / 1000), &wait_us))
+      {
+        uint8_t slot = wait_us / STATION_SLOT_US;
+        answers[slot][count[slot]++] = ki;
+      }
+    }
+    now += STATION_AIR_US + STATION_GAP_US;
+
+    /* What came back in each slot */
+    for (int slot = 0; slot < slots; slot++)
+    {
+      station_ki_t * ki = station_receive(answers[slot], count[slot]);
+
+      if (!ki)
+      {
+        continue;
+      }
+      /* A uuid (on MHAL), or a confirm (on FHAL)? */
+      if (!ki->mm.confirming)
+      {
+        ki->station_state = STATION_NEW;
+      }
+      else if (station_confirm_good(ki))
+      {
+        /*
+         * Not if another Ki in that slot might have its secrets wrong: it
+         * could have been drowned out, and would take the done as its own
+         */
+        ki->station_state = doubtful[slot] - station_doubtful(ki) ?
+                            STATION_GOOD : STATION_DONE;
+        if (ki->station_state == STATION_DONE)
+        {
+          provision_set_done(&last, slot);
+        }
+      }
+      else
+      {
+        /* It has them wrong: again */
+        ki->station_state = STATION_NEW;
+      }
+    }
+    now += slots * STATION_SLOT_US;
+
+    /* Secrets for each Ki that wants them, one packet each */
+    bool sent = false;
+    for (int i = 0; i < STATION_KIS; i++)
+    {
+      station_ki_t * ki = &kis[i];
+
+      if (ki->station_state != STATION_NEW)
+      {
+        continue;
+      }
+      if (station_heard(ki, now, provision_listening(&ki->mm,
+                                 TIMER_MS_TO_TICKS(now / 1000))))
+      {
+        station_store(ki, now);
+      }
+      ki->station_state = STATION_SENT;
+      now += STATION_AIR_US + STATION_GAP_US;
+      sent = true;
+    }
+
+    /* Give them time to store them before the next round */
+    if (sent)
+    {
+      now += STATION_STORE_US;
+    }
+  }
+
+  return left ? 0 : now;
+}
+
+/*
+ * The legacy machine: a uuid request, 50 uuids back from whoever heard
+ * it, then 50 lots of secrets for the one we made out. It never hears
+ * whether they went in.
+ */
+static int station_legacy(int * good)
+{
+  static station_ki_t * answers[STATION_KIS];
+  uint64_t now = 0;
+  uint32_t burst_us = SEND_COUNT_MANUFACTURING *
+                      (STATION_REPLY_US + SEND_SPACING_MANUFACTURING);
+  int done = 0;
+
+  while (now < STATION_TIME_US)
+  {
+    int count = 0;
+    station_ki_t * ki;
+
+    for (int i = 0; i < STATION_KIS; i++)
+    {
+      if (station_heard(&kis[i], now, kis[i].legacy_awake))
+      {
+        kis[i].legacy_awake = true;
+        answers[count++] = &kis[i];
+      }
+      else
+      {
+        kis[i].legacy_awake = false;
+      }
+    }
+    now += STATION_AIR_US + burst_us;
+
+    /* Every copy goes out at the same moment as the others' */
+    ki = NULL;
+    for (int copy = 0; copy < SEND_COUNT_MANUFACTURING && !ki; copy++)
+    {
+      ki = station_receive(answers, count);
+    }
+    if (!ki)
+    {
+      continue;
+    }
+
+    for (int copy = 0; copy < SEND_COUNT_MANUFACTURING; copy++)
+    {
+      if (!ki->rebooted && station_heard(ki, now, true))
+      {
+        station_store(ki, now);
+        ki->rebooted = true;
+        *good += ki->good;
+        done++;
+      }
+      now += STATION_AIR_US + SEND_SPACING_MANUFACTURING;
+    }
+  }
+
+  return done;
+}
+
+TEST(provision_test_station, 0, 0)
+{
+  uint64_t took;
+  int good = 0;
+  int legacy;
+  int legacy_good = 0;
+
+  station_tray();
+  took = station_rounds(&good);
+
+  /* The whole tray, and every one of them with the right secrets */
+  TEST_EQ(took > 0, true);
+  TEST_EQ(good, STATION_KIS);
+
+  station_tray();
+  legacy = station_legacy(&legacy_good);
+
+  if (test_verbose)
+  {
+    printf("%d Kis in rounds: %llu mS, %llu a minute\n", STATION_KIS,
+           (unsigned long long) took / 1000,
+           (unsigned long long) STATION_KIS * 60000000 / took);
+    printf("Legacy: %d a minute, %d of them bad\n", legacy,
+           legacy - legacy_good);
+  }
+
+  TEST_EQ(took < 10000000, true);
+  TEST_EQ((uint64_t) STATION_KIS * 60000000 / took > 10 * legacy, true);
+}
@@ -1,6 +1,7 @@
 #include "test.h"
 #include "radio.h"
 #include "nrf51.h"
+#include "hw.h"
 
 uint8_t fake_radio_memory[sizeof(NRF_RADIO_Type)];
 
@@ -77,3 +78,42 @@ TEST(radio_test_convert_byte, 0, 0)
     TEST_EQ(lut[i], radio_convert_byte(i));
   }
 }
+
+extern void hw_mock_wait_stats(uint64_t * spin_us, uint64_t * sleep_us); /* hw_mock.c */
+
+TEST(radio_test_middle_listen, 0, 0)
+{
+  uint64_t spin_before, sleep_before, spin_after, sleep_after;
+  radio_packet_t packet;
+
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  radio_init();
+
+  /* Nothing heard: we slept through the whole window */
+  hw_mock_wait_stats(&spin_before, &sleep_before);
+  TEST_EQ(radio_middle_listen(&packet, 1000), 0);
+  hw_mock_wait_stats(&spin_after, &sleep_after);
+  TEST_EQ(sleep_after - sleep_before, 1000);
+  TEST_EQ(spin_after - spin_before, 0);
+
+  /* Short waits spin, longer ones sleep */
+  hw_wait_us(HW_WAIT_SPIN_US - 1);
+  hw_wait_us(HW_WAIT_SPIN_US);
+  hw_mock_wait_stats(&spin_before, &sleep_before);
+  TEST_EQ(spin_before - spin_after, HW_WAIT_SPIN_US - 1);
+  TEST_EQ(sleep_before - sleep_after, HW_WAIT_SPIN_US);
+}
+
+TEST(radio_test_sample_rssi, 0, 0)
+{
+  RadioPtr = (NRF_RADIO_Type *)fake_radio_memory;
+  radio_init();
+
+  /* Only the sample bits count */
+  RadioPtr->RSSISAMPLE = 0x80 | 90;
+  TEST_EQ(radio_sample_rssi(), 90);
+
+  /* And we're left ready to send */
+  TEST_EQ(RadioPtr->TASKS_DISABLE, 1);
+  RadioPtr->RSSISAMPLE = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <string.h>
+#include "test.h"
+#include "retained.h"
+#include "crc.h"
+
+extern retained_block_t retained_block; /* retained.c */
+
+TEST(retained_test_crc32, 0, 0)
+{
+  /* The standard check value */
+  TEST_EQ(crc32(0, "123456789", 9), 0xCBF43926);
+
+  /* Carrying on gives the same as doing it in one go */
+  TEST_EQ(crc32(crc32(0, "1234", 4), "56789", 5), 0xCBF43926);
+  TEST_EQ(crc32(0, "", 0), 0);
+}
+
+TEST(retained_test_save_load, 0, 0)
+{
+  uint8_t saved[RETAINED_SIZE];
+  uint8_t loaded[RETAINED_SIZE];
+
+  for (int i = 0; i < RETAINED_SIZE; i++)
+  {
+    saved[i] = i * 7;
+  }
+
+  TEST_EQ(retained_save(saved, 10), true);
+  TEST_EQ(retained_load(loaded, 10), true);
+  TEST_MEM_EQ(loaded, saved, 10);
+
+  /* Something else, or too big, is not what was saved */
+  TEST_EQ(retained_load(loaded, 11), false);
+  TEST_EQ(retained_save(saved, RETAINED_SIZE + 1), false);
+
+  /* The whole thing fits */
+  TEST_EQ(retained_save(saved, RETAINED_SIZE), true);
+  TEST_EQ(retained_load(loaded, RETAINED_SIZE), true);
+  TEST_MEM_EQ(loaded, saved, RETAINED_SIZE);
+
+  retained_invalidate();
+  TEST_EQ(retained_load(loaded, RETAINED_SIZE), false);
+}
+
+TEST(retained_test_corrupt, 0, 0)
+{
+  uint8_t saved[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  uint8_t loaded[8];
+
+  /* A flipped bit is caught */
+  retained_save(saved, sizeof(saved));
+  retained_block.data[3] ^= 0x10;
+  TEST_EQ(retained_load(loaded, sizeof(loaded)), false);
+
+  /* So is a mangled length */
+  retained_save(saved, sizeof(saved));
+  retained_block.length = 0xFFFF;
+  TEST_EQ(retained_load(loaded, sizeof(loaded)), false);
+
+  /* And RAM that was never written (a power-on reset) */
+  memset(&retained_block, 0xA5, sizeof(retained_block));
+  TEST_EQ(retained_load(loaded, sizeof(loaded)), false);
+}
@@ -0,0 +1,112 @@
+#include "test.h"
+#include "sched.h"
+
+static sched_event_t seen[SCHED_QUEUE_SIZE * 2];
+static uint8_t seen_count;
+
+static void record(sched_event_t event, void * ctx)
+{
+  seen[seen_count++] = event;
+  if (ctx)
+  {
+    (*(int *)ctx)++;
+  }
+}
+
+/* Posts itself once more, the way the FSM queues its next step */
+static void repost(sched_event_t event, void * ctx)
+{
+  int * left = (int *)ctx;
+  seen[seen_count++] = event;
+  if ((*left)-- > 0)
+  {
+    sched_post(event);
+  }
+}
+
+TEST(sched_test_dispatch_order, 0, 0)
+{
+  int calls = 0;
+  sched_init();
+  seen_count = 0;
+  sched_register(SCHED_EVT_RTC, record, &calls);
+  sched_register(SCHED_EVT_GPIOTE, record, &calls);
+  sched_register(SCHED_EVT_RADIO, record, &calls);
+
+  /* Nothing to do */
+  TEST_EQ(sched_dispatch(), false);
+
+  /* Events come out in the order they went in */
+  TEST_EQ(sched_post(SCHED_EVT_GPIOTE), true);
+  TEST_EQ(sched_post(SCHED_EVT_RADIO), true);
+  TEST_EQ(sched_post(SCHED_EVT_RTC), true);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(sched_dispatch(), false);
+
+  TEST_EQ(calls, 3);
+  TEST_EQ(seen[0], SCHED_EVT_GPIOTE);
+  TEST_EQ(seen[1], SCHED_EVT_RADIO);
+  TEST_EQ(seen[2], SCHED_EVT_RTC);
+
+  /* Out of range events are refused */
+  TEST_EQ(sched_post(SCHED_EVT_COUNT), false);
+  TEST_EQ(sched_dispatch(), false);
+}
+
+TEST(sched_test_coalesce, 0, 0)
+{
+  int calls = 0;
+  sched_init();
+  seen_count = 0;
+  sched_register(SCHED_EVT_GPIOTE, record, &calls);
+
+  /* An interrupt storm only gets handled once */
+  TEST_EQ(sched_post(SCHED_EVT_GPIOTE), true);
+  TEST_EQ(sched_post(SCHED_EVT_GPIOTE), false);
+  TEST_EQ(sched_post(SCHED_EVT_GPIOTE), false);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(sched_dispatch(), false);
+  TEST_EQ(calls, 1);
+
+  /* Once handled, it can be posted again */
+  TEST_EQ(sched_post(SCHED_EVT_GPIOTE), true);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(calls, 2);
+
+  /* Every event at once fits in the queue */
+  for (int i = 0; i < SCHED_EVT_COUNT; i++)
+  {
+    TEST_EQ(sched_post((sched_event_t) i), true);
+  }
+  for (int i = 0; i < SCHED_EVT_COUNT; i++)
+  {
+    TEST_EQ(sched_dispatch(), true);
+  }
+  TEST_EQ(sched_dispatch(), false);
+}
+
+TEST(sched_test_repost, 0, 0)
+{
+  int left = 2;
+  sched_init();
+  seen_count = 0;
+  sched_register(SCHED_EVT_STEP, repost, &left);
+
+  /* A handler can queue itself again */
+  sched_post(SCHED_EVT_STEP);
+  while (sched_dispatch());
+  TEST_EQ(seen_count, 3);
+  TEST_EQ(left, -1);
+}
+
+TEST(sched_test_unregistered, 0, 0)
+{
+  sched_init();
+
+  /* Nobody listening, the event is just dropped */
+  TEST_EQ(sched_post(SCHED_EVT_RADIO), true);
+  TEST_EQ(sched_dispatch(), true);
+  TEST_EQ(sched_dispatch(), false);
+}
@@ -0,0 +1,366 @@
+/*
+ * This file is part of the KIWI.KI GmbH Ki firmware.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, you can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ */
+
+#include <stdio.h>
+#include "test.h"
+#include "session.h"
+#include "timer.h"
+
+static const uint8_t near_door[SESSION_ID_SIZE] = { 0x01, 0x02, 0x03, 0x04 };
+static const uint8_t far_door[SESSION_ID_SIZE] = { 0x0A, 0x0B, 0x0C, 0x0D };
+
+TEST(session_test_table, 0, 0)
+{
+  session_table_t table;
+  uint8_t id[SESSION_ID_SIZE] = { 0 };
+
+  session_init(&table);
+  TEST_EQ(session_find(&table, near_door) == NULL, true);
+  TEST_EQ(session_best(&table, 0) == NULL, true);
+
+  /* A door is found again where we put it */
+  session_t * near = session_seen(&table, near_door, 60, 100);
+  TEST_EQ(session_find(&table, near_door) == near, true);
+  TEST_EQ(session_seen(&table, near_door, 60, 200) == near, true);
+  TEST_EQ(near->state, SESSION_SEEN);
+  TEST_EQ(near->seen_at, 200);
+
+  /* A full table gives up the door heard longest ago */
+  for (uint8_t i = 0; i < SESSION_MAX - 1; i++)
+  {
+    id[0] = 0x80 + i;
+    session_seen(&table, id, 70, 300 + i);
+  }
+  TEST_EQ(session_find(&table, near_door) == near, true);
+  session_seen(&table, far_door, 80, 400);
+  TEST_EQ(session_find(&table, near_door) == NULL, true);
+  TEST_EQ(session_find(&table, far_door) != NULL, true);
+  TEST_EQ(session_find(&table, far_door)->has_key, false);
+}
+
+TEST(session_test_hash, 0, 0)
+{
+  session_table_t table;
+  uint8_t id[SESSION_ID_SIZE] = { 0x00, 0x00, 0x01, 0x00 };
+
+  session_init(&table);
+
+  /*
+   * A run of doors down a corridor (ids handed out one after another),
+   * twice as many as fit: the table always holds the latest ones, and
+   * each of them can still be found past the ones that were pushed out.
+   */
+  for (uint8_t i = 0; i < 2 * SESSION_MAX; i++)
+  {
+    id[0] = i;
+    session_seen(&table, id, 70, 100 + i);
+    TEST_EQ(table.count, i < SESSION_MAX ? i + 1 : SESSION_MAX);
+
+    for (uint8_t j = 0; j <= i; j++)
+    {
+      id[0] = j;
+      session_t * found = session_find(&table, id);
+      TEST_EQ(found != NULL, j + SESSION_MAX > i);
+      if (found)
+      {
+        TEST_EQ(found->seen_at, 100 + j);
+      }
+    }
+  }
+}
+
+TEST(session_test_neighbours, 0, 0)
+{
+  session_table_t table;
+  session_t * door;
+  uint32_t now = 1000;
+
+  session_init(&table);
+  TEST_EQ(session_waiting(&table, now), false);
+
+  /* Beacons are counted while the door is in range... */
+  for (int i = 0; i < 5; i++)
+  {
+    door = session_seen(&table, near_door, 60, ++now);
+  }
+  TEST_EQ(door->beacons, 5);
+
+  /* ...and it's waiting for us until we get a challenge to it */
+  TEST_EQ(session_waiting(&table, now), true);
+  session_challenged(door, now, true);
+  TEST_EQ(door->state, SESSION_DONE);
+  TEST_EQ(door->challenged_at, now);
+  TEST_EQ(session_waiting(&table, now), false);
+
+  /* A while later it wants another one */
+  now += TIMER_MS_TO_TICKS(SESSION_FRESH_TIME) + 1;
+  session_seen(&table, near_door, 60, now);
+  TEST_EQ(session_waiting(&table, now), true);
+
+  /* Out of range and back, it starts counting again */
+  TEST_EQ(door->beacons, 1);
+  TEST_EQ(door->challenged, true);
+
+  /* Doors that have gone quiet aren't waiting for anything */
+  now += TIMER_MS_TO_TICKS(SESSION_FRESH_TIME) + 1;
+  TEST_EQ(session_waiting(&table, now), false);
+}
+
+TEST(session_test_holdoff, 0, 0)
+{
+  session_table_t table;
+  session_t * door;
+  uint32_t now = 1000;
+  uint32_t holdoff = TIMER_MS_TO_TICKS(10000);
+
+  session_init(&table);
+  session_set_holdoff(&table, 10000);
+
+  /* Challenged: left be for the whole window, but still tracked */
+  door = session_seen(&table, near_door, 60, now);
+  TEST_EQ(session_should_answer(&table, door, now), true);
+  session_challenged(door, now, true);
+  session_new_wake(&table);
+  for (uint32_t t = now + 100; t < now + holdoff; t += holdoff / 8)
+  {
+    session_seen(&table, near_door, 60, t);
+    TEST_EQ(session_held_off(&table, door, t), true);
+    TEST_EQ(session_should_answer(&table, door, t), false);
+    TEST_EQ(session_pending(&table, t), 0);
+    TEST_EQ(session_waiting(&table, t), false);
+  }
+  TEST_EQ(door->beacons, 9);
+
+  /* Then it gets another one */
+  now += holdoff;
+  session_seen(&table, near_door, 60, now);
+  TEST_EQ(session_should_answer(&table, door, now), true);
+  session_challenged(door, now, true);
+
+  /* Walked off down the corridor and back: no need to wait */
+  for (int i = 0; i < 4; i++)
+  {
+    session_seen(&table, near_door, 60 + SESSION_LEFT_RSSI + 5, ++now);
+  }
+  for (int i = 0; i < 4; i++)
+  {
+    session_seen(&table, near_door, 60, ++now);
+  }
+  session_new_wake(&table);
+  TEST_EQ(session_held_off(&table, door, now), false);
+  TEST_EQ(session_should_answer(&table, door, now), true);
+
+  /* Out of range and back, likewise */
+  session_challenged(door, now, true);
+  now += TIMER_MS_TO_TICKS(SESSION_FRESH_TIME) + 1;
+  session_seen(&table, near_door, 60, now);
+  session_new_wake(&table);
+  TEST_EQ(session_held_off(&table, door, now), false);
+
+  /* And a double tap lets go of everything */
+  session_challenged(door, now, true);
+  TEST_EQ(session_held_off(&table, door, now), true);
+  session_release(&table);
+  TEST_EQ(session_held_off(&table, door, now), false);
+
+  /* No ack, no telling it opened: left be for this wake only */
+  session_challenged(door, now, false);
+  TEST_EQ(session_should_answer(&table, door, now), false);
+  TEST_EQ(session_held_off(&table, door, now), false);
+  session_new_wake(&table);
+  TEST_EQ(session_should_answer(&table, door, now + 1), true);
+
+  /* No hold-off configured: every beacon is answered */
+  session_set_holdoff(&table, 0);
+  session_challenged(door, now, true);
+  TEST_EQ(session_held_off(&table, door, now), false);
+}
+
+TEST(session_test_no_ack, 0, 0)
+{
+  session_table_t table;
+  uint8_t id[SESSION_ID_SIZE] = { 0, 0, 0, 0 };
+
+  session_init(&table);
+  TEST_EQ(session_no_ack(&table, near_door), false);
+
+  /* Remembered without a session, and only once */
+  session_set_no_ack(&table, near_door);
+  session_set_no_ack(&table, near_door);
+  TEST_EQ(session_no_ack(&table, near_door), true);
+  TEST_EQ(session_find(&table, near_door) == NULL, true);
+  TEST_EQ(table.no_ack.count, 1);
+
+  /* Full: the oldest makes room */
+  for (uint8_t i = 0; i < SESSION_NO_ACK_MAX; i++)
+  {
+    id[0] = i + 1;
+    session_set_no_ack(&table, id);
+  }
+  TEST_EQ(table.no_ack.count, SESSION_NO_ACK_MAX);
+  TEST_EQ(session_no_ack(&table, near_door), false);
+  TEST_EQ(session_no_ack(&table, id), true);
+
+  id[0] = 1;
+  TEST_EQ(session_no_ack(&table, id), true);
+
+  /* Tried, not challenged: done for this wake, but no hold-off after */
+  session_set_holdoff(&table, 10000);
+  session_t * door = session_seen(&table, near_door, 60, 100);
+  session_tried(door);
+  TEST_EQ(session_should_answer(&table, door, 100), false);
+  session_new_wake(&table);
+  TEST_EQ(session_held_off(&table, door, 101), false);
+  TEST_EQ(session_should_answer(&table, door, 101), true);
+}
+
+TEST(session_test_rssi, 0, 0)
+{
+  session_table_t table;
+  session_init(&table);
+
+  /* Beacon to beacon, it moves halfway */
+  session_t * door = session_seen(&table, near_door, 80, 0);
+  session_seen(&table, near_door, 60, 1);
+  TEST_EQ(door->rssi, 70);
+  session_seen(&table, near_door, 90, 2);
+  TEST_EQ(door->rssi, 80);
+
+  /* But not from what we heard long ago */
+  session_seen(&table, near_door, 50,
+               3 + TIMER_MS_TO_TICKS(SESSION_FRESH_TIME) + 1);
+  TEST_EQ(door->rssi, 50);
+}
+
+TEST(session_test_pick, 0, 0)
+{
+  session_table_t table;
+  session_t * near;
+  session_t * far;
+  uint32_t now = 1000;
+
+  session_init(&table);
+
+  /* Only one door: answer it */
+  far = session_seen(&table, far_door, 85, now);
+  TEST_EQ(session_should_answer(&table, far, now), true);
+
+  /* Once we know of a closer door, the far one is let go... */
+  near = session_seen(&table, near_door, 60, ++now);
+  far = session_seen(&table, far_door, 85, ++now);
+  TEST_EQ(session_best(&table, now) == near, true);
+  TEST_EQ(session_should_answer(&table, far, now), false);
+
+  /* ...and the near one answered */
+  near = session_seen(&table, near_door, 60, ++now);
+  TEST_EQ(session_should_answer(&table, near, now), true);
+  TEST_EQ(session_pending(&table, now), 2);
+
+  /* After the near door is done, it's the far one's turn this wake */
+  near->state = SESSION_DONE;
+  TEST_EQ(session_pending(&table, now), 1);
+  TEST_EQ(session_should_answer(&table, near, now), false);
+  TEST_EQ(session_should_answer(&table, far, now), true);
+
+  /* Next wake, the near door comes first again */
+  session_new_wake(&table);
+  TEST_EQ(near->state, SESSION_SEEN);
+  TEST_EQ(session_should_answer(&table, far, now), false);
+
+  /* Doors about as close as each other: no point waiting */
+  near->rssi = far->rssi - SESSION_RSSI_MARGIN + 1;
+  TEST_EQ(session_should_answer(&table, far, now), true);
+
+  /* A closer door that's gone quiet doesn't hold us up */
+  near->rssi = 40;
+  now += TIMER_MS_TO_TICKS(SESSION_FRESH_TIME) + 1;
+  far = session_seen(&table, far_door, 85, now);
+  TEST_EQ(session_best(&table, now) == far, true);
+  TEST_EQ(session_should_answer(&table, far, now), true);
+}
+
+TEST(session_test_starvation, 0, 0)
+{
+  session_table_t table;
+  session_t * near;
+  session_t * far;
+  uint8_t answered = 0;
+
+  session_init(&table);
+  near = session_seen(&table, near_door, 50, 0);
+
+  /*
+   * The near door keeps beaconing but never answers us (it's not one of
+   * ours). We still get round to the far one.
+   */
+  for (uint32_t now = 1; now < 10; now++)
+  {
+    session_seen(&table, near_door, 50, now);
+    far = session_seen(&table, far_door, 80, now);
+    answered += session_should_answer(&table, far, now);
+  }
+  TEST_EQ(answered, 9 / (SESSION_MAX_DEFERRALS + 1));
+  TEST_EQ(near->state, SESSION_SEEN);
+}
+
+/*
+ * A corridor: the Ki stands at the near door, the far one is in range as
+ * well, and their beacons come in in any order with a few dB of fading.
+ * Count how often a wake ends up answering the near door first, against
+ * just taking the first beacon heard.
+ */
+TEST(session_test_corridor, 0, 0)
+{
+  session_table_t table;
+  uint32_t seed = 12345;
+  uint32_t now = 0;
+  int first_heard = 0;
+  int table_picked = 0;
+  const int wakes = 200;
+
+  session_init(&table);
+
+  for (int wake = 0; wake < wakes; wake++)
+  {
+    bool answered = false;
+
+    session_new_wake(&table);
+    now += TIMER_MS_TO_TICKS(150);
+
+    /* Up to four beacons in a listen, from either door */
+    for (int beacon = 0; beacon < 4 && !answered; beacon++)
+    {
+      seed = seed * 1103515245 + 12345;
+      bool near = (seed >> 16) & 1;
+      uint8_t rssi = (near ? 62 : 74) + ((seed >> 20) % 7);
+      session_t * door = session_seen(&table, near ? near_door : far_door,
+                                      rssi, ++now);
+
+      if (beacon == 0)
+      {
+        first_heard += near;
+      }
+      if (session_should_answer(&table, door, now))
+      {
+        table_picked += (door->sensor_id[0] == near_door[0]);
+        answered = true;
+      }
+    }
+  }
+
+  if (test_verbose)
+  {
+    printf("Near door answered first: %d%% taking the first beacon, "
+           "%d%% with the session table\n",
+           first_heard * 100 / wakes, table_picked * 100 / wakes);
+  }
+
+  TEST_EQ(table_picked > first_heard, true);
+  TEST_EQ(table_picked * 100 / wakes >= 80, true);
+}
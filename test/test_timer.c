@@ -0,0 +1,206 @@
+#include "test.h"
+#include "timer.h"
+#include "sched.h"
+#include "hw.h"
+
+extern uint32_t rtc_counter;                /* hw_mock.c */
+extern uint32_t rtc_alarm;                  /* hw_mock.c */
+extern bool rtc_alarm_set;                  /* hw_mock.c */
+extern void hw_rtc_advance(uint32_t ticks); /* hw_mock.c */
+
+static int fired[8];
+static int fired_count;
+
+static void record(void * ctx)
+{
+  fired[fired_count++] = *(int *)ctx;
+}
+
+static void setup(uint32_t counter)
+{
+  sched_init();
+  hw_rtc_init();
+  rtc_counter = counter;
+  timer_init();
+  fired_count = 0;
+}
+
+/* Let the scheduler run whatever the alarm posted */
+static void run(void)
+{
+  while (sched_dispatch());
+}
+
+TEST(timer_test_now_wraps, 0, 0)
+{
+  uint32_t before;
+
+  setup(TIMER_COUNTER_MASK - 5);
+  before = timer_now();
+
+  /* The 24 bit counter wraps, our time doesn't */
+  hw_rtc_advance(10);
+  TEST_EQ(timer_now() - before, 10);
+  TEST_EQ(timer_elapsed(before), 10);
+  TEST_EQ(timer_now() > before, true);
+}
+
+TEST(timer_test_order, 0, 0)
+{
+  soft_timer_t a, b, c;
+  int ida = 1, idb = 2, idc = 3;
+
+  setup(1000);
+  a.running = b.running = c.running = false;
+
+  timer_start(&a, 300, record, &ida);
+  timer_start(&b, 100, record, &idb);
+  timer_start(&c, 200, record, &idc);
+
+  /* Only the soonest is given to the RTC */
+  TEST_EQ(rtc_alarm_set, true);
+  TEST_EQ(rtc_alarm, 1100);
+
+  hw_rtc_advance(150);
+  run();
+  TEST_EQ(fired_count, 1);
+  TEST_EQ(fired[0], 2);
+  TEST_EQ(rtc_alarm, 1200);
+
+  /* Sleeping through two deadlines fires both, in order */
+  hw_rtc_advance(1000);
+  run();
+  TEST_EQ(fired_count, 3);
+  TEST_EQ(fired[1], 3);
+  TEST_EQ(fired[2], 1);
+  TEST_EQ(timer_running(&a), false);
+  TEST_EQ(rtc_alarm_set, false);
+}
+
+TEST(timer_test_stop, 0, 0)
+{
+  soft_timer_t a, b;
+  int ida = 1, idb = 2;
+
+  setup(0);
+  a.running = b.running = false;
+
+  timer_start(&a, 50, record, &ida);
+  timer_start(&b, 80, record, &idb);
+
+  /* Stopping the first moves the alarm on to the next */
+  timer_stop(&a);
+  TEST_EQ(timer_running(&a), false);
+  TEST_EQ(rtc_alarm, 80);
+
+  /* Stopping twice does no harm */
+  timer_stop(&a);
+
+  hw_rtc_advance(100);
+  run();
+  TEST_EQ(fired_count, 1);
+  TEST_EQ(fired[0], 2);
+
+  /* Restarting a running timer moves it rather than adding it twice */
+  timer_start(&a, 50, record, &ida);
+  timer_start(&a, 20, record, &ida);
+  TEST_EQ(rtc_alarm, 120);
+  hw_rtc_advance(100);
+  run();
+  TEST_EQ(fired_count, 2);
+}
+
+static soft_timer_t periodic;
+static int periodic_left;
+
+static void tick(void * ctx)
+{
+  fired_count++;
+  if (--periodic_left > 0)
+  {
+    timer_start(&periodic, 10, tick, ctx);
+  }
+}
+
+TEST(timer_test_restart_from_callback, 0, 0)
+{
+  setup(0);
+  periodic.running = false;
+  periodic_left = 3;
+
+  timer_start(&periodic, 10, tick, NULL);
+  for (int i = 0; i < 5; i++)
+  {
+    hw_rtc_advance(10);
+    run();
+  }
+  TEST_EQ(fired_count, 3);
+  TEST_EQ(timer_running(&periodic), false);
+
+  /* Something already due goes off without waiting on the RTC */
+  periodic_left = 1;
+  timer_start(&periodic, 0, tick, NULL);
+  TEST_EQ(rtc_alarm_set, false);
+  run();
+  TEST_EQ(fired_count, 4);
+}
+
+TEST(timer_test_far_deadline, 0, 0)
+{
+  soft_timer_t a;
+  int ida = 1;
+
+  setup(0);
+  a.running = false;
+
+  /* Further out than we can safely set the compare */
+  timer_start(&a, TIMER_COUNTER_MASK, record, &ida);
+  TEST_EQ(rtc_alarm, TIMER_MAX_TICKS);
+
+  /* Halfway, we just set it again */
+  hw_rtc_advance(TIMER_MAX_TICKS);
+  run();
+  TEST_EQ(fired_count, 0);
+  TEST_EQ(rtc_alarm_set, true);
+
+  hw_rtc_advance(TIMER_COUNTER_MASK - TIMER_MAX_TICKS);
+  run();
+  TEST_EQ(fired_count, 1);
+}
+
+TEST(timer_test_now64, 0, 0)
+{
+  uint64_t start;
+
+  setup(0);
+  start = timer_now64();
+
+  /* Several wraps of the 24 bit counter (looked at in between) */
+  for (int i = 0; i < 5; i++)
+  {
+    hw_rtc_advance(TIMER_MAX_TICKS);
+    timer_now64();
+    hw_rtc_advance(TIMER_COUNTER_MASK + 1 - TIMER_MAX_TICKS);
+    TEST_EQ(timer_now64() - start, (uint64_t)(i + 1) * (TIMER_COUNTER_MASK + 1));
+  }
+
+  /* One second is one second */
+  start = timer_now64();
+  hw_rtc_advance(RTC_FREQUENCY);
+  TEST_EQ(timer_elapsed_us(start), 1000000);
+
+  /* And a tick is about 30.5uS */
+  start = timer_now64();
+  hw_rtc_advance(1);
+  TEST_EQ(timer_elapsed_us(start), 30);
+
+  /* Whole mS survive the trip through ticks */
+  for (uint32_t ms = 0; ms < 3000; ms++)
+  {
+    if (TIMER_TICKS_TO_MS(TIMER_MS_TO_TICKS(ms)) != ms)
+    {
+      TEST_EQ(ms, 0xFFFFFFFF);
+      break;
+    }
+  }
+}